@@ -0,0 +1,296 @@
+/// Check that Window3D draws frames without heap allocations once it is warmed up (per-frame data goes to
+/// Window3D::FFrameArena). Every operator new, and with glibc every malloc/calloc/realloc, is counted while
+/// the measured frames are drawn.
+///
+///    allocs [-frames N]
+///
+/// The windows are headless (no App, so no display is opened) and drawn by calling OnDraw() directly, in
+/// every mode listed in Modes. Returns 1 if any measured frame allocated.
+
+#include "CameraView.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <new>
+
+static std::atomic<long> NumAllocations(0);
+static std::atomic<bool> Counting(false);
+
+static inline void count_allocation()
+{
+    if(Counting) { NumAllocations++; }
+}
+
+#ifdef __GLIBC__
+extern "C" void* __libc_malloc(size_t);
+extern "C" void* __libc_calloc(size_t, size_t);
+extern "C" void* __libc_realloc(void*, size_t);
+
+extern "C" void* malloc(size_t Size)              { count_allocation(); return __libc_malloc(Size); }
+extern "C" void* calloc(size_t Count, size_t Size) { count_allocation(); return __libc_calloc(Count, Size); }
+extern "C" void* realloc(void* P, size_t Size)    { count_allocation(); return __libc_realloc(P, Size); }
+
+extern "C" void  __libc_free(void*);
+
+static void* raw_alloc(size_t Size) { return __libc_malloc(Size ? Size : 1); }
+static void  raw_free(void* P)      { __libc_free(P); }
+#else
+static void* raw_alloc(size_t Size) { return malloc(Size ? Size : 1); }
+static void  raw_free(void* P)      { free(P); }
+#endif
+
+void* operator new(size_t Size)
+{
+    count_allocation();
+
+    void* P = raw_alloc(Size);
+    if(!P) { throw std::bad_alloc(); }
+
+    return P;
+}
+
+void* operator new[](size_t Size) { return operator new(Size); }
+
+void operator delete(void* P) noexcept   { raw_free(P); }
+void operator delete[](void* P) noexcept { raw_free(P); }
+void operator delete(void* P, size_t) noexcept   { raw_free(P); }
+void operator delete[](void* P, size_t) noexcept { raw_free(P); }
+
+enum
+{
+    MODE_DEFERRED = 1,
+    MODE_PICKING  = 2,
+    MODE_DEPTH    = 4,
+
+    /// Dynamic resolution at half size, upscaled with the bilinear or the nearest filter
+    MODE_SCALED   = 8,
+    MODE_NEAREST  = 16,
+
+    /// The 3D scene recorded and drawn into four viewports by a ViewportRenderer
+    MODE_VIEWS    = 32,
+
+    /// A memory-mapped point cloud in the scene
+    MODE_CLOUD    = 64
+};
+
+struct Mode
+{
+    const char* Name;
+    int Flags;
+};
+
+static const Mode Modes[] =
+{
+    { "immediate",         0 },
+    { "deferred",          MODE_DEFERRED },
+    { "picking",           MODE_PICKING },
+    { "deferred+picking",  MODE_DEFERRED | MODE_PICKING },
+    { "depth",             MODE_DEPTH },
+    { "deferred+depth",    MODE_DEFERRED | MODE_DEPTH },
+    { "scaled",            MODE_SCALED },
+    { "scaled+nearest",    MODE_SCALED | MODE_NEAREST },
+    { "deferred+scaled",   MODE_DEFERRED | MODE_SCALED },
+    { "viewports",         MODE_VIEWS },
+    { "viewports+depth",   MODE_VIEWS | MODE_DEPTH },
+    { "cloud",             MODE_CLOUD },
+    { "deferred+cloud",    MODE_DEFERRED | MODE_CLOUD },
+    { "picking+cloud",     MODE_PICKING | MODE_CLOUD }
+};
+
+static const char* CloudFile = "allocs.pcld";
+
+static const int WarmUpFrames = 130;
+
+struct TestWindow: public Window3D
+{
+    TestWindow(int w, int h): Window3D(0, 0, w, h, "allocs"), FFrame(0), FFlags(0)
+    {
+        FDepth.resize(w * h);
+
+        // a spiral of points
+        for(int i = 0 ; i < 2000 ; i++)
+        {
+            float t = 0.01f * (float)i;
+            FPoints.push_back(6.0f * cosf(7.0f * t) * t / 20.0f);
+            FPoints.push_back(6.0f * sinf(7.0f * t) * t / 20.0f);
+            FPoints.push_back(t);
+        }
+    }
+
+    void SetMode(int Flags)
+    {
+        FFlags = Flags;
+
+        FDeferredDraw = (Flags & MODE_DEFERRED) != 0;
+        FPicking      = (Flags & MODE_PICKING) != 0;
+
+        FCanvasBitmap->ZB = (Flags & MODE_DEPTH) ? &FDepth[0] : NULL;
+        FCanvas3D->FDepthTest = (Flags & MODE_DEPTH) != 0;
+
+        // a budget no frame meets keeps the scale at the minimum, so the low resolution target is not reallocated
+        FDynamicResolution = (Flags & MODE_SCALED) != 0;
+        FMinRenderScale    = 0.5f;
+        FFrameBudget       = (Flags & MODE_SCALED) ? 1e-9f : 0.016f;
+        FUpscaleFilter     = (Flags & MODE_NEAREST) ? BLIT_NEAREST : BLIT_BILINEAR;
+    }
+
+    virtual void Render3D()
+    {
+        const float a = 0.05f * (float)FFrame++;
+
+        FCanvas2D->Clear(0x202020);
+        if(FFlags & MODE_DEPTH) { FCanvasBitmap->ClearDepth(); }
+
+        if(FFlags & MODE_VIEWS)
+        {
+            // the scene once, drawn by four cameras turned around the vertical axis
+            FViewCommands.Begin(&FFrameArena);
+            FCanvas3D->SetCommandBuffer(&FViewCommands);
+            DrawScene(a);
+            FCanvas3D->SetCommandBuffer(NULL);
+
+            const int w2 = Width / 2, h2 = Height / 2;
+
+            Viewport3D Views[4];
+            for(int i = 0 ; i < 4 ; i++)
+            {
+                mtx4 Turn;
+                rotate_matrix_axis(Turn, 1.5708f * (float)i, vec3(0, 0, 1));
+
+                Views[i].X = (i % 2) * w2; Views[i].Y = (i / 2) * h2;
+                Views[i].W = w2;           Views[i].H = h2;
+                Views[i].Proj = FProj;
+                Views[i].View = Turn * Camera.FRenderTransform;
+            }
+
+            FViewRenderer.Render(FCanvasBitmap, FViewCommands, Views, 4, (FFlags & MODE_DEPTH) != 0);
+        } else
+        {
+            DrawScene(a);
+        }
+
+        FCanvas2D->Text(4, 4, "allocs", 0xFFFFFF);
+    }
+
+    /// A bit of everything, moving from frame to frame
+    void DrawScene(float a)
+    {
+        FCanvas3D->SetPickID(1);
+        FCanvas3D->Plane(vec3(0, 0, 0), vec3(1, 0, 0), vec3(0, 1, 0), 2.0f, 2.0f, 10, 10, 0x00AA00);
+
+        FCanvas3D->SetPickID(2);
+        FCanvas3D->Triangle3D(vec3(-5, 0, 1), vec3(5 * cosf(a), 5 * sinf(a), 1), vec3(0, 5, 3), 0xAA4040);
+        FCanvas3D->Arrow3D(vec3(0, 0, 0), vec3(6 * cosf(a), 6 * sinf(a), 4), 1.0f, 0xFFFFFF, 0xFF0000);
+
+        mtx4 Poses[16];
+        for(int i = 0 ; i < 16 ; i++)
+        {
+            Poses[i] = translate((float)(i % 4) * 3.0f - 4.5f, (float)(i / 4) * 3.0f - 4.5f, 1.0f + sinf(a + (float)i));
+        }
+
+        FCanvas3D->SetPickID(3);
+        FCanvas3D->Frames3D(Poses, 16, 1.0f, 0xFF0000, 0x00FF00, 0x0000FF);
+        FCanvas3D->Sphere3D(vec3(0, 0, 5), 2.0f + sinf(a), 0x8080FF);
+        FCanvas3D->Bezier3D(vec3(-8, -8, 0), vec3(-8, 8, 6), vec3(8, -8, 6), vec3(8, 8, 0), 0xFFFF00);
+
+        FCanvas3D->SetPickID(-1);
+        FCanvas3D->Points3D(&FPoints[0], (int)FPoints.size() / 3, 0xFFFFFF);
+
+        if(FFlags & MODE_CLOUD)
+        {
+            FCanvas3D->SetPickID(4);
+            FCanvas3D->PointCloud3D(FCloud);
+            FCanvas3D->SetPickID(-1);
+        }
+        FCanvas3D->Text3D(vec3(0, 0, 8), "label", 0xFFFFFF);
+    }
+
+    int FFrame;
+    int FFlags;
+    std::vector<float> FDepth;
+    std::vector<float> FPoints;
+
+    PointCloudFile FCloud;
+
+    DrawCommandBuffer FViewCommands;
+    ViewportRenderer FViewRenderer;
+};
+
+int main(int argc, char** argv)
+{
+    int NumFrames = 100;
+
+    for(int i = 1 ; i < argc ; i++)
+    {
+        if(!strcmp(argv[i], "-frames") && i + 1 < argc) { NumFrames = atoi(argv[++i]); } else
+        {
+            printf("Usage: allocs [-frames N]\n");
+            return 1;
+        }
+    }
+
+    // the hooks must see a deliberate allocation, or the zeros below mean nothing
+    Counting = true;
+    int* volatile P = new int(0);
+    delete P;
+    void* volatile M = malloc(16);
+    free(M);
+    Counting = false;
+
+    if(NumAllocations < 2)
+    {
+        printf("Allocation hooks are not active\n");
+        return 1;
+    }
+
+    // a colored grid of points in small chunks, so that culling has work to do
+    PointCloudWriter Writer;
+    if(!Writer.Open(CloudFile, PCF_COLORS, 1000))
+    {
+        printf("Cannot write %s\n", CloudFile);
+        return 1;
+    }
+
+    for(int y = 0 ; y < 200 ; y++)
+        for(int x = 0 ; x < 200 ; x++)
+            Writer.Add(vec3(0.1f * (float)x - 10.0f, 0.1f * (float)y - 10.0f, 0.5f * sinf(0.1f * (float)(x + y))), (x * 0x010000) | (y * 0x000100));
+
+    Writer.Close();
+
+    TestWindow W(640, 360);
+
+    if(!W.FCloud.Open(CloudFile))
+    {
+        printf("Cannot read %s\n", CloudFile);
+        return 1;
+    }
+
+    int Failed = 0;
+
+    for(size_t m = 0 ; m < sizeof(Modes) / sizeof(Modes[0]) ; m++)
+    {
+        W.SetMode(Modes[m].Flags);
+
+        // warm-up over a whole period of the animation (2 pi / 0.05 frames): the arena and the buffers that
+        // keep their capacity (pick grid, ...) reach the size of the largest frame
+        for(int f = 0 ; f < WarmUpFrames ; f++) { W.OnDraw(); }
+
+        NumAllocations = 0;
+        Counting = true;
+
+        for(int f = 0 ; f < NumFrames ; f++) { W.OnDraw(); }
+
+        Counting = false;
+
+        const long n = NumAllocations;
+        printf("%-20s %d frames, %ld heap allocations%s\n", Modes[m].Name, NumFrames, n, n ? "  FAILED" : "");
+
+        if(n) { Failed++; }
+    }
+
+    W.FCloud.Close();
+    remove(CloudFile);
+
+    return Failed ? 1 : 0;
+}
@@ -0,0 +1,215 @@
+/// Checks of Bitmap's occupancy tracking and lazy clear against plain pixel values.
+///
+///    bitmapcheck
+///
+/// Every case draws into a tracked bitmap (linear, tiled and indexed), then checks that FB holds what was drawn and
+/// that the presented image (untouched cells shown in GetClearColor(), as the presenters do) agrees with FB.
+/// Returns 1 if any case fails.
+
+#include "Bitmap.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+static int NumFailed = 0;
+
+static void check(bool Ok, const char* Case, const char* Variant, const char* What)
+{
+    if(Ok) { return; }
+
+    printf("%-32s %-8s %s  FAILED\n", Case, Variant, What);
+    NumFailed++;
+}
+
+/// Every pixel of FB is color (after Resolve())
+static bool all_pixels(Bitmap& B, int color)
+{
+    B.Resolve();
+
+    for(int y = 0 ; y < B.Height ; y++)
+        for(int x = 0 ; x < B.Width ; x++)
+            if(B.GetPixel(x, y) != color) { return false; }
+
+    return true;
+}
+
+/// The untouched cells, presented in the clear color, match FB
+static bool presented_matches(Bitmap& B)
+{
+    B.Resolve();
+
+    for(int y = 0 ; y < B.Height ; y++)
+        for(int x = 0 ; x < B.Width ; x++)
+        {
+            if(B.GetCellFlags(x >> BITMAP_TRACK_SHIFT, y >> BITMAP_TRACK_SHIFT) & CELL_TOUCHED) { continue; }
+            if(B.GetPixel(x, y) != B.GetClearColor()) { return false; }
+        }
+
+    return true;
+}
+
+/// Every pixel outside the (x, y, w, h) rectangle is color (after Resolve())
+static bool outside_pixels(Bitmap& B, int x, int y, int w, int h, int color)
+{
+    B.Resolve();
+
+    for(int j = 0 ; j < B.Height ; j++)
+        for(int i = 0 ; i < B.Width ; i++)
+        {
+            if(i >= x && i < x + w && j >= y && j < y + h) { continue; }
+            if(B.GetPixel(i, j) != color) { return false; }
+        }
+
+    return true;
+}
+
+/// The plain Bresenham loop (as Bitmap::Line was before clipping and pointer walks), every step through SetPixel()
+static void reference_line(Bitmap& B, int x0, int y0, int x1, int y1, int color)
+{
+    int dx = abs(x1-x0), sx = x0<x1 ? 1 : -1;
+    int dy = abs(y1-y0), sy = y0<y1 ? 1 : -1;
+    int err = (dx>dy ? dx : -dy)/2, e2;
+
+    for(;;)
+    {
+        B.SetPixel(x0, y0, color);
+        if (x0==x1 && y0==y1) break;
+        e2 = err;
+        if (e2 >-dx) { err -= dy; x0 += sx; }
+        if (e2 < dy) { err += dx; y0 += sy; }
+    }
+}
+
+struct Variant
+{
+    const char* Name;
+    int Format;
+    int Layout;
+};
+
+static const Variant Variants[] =
+{
+    { "linear",  BITMAP_RGB24,    BITMAP_LINEAR },
+    { "tiled",   BITMAP_RGB24,    BITMAP_TILED },
+    { "indexed", BITMAP_INDEXED8, BITMAP_LINEAR }
+};
+
+int main()
+{
+    const int W = 100, H = 70;
+    const int Red = 0xFF0000;
+
+    for(size_t v = 0 ; v < sizeof(Variants) / sizeof(Variants[0]) ; v++)
+    {
+        const Variant& V = Variants[v];
+
+        std::vector<unsigned char> Pixels(W * H * 3);
+        Bitmap B(&Pixels[0], W, H, V.Format);
+        B.SetLayout(V.Layout);
+        B.EnableTracking(true);
+
+        // the colors used below are exact in the palette of the indexed bitmap
+        const int Palette[2] = { 0x000000, Red };
+        B.SetPalette(Palette, 2);
+
+        B.Clear(0);
+        check(all_pixels(B, 0), "first clear", V.Name, "pixels");
+
+        // lines in all directions, short and long, some crossing the border or reaching far outside, with and without
+        // a clip rectangle: the pixels of the plain loop, every drawn pixel in a touched cell. One line per clear, so
+        // that a cell missed by the tracking is not covered by another line
+        for(int Clip = 0 ; Clip < 2 ; Clip++)
+        {
+            std::vector<unsigned char> RefPixels(W * H * 3);
+            Bitmap Ref(&RefPixels[0], W, H, V.Format);
+            Ref.SetLayout(V.Layout);
+            Ref.SetPalette(Palette, 2);
+
+            if(Clip) { Ref.SetClipRect(7, 11, 61, 40); }
+
+            bool Same = true, Presented = true, Cleared = true;
+
+            srand(1);
+            for(int i = 0 ; i < 2000 ; i++)
+            {
+                const int Reach = (i % 4 == 3) ? 3000 : 20;
+                const int x0 = rand() % (W + 2 * Reach) - Reach, y0 = rand() % (H + 2 * Reach) - Reach;
+                const int x1 = rand() % (W + 40) - 20, y1 = rand() % (H + 40) - 20;
+
+                B.Clear(0);
+                Ref.Clear(0);
+
+                if(Clip) { B.SetClipRect(7, 11, 61, 40); }
+                B.Line(x0, y0, x1, y1, Red);
+                B.ResetClipRect();
+
+                reference_line(Ref, x0, y0, x1, y1, Red);
+
+                B.Resolve();
+                Ref.Resolve();
+
+                for(int y = 0 ; y < H ; y++)
+                    for(int x = 0 ; x < W ; x++)
+                        if(B.GetPixel(x, y) != Ref.GetPixel(x, y)) { Same = false; }
+
+                if(!presented_matches(B)) { Presented = false; }
+            }
+
+            B.Clear(0);
+            Cleared = all_pixels(B, 0);
+
+            check(Same,      Clip ? "lines, clipped" : "lines", V.Name, "pixels");
+            check(Presented, Clip ? "lines, clipped" : "lines", V.Name, "presented");
+            check(Cleared,   Clip ? "lines, clipped, clear" : "lines, clear", V.Name, "pixels");
+        }
+
+        // drawing, then the lazy clear
+        B.Line(3, 5, 90, 60, Red);
+        B.Clear(0);
+        check(all_pixels(B, 0), "line, clear", V.Name, "pixels");
+        check(presented_matches(B), "line, clear", V.Name, "presented");
+
+        // a view covering the whole parent, cleared in another color, then the parent cleared again
+        {
+            Bitmap View(&B, 0, 0, W, H);
+            View.Clear(Red);
+        }
+        check(all_pixels(B, Red), "full view clear", V.Name, "pixels");
+        check(presented_matches(B), "full view clear", V.Name, "presented");
+
+        B.Clear(0);
+        check(all_pixels(B, 0), "full view clear, parent clear", V.Name, "pixels");
+        check(presented_matches(B), "full view clear, parent clear", V.Name, "presented");
+
+        // same with a view of a part
+        {
+            Bitmap View(&B, 10, 20, 30, 17);
+            View.Clear(Red);
+        }
+        check(presented_matches(B), "part view clear", V.Name, "presented");
+
+        B.Clear(0);
+        check(all_pixels(B, 0), "part view clear, parent clear", V.Name, "pixels");
+        check(presented_matches(B), "part view clear, parent clear", V.Name, "presented");
+
+        // clip rectangles set on a view (as a recording replayed into it does) stay inside the view
+        {
+            Bitmap View(&B, 10, 20, 30, 17);
+            View.SetClipRect(0, 0, W, H);
+            View.Clear(Red);
+            View.ResetClipRect();
+            View.Line(0, 0, W - 1, H - 1, Red);
+            View.Line(W - 1, 0, 0, H - 1, Red);
+        }
+        check(outside_pixels(B, 10, 20, 30, 17, 0), "view clip rect", V.Name, "pixels");
+        check(presented_matches(B), "view clip rect", V.Name, "presented");
+
+        B.Clear(0);
+        check(all_pixels(B, 0), "view clip rect, parent clear", V.Name, "pixels");
+    }
+
+    printf("%s\n", NumFailed ? "FAILED" : "All checks passed");
+
+    return NumFailed ? 1 : 0;
+}
@@ -0,0 +1,120 @@
+/// Check of PanOrbitPositioner against the matrix chain it replaced: the camera transform built from a quaternion
+/// (BuildTransform) and the viewer position in closed form (MakeStep) must match translate(Target) * RotZ * RotY *
+/// translate(0, 0, -Distance) and decompose_camera_transform() within a tolerance relative to the scene scale.
+///
+///    cameracheck [-cases N] [-seed S] [-tolerance T]
+///
+/// Targets, angles, distances and up vectors are random. Returns 1 if any case is off by more than the tolerance.
+
+#include "Canvas.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+/// The camera transform as built before the quaternion version
+static void reference_transform(mtx4& Out, const vec3& Up, const vec3& Target, const vec3& Spherical, float Distance)
+{
+    mtx4 ViewTrans = translate(0.0f, 0.0f, -Distance);
+
+    float Angle2 = deg2rad( Spherical.z );
+    float Angle1 = deg2rad( Spherical.y - 90.0f );
+
+    mtx4 RotY, RotZ;
+    vec3 MinusX ( 1, 0, 0 );
+
+    rotate_matrix_axis( RotY, Angle2, MinusX );
+    rotate_matrix_axis( RotZ, Angle1, Up );
+
+    mtx4 m = RotZ * RotY * ViewTrans;
+
+    Out = translate(Target.x, Target.y, Target.z) * m;
+}
+
+/// Uniform in [a, b]
+static float uniform(float a, float b)
+{
+    return a + (b - a) * (float)rand() / (float)RAND_MAX;
+}
+
+int main(int argc, char** argv)
+{
+    int NumCases = 100000;
+    unsigned Seed = 1;
+    float Tolerance = 1e-5f;
+
+    for(int i = 1 ; i < argc ; i++)
+    {
+        if(!strcmp(argv[i], "-cases")     && i + 1 < argc) { NumCases = atoi(argv[++i]); } else
+        if(!strcmp(argv[i], "-seed")      && i + 1 < argc) { Seed = (unsigned)atoi(argv[++i]); } else
+        if(!strcmp(argv[i], "-tolerance") && i + 1 < argc) { Tolerance = (float)atof(argv[++i]); } else
+        {
+            printf("Usage: cameracheck [-cases N] [-seed S] [-tolerance T]\n");
+            return 1;
+        }
+    }
+
+    srand(Seed);
+
+    // Reset() sets up the transform the first MakeStep() starts from
+    PanOrbitPositioner Camera;
+    Camera.FViewerPosition = vec3(0, -20, 0);
+    Camera.FTarget         = vec3(0, 0, 0);
+    Camera.Reset();
+
+    float MaxMatrix = 0.0f, MaxPosition = 0.0f;
+    int Failed = 0;
+
+    for(int c = 0 ; c < NumCases ; c++)
+    {
+        // a third of the cases with the default up vector, the others with any (not normalized) direction
+        if(c % 3)
+            Camera.FUpVector = vec3(uniform(-1, 1), uniform(-1, 1), uniform(-1, 1));
+        else
+            Camera.FUpVector = vec3(0, 0, 1);
+
+        if(Camera.FUpVector.Length() < 0.01f) { Camera.FUpVector = vec3(0, 1, 0); }
+
+        Camera.FTarget          = vec3(uniform(-100, 100), uniform(-100, 100), uniform(-100, 100));
+        Camera.FSphericalCoords = vec3(0.0f, uniform(-720, 720), uniform(-180, 180));
+        Camera.FViewDistance    = uniform(Camera.FMinDistance, 500.0f);
+
+        mtx4 Ref;
+        reference_transform(Ref, Camera.FUpVector, Camera.FTarget, Camera.FSphericalCoords, Camera.FViewDistance);
+
+        vec3 RefPos;
+        mtx4 RefRot;
+        decompose_camera_transform(Ref, RefPos, RefRot);
+
+        // a step without input rebuilds FCurrentTransform and FViewerPosition from the parameters
+        Camera.MakeStep(0.0f);
+
+        const mtx4& M = Camera.FCurrentTransform;
+
+        // errors relative to the size of the scene (the translation row scales with target and distance)
+        const float Scale = std::max(1.0f, Camera.FTarget.Length() + Camera.FViewDistance);
+
+        float ErrM = 0.0f;
+        for(int k = 0 ; k < 16 ; k++)
+            ErrM = std::max(ErrM, fabsf(M.x[k] - Ref.x[k]) / ((k >= 12) ? Scale : 1.0f));
+
+        vec3 d = Camera.FViewerPosition - RefPos;
+        float ErrP = d.Length() / Scale;
+
+        MaxMatrix   = std::max(MaxMatrix, ErrM);
+        MaxPosition = std::max(MaxPosition, ErrP);
+
+        if(ErrM > Tolerance || ErrP > Tolerance)
+        {
+            if(Failed < 10)
+                printf("case %d: matrix error %g, position error %g\n", c, ErrM, ErrP);
+
+            Failed++;
+        }
+    }
+
+    printf("%d cases, largest relative error: matrix %g, viewer position %g (tolerance %g)%s\n",
+        NumCases, MaxMatrix, MaxPosition, Tolerance, Failed ? "  FAILED" : "");
+
+    return Failed ? 1 : 0;
+}
@@ -0,0 +1,173 @@
+/// Benchmark of the virtual Canvas3D -> Canvas2D_Bitmap path against the devirtualized Canvas3D_Bitmap (CanvasT.h).
+///
+///    canvasbench [-frames N] [-grid N] [-size WxH]
+///
+/// Both draw the same scene (a grid plane of N x N cells, arrows, coordinate frames and points) from the same orbiting
+/// camera into their own bitmap; only the drawing is timed. Everything runs twice, without and with occupancy
+/// tracking (Bitmap::EnableTracking, on in Window3D). The two images are compared after every frame, and the
+/// program returns 1 if they ever differ or come out empty.
+
+#include "Canvas.h"
+#include "CanvasT.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+
+static double Seconds()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/// The scene through the calls both canvases share, CanvasT is Canvas3D or a Canvas3DT<>
+template <class CanvasT>
+static void draw_scene(CanvasT& C, int Grid, float a)
+{
+    C.Plane(vec3(0, 0, 0), vec3(1, 0, 0), vec3(0, 1, 0), 20.0f / (float)Grid, 20.0f / (float)Grid, Grid, Grid, 0x00AA00);
+
+    for(int i = 0 ; i < 64 ; i++)
+    {
+        const float t = a + 0.1f * (float)i;
+        C.Arrow3D(vec3(0, 0, 0), vec3(8.0f * cosf(t), 8.0f * sinf(t), 0.1f * (float)i), 0.5f, 0xFFFFFF, 0xFF0000);
+    }
+
+    for(int i = 0 ; i < 100 ; i++)
+    {
+        mtx4 m;
+        rotate_matrix_axis(m, a + (float)i, vec3(0, 0, 1));
+        C.Frame3D(vec3((float)(i % 10) * 2.0f - 9.0f, (float)(i / 10) * 2.0f - 9.0f, 1.0f), m, 0.8f, 0xFF0000, 0x00FF00, 0x0000FF);
+    }
+
+    for(int i = 0 ; i < 1000 ; i++)
+    {
+        const float t = 0.02f * (float)i;
+        C.Pt3D(vec3(6.0f * cosf(7.0f * t) * t / 20.0f, 6.0f * sinf(7.0f * t) * t / 20.0f, t), 0.05f, 0xFFFF00);
+    }
+}
+
+static double median(std::vector<double> Times)
+{
+    std::sort(Times.begin(), Times.end());
+    return Times[Times.size() / 2];
+}
+
+/// Median times of both paths over NumFrames frames, returns the number of frames whose images differ or are empty
+static int run(int W, int H, int Grid, int NumFrames, bool Tracking, double& MedV, double& MedT)
+{
+    std::vector<unsigned char> PixelsV((size_t)W * H * 3), PixelsT((size_t)W * H * 3);
+    Bitmap TargetV(&PixelsV[0], W, H), TargetT(&PixelsT[0], W, H);
+
+    TargetV.EnableTracking(Tracking);
+    TargetT.EnableTracking(Tracking);
+
+    // the canvas owns the bitmap, so it draws through a view of the whole target
+    Canvas2D_Bitmap C2(new Bitmap(&TargetV, 0, 0, W, H));
+    Canvas3D CV(&C2);
+
+    Canvas3D_Bitmap CT = Canvas3D_Bitmap(BitmapTargetRGB24(&TargetT));
+
+    const float aa = (float)W / (float)H;
+    mtx4 Proj;
+    frustum(Proj, 10.0, 150.0, -1.0 * aa, 1.0 * aa, -1.0, +1.0);
+
+    // Reset() derives the orbit from the positions and sets up the transform MakeStep() starts from
+    PanOrbitPositioner Camera;
+    Camera.FViewerPosition = vec3(0, -40, 0);
+    Camera.FTarget         = vec3(0, 0, 0);
+    Camera.Reset();
+
+    std::vector<double> TimesV, TimesT;
+    int Mismatches = 0;
+
+    for(int f = 0 ; f < NumFrames ; f++)
+    {
+        Camera.FSphericalCoords = vec3(0.0f, 1.8f * (float)f, 40.0f);
+        Camera.MakeStep(0.0f);
+
+        const float a = 0.05f * (float)f;
+
+        TargetV.Clear(0);
+        TargetT.Clear(0);
+
+        // alternate the order, so neither path always runs on caches warmed by the other
+        double tv = 0.0, tt = 0.0;
+
+        for(int k = 0 ; k < 2 ; k++)
+        {
+            double t0 = Seconds();
+
+            if((f + k) % 2)
+            {
+                CV.SetMatrices(Proj, Camera.FCurrentTransform);
+                draw_scene(CV, Grid, a);
+                tv = Seconds() - t0;
+            } else
+            {
+                CT.SetMatrices(Proj, Camera.FCurrentTransform);
+                draw_scene(CT, Grid, a);
+                tt = Seconds() - t0;
+            }
+        }
+
+        TimesV.push_back(tv);
+        TimesT.push_back(tt);
+
+        bool Empty = true;
+        for(size_t i = 0 ; i < PixelsT.size() && Empty ; i++) { Empty = (PixelsT[i] == 0); }
+
+        if(Empty || memcmp(&PixelsV[0], &PixelsT[0], PixelsV.size())) { Mismatches++; }
+    }
+
+    MedV = median(TimesV);
+    MedT = median(TimesT);
+
+    return Mismatches;
+}
+
+int main(int argc, char** argv)
+{
+    int NumFrames = 200;
+    int Grid = 100;
+    int W = 1280, H = 720;
+
+    for(int i = 1 ; i < argc ; i++)
+    {
+        if(!strcmp(argv[i], "-frames") && i + 1 < argc) { NumFrames = atoi(argv[++i]); } else
+        if(!strcmp(argv[i], "-grid")   && i + 1 < argc) { Grid = atoi(argv[++i]); } else
+        if(!strcmp(argv[i], "-size")   && i + 1 < argc && sscanf(argv[i + 1], "%dx%d", &W, &H) == 2) { i++; } else
+        {
+            printf("Usage: canvasbench [-frames N] [-grid N] [-size WxH]\n");
+            return 1;
+        }
+    }
+
+    if(NumFrames < 1) { NumFrames = 1; }
+    if(Grid < 1) { Grid = 1; }
+
+    printf("%dx%d, grid %d, %d frames\n", W, H, Grid, NumFrames);
+
+    int Mismatches = 0;
+
+    for(int t = 0 ; t < 2 ; t++)
+    {
+        double MedV, MedT;
+        Mismatches += run(W, H, Grid, NumFrames, t != 0, MedV, MedT);
+
+        const char* Tracking = t ? "tracked  " : "untracked";
+
+        printf("%s Canvas3D (virtual)  median %.3f ms/frame\n", Tracking, MedV * 1e3);
+        printf("%s Canvas3D_Bitmap     median %.3f ms/frame, %.2fx\n", Tracking, MedT * 1e3, MedT > 0 ? MedV / MedT : 0.0);
+    }
+
+    if(Mismatches)
+    {
+        printf("Images differ or are empty in %d of %d frames  FAILED\n", Mismatches, 2 * NumFrames);
+        return 1;
+    }
+
+    printf("Images identical\n");
+
+    return 0;
+}
@@ -1,5 +1,10 @@
 #include "CameraView.h"
 
+#ifdef __linux__
+#include "FrameServer.h"
+#include <string.h>
+#endif
+
 struct DemoWindow: public Window3D
 {
     DemoWindow(int x, int y, int w, int h, const char* title): Window3D(x,y,w,h,title)
@@ -17,11 +22,20 @@ struct DemoWindow: public Window3D
     }
 };
 
-int main()
+int main(int argc, char** argv)
 {
     App a;
     DemoWindow w(10, 10, 640, 360, "Demo");
     w.SetDelta(0.02f);
     w.Show(true);
+
+#ifdef __linux__
+    // "demo -stream 5900" publishes the window for example/streamview (also without a display)
+    FrameServer Server;
+
+    if(argc > 2 && !strcmp(argv[1], "-stream") && Server.Listen(argv[2]))
+        w.FServer = &Server;
+#endif
+
     return a.Run();
 }
@@ -0,0 +1,90 @@
+/// Writes a synthetic trace of 2D lines for replay (example/replay.cpp), to compare the linear and the tiled
+/// bitmap layouts on the two kinds of lines they handle differently.
+///
+///    linetrace <out.trace> [-lines steep|shallow] [-count N] [-frames N] [-size WxH]
+///
+/// Every frame clears the target and draws Count lines crossing the whole bitmap: steep ones from the top row to the
+/// bottom row (one pixel per row, the worst case of the linear layout), shallow ones from the left column to the
+/// right column (long horizontal runs, its best case).
+
+#include "Trace.h"
+#include "Arena.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int main(int argc, char** argv)
+{
+    if(argc < 2)
+    {
+        printf("Usage: linetrace <out.trace> [-lines steep|shallow] [-count N] [-frames N] [-size WxH]\n");
+        return 1;
+    }
+
+    bool Steep = true;
+    int Count = 10000;
+    int NumFrames = 10;
+    int W = 1920, H = 1080;
+
+    for(int i = 2 ; i < argc ; i++)
+    {
+        if(!strcmp(argv[i], "-lines")  && i + 1 < argc) { Steep = strcmp(argv[++i], "shallow") != 0; } else
+        if(!strcmp(argv[i], "-count")  && i + 1 < argc) { Count = atoi(argv[++i]); } else
+        if(!strcmp(argv[i], "-frames") && i + 1 < argc) { NumFrames = atoi(argv[++i]); } else
+        if(!strcmp(argv[i], "-size")   && i + 1 < argc && sscanf(argv[i + 1], "%dx%d", &W, &H) == 2) { i++; } else
+        {
+            printf("Unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    if(W < 2 || H < 2)
+    {
+        printf("Bad size %dx%d\n", W, H);
+        return 1;
+    }
+
+    TraceWriter Writer;
+    if(!Writer.Open(argv[1]))
+    {
+        printf("Cannot write %s\n", argv[1]);
+        return 1;
+    }
+
+    LinearArena Arena;
+    DrawCommandBuffer B;
+
+    srand(1);
+
+    for(int f = 0 ; f < NumFrames ; f++)
+    {
+        Arena.Reset();
+        B.Begin(&Arena);
+
+        B.AddClear(0x000000);
+
+        for(int i = 0 ; i < Count ; i++)
+        {
+            const int Color = (rand() & 0xFF) << 16 | (rand() & 0xFF) << 8 | 0x80;
+
+            // the far end is at most half the length of the line away sideways, so the line keeps its orientation
+            if(Steep)
+            {
+                const int x = rand() % W;
+                B.AddLine2D(x, 0, x + rand() % H / 2 - H / 4, H - 1, Color);
+            } else
+            {
+                const int y = rand() % H;
+                B.AddLine2D(0, y, W - 1, y + rand() % W / 2 - W / 4, Color);
+            }
+        }
+
+        Writer.WriteFrame(B, W, H);
+    }
+
+    printf("%s: %d frames of %d %s lines, %dx%d\n", argv[1], Writer.GetNumFrames(), Count, Steep ? "steep" : "shallow", W, H);
+
+    Writer.Close();
+
+    return 0;
+}
@@ -0,0 +1,226 @@
+/// Headless replay of a drawing trace (see Trace.h, Window3D::FTrace), reports the drawing throughput.
+///
+///    replay <trace> [-backend bitmap|tiled|bands|null|ssaa2|ssaa4] [-repeat N] [-threads N] [-depth] [-out last.ppm]
+///
+/// The frames are decoded up front, so only the drawing is timed. "null" draws into a canvas that drops everything
+/// (the cost of the transforms and the command dispatch), "ssaa2/4" goes through render_supersampled(), "bands" draws
+/// the tiled layout in parallel bands (ViewportRenderer::RenderBands()).
+/// "-threads" sizes the thread pool, 0 runs everything inline on the main thread.
+
+#include "Canvas.h"
+#include "Trace.h"
+#include "ThreadPool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+
+static double Seconds()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/// Canvas that ignores all drawing
+struct NullCanvas2D: public iCanvas2D
+{
+    NullCanvas2D(int W, int H): FWidth(W), FHeight(H) {}
+
+    virtual void SetPixel(int, int, int) {}
+    virtual void Line(int, int, int, int, int) {}
+    virtual void Clear(int) {}
+
+    virtual int GetWidth()  const { return FWidth;  }
+    virtual int GetHeight() const { return FHeight; }
+
+    int FWidth, FHeight;
+};
+
+struct Frame
+{
+    LinearArena* Arena;
+    DrawCommandBuffer Commands;
+    int Width, Height;
+};
+
+static void SavePPM(const char* FileName, const Bitmap& B)
+{
+    FILE* F = fopen(FileName, "wb");
+    if(!F) { printf("Cannot write %s\n", FileName); return; }
+
+    fprintf(F, "P6\n%d %d\n255\n", B.Width, B.Height);
+    fwrite(B.FB, 1, B.Width * B.Height * 3, F);
+    fclose(F);
+}
+
+int main(int argc, char** argv)
+{
+    if(argc < 2)
+    {
+        printf("Usage: replay <trace> [-backend bitmap|tiled|bands|null|ssaa2|ssaa4] [-repeat N] [-threads N] [-depth] [-out last.ppm]\n");
+        return 1;
+    }
+
+    const char* Backend = "bitmap";
+    const char* Out = NULL;
+    int Repeat = 1;
+    int Threads = -1;
+    bool Depth = false;
+
+    for(int i = 2 ; i < argc ; i++)
+    {
+        if(!strcmp(argv[i], "-backend") && i + 1 < argc) { Backend = argv[++i]; } else
+        if(!strcmp(argv[i], "-repeat")  && i + 1 < argc) { Repeat = atoi(argv[++i]); } else
+        if(!strcmp(argv[i], "-threads") && i + 1 < argc) { Threads = atoi(argv[++i]); } else
+        if(!strcmp(argv[i], "-out")     && i + 1 < argc) { Out = argv[++i]; } else
+        if(!strcmp(argv[i], "-depth"))                   { Depth = true; } else
+        {
+            printf("Unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    if(Repeat < 1) { Repeat = 1; }
+
+    if(Threads == 0)
+        ThreadPool::Global().SetInline(true);
+    else
+    if(Threads > 0)
+        ThreadPool::Global().Resize(Threads, false);
+
+    TraceReader Reader;
+    if(!Reader.Open(argv[1]))
+    {
+        printf("Cannot read trace %s\n", argv[1]);
+        return 1;
+    }
+
+    // decode everything first
+    double Start = Seconds();
+
+    std::vector<Frame*> Frames;
+    long NumCommands = 0;
+
+    for(;;)
+    {
+        Frame* F = new Frame;
+        F->Arena = new LinearArena();
+        F->Commands.Begin(F->Arena);
+
+        if(!Reader.ReadFrame(F->Commands, F->Width, F->Height))
+        {
+            delete F->Arena;
+            delete F;
+            break;
+        }
+
+        NumCommands += F->Commands.GetCount();
+        Frames.push_back(F);
+    }
+
+    double DecodeTime = Seconds() - Start;
+
+    if(Frames.empty())
+    {
+        printf("No frames in %s\n", argv[1]);
+        return 1;
+    }
+
+    printf("%d frames, %ld commands, %.1f KB (%.1f bytes/command), decoded in %.1f ms (%.0f MB/s)\n",
+        (int)Frames.size(), NumCommands, (double)Reader.GetSize() / 1024.0, (double)Reader.GetSize() / (double)(NumCommands ? NumCommands : 1),
+        DecodeTime * 1e3, (double)Reader.GetSize() / (DecodeTime > 0 ? DecodeTime : 1e-9) / 1e6);
+
+    // the target is reallocated when the frame size changes
+    int W = 0, H = 0;
+    std::vector<unsigned char> Pixels;
+    std::vector<float> ZBuffer;
+    Bitmap* Target = NULL;
+
+    // the canvases of the bands are kept between frames
+    ViewportRenderer Bands;
+
+    std::vector<double> Times;
+    Times.reserve(Frames.size() * Repeat);
+
+    for(int r = 0 ; r < Repeat ; r++)
+    {
+        for(size_t f = 0 ; f < Frames.size() ; f++)
+        {
+            Frame* F = Frames[f];
+
+            if(!Target || F->Width != W || F->Height != H)
+            {
+                delete Target;
+
+                W = F->Width; H = F->Height;
+                Pixels.assign((size_t)W * H * 3, 0);
+                Target = new Bitmap(&Pixels[0], W, H);
+
+                if(!strcmp(Backend, "tiled") || !strcmp(Backend, "bands")) { Target->SetLayout(BITMAP_TILED); }
+
+                if(Depth)
+                {
+                    ZBuffer.assign((size_t)W * H, 1.0f);
+                    Target->ZB = &ZBuffer[0];
+                }
+            }
+
+            double t0 = Seconds();
+
+            if(!strncmp(Backend, "ssaa", 4))
+            {
+                render_supersampled(Target, F->Commands, atoi(Backend + 4), DOWNSAMPLE_BOX, Depth);
+            } else
+            if(!strcmp(Backend, "bands"))
+            {
+                if(Depth) { Target->ClearDepth(); }
+
+                Bands.RenderBands(Target, F->Commands, Depth);
+                Target->Resolve();
+            } else
+            if(!strcmp(Backend, "null"))
+            {
+                NullCanvas2D C2(W, H);
+                Canvas3D C3(&C2);
+                C3.Execute(F->Commands);
+            } else
+            {
+                // the canvas owns the bitmap, so it draws through a view of the whole target
+                Canvas2D_Bitmap C2(new Bitmap(Target, 0, 0, W, H));
+                Canvas3D C3(&C2);
+                C3.FDepthTest = Depth;
+
+                if(Depth) { Target->ClearDepth(); }
+
+                C3.Execute(F->Commands);
+                Target->Resolve();
+            }
+
+            Times.push_back(Seconds() - t0);
+        }
+    }
+
+    double Total = 0.0;
+    for(size_t i = 0 ; i < Times.size() ; i++) { Total += Times[i]; }
+
+    std::vector<double> Sorted(Times);
+    std::sort(Sorted.begin(), Sorted.end());
+
+    printf("backend %s, %d threads: %d frames in %.1f ms, %.3f ms/frame (median %.3f, 95%% %.3f, max %.3f), %.1f frames/s, %.2f M commands/s\n",
+        Backend, ThreadPool::Global().GetNumThreads(), (int)Times.size(), Total * 1e3, Total * 1e3 / (double)Times.size(),
+        Sorted[Sorted.size() / 2] * 1e3, Sorted[(Sorted.size() * 95) / 100] * 1e3, Sorted.back() * 1e3,
+        (double)Times.size() / Total, (double)NumCommands * Repeat / Total / 1e6);
+
+    if(Out) { SavePPM(Out, *Target); }
+
+    delete Target;
+
+    for(size_t f = 0 ; f < Frames.size() ; f++)
+    {
+        delete Frames[f]->Arena;
+        delete Frames[f];
+    }
+
+    return 0;
+}
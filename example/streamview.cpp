@@ -0,0 +1,85 @@
+/// Viewer of a streamed window (see FrameServer.h): shows the frames and sends the mouse and keyboard back.
+///
+///    streamview [address]      (default "5900", TCP on the loopback interface)
+///
+/// Run a program with a Window3D whose FServer listens on the address, e.g. on a machine without a display
+/// and with the port forwarded over ssh.
+
+#include "CommonFramework.h"
+#include "FrameServer.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+struct StreamWindow: public BaseWindow
+{
+    StreamWindow(FrameClient* C): BaseWindow(10, 10, C->FWidth, C->FHeight, "Stream"), FClient(C), FNewFrame(true) {}
+
+    virtual void OnTimer()
+    {
+        if(FClient->Poll()) { FNewFrame = true; }
+
+        if(FNewFrame) { Repaint(); }
+    }
+
+    virtual bool IsFrameDirty() { return FNewFrame; }
+
+    /// The stream keeps its first size, the window is not resized
+    virtual void OnDraw()
+    {
+        FNewFrame = false;
+
+        if(FClient->FWidth != Width || FClient->FHeight != Height) { return; }
+
+        memcpy(FB, &FClient->FPixels[0], Width * Height * 3);
+    }
+
+    virtual void OnMouseDown(int btn, int x, int y) { FClient->SendEvent(STREAM_MOUSE_DOWN, btn, x, y); }
+    virtual void OnMouseUp(int btn, int x, int y)   { FClient->SendEvent(STREAM_MOUSE_UP, btn, x, y); }
+    virtual void OnMouseMove(int x, int y)          { FClient->SendEvent(STREAM_MOUSE_MOVE, 0, x, y); }
+    virtual void OnWheelUp()                        { FClient->SendEvent(STREAM_WHEEL_UP); }
+    virtual void OnWheelDown()                      { FClient->SendEvent(STREAM_WHEEL_DOWN); }
+    virtual void OnKeyDown(int key)                 { FClient->SendEvent(STREAM_KEY_DOWN, key); }
+    virtual void OnKeyUp(int key)                   { FClient->SendEvent(STREAM_KEY_UP, key); }
+
+    FrameClient* FClient;
+    bool FNewFrame;
+};
+
+int main(int argc, char** argv)
+{
+    const char* Address = (argc > 1) ? argv[1] : "5900";
+
+    FrameClient Client;
+    if(!Client.Connect(Address))
+    {
+        printf("Cannot connect to %s\n", Address);
+        return 1;
+    }
+
+    // the window gets the size of the first frame
+    while(Client.IsConnected() && !Client.FFrames)
+    {
+        Client.Poll();
+        usleep(1000);
+    }
+
+    if(!Client.FFrames)
+    {
+        printf("Connection closed\n");
+        return 1;
+    }
+
+    App a;
+
+    if(App::IsHeadless())
+    {
+        printf("No display\n");
+        return 1;
+    }
+
+    StreamWindow w(&Client);
+    w.SetDelta(0.01f);
+    w.Show(true);
+    return a.Run();
+}
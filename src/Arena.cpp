@@ -0,0 +1,97 @@
+#include "Arena.h"
+#include <stdlib.h>
+#include <stdio.h>
+
+/// Offset of the payload inside a block (keeps the payload 16-byte aligned)
+static const size_t BlockHeaderSize = 32;
+
+LinearArena::LinearArena(size_t InitialSize): FHead(NULL), FNumHeapAllocations(0)
+{
+    FHead = NewBlock(InitialSize);
+}
+
+LinearArena::~LinearArena()
+{
+    while(FHead)
+    {
+        Block* Next = FHead->Next;
+        free(FHead);
+        FHead = Next;
+    }
+}
+
+LinearArena::Block* LinearArena::NewBlock(size_t Size)
+{
+    Block* B = (Block*)malloc(BlockHeaderSize + Size);
+
+    // Alloc() promises memory, there is no way to report the failure to the caller
+    if(!B)
+    {
+        fprintf(stderr, "LinearArena: out of memory (%lu bytes)\n", (unsigned long)(BlockHeaderSize + Size));
+        abort();
+    }
+
+    B->Next = NULL;
+    B->Size = Size;
+    B->Used = 0;
+
+    FNumHeapAllocations++;
+
+    return B;
+}
+
+void* LinearArena::Alloc(size_t Size, size_t Align)
+{
+    unsigned char* Base = (unsigned char*)FHead + BlockHeaderSize;
+
+    size_t Ofs = (FHead->Used + Align - 1) & ~(Align - 1);
+
+    if(Ofs + Size > FHead->Size)
+    {
+        // chain a new block, at least doubling the capacity so that the overflow case stays rare
+        size_t NewSize = FHead->Size * 2;
+        if(NewSize < Size + Align) { NewSize = Size + Align; }
+
+        Block* B = NewBlock(NewSize);
+        B->Next = FHead;
+        FHead = B;
+
+        Base = (unsigned char*)FHead + BlockHeaderSize;
+        Ofs = 0;
+    }
+
+    FHead->Used = Ofs + Size;
+
+    return Base + Ofs;
+}
+
+void LinearArena::Reset()
+{
+    if(FHead->Next)
+    {
+        // the last frame overflowed: replace the chain with one block that fits all of it
+        size_t Total = 0;
+
+        while(FHead)
+        {
+            Block* Next = FHead->Next;
+            Total += FHead->Size;
+            free(FHead);
+            FHead = Next;
+        }
+
+        FHead = NewBlock(Total);
+    }
+
+    FHead->Used = 0;
+}
+
+size_t LinearArena::GetUsed() const
+{
+    size_t Used = 0;
+
+    for(Block* B = FHead ; B != NULL ; B = B->Next)
+        Used += B->Used;
+
+    return Used;
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stddef.h>
+
+/// Linear (bump) allocator for transient per-frame data. Everything allocated from the arena is released at once by Reset().
+/// When a frame does not fit into the current block, additional blocks are chained. The next Reset() replaces the chain
+/// with a single block large enough for the whole frame, so after a warm-up frame no heap allocations happen at all.
+struct LinearArena
+{
+    LinearArena(size_t InitialSize = 64 * 1024);
+    ~LinearArena();
+
+    /// Allocate Size bytes aligned to Align (power of two). Never returns NULL, aborts if the heap is exhausted.
+    void* Alloc(size_t Size, size_t Align = 16);
+
+    template <class T> T* AllocArray(size_t Count) { return (T*)Alloc(sizeof(T) * Count); }
+
+    /// Release everything allocated since the last Reset()
+    void Reset();
+
+    /// Bytes handed out since the last Reset()
+    size_t GetUsed() const;
+
+    /// Total number of malloc() calls made by this arena (for checking the zero-allocation steady state)
+    int GetNumHeapAllocations() const { return FNumHeapAllocations; }
+
+private:
+    struct Block
+    {
+        Block* Next;
+        size_t Size;
+        size_t Used;
+    };
+
+    Block* NewBlock(size_t Size);
+
+    /// Block we allocate from (head of the chain), older blocks follow via Next
+    Block* FHead;
+
+    int FNumHeapAllocations;
+
+    LinearArena(const LinearArena&);
+    LinearArena& operator=(const LinearArena&);
+};
@@ -1,59 +1,529 @@
 #include "Bitmap.h"
+#include "BitmapRaster.h"
+#include "Parallel.h"
 #include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+/// Smallest amount of pixel data (bytes) worth a parallel pass
+static const int ParallelMinBytes = 1 << 20;
+
+/// Part of a plain Clear(): pixels [First, First + Count) of a tile or pixel buffer, split in chunks
+template <class PixelT>
+struct ClearTask
+{
+    unsigned char* Buffer;
+    int Count, ChunkSize;
+    typename PixelT::Value Color;
+
+    void operator()(int i) const
+    {
+        int First = i * ChunkSize;
+        int n = (Count - First < ChunkSize) ? Count - First : ChunkSize;
+
+        PixelT::Fill(Buffer + (size_t)First * PixelT::Size, n, Color);
+    }
+};
+
+/// Fill the whole buffer, large ones in chunks of ParallelMinBytes on the pool
+template <class PixelT>
+static void clear_buffer(unsigned char* Buffer, int Count, int value)
+{
+    ClearTask<PixelT> Task;
+    Task.Buffer    = Buffer;
+    Task.Count     = Count;
+    Task.Color     = PixelT::Pack(value);
+    Task.ChunkSize = ParallelMinBytes / PixelT::Size;
+
+    parallel_for((Count + Task.ChunkSize - 1) / Task.ChunkSize, Task);
+}
+
+/// Fill Count pixels of row y starting at x with value (see Bitmap::MapColor)
+static inline void fill_row(Bitmap* B, int x, int y, int Count, int value)
+{
+    if(B->FFormat == BITMAP_INDEXED8)
+        bitmap_fill_row<PixelIndexed8>(B, x, y, Count, PixelIndexed8::Pack(value));
+    else
+        bitmap_fill_row<PixelRGB24>(B, x, y, Count, PixelRGB24::Pack(value));
+}
+
+BitmapPalette::BitmapPalette()
+{
+    int n = 0;
+
+    for(int r = 0 ; r < 6 ; r++)
+        for(int g = 0 ; g < 6 ; g++)
+            for(int b = 0 ; b < 6 ; b++)
+                Colors[n++] = ((r * 51) << 16) | ((g * 51) << 8) | (b * 51);
+
+    // grays between the ones of the cube
+    for(int k = 1 ; n < 256 ; k++)
+    {
+        int v = k * 255 / 41;
+        Colors[n++] = (v << 16) | (v << 8) | v;
+    }
+
+    Count = 256;
+    BuildLookup();
+}
+
+void BitmapPalette::Set(const int* colors, int count)
+{
+    if(count > 256) { count = 256; }
+
+    for(int i = 0 ; i < count ; i++)
+        Colors[i] = colors[i] & 0xFFFFFF;
+
+    if(count > Count) { Count = count; }
+
+    BuildLookup();
+}
+
+static inline int palette_slot(int color) { return (int)(((unsigned)color * 0x9E3779B1u) >> 23); }
+
+void BitmapPalette::BuildLookup()
+{
+    memset(FLookup, 0xFF, sizeof(FLookup));
+
+    // the first of equal entries wins
+    for(int i = 0 ; i < Count ; i++)
+    {
+        int s = palette_slot(Colors[i]);
+        while(FLookup[s] >= 0 && Colors[FLookup[s]] != Colors[i]) { s = (s + 1) & 511; }
+
+        if(FLookup[s] < 0) { FLookup[s] = (short)i; }
+    }
+}
+
+int BitmapPalette::Map(int color) const
+{
+    color &= 0xFFFFFF;
+
+    for(int s = palette_slot(color) ; FLookup[s] >= 0 ; s = (s + 1) & 511)
+    {
+        if(Colors[FLookup[s]] == color) { return FLookup[s]; }
+    }
+
+    const int r = (color >> 16) & 0xFF, g = (color >> 8) & 0xFF, b = color & 0xFF;
+
+    int Best = 0, BestDist = 0x7FFFFFFF;
+    for(int i = 0 ; i < Count ; i++)
+    {
+        int dr = ((Colors[i] >> 16) & 0xFF) - r, dg = ((Colors[i] >> 8) & 0xFF) - g, db = (Colors[i] & 0xFF) - b;
+        int d  = dr * dr + dg * dg + db * db;
+
+        if(d < BestDist) { BestDist = d; Best = i; }
+    }
+
+    return Best;
+}
+
+/// Resolve() of one row of tiles
+struct ResolveTask
+{
+    Bitmap* B;
+
+    void operator()(int ty) const { B->ResolveTileRow(ty); }
+};
+
+Bitmap::Bitmap(Bitmap* Parent, int x, int y, int w, int h):
+    Width(Parent->Width), Height(Parent->Height), FB(Parent->FB), ZB(Parent->ZB), FLayout(Parent->FLayout),
+    FFormat(Parent->FFormat), FPalette(Parent->FPalette),
+    FTiles(Parent->FTiles), FTilesX(Parent->FTilesX), FTilesY(Parent->FTilesY),
+    FCells(Parent->FCells), FCellRows(Parent->FCellRows), FCellsX(Parent->FCellsX), FCellsY(Parent->FCellsY),
+    FClearColor(Parent->FClearColor), FClearValid(Parent->FClearValid),
+    FViewX0(0), FViewY0(0), FViewX1(Parent->Width), FViewY1(Parent->Height), FShared(true)
+{
+    SetClipRect(x, y, w, h);
+
+    FViewX0 = FClipX0; FViewY0 = FClipY0;
+    FViewX1 = FClipX1; FViewY1 = FClipY1;
+}
+
+Bitmap::~Bitmap()
+{
+    if(FShared) { return; }
+
+    delete FPalette;
+    delete[] FTiles;
+    delete[] FCells;
+    delete[] FCellRows;
+}
+
+void Bitmap::SetClipRect(int x, int y, int w, int h)
+{
+    FClipX0 = x < FViewX0 ? FViewX0 : x;
+    FClipY0 = y < FViewY0 ? FViewY0 : y;
+    FClipX1 = x + w > FViewX1 ? FViewX1 : x + w;
+    FClipY1 = y + h > FViewY1 ? FViewY1 : y + h;
+
+    if(FClipX1 < FClipX0) { FClipX1 = FClipX0; }
+    if(FClipY1 < FClipY0) { FClipY1 = FClipY0; }
+}
+
+void Bitmap::SetPalette(const int* colors, int count)
+{
+    if(!FPalette) { return; }
+
+    FPalette->Set(colors, count);
+
+    FClearValid = false;
+    MarkRect(0, 0, Width - 1, Height - 1);
+}
+
+void Bitmap::SetLayout(int Layout)
+{
+    // the buffers of a view belong to its parent, indexed bitmaps are always linear
+    if(FShared || FFormat != BITMAP_RGB24) { return; }
+
+    delete[] FTiles;
+    FTiles = NULL;
+    FTilesX = FTilesY = 0;
+
+    FLayout = Layout;
+    FClearValid = false;
+
+    if(Layout == BITMAP_TILED)
+    {
+        FTilesX = (Width  + BITMAP_TILE_SIZE - 1) >> BITMAP_TILE_SHIFT;
+        FTilesY = (Height + BITMAP_TILE_SIZE - 1) >> BITMAP_TILE_SHIFT;
+        FTiles  = new unsigned char[FTilesX * FTilesY * BITMAP_TILE_SIZE * BITMAP_TILE_SIZE * 3];
+    }
+}
+
+void Bitmap::Resolve()
+{
+    if(FLayout != BITMAP_TILED) { return; }
+
+    // rows of tiles are independent
+    if(Width * Height * 3 >= ParallelMinBytes)
+    {
+        ResolveTask Task;
+        Task.B = this;
+
+        parallel_for(FTilesY, Task);
+        return;
+    }
+
+    for(int ty = 0 ; ty < FTilesY ; ty++)
+        ResolveTileRow(ty);
+}
+
+void Bitmap::ResolveTileRow(int ty)
+{
+    const int RowBytes = BITMAP_TILE_SIZE * 3;
+    const int CellShift = BITMAP_TRACK_SHIFT - BITMAP_TILE_SHIFT;
+
+    // with tracking only the tiles of dirty cells can differ from FB
+    if(FCells && !(FCellRows[ty >> CellShift] & CELL_DIRTY)) { return; }
+
+    for(int tx = 0 ; tx < FTilesX ; tx++)
+    {
+        if(FCells && !(GetCellFlags(tx >> CellShift, ty >> CellShift) & CELL_DIRTY)) { continue; }
+
+        const unsigned char* Tile = FTiles + (ty * FTilesX + tx) * BITMAP_TILE_SIZE * RowBytes;
+
+        int x = tx << BITMAP_TILE_SHIFT, y = ty << BITMAP_TILE_SHIFT;
+        int w = (Width  - x < BITMAP_TILE_SIZE) ? Width  - x : BITMAP_TILE_SIZE;
+        int h = (Height - y < BITMAP_TILE_SIZE) ? Height - y : BITMAP_TILE_SIZE;
+
+        for(int j = 0 ; j < h ; j++)
+            memcpy(FB + ((y + j) * Width + x) * 3, Tile + j * RowBytes, w * 3);
+    }
+}
+
+void Bitmap::EnableTracking(bool On)
+{
+    if(FShared) { return; }
+
+    delete[] FCells;
+    delete[] FCellRows;
+    FCells = FCellRows = NULL;
+    FCellsX = FCellsY = 0;
+
+    // the content is unknown until the next (full) Clear()
+    FClearValid = false;
+
+    if(!On) { return; }
+
+    FCellsX = (Width  + BITMAP_TRACK_SIZE - 1) >> BITMAP_TRACK_SHIFT;
+    FCellsY = (Height + BITMAP_TRACK_SIZE - 1) >> BITMAP_TRACK_SHIFT;
+
+    FCells    = new unsigned char[FCellsX * FCellsY];
+    FCellRows = new unsigned char[FCellsY];
+
+    memset(FCells,    CELL_TOUCHED | CELL_DIRTY, FCellsX * FCellsY);
+    memset(FCellRows, CELL_TOUCHED | CELL_DIRTY, FCellsY);
+}
+
+void Bitmap::MarkRect(int x0, int y0, int x1, int y1)
+{
+    if(!FCells) { return; }
+
+    if(x0 < 0) { x0 = 0; }
+    if(y0 < 0) { y0 = 0; }
+    if(x1 > Width  - 1) { x1 = Width  - 1; }
+    if(y1 > Height - 1) { y1 = Height - 1; }
+    if(x0 > x1 || y0 > y1) { return; }
+
+    const int cx0 = x0 >> BITMAP_TRACK_SHIFT, cx1 = x1 >> BITMAP_TRACK_SHIFT;
+
+    for(int cy = y0 >> BITMAP_TRACK_SHIFT ; cy <= (y1 >> BITMAP_TRACK_SHIFT) ; cy++)
+    {
+        memset(FCells + cy * FCellsX + cx0, CELL_TOUCHED | CELL_DIRTY, cx1 - cx0 + 1);
+        FCellRows[cy] = CELL_TOUCHED | CELL_DIRTY;
+    }
+}
+
+void Bitmap::TouchLine(int x0, int y0, int x1, int y1)
+{
+    // a is the major axis, b the minor one
+    const bool XMajor = abs(x1 - x0) >= abs(y1 - y0);
+
+    int a0 = XMajor ? x0 : y0, a1 = XMajor ? x1 : y1;
+    int b0 = XMajor ? y0 : x0, b1 = XMajor ? y1 : x1;
+
+    if(a0 > a1)
+    {
+        int t = a0; a0 = a1; a1 = t;
+        t = b0; b0 = b1; b1 = t;
+    }
+
+    const float Slope = (a1 > a0) ? (float)(b1 - b0) / (float)(a1 - a0) : 0.0f;
+    const int BMax = (XMajor ? Height : Width) - 1;
+
+    for(int ca = a0 >> BITMAP_TRACK_SHIFT ; ca <= (a1 >> BITMAP_TRACK_SHIFT) ; ca++)
+    {
+        // the part of the line in this column (row) of cells
+        const int s = std::max(a0, ca << BITMAP_TRACK_SHIFT);
+        const int e = std::min(a1, (ca << BITMAP_TRACK_SHIFT) + BITMAP_TRACK_SIZE - 1);
+
+        float bs = (float)b0 + (float)(s - a0) * Slope;
+        float be = (float)b0 + (float)(e - a0) * Slope;
+        if(bs > be) { float t = bs; bs = be; be = t; }
+
+        // the ideal line is inside the bitmap, so truncation is floor
+        const int lo = std::max(0,    (int)bs - 1);
+        const int hi = std::min(BMax, (int)be + 1);
+
+        for(int cb = lo >> BITMAP_TRACK_SHIFT ; cb <= (hi >> BITMAP_TRACK_SHIFT) ; cb++)
+        {
+            const int cx = XMajor ? ca : cb, cy = XMajor ? cb : ca;
+
+            FCells[cy * FCellsX + cx] = CELL_TOUCHED | CELL_DIRTY;
+            FCellRows[cy] = CELL_TOUCHED | CELL_DIRTY;
+        }
+    }
+}
+
+void Bitmap::ClearDirty()
+{
+    if(!FCells) { return; }
+
+    for(int cy = 0 ; cy < FCellsY ; cy++)
+    {
+        if(!(FCellRows[cy] & CELL_DIRTY)) { continue; }
+
+        unsigned char* c = FCells + cy * FCellsX;
+        for(int cx = 0 ; cx < FCellsX ; cx++)
+            c[cx] &= ~CELL_DIRTY;
+
+        FCellRows[cy] &= ~CELL_DIRTY;
+    }
+}
+
+void Bitmap::FillCell(int cx, int cy, int value)
+{
+    int x = cx << BITMAP_TRACK_SHIFT, y = cy << BITMAP_TRACK_SHIFT;
+    int w = (Width  - x < BITMAP_TRACK_SIZE) ? Width  - x : BITMAP_TRACK_SIZE;
+    int h = (Height - y < BITMAP_TRACK_SIZE) ? Height - y : BITMAP_TRACK_SIZE;
+
+    if(FFormat == BITMAP_INDEXED8)
+    {
+        for(int j = 0 ; j < h ; j++)
+            memset(FB + (y + j) * Width + x, value, w);
+
+        return;
+    }
+
+    const PixelRGB24::Value v = PixelRGB24::Pack(value);
+
+    for(int j = 0 ; j < h ; j++)
+    {
+        // split at the tiles of the BITMAP_TILED layout
+        for(int i = 0 ; i < w ; )
+        {
+            int n = RunLength(x + i);
+            if(n > w - i) { n = w - i; }
+
+            PixelRGB24::Fill(PixelPtr(x + i, y + j), n, v);
+            i += n;
+        }
+    }
+}
+
+void Bitmap::WriteRow(int x, int y, int Count, const unsigned char* Src)
+{
+    if(FCells) { MarkRect(x, y, x + Count - 1, y); }
+
+    if(FFormat == BITMAP_INDEXED8)
+    {
+        unsigned char* p = FB + y * Width + x;
+
+        // runs of one color are common, map each color once
+        int Last = -1, Index = 0;
+        for(int i = 0 ; i < Count ; i++, Src += 3)
+        {
+            int c = PixelRGB24::Load(Src);
+            if(c != Last) { Last = c; Index = FPalette->Map(c); }
+
+            p[i] = (unsigned char)Index;
+        }
+        return;
+    }
+
+    while(Count > 0)
+    {
+        int n = RunLength(x);
+        if(n > Count) { n = Count; }
+
+        memcpy(PixelPtr(x, y), Src, n * 3);
+
+        x += n; Src += n * 3; Count -= n;
+    }
+}
+
+void Bitmap::ReadRow(int x, int y, int Count, unsigned char* Dst) const
+{
+    if(FFormat == BITMAP_INDEXED8)
+    {
+        const unsigned char* p = FB + y * Width + x;
+
+        for(int i = 0 ; i < Count ; i++, Dst += 3)
+            PixelRGB24::Store(Dst, PixelRGB24::Pack(FPalette->Colors[p[i]]));
+
+        return;
+    }
+
+    while(Count > 0)
+    {
+        int n = RunLength(x);
+        if(n > Count) { n = Count; }
+
+        memcpy(Dst, PixelPtr(x, y), n * 3);
+
+        x += n; Dst += n * 3; Count -= n;
+    }
+}
 
 void Bitmap::Clear(int color)
 {
-    unsigned char R = (color >> 16) & 0xFF;
-    unsigned char G = (color >>  8) & 0xFF;
-    unsigned char B = (color      ) & 0xFF;
+    const int value = MapColor(color);
+
+    // the color the pixels really get (GetClearColor() is presented for untouched cells)
+    if(FPalette) { color = FPalette->Colors[value]; }
+
+    if(IsClipped() || FShared)
+    {
+        // a viewport, or a view sharing its parent's cells (even when it covers all of it: the clear color it would
+        // remember is its own copy, the parent's next lazy clear would not know about it): fill the rectangle like
+        // any other drawing, so the cells get touched
+        for(int y = FClipY0 ; y < FClipY1 ; y++)
+            fill_row(this, FClipX0, y, FClipX1 - FClipX0, value);
 
-    int sz = Width * Height;
-    unsigned char* pos = FB;
+        return;
+    }
 
-    for(int i = 0 ; i < sz ; i++)
+    if(FCells && FClearValid && color == FClearColor)
     {
-        *pos++ = R;
-        *pos++ = G;
-        *pos++ = B;
+        // lazy clear: only the touched cells differ from the clear color
+        for(int cy = 0 ; cy < FCellsY ; cy++)
+        {
+            if(!(FCellRows[cy] & CELL_TOUCHED)) { continue; }
+
+            unsigned char* c = FCells + cy * FCellsX;
+
+            for(int cx = 0 ; cx < FCellsX ; cx++)
+            {
+                if(!(c[cx] & CELL_TOUCHED)) { continue; }
+
+                FillCell(cx, cy, value);
+                c[cx] = CELL_DIRTY;
+            }
+
+            FCellRows[cy] = CELL_DIRTY;
+        }
+        return;
+    }
+
+    // the tile buffer is cleared as a whole, including the padding of the border tiles
+    if(FFormat == BITMAP_INDEXED8)
+        clear_buffer<PixelIndexed8>(FB, Width * Height, value);
+    else
+    if(FLayout == BITMAP_TILED)
+        clear_buffer<PixelRGB24>(FTiles, FTilesX * FTilesY * BITMAP_TILE_SIZE * BITMAP_TILE_SIZE, value);
+    else
+        clear_buffer<PixelRGB24>(FB, Width * Height, value);
+
+    if(FCells)
+    {
+        memset(FCells,    CELL_DIRTY, FCellsX * FCellsY);
+        memset(FCellRows, CELL_DIRTY, FCellsY);
+
+        FClearColor = color;
+        FClearValid = true;
     }
 }
 
 void Bitmap::SetPixel(int x, int y, int color)
 {
-    if(x < 0 || y < 0 || x >= Width || y >= Height) { return; }
-
-    unsigned char R = (color >> 16) & 0xFF;
-    unsigned char G = (color >>  8) & 0xFF;
-    unsigned char B = (color      ) & 0xFF;
+    if(x < FClipX0 || y < FClipY0 || x >= FClipX1 || y >= FClipY1) { return; }
 
-    int ofs = (y * Width + x) * 3;
+    if(FCells) { TouchPixel(x, y); }
 
-    FB[ofs + 0] = R;
-    FB[ofs + 1] = G;
-    FB[ofs + 2] = B;
+    if(FPalette)
+        *PixelPtr(x, y) = (unsigned char)FPalette->Map(color);
+    else
+        PixelRGB24::Store(PixelPtr(x, y), PixelRGB24::Pack(color));
 }
 
-int  Bitmap::GetPixel(int x, int y)
+int  Bitmap::GetPixel(int x, int y) const
 {
     if(x < 0 || y < 0 || x >= Width || y >= Height) { return 0; }
 
-    int ofs = (y * Width + x) * 3;
-    return (((int)(FB[ofs + 0])) << 16) + (((int)(FB[ofs + 1])) << 8) + ((int)(FB[ofs + 2]));
+    if(FPalette) { return FPalette->Colors[*PixelPtr(x, y)]; }
+
+    return PixelRGB24::Load(PixelPtr(x, y));
 }
 
 // Adapted from https://rosettacode.org/wiki/Bitmap/Bresenham%27s_line_algorithm#C
+// The loop itself lives in BitmapTarget::Line (BitmapRaster.h)
 void Bitmap::Line(int x0, int y0, int x1, int y1, int color)
 {
-    int dx = abs(x1-x0), sx = x0<x1 ? 1 : -1;
-    int dy = abs(y1-y0), sy = y0<y1 ? 1 : -1; 
-    int err = (dx>dy ? dx : -dy)/2, e2;
+    if(FFormat == BITMAP_INDEXED8)
+        BitmapTargetIndexed8(this).Line(x0, y0, x1, y1, FPalette->Map(color));
+    else
+    if(FLayout == BITMAP_TILED)
+        BitmapTargetTiledRGB24(this).Line(x0, y0, x1, y1, color);
+    else
+        BitmapTargetRGB24(this).Line(x0, y0, x1, y1, color);
+}
 
-    for(;;)
+void Bitmap::Line(int x0, int y0, int x1, int y1, int color, const LineStyle& Style)
+{
+    const int EndColor = (Style.EndColor < 0) ? color : Style.EndColor;
+
+    if(EndColor == color && Style.IsSolid())
     {
-        SetPixel(x0,y0, color);
-        if (x0==x1 && y0==y1) break;
-        e2 = err;
-        if (e2 >-dx) { err -= dy; x0 += sx; }
-        if (e2 < dy) { err += dx; y0 += sy; }
+        Line(x0, y0, x1, y1, color);
+        return;
     }
+
+    if(FFormat == BITMAP_INDEXED8)
+        BitmapTargetIndexed8(this).LineStyled(x0, y0, x1, y1, color, EndColor, Style);
+    else
+    if(FLayout == BITMAP_TILED)
+        BitmapTargetTiledRGB24(this).LineStyled(x0, y0, x1, y1, color, EndColor, Style);
+    else
+        BitmapTargetRGB24(this).LineStyled(x0, y0, x1, y1, color, EndColor, Style);
 }
@@ -1,20 +1,338 @@
 #pragma once
 
-/// Simple 24-bit image with pixel and line rendering
+#include <stddef.h>
+
+struct LinearArena;
+
+/// Filtering for Bitmap::BlitScaled
+enum BlitFilter
+{
+    BLIT_NEAREST = 0,
+    BLIT_BILINEAR
+};
+
+/// Reconstruction filter of Bitmap::Downsample
+enum DownsampleFilter
+{
+    /// Average of the Factor x Factor samples of the pixel
+    DOWNSAMPLE_BOX = 0,
+
+    /// Separable tent over 2 * Factor samples per axis (half a pixel into the neighbours), softer edges
+    DOWNSAMPLE_TENT
+};
+
+/// Memory layout of the drawing buffer
+enum BitmapLayout
+{
+    /// Rows of pixels, drawing goes straight to FB
+    BITMAP_LINEAR = 0,
+
+    /// 8x8 pixel tiles (3 cache lines each) in an internal buffer, so steep lines stay in cache.
+    /// Resolve() converts the tiles into FB
+    BITMAP_TILED
+};
+
+/// Pixel format of the drawing buffer
+enum BitmapFormat
+{
+    /// 3 bytes per pixel: R, G, B
+    BITMAP_RGB24 = 0,
+
+    /// 1 byte per pixel, an index into the palette of the bitmap. Drawing calls still take 0xRRGGBB colors,
+    /// each call maps its color to the palette once. Only the linear layout. Indexed sources can only be blitted
+    /// (Blit, nearest BlitScaled) into indexed bitmaps, the indices are copied as they are; BlitKeyed, BlitAlpha
+    /// and Downsample need RGB24 sources
+    BITMAP_INDEXED8
+};
+
+/// Colors of a BITMAP_INDEXED8 bitmap
+struct BitmapPalette
+{
+    /// The default palette: a 6x6x6 color cube and 40 grays
+    BitmapPalette();
+
+    /// Replace the first Count (up to 256) entries, 0xRRGGBB each
+    void Set(const int* colors, int count);
+
+    /// Index of the entry equal to color, or of the nearest one (squared RGB distance). Exact matches are a hash lookup
+    int Map(int color) const;
+
+    /// The entries, change them with Set() only
+    int Colors[256];
+    int Count;
+
+private:
+    /// Open addressing table of the entries for Map(), -1 marks free slots
+    short FLookup[512];
+
+    void BuildLookup();
+};
+
+/// Appearance of a styled line (Bitmap::Line with a style, iCanvas2D::LineStyled, Canvas3D::Line3DStyled).
+/// The default is a plain solid line
+struct LineStyle
+{
+    LineStyle(): Pattern(0xFFFFFFFFu), Length(32), Phase(0), EndColor(-1), FogColor(0), FogNear(0.0f), FogFar(0.0f) {}
+
+    /// Stipple: the pixel of Bresenham step i (counted from the first end point, clipped steps included) is drawn
+    /// if bit (i + Phase) % Length of Pattern is set, bit 0 first. Length is 1..32
+    unsigned Pattern;
+    int Length, Phase;
+
+    /// Color at the second end point, interpolated from the line color in 8.16 fixed point. -1 keeps the color constant
+    int EndColor;
+
+    /// Depth fog of 3D lines: the color of each end point is blended towards FogColor by its depth z in [0..1]
+    /// (see canvas_ndc_to_fb), not at all up to FogNear and fully from FogFar on. Off while FogFar <= FogNear
+    int FogColor;
+    float FogNear, FogFar;
+
+    /// Dashes of On drawn and Off skipped pixels (On + Off <= 32)
+    void SetDash(int On, int Off)
+    {
+        Pattern = (On >= 32) ? 0xFFFFFFFFu : (1u << On) - 1;
+        Length  = On + Off;
+    }
+
+    int GetLength() const { return Length < 1 ? 1 : (Length > 32 ? 32 : Length); }
+
+    /// Pattern bit of step i
+    int PatternBit(int i) const { const int L = GetLength(); return ((Phase + i) % L + L) % L; }
+
+    /// The pattern draws every pixel
+    bool IsSolid() const
+    {
+        const unsigned Mask = (GetLength() >= 32) ? 0xFFFFFFFFu : (1u << GetLength()) - 1;
+        return (Pattern & Mask) == Mask;
+    }
+};
+
+/// Tile size of the BITMAP_TILED layout
+#define BITMAP_TILE_SHIFT 3
+#define BITMAP_TILE_SIZE  (1 << BITMAP_TILE_SHIFT)
+
+/// Cell size of the occupancy tracking (see Bitmap::EnableTracking)
+#define BITMAP_TRACK_SHIFT 4
+#define BITMAP_TRACK_SIZE  (1 << BITMAP_TRACK_SHIFT)
+
+/// Occupancy flags of a tracking cell
+enum BitmapCellFlags
+{
+    /// Drawn into since the last Clear()
+    CELL_TOUCHED = 1,
+
+    /// Changed since the last ClearDirty(), i.e. has to be presented again
+    CELL_DIRTY   = 2
+};
+
+/// Simple 24-bit (or 8-bit indexed) image with pixel and line rendering
 struct Bitmap
 {
-    Bitmap(unsigned char* buffer, int W, int H): FB(buffer), Width(W), Height(H) {}
-    
+    /// buffer holds W * H pixels of the format (see BitmapFormat). Indexed bitmaps start with the default palette
+    Bitmap(unsigned char* buffer, int W, int H, int Format = BITMAP_RGB24): FB(buffer), Width(W), Height(H), ZB(NULL), FLayout(BITMAP_LINEAR),
+        FFormat(Format), FPalette(Format == BITMAP_INDEXED8 ? new BitmapPalette() : NULL), FTiles(NULL), FTilesX(0), FTilesY(0),
+        FCells(NULL), FCellRows(NULL), FCellsX(0), FCellsY(0), FClearColor(0), FClearValid(false),
+        FClipX0(0), FClipY0(0), FClipX1(W), FClipY1(H), FViewX0(0), FViewY0(0), FViewX1(W), FViewY1(H), FShared(false) {}
+
+    /// View of the (x, y, w, h) part of Parent: shares all of its buffers (pixels, tiles, depth, tracking), clips drawing
+    /// to the rectangle (SetClipRect() cannot leave it) and keeps the parent coordinates. Views of disjoint rectangles can be drawn from different threads
+    Bitmap(Bitmap* Parent, int x, int y, int w, int h);
+
+    ~Bitmap();
+
+    /// Select the drawing layout (allocates the tile buffer for BITMAP_TILED). The drawing buffer content is undefined afterwards.
+    /// Layout and tracking are set up on the parent bitmap, views ignore these calls
+    void SetLayout(int Layout);
+    int  GetLayout() const { return FLayout; }
+
+    int GetFormat() const { return FFormat; }
+
+    /// Bytes per pixel of FB (and of the drawing buffer)
+    int GetPixelSize() const { return (FFormat == BITMAP_INDEXED8) ? 1 : 3; }
+
+    /// Palette of an indexed bitmap (shared with its views), NULL for RGB24
+    BitmapPalette* GetPalette() const { return FPalette; }
+
+    /// Replace palette entries (see BitmapPalette::Set). Pixels keep their indices, so their colors change; with
+    /// tracking all cells become dirty and the next Clear() is a full one
+    void SetPalette(const int* colors, int count);
+
+    /// The value stored for color: its palette index for indexed bitmaps, color itself for RGB24
+    int MapColor(int color) const { return FPalette ? FPalette->Map(color) : color; }
+
+    /// Write the drawing buffer into FB. Needed before presenting/exporting a tiled bitmap, no-op for the linear layout.
+    /// Large bitmaps are resolved on the thread pool
+    void Resolve();
+
+    /// Resolve() of the row ty of tiles
+    void ResolveTileRow(int ty);
+
+    /// Occupancy tracking. The bitmap is split into 16x16 cells with a CELL_TOUCHED and a CELL_DIRTY flag each,
+    /// plus one summary byte per row of cells. While enabled, Clear() with the previous clear color only refills
+    /// the touched cells, and presenters can convert just the dirty cells (filling the untouched ones with the
+    /// clear color). All drawing has to go through Bitmap/BitmapTarget, or be reported with MarkRect()
+    void EnableTracking(bool On);
+    bool IsTracking() const { return FCells != NULL; }
+
+    /// Flag the cell of pixel (x, y) as touched and dirty. Tracking must be enabled, (x, y) inside the bitmap
+    inline void TouchPixel(int x, int y)
+    {
+        const int cy = y >> BITMAP_TRACK_SHIFT;
+        FCells[cy * FCellsX + (x >> BITMAP_TRACK_SHIFT)] = CELL_TOUCHED | CELL_DIRTY;
+        FCellRows[cy] = CELL_TOUCHED | CELL_DIRTY;
+    }
+
+    /// Flag the cells of the box spanned by (x0, y0) and (x1, y1), which are at most one cell apart on each axis.
+    /// Tracking must be enabled, both points inside the bitmap
+    inline void TouchCellBox(int x0, int y0, int x1, int y1)
+    {
+        const int cx0 = x0 >> BITMAP_TRACK_SHIFT, cy0 = y0 >> BITMAP_TRACK_SHIFT;
+        const int cx1 = x1 >> BITMAP_TRACK_SHIFT, cy1 = y1 >> BITMAP_TRACK_SHIFT;
+
+        unsigned char* Row0 = FCells + cy0 * FCellsX;
+        unsigned char* Row1 = FCells + cy1 * FCellsX;
+
+        Row0[cx0] = Row0[cx1] = Row1[cx0] = Row1[cx1] = CELL_TOUCHED | CELL_DIRTY;
+        FCellRows[cy0] = FCellRows[cy1] = CELL_TOUCHED | CELL_DIRTY;
+    }
+
+    /// Flag the cells a line from (x0, y0) to (x1, y1) passes, both inside the bitmap. One cell per cell size of steps
+    /// along the major axis, following the ideal line with a pixel of slack for the Bresenham pixels (so a neighbour
+    /// cell within a pixel of the line may be flagged too). Tracking must be enabled
+    void TouchLine(int x0, int y0, int x1, int y1);
+
+    /// Flag all cells overlapping the inclusive rectangle (clipped to the bitmap). No-op without tracking
+    void MarkRect(int x0, int y0, int x1, int y1);
+
+    /// Reset the CELL_DIRTY flags, called once the dirty cells have been presented
+    void ClearDirty();
+
+    int GetCellFlags(int cx, int cy) const { return FCells[cy * FCellsX + cx]; }
+    int GetCellRowFlags(int cy) const { return FCellRows[cy]; }
+
+    /// Color of the untouched cells (valid after the first Clear() with tracking enabled)
+    int GetClearColor() const { return FClearColor; }
+
+    /// Address of pixel (x, y) in the drawing buffer (no bounds checks)
+    inline unsigned char* PixelPtr(int x, int y) const
+    {
+        if(FLayout == BITMAP_TILED)
+        {
+            int Tile = (y >> BITMAP_TILE_SHIFT) * FTilesX + (x >> BITMAP_TILE_SHIFT);
+            int Ofs  = ((y & (BITMAP_TILE_SIZE - 1)) << BITMAP_TILE_SHIFT) + (x & (BITMAP_TILE_SIZE - 1));
+            return FTiles + ((Tile << (2 * BITMAP_TILE_SHIFT)) + Ofs) * 3;
+        }
+
+        if(FFormat == BITMAP_INDEXED8) { return FB + y * Width + x; }
+
+        return FB + (y * Width + x) * 3;
+    }
+
+    /// Number of pixels stored contiguously from (x, y) to the right
+    inline int RunLength(int x) const { return (FLayout == BITMAP_TILED) ? BITMAP_TILE_SIZE - (x & (BITMAP_TILE_SIZE - 1)) : Width - x; }
+
+    /// Copy Count pixels of packed RGB24 data to/from the row y starting at x (no bounds checks), for any layout and format
+    void WriteRow(int x, int y, int Count, const unsigned char* Src);
+    void ReadRow (int x, int y, int Count, unsigned char* Dst) const;
+
+    /// Restrict all drawing to the (x, y, w, h) rectangle (clipped to the bitmap, or to the rectangle of a view)
+    void SetClipRect(int x, int y, int w, int h);
+    void ResetClipRect() { FClipX0 = FViewX0; FClipY0 = FViewY0; FClipX1 = FViewX1; FClipY1 = FViewY1; }
+    bool IsClipped() const { return FClipX0 > 0 || FClipY0 > 0 || FClipX1 < Width || FClipY1 < Height; }
+
+    /// Fill the bitmap (only the clip rectangle if one is set). With tracking enabled and the same color as the last time only the touched cells are filled.
+    /// Views always fill their rectangle like other drawing (the lazy clear state belongs to the parent).
+    /// Full fills of large bitmaps run on the thread pool
     void Clear(int color);
 
     void SetPixel(int x, int y, int color);
-    int  GetPixel(int x, int y);
+    int  GetPixel(int x, int y) const;
 
     void Line(int x1, int y1, int x2, int y2, int color);
 
+    /// Line with a stipple pattern and a color gradient from color to Style.EndColor (the fog is left to the 3D
+    /// callers). The pixels are the ones of the plain Line(), which draws unstyled lines
+    void Line(int x1, int y1, int x2, int y2, int color, const LineStyle& Style);
+
+    /// Filled triangle with sub-pixel precise vertices (pixel centers are at +0.5). Uses the top-left fill rule,
+    /// so triangles sharing an edge never overdraw or leave gaps
+    void FillTriangle(float x0, float y0, float x1, float y1, float x2, float y2, int color);
+
+    /// Filled triangle tested against ZB (smaller z is nearer). Without a depth buffer this is FillTriangle()
+    void FillTriangleZ(float x0, float y0, float z0, float x1, float y1, float z1, float x2, float y2, float z2, int color);
+
+    /// Filled convex polygon, xy holds Count (x, y) pairs
+    void FillPolygon(const float* xy, int Count, int color);
+
+    /// Draw text with the built-in 5x7 font (see Font.h), top-left corner at (x, y). Each font pixel becomes a scale x scale block
+    void Text(int x, int y, const char* text, int color, int scale = 1);
+
+    /// Copy the w x h rectangle at (sx, sy) of Src to (dx, dy), one memcpy per row. Negative w/h mean the whole Src.
+    /// The rectangle is clipped against both bitmaps. Sources are always read from their (resolved) FB
+    void Blit(const Bitmap& Src, int dx, int dy, int sx = 0, int sy = 0, int w = -1, int h = -1);
+
+    /// Like Blit(), but source pixels of the Key color are left out
+    void BlitKeyed(const Bitmap& Src, int Key, int dx, int dy, int sx = 0, int sy = 0, int w = -1, int h = -1);
+
+    /// Like Blit(), but blends with constant opacity: dst = src * Alpha + dst * (1 - Alpha), Alpha in [0..255]
+    void BlitAlpha(const Bitmap& Src, int Alpha, int dx, int dy, int sx = 0, int sy = 0, int w = -1, int h = -1);
+
+    /// Scale the (sx, sy, sw, sh) rectangle of Src into the (dx, dy, dw, dh) rectangle. Bilinear taps near the
+    /// rectangle border are clamped to the source bitmap, not to the rectangle. The row buffers come from Scratch
+    /// if given (e.g. a per-frame arena, so that scaling every frame does not allocate), otherwise from the heap
+    void BlitScaled(const Bitmap& Src, int dx, int dy, int dw, int dh, int sx, int sy, int sw, int sh, int Filter = BLIT_NEAREST, LinearArena* Scratch = NULL);
+
+    /// Filter an image Factor (2 or 4) times larger in both directions into the rows [y0, y1) of this bitmap
+    /// (clipped to the clip rectangle). Src may be a horizontal strip of that image: its first row is row SrcY
+    /// of the large image, and taps above/below the strip are clamped to it, like the taps at the image borders.
+    /// Src must be Width * Factor pixels wide. Disjoint row ranges can be filtered from different threads if
+    /// they do not share tracking cells
+    void Downsample(const Bitmap& Src, int SrcY, int Factor, int Filter, int y0, int y1);
+
+    /// Reset the depth buffer (if any) inside the clip rectangle
+    void ClearDepth(float z = 1.0f);
+
     // Dimensions
     int  Width, Height;
 
     // The buffer;
     unsigned char* FB;
+
+    /// Optional depth buffer (Width * Height floats), owned by the caller. Only used by FillTriangleZ()
+    float* ZB;
+
+    int FLayout;
+
+    /// BitmapFormat of FB, and the palette of indexed bitmaps (owned unless this is a view)
+    int FFormat;
+    BitmapPalette* FPalette;
+
+    /// Tile buffer of the BITMAP_TILED layout and its size in tiles
+    unsigned char* FTiles;
+    int FTilesX, FTilesY;
+
+    /// Occupancy tracking: flags per cell, the OR of the flags per row of cells and the size in cells
+    unsigned char* FCells;
+    unsigned char* FCellRows;
+    int FCellsX, FCellsY;
+
+    /// Last clear color. FClearValid is set while every untouched cell is known to hold it
+    int  FClearColor;
+    bool FClearValid;
+
+    /// Clip rectangle, [FClipX0, FClipX1) x [FClipY0, FClipY1)
+    int FClipX0, FClipY0, FClipX1, FClipY1;
+
+    /// Rectangle of a view (the whole bitmap otherwise), the clip rectangle always stays inside it
+    int FViewX0, FViewY0, FViewX1, FViewY1;
+
+private:
+    /// Set for views: the buffers belong to the parent
+    bool FShared;
+
+    /// Fill the pixels of one cell, value as returned by MapColor()
+    void FillCell(int cx, int cy, int value);
+
+    Bitmap(const Bitmap&);
+    Bitmap& operator=(const Bitmap&);
 };
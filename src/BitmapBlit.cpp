@@ -0,0 +1,430 @@
+#include "Bitmap.h"
+#include "BitmapRaster.h"
+#include "Arena.h"
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#  include <emmintrin.h>
+#  define BITMAP_BLIT_SSE2
+#endif
+
+/// Clip a Src rectangle copied to (dx, dy) against the source bitmap and the destination clip rectangle.
+/// Returns false if nothing is left
+static bool ClipBlitRect(const Bitmap& Dst, const Bitmap& Src, int& dx, int& dy, int& sx, int& sy, int& w, int& h)
+{
+    if(w < 0) { w = Src.Width;  }
+    if(h < 0) { h = Src.Height; }
+
+    // source rectangle inside the source bitmap
+    if(sx < 0) { dx -= sx; w += sx; sx = 0; }
+    if(sy < 0) { dy -= sy; h += sy; sy = 0; }
+    if(sx + w > Src.Width)  { w = Src.Width  - sx; }
+    if(sy + h > Src.Height) { h = Src.Height - sy; }
+
+    // destination rectangle inside the clip rectangle
+    if(dx < Dst.FClipX0) { int d = Dst.FClipX0 - dx; sx += d; w -= d; dx = Dst.FClipX0; }
+    if(dy < Dst.FClipY0) { int d = Dst.FClipY0 - dy; sy += d; h -= d; dy = Dst.FClipY0; }
+    if(dx + w > Dst.FClipX1) { w = Dst.FClipX1 - dx; }
+    if(dy + h > Dst.FClipY1) { h = Dst.FClipY1 - dy; }
+
+    return (w > 0 && h > 0);
+}
+
+/// Byte-wise blend Dst = (Src * a + Dst * (256 - a)) >> 8, a in [0..256]. Works for any packed format with constant weight
+static void BlendBytes(unsigned char* Dst, const unsigned char* Src, int Count, int a)
+{
+    int i = 0;
+
+#ifdef BITMAP_BLIT_SSE2
+    const __m128i Zero = _mm_setzero_si128();
+    const __m128i A    = _mm_set1_epi16((short)a);
+    const __m128i InvA = _mm_set1_epi16((short)(256 - a));
+
+    for( ; i + 16 <= Count ; i += 16)
+    {
+        __m128i s = _mm_loadu_si128((const __m128i*)(Src + i));
+        __m128i d = _mm_loadu_si128((const __m128i*)(Dst + i));
+
+        __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(s, Zero), A), _mm_mullo_epi16(_mm_unpacklo_epi8(d, Zero), InvA));
+        __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(s, Zero), A), _mm_mullo_epi16(_mm_unpackhi_epi8(d, Zero), InvA));
+
+        _mm_storeu_si128((__m128i*)(Dst + i), _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8)));
+    }
+#endif
+
+    for( ; i < Count ; i++)
+        Dst[i] = (unsigned char)((Src[i] * a + Dst[i] * (256 - a)) >> 8);
+}
+
+/// Interpolate two rows: Dst = (Row0 * (256 - f) + Row1 * f) >> 8
+static void LerpRows(unsigned char* Dst, const unsigned char* Row0, const unsigned char* Row1, int Count, int f)
+{
+    memcpy(Dst, Row0, Count);
+    BlendBytes(Dst, Row1, Count, f);
+}
+
+void Bitmap::Blit(const Bitmap& Src, int dx, int dy, int sx, int sy, int w, int h)
+{
+    // indices only go to indexed bitmaps
+    if(Src.FFormat != BITMAP_RGB24 && Src.FFormat != FFormat) { return; }
+
+    if(!ClipBlitRect(*this, Src, dx, dy, sx, sy, w, h)) { return; }
+
+    MarkRect(dx, dy, dx + w - 1, dy + h - 1);
+
+    const int Size = Src.GetPixelSize();
+    const bool Direct = (FLayout == BITMAP_LINEAR && FFormat == Src.FFormat);
+
+    for(int j = 0 ; j < h ; j++)
+    {
+        const unsigned char* s = Src.FB + ((sy + j) * Src.Width + sx) * Size;
+
+        if(Direct)
+            memmove(FB + ((dy + j) * Width + dx) * Size, s, w * Size);
+        else
+            WriteRow(dx, dy + j, w, s);
+    }
+}
+
+void Bitmap::BlitKeyed(const Bitmap& Src, int Key, int dx, int dy, int sx, int sy, int w, int h)
+{
+    if(Src.FFormat != BITMAP_RGB24) { return; }
+
+    if(!ClipBlitRect(*this, Src, dx, dy, sx, sy, w, h)) { return; }
+
+    const unsigned char KR = (Key >> 16) & 0xFF, KG = (Key >> 8) & 0xFF, KB = Key & 0xFF;
+
+    for(int j = 0 ; j < h ; j++)
+    {
+        const unsigned char* s = Src.FB + ((sy + j) * Src.Width + sx) * 3;
+
+        // copy runs of non-key pixels at once
+        for(int i = 0 ; i < w ; )
+        {
+            int Start = i;
+            while(i < w && !(s[i * 3] == KR && s[i * 3 + 1] == KG && s[i * 3 + 2] == KB)) { i++; }
+
+            if(i > Start) { WriteRow(dx + Start, dy + j, i - Start, s + Start * 3); }
+
+            while(i < w && (s[i * 3] == KR && s[i * 3 + 1] == KG && s[i * 3 + 2] == KB)) { i++; }
+        }
+    }
+}
+
+void Bitmap::BlitAlpha(const Bitmap& Src, int Alpha, int dx, int dy, int sx, int sy, int w, int h)
+{
+    if(Alpha <= 0) { return; }
+    if(Alpha >= 255) { Blit(Src, dx, dy, sx, sy, w, h); return; }
+
+    if(Src.FFormat != BITMAP_RGB24) { return; }
+
+    if(!ClipBlitRect(*this, Src, dx, dy, sx, sy, w, h)) { return; }
+
+    // 0..255 -> 0..256 so that both ends are exact
+    int a = Alpha + (Alpha >> 7);
+
+    if(FLayout == BITMAP_LINEAR && FFormat == BITMAP_RGB24)
+    {
+        MarkRect(dx, dy, dx + w - 1, dy + h - 1);
+
+        for(int j = 0 ; j < h ; j++)
+            BlendBytes(FB + ((dy + j) * Width + dx) * 3, Src.FB + ((sy + j) * Src.Width + sx) * 3, w * 3, a);
+
+        return;
+    }
+
+    // other layouts and formats: blend a copy of the destination row and write it back
+    std::vector<unsigned char> Tmp(w * 3);
+
+    for(int j = 0 ; j < h ; j++)
+    {
+        ReadRow(dx, dy + j, w, &Tmp[0]);
+        BlendBytes(&Tmp[0], Src.FB + ((sy + j) * Src.Width + sx) * 3, w * 3, a);
+        WriteRow(dx, dy + j, w, &Tmp[0]);
+    }
+}
+
+/// Horizontal bilinear resampling of one source row into dw pixels (16.16 source positions, 64 bits so that wide
+/// sources do not overflow)
+static void ResampleRow(unsigned char* Dst, const unsigned char* SrcRow, int SrcW, int dw, long long x0, int Step)
+{
+    long long x = x0;
+
+    for(int i = 0 ; i < dw ; i++, x += Step, Dst += 3)
+    {
+        int ix = (int)(x >> 16);
+        int f  = (int)(x >> 8) & 0xFF;
+
+        if(ix < 0)         { ix = 0; f = 0; }
+        if(ix >= SrcW - 1) { ix = SrcW - 1; f = 0; }
+
+        const unsigned char* p = SrcRow + ix * 3;
+        const unsigned char* q = (ix + 1 < SrcW) ? p + 3 : p;
+
+        Dst[0] = (unsigned char)((p[0] * (256 - f) + q[0] * f) >> 8);
+        Dst[1] = (unsigned char)((p[1] * (256 - f) + q[1] * f) >> 8);
+        Dst[2] = (unsigned char)((p[2] * (256 - f) + q[2] * f) >> 8);
+    }
+}
+
+void Bitmap::BlitScaled(const Bitmap& Src, int dx, int dy, int dw, int dh, int sx, int sy, int sw, int sh, int Filter, LinearArena* Scratch)
+{
+    if(dw <= 0 || dh <= 0 || sw <= 0 || sh <= 0) { return; }
+
+    // indices only go to indexed bitmaps, and cannot be interpolated
+    if(Src.FFormat != BITMAP_RGB24)
+    {
+        if(Src.FFormat != FFormat) { return; }
+        Filter = BLIT_NEAREST;
+    }
+
+    // 16.16 steps through the source rectangle
+    const int StepX = (int)(((long long)sw << 16) / dw);
+    const int StepY = (int)(((long long)sh << 16) / dh);
+
+    // visible part of the destination rectangle
+    int i0 = dx < FClipX0 ? FClipX0 - dx : 0, i1 = (dx + dw > FClipX1) ? FClipX1 - dx : dw;
+    int j0 = dy < FClipY0 ? FClipY0 - dy : 0, j1 = (dy + dh > FClipY1) ? FClipY1 - dy : dh;
+    if(i0 >= i1 || j0 >= j1) { return; }
+
+    const int Count = i1 - i0;
+
+    // rows are produced in place for the linear layout of the same format, otherwise in a temporary row
+    const bool Direct = (FLayout == BITMAP_LINEAR && FFormat == Src.FFormat);
+    const int Size = Src.GetPixelSize();
+
+    // column offsets (nearest), the output row and two resampled rows (bilinear) in one block
+    const size_t ScratchSize = Count * sizeof(int) + Count * 3 * 3;
+
+    std::vector<unsigned char> HeapScratch;
+    unsigned char* Buffer;
+
+    if(Scratch)
+    {
+        Buffer = (unsigned char*)Scratch->Alloc(ScratchSize);
+    } else
+    {
+        HeapScratch.resize(ScratchSize);
+        Buffer = &HeapScratch[0];
+    }
+
+    int* Ofs = (int*)Buffer;
+    unsigned char* OutRow = Buffer + Count * sizeof(int);
+
+    if(Direct) { MarkRect(dx + i0, dy + j0, dx + i1 - 1, dy + j1 - 1); }
+
+    if(Filter == BLIT_NEAREST)
+    {
+        // source offsets of the columns, -1 outside the source (computed once for all rows)
+        bool AllInside = true;
+
+        long long x = ((long long)sx << 16) + (long long)i0 * StepX + StepX / 2;
+        for(int i = 0 ; i < Count ; i++, x += StepX)
+        {
+            long long ix = x >> 16;
+            Ofs[i] = (ix < 0 || ix >= Src.Width) ? -1 : (int)ix * Size;
+            if(Ofs[i] < 0) { AllInside = false; }
+        }
+
+        int PrevY = -1;
+
+        for(int j = j0 ; j < j1 ; j++)
+        {
+            int y = sy + (int)(((long long)j * StepY + StepY / 2) >> 16);
+            if(y < 0 || y >= Src.Height) { PrevY = -1; continue; }
+
+            unsigned char* d = Direct ? FB + ((dy + j) * Width + dx + i0) * Size : OutRow;
+
+            // upscaling repeats source rows: copy the previous output row (if it has no skipped pixels)
+            if(Direct && AllInside && y == PrevY)
+            {
+                memcpy(d, d - Width * Size, Count * Size);
+                continue;
+            }
+            PrevY = y;
+
+            const unsigned char* s = Src.FB + y * Src.Width * Size;
+
+            if(!Direct) { ReadRow(dx + i0, dy + j, Count, d); }
+
+            if(Size == 1)
+            {
+                for(int i = 0 ; i < Count ; i++)
+                    if(Ofs[i] >= 0) { d[i] = s[Ofs[i]]; }
+            } else
+            {
+                for(int i = 0 ; i < Count ; i++, d += 3)
+                {
+                    if(Ofs[i] < 0) { continue; }
+
+                    const unsigned char* p = s + Ofs[i];
+                    d[0] = p[0]; d[1] = p[1]; d[2] = p[2];
+                }
+            }
+
+            if(!Direct) { WriteRow(dx + i0, dy + j, Count, OutRow); }
+        }
+        return;
+    }
+
+    // Bilinear: resample the two contributing source rows horizontally (cached while they do not change),
+    // then interpolate them vertically with the vector blend
+    unsigned char* Rows[2] = { OutRow + Count * 3, OutRow + Count * 6 };
+    int RowY[2] = { -1, -1 };
+
+    // sample at pixel centers: src = (dst + 0.5) * scale - 0.5
+    const long long X0 = ((long long)sx << 16) + (long long)i0 * StepX + StepX / 2 - 0x8000;
+
+    for(int j = j0 ; j < j1 ; j++)
+    {
+        long long y = ((long long)sy << 16) + (long long)j * StepY + StepY / 2 - 0x8000;
+        int iy = (int)(y >> 16);
+        int f  = (int)(y >> 8) & 0xFF;
+
+        if(iy < 0)               { iy = 0; f = 0; }
+        if(iy >= Src.Height - 1) { iy = Src.Height - 1; f = 0; }
+
+        int Need[2] = { iy, (iy + 1 < Src.Height) ? iy + 1 : iy };
+
+        for(int k = 0 ; k < 2 ; k++)
+        {
+            if(RowY[0] == Need[k] || RowY[1] == Need[k]) { continue; }
+
+            // replace the row that is not needed anymore
+            int Slot = (RowY[0] == Need[0] || RowY[0] == Need[1]) ? 1 : 0;
+
+            ResampleRow(Rows[Slot], Src.FB + Need[k] * Src.Width * 3, Src.Width, Count, X0, StepX);
+            RowY[Slot] = Need[k];
+        }
+
+        const unsigned char* Top    = Rows[RowY[0] == Need[0] ? 0 : 1];
+        const unsigned char* Bottom = Rows[RowY[0] == Need[1] ? 0 : 1];
+
+        if(Direct)
+        {
+            LerpRows(FB + ((dy + j) * Width + dx + i0) * 3, Top, Bottom, Count * 3, f);
+        } else
+        {
+            LerpRows(OutRow, Top, Bottom, Count * 3, f);
+            WriteRow(dx + i0, dy + j, Count, OutRow);
+        }
+    }
+}
+
+/// Acc += Row * Weight for Count bytes (16-bit sums)
+static void AccumulateRow(unsigned short* Acc, const unsigned char* Row, int Count, int Weight)
+{
+    int i = 0;
+
+#ifdef BITMAP_BLIT_SSE2
+    const __m128i Zero = _mm_setzero_si128();
+    const __m128i W    = _mm_set1_epi16((short)Weight);
+
+    for( ; i + 16 <= Count ; i += 16)
+    {
+        __m128i s  = _mm_loadu_si128((const __m128i*)(Row + i));
+        __m128i lo = _mm_loadu_si128((const __m128i*)(Acc + i));
+        __m128i hi = _mm_loadu_si128((const __m128i*)(Acc + i + 8));
+
+        lo = _mm_add_epi16(lo, _mm_mullo_epi16(_mm_unpacklo_epi8(s, Zero), W));
+        hi = _mm_add_epi16(hi, _mm_mullo_epi16(_mm_unpackhi_epi8(s, Zero), W));
+
+        _mm_storeu_si128((__m128i*)(Acc + i), lo);
+        _mm_storeu_si128((__m128i*)(Acc + i + 8), hi);
+    }
+#endif
+
+    for( ; i < Count ; i++)
+        Acc[i] = (unsigned short)(Acc[i] + Row[i] * Weight);
+}
+
+/// Horizontal pass of Downsample: every output pixel is the weighted sum of Taps consecutive accumulated pixels,
+/// starting Factor pixels apart. Acc is padded, so no tap needs clamping
+template <int Factor, int Taps>
+static void ReduceRow(unsigned char* Dst, const unsigned short* Acc, int Count, const int* Weights, int Shift)
+{
+    const int Round = 1 << (Shift - 1);
+
+    for(int i = 0 ; i < Count ; i++, Dst += 3, Acc += Factor * 3)
+    {
+        int r = Round, g = Round, b = Round;
+
+        for(int k = 0 ; k < Taps ; k++)
+        {
+            r += Acc[k * 3    ] * Weights[k];
+            g += Acc[k * 3 + 1] * Weights[k];
+            b += Acc[k * 3 + 2] * Weights[k];
+        }
+
+        Dst[0] = (unsigned char)(r >> Shift);
+        Dst[1] = (unsigned char)(g >> Shift);
+        Dst[2] = (unsigned char)(b >> Shift);
+    }
+}
+
+void Bitmap::Downsample(const Bitmap& Src, int SrcY, int Factor, int Filter, int y0, int y1)
+{
+    const int F = (Factor >= 4) ? 4 : 2;
+    const bool Tent = (Filter == DOWNSAMPLE_TENT);
+
+    if(Src.Width != Width * F || Src.FFormat != BITMAP_RGB24) { return; }
+
+    if(y0 < FClipY0) { y0 = FClipY0; }
+    if(y1 > FClipY1) { y1 = FClipY1; }
+    if(y0 >= y1 || FClipX0 >= FClipX1) { return; }
+
+    // integer weights: the box is flat, the tent over 2F taps is 1, 3, 5, ..., 5, 3, 1. Per axis they sum up to
+    // F (box) or 2F^2 (tent), both powers of two, so the 2D normalization is a shift
+    const int Taps   = Tent ? 2 * F : F;
+    const int Offset = Tent ? -F / 2 : 0;
+    const int Shift  = Tent ? (F == 2 ? 6 : 10) : (F == 2 ? 2 : 4);
+
+    int Weights[8];
+    for(int k = 0 ; k < Taps ; k++)
+        Weights[k] = Tent ? 2 * F - abs(2 * k + 1 - 2 * F) : 1;
+
+    // vertical sums of one output row, with -Offset clamped pixels on both sides for the horizontal taps
+    const int Pad = -Offset;
+    const int SrcW = Src.Width;
+    std::vector<unsigned short> Acc((SrcW + 2 * Pad) * 3);
+    std::vector<unsigned char>  Out(Width * 3);
+
+    for(int y = y0 ; y < y1 ; y++)
+    {
+        unsigned short* Row = &Acc[Pad * 3];
+        memset(Row, 0, SrcW * 3 * sizeof(unsigned short));
+
+        for(int k = 0 ; k < Taps ; k++)
+        {
+            int r = y * F + Offset + k - SrcY;
+            if(r < 0) { r = 0; }
+            if(r > Src.Height - 1) { r = Src.Height - 1; }
+
+            AccumulateRow(Row, Src.FB + r * SrcW * 3, SrcW * 3, Weights[k]);
+        }
+
+        for(int k = 0 ; k < Pad ; k++)
+        {
+            memcpy(&Acc[k * 3], Row, 3 * sizeof(unsigned short));
+            memcpy(&Row[(SrcW + k) * 3], &Row[(SrcW - 1) * 3], 3 * sizeof(unsigned short));
+        }
+
+        const unsigned short* First = &Acc[(FClipX0 * F) * 3];
+        unsigned char* Dst = &Out[FClipX0 * 3];
+        const int Count = FClipX1 - FClipX0;
+
+        if(Tent)
+        {
+            if(F == 2) ReduceRow<2, 4>(Dst, First, Count, Weights, Shift);
+            else       ReduceRow<4, 8>(Dst, First, Count, Weights, Shift);
+        } else
+        {
+            if(F == 2) ReduceRow<2, 2>(Dst, First, Count, Weights, Shift);
+            else       ReduceRow<4, 4>(Dst, First, Count, Weights, Shift);
+        }
+
+        WriteRow(FClipX0, y, Count, Dst);
+    }
+}
@@ -0,0 +1,231 @@
+#include "Bitmap.h"
+#include "BitmapRaster.h"
+
+/// Half-space triangle rasterizer.
+/// Vertices are snapped to 28.4 fixed point, every edge becomes an integer edge function evaluated at pixel centers.
+/// The bounding box is walked in 8x8 blocks: blocks entirely outside one edge are skipped, blocks entirely inside
+/// all edges are filled with whole spans, and only the blocks on the triangle border are tested per pixel.
+/// The blocks coincide with the BITMAP_TILED tiles.
+
+static const int SubBits   = 4;
+static const int SubOne    = 1 << SubBits;
+static const int BlockSize = BITMAP_TILE_SIZE;
+
+/// Float -> 28.4, clamped so that far-off vertices (e.g. behind the camera) cannot overflow
+static inline long long ToFixed(float v)
+{
+    if(v >  1.0e7f) { v =  1.0e7f; }
+    if(v < -1.0e7f) { v = -1.0e7f; }
+    return (long long)(v * (float)SubOne + (v >= 0 ? 0.5f : -0.5f));
+}
+
+/// Edge function E(x, y) = A * x + B * y + C, positive inside. Bias implements the top-left rule
+struct Edge
+{
+    long long A, B, C;
+
+    void Setup(long long xa, long long ya, long long xb, long long yb)
+    {
+        A = -(yb - ya);
+        B =  (xb - xa);
+        C = -(A * xa + B * ya);
+
+        // top edge (horizontal, interior below) or left edge (going up in y-down coordinates) own their pixels
+        bool TopLeft = (ya == yb && xb > xa) || (yb < ya);
+        if(!TopLeft) { C -= 1; }
+    }
+
+    /// Value at the center of pixel (px, py)
+    inline long long At(int px, int py) const
+    {
+        return A * ((long long)px * SubOne + SubOne / 2) + B * ((long long)py * SubOne + SubOne / 2) + C;
+    }
+};
+
+/// Linear depth interpolation z = z0 + dzdx * (x - x0) + dzdy * (y - y0) in pixel units
+struct DepthPlane
+{
+    float Z0, DzDx, DzDy;
+    float X0, Y0;
+
+    inline float At(int px, int py) const { return Z0 + DzDx * ((float)px + 0.5f - X0) + DzDy * ((float)py + 0.5f - Y0); }
+};
+
+/// color is the value stored, see Bitmap::MapColor()
+template <class PixelT, bool UseDepth>
+static void RasterizeTriangle(Bitmap* B, float x0, float y0, float z0, float x1, float y1, float z1, float x2, float y2, float z2, int color)
+{
+    long long X0 = ToFixed(x0), Y0 = ToFixed(y0);
+    long long X1 = ToFixed(x1), Y1 = ToFixed(y1);
+    long long X2 = ToFixed(x2), Y2 = ToFixed(y2);
+
+    long long Area = (X1 - X0) * (Y2 - Y0) - (Y1 - Y0) * (X2 - X0);
+    if(Area == 0) { return; }
+
+    // accept both windings: make the vertex order positive
+    if(Area < 0)
+    {
+        long long t;
+        t = X1; X1 = X2; X2 = t;
+        t = Y1; Y1 = Y2; Y2 = t;
+
+        float f;
+        f = x1; x1 = x2; x2 = f;
+        f = y1; y1 = y2; y2 = f;
+        f = z1; z1 = z2; z2 = f;
+    }
+
+    // pixel bounding box, clipped to the clip rectangle
+    long long MinX = X0 < X1 ? (X0 < X2 ? X0 : X2) : (X1 < X2 ? X1 : X2);
+    long long MaxX = X0 > X1 ? (X0 > X2 ? X0 : X2) : (X1 > X2 ? X1 : X2);
+    long long MinY = Y0 < Y1 ? (Y0 < Y2 ? Y0 : Y2) : (Y1 < Y2 ? Y1 : Y2);
+    long long MaxY = Y0 > Y1 ? (Y0 > Y2 ? Y0 : Y2) : (Y1 > Y2 ? Y1 : Y2);
+
+    int BX0 = (int)(MinX >> SubBits), BX1 = (int)(MaxX >> SubBits);
+    int BY0 = (int)(MinY >> SubBits), BY1 = (int)(MaxY >> SubBits);
+
+    if(BX0 < B->FClipX0) { BX0 = B->FClipX0; }
+    if(BY0 < B->FClipY0) { BY0 = B->FClipY0; }
+    if(BX1 > B->FClipX1 - 1) { BX1 = B->FClipX1 - 1; }
+    if(BY1 > B->FClipY1 - 1) { BY1 = B->FClipY1 - 1; }
+
+    if(BX0 > BX1 || BY0 > BY1) { return; }
+
+    Edge E[3];
+    E[0].Setup(X1, Y1, X2, Y2);
+    E[1].Setup(X2, Y2, X0, Y0);
+    E[2].Setup(X0, Y0, X1, Y1);
+
+    DepthPlane Z;
+    if(UseDepth)
+    {
+        // plane through the three (x, y, z) points
+        float ax = x1 - x0, ay = y1 - y0, az = z1 - z0;
+        float bx = x2 - x0, by = y2 - y0, bz = z2 - z0;
+        float D = ax * by - ay * bx;
+
+        Z.Z0 = z0; Z.X0 = x0; Z.Y0 = y0;
+        Z.DzDx = (az * by - ay * bz) / D;
+        Z.DzDy = (ax * bz - az * bx) / D;
+    }
+
+    const typename PixelT::Value v = PixelT::Pack(color);
+    const int W = B->Width;
+
+    // pixel steps of the edge functions
+    const long long StepX[3] = { E[0].A * SubOne, E[1].A * SubOne, E[2].A * SubOne };
+    const long long StepY[3] = { E[0].B * SubOne, E[1].B * SubOne, E[2].B * SubOne };
+
+    for(int by = BY0 & ~(BlockSize - 1) ; by <= BY1 ; by += BlockSize)
+    {
+        int ry0 = by < BY0 ? BY0 : by;
+        int ry1 = (by + BlockSize - 1) > BY1 ? BY1 : (by + BlockSize - 1);
+
+        for(int bx = BX0 & ~(BlockSize - 1) ; bx <= BX1 ; bx += BlockSize)
+        {
+            int rx0 = bx < BX0 ? BX0 : bx;
+            int rx1 = (bx + BlockSize - 1) > BX1 ? BX1 : (bx + BlockSize - 1);
+
+            // classify the block by its corner pixels (edge functions are linear, so corners bound the block)
+            bool Reject = false, Accept = true;
+
+            for(int k = 0 ; k < 3 ; k++)
+            {
+                long long c00 = E[k].At(rx0, ry0), c10 = E[k].At(rx1, ry0);
+                long long c01 = E[k].At(rx0, ry1), c11 = E[k].At(rx1, ry1);
+
+                if(c00 < 0 && c10 < 0 && c01 < 0 && c11 < 0) { Reject = true; break; }
+                if(c00 < 0 || c10 < 0 || c01 < 0 || c11 < 0) { Accept = false; }
+            }
+
+            if(Reject) { continue; }
+
+            if(B->FCells) { B->MarkRect(rx0, ry0, rx1, ry1); }
+
+            if(Accept && !UseDepth)
+            {
+                for(int y = ry0 ; y <= ry1 ; y++)
+                    PixelT::Fill(B->PixelPtr(rx0, y), rx1 - rx0 + 1, v);
+
+                continue;
+            }
+
+            long long Row[3] = { E[0].At(rx0, ry0), E[1].At(rx0, ry0), E[2].At(rx0, ry0) };
+
+            for(int y = ry0 ; y <= ry1 ; y++)
+            {
+                long long e0 = Row[0], e1 = Row[1], e2 = Row[2];
+
+                // blocks are tile-aligned, so the block row is contiguous in both layouts
+                unsigned char* p = B->PixelPtr(rx0, y);
+
+                float  z  = UseDepth ? Z.At(rx0, y) : 0.0f;
+                float* zb = UseDepth ? B->ZB + y * W + rx0 : NULL;
+
+                for(int x = rx0 ; x <= rx1 ; x++, p += PixelT::Size)
+                {
+                    if((e0 | e1 | e2) >= 0)
+                    {
+                        if(!UseDepth)
+                        {
+                            PixelT::Store(p, v);
+                        } else
+                        if(z < *zb)
+                        {
+                            *zb = z;
+                            PixelT::Store(p, v);
+                        }
+                    }
+
+                    e0 += StepX[0]; e1 += StepX[1]; e2 += StepX[2];
+
+                    if(UseDepth) { z += Z.DzDx; zb++; }
+                }
+
+                Row[0] += StepY[0]; Row[1] += StepY[1]; Row[2] += StepY[2];
+            }
+        }
+    }
+}
+
+void Bitmap::FillTriangle(float x0, float y0, float x1, float y1, float x2, float y2, int color)
+{
+    if(FPalette)
+        RasterizeTriangle<PixelIndexed8, false>(this, x0, y0, 0.0f, x1, y1, 0.0f, x2, y2, 0.0f, FPalette->Map(color));
+    else
+        RasterizeTriangle<PixelRGB24, false>(this, x0, y0, 0.0f, x1, y1, 0.0f, x2, y2, 0.0f, color);
+}
+
+void Bitmap::FillTriangleZ(float x0, float y0, float z0, float x1, float y1, float z1, float x2, float y2, float z2, int color)
+{
+    if(!ZB)
+    {
+        FillTriangle(x0, y0, x1, y1, x2, y2, color);
+        return;
+    }
+
+    if(FPalette)
+        RasterizeTriangle<PixelIndexed8, true>(this, x0, y0, z0, x1, y1, z1, x2, y2, z2, FPalette->Map(color));
+    else
+        RasterizeTriangle<PixelRGB24, true>(this, x0, y0, z0, x1, y1, z1, x2, y2, z2, color);
+}
+
+void Bitmap::FillPolygon(const float* xy, int Count, int color)
+{
+    // convex: a fan from the first vertex, shared edges are handled by the fill rule
+    for(int i = 1 ; i + 1 < Count ; i++)
+        FillTriangle(xy[0], xy[1], xy[2 * i], xy[2 * i + 1], xy[2 * i + 2], xy[2 * i + 3], color);
+}
+
+void Bitmap::ClearDepth(float z)
+{
+    if(!ZB) { return; }
+
+    for(int y = FClipY0 ; y < FClipY1 ; y++)
+    {
+        float* Row = ZB + y * Width;
+
+        for(int x = FClipX0 ; x < FClipX1 ; x++)
+            Row[x] = z;
+    }
+}
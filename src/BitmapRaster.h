@@ -0,0 +1,512 @@
+#pragma once
+
+/// Compile-time building blocks for rasterizing into a Bitmap.
+/// Pixel formats and clipping policies are template parameters, so a BitmapTarget<> instance
+/// compiles the whole line loop into direct stores without any calls per pixel.
+
+#include "Bitmap.h"
+#include <stdlib.h>
+#include <string.h>
+
+/// Packed 24-bit RGB, the native Bitmap format
+struct PixelRGB24
+{
+    enum { Size = 3 };
+
+    struct Value { unsigned char R, G, B; };
+
+    static inline Value Pack(int color)
+    {
+        Value v;
+        v.R = (unsigned char)((color >> 16) & 0xFF);
+        v.G = (unsigned char)((color >>  8) & 0xFF);
+        v.B = (unsigned char)((color      ) & 0xFF);
+        return v;
+    }
+
+    static inline void Store(unsigned char* p, const Value& v) { p[0] = v.R; p[1] = v.G; p[2] = v.B; }
+
+    static inline int Load(const unsigned char* p) { return (((int)p[0]) << 16) + (((int)p[1]) << 8) + ((int)p[2]); }
+
+    /// Value of a 0xRRGGBB color in the bitmap
+    static inline Value FromRGB(const Bitmap*, int color) { return Pack(color); }
+
+    /// Fill Count consecutive pixels. Gray colors become a memset, others are written 16 pixels (48 bytes)
+    /// at a time from a prepared pattern, which compilers turn into wide vector stores
+    static inline void Fill(unsigned char* p, int Count, const Value& v)
+    {
+        if(v.R == v.G && v.G == v.B) { memset(p, v.R, Count * 3); return; }
+
+        if(Count >= 16)
+        {
+            unsigned char Pattern[48];
+            for(int i = 0 ; i < 48 ; i += 3) { Pattern[i] = v.R; Pattern[i + 1] = v.G; Pattern[i + 2] = v.B; }
+
+            for( ; Count >= 16 ; Count -= 16, p += 48)
+                memcpy(p, Pattern, 48);
+        }
+
+        for( ; Count > 0 ; Count--, p += 3)
+            Store(p, v);
+    }
+};
+
+/// Palette index (BITMAP_INDEXED8). The colors given to indexed targets are indices, see Bitmap::MapColor()
+struct PixelIndexed8
+{
+    enum { Size = 1 };
+
+    typedef unsigned char Value;
+
+    static inline Value Pack(int index) { return (unsigned char)index; }
+
+    static inline void Store(unsigned char* p, Value v) { *p = v; }
+
+    static inline int Load(const unsigned char* p) { return *p; }
+
+    static inline Value FromRGB(const Bitmap* B, int color) { return (unsigned char)B->FPalette->Map(color); }
+
+    static inline void Fill(unsigned char* p, int Count, Value v) { memset(p, v, Count); }
+};
+
+/// Every pixel is tested against the clip rectangle (the behaviour of Bitmap::SetPixel)
+struct ClipPerPixel
+{
+    /// Prepare the segment of N Bresenham steps for the clip rectangle [X0, X1) x [Y0, Y1): the steps [First, Last]
+    /// are the ones that can be visible. Returns false if nothing is visible, sets Checked if the loop must test pixels
+    static inline bool Prepare(int, int, int, int, int, int, int, int, int N, int& First, int& Last, bool& Checked)
+    {
+        First = 0; Last = N; Checked = true;
+        return true;
+    }
+};
+
+/// Trivially accepts segments lying inside the clip rectangle (no tests in the loop) and trivially rejects the ones
+/// entirely outside of it. Crossing segments are limited to the steps inside a guard band around the rectangle, so
+/// the per-pixel tested loop never walks thousands of invisible pixels. The walk starts at the exact Bresenham state
+/// of its first step (see bresenham_skip), so inside the rectangle the pixels stay exactly as drawn by the unclipped
+/// loop, whatever the rectangle is (e.g. the strips of render_supersampled())
+struct ClipGuardBand
+{
+    static inline int OutCode(int x, int y, int X0, int Y0, int X1, int Y1)
+    {
+        return (x < X0 ? 1 : 0) | (x >= X1 ? 2 : 0) | (y < Y0 ? 4 : 0) | (y >= Y1 ? 8 : 0);
+    }
+
+    static bool Prepare(int X0, int Y0, int X1, int Y1, int x0, int y0, int x1, int y1, int N, int& First, int& Last, bool& Checked)
+    {
+        int c0 = OutCode(x0, y0, X0, Y0, X1, Y1);
+        int c1 = OutCode(x1, y1, X0, Y0, X1, Y1);
+
+        First = 0; Last = N;
+
+        if(!(c0 | c1)) { Checked = false; return true; }
+        if(c0 & c1)    { return false; }
+
+        Checked = true;
+
+        // Liang-Barsky against the guard band [-W, 2W) x [-H, 2H) around the rectangle. The math is done relative
+        // to the rectangle origin, so a viewport draws exactly what a bitmap of its size would
+        const int W = X1 - X0, H = Y1 - Y0;
+        const double Lo[2] = { (double)-W, (double)-H };
+        const double Hi[2] = { (double)(2 * W - 1), (double)(2 * H - 1) };
+
+        double P0[2] = { (double)x0 - X0, (double)y0 - Y0 };
+        double D[2]  = { (double)x1 - x0, (double)y1 - y0 };
+
+        double t0 = 0.0, t1 = 1.0;
+
+        for(int k = 0 ; k < 2 ; k++)
+        {
+            if(D[k] == 0.0)
+            {
+                if(P0[k] < Lo[k] || P0[k] > Hi[k]) { return false; }
+                continue;
+            }
+
+            double ta = (Lo[k] - P0[k]) / D[k];
+            double tb = (Hi[k] - P0[k]) / D[k];
+            if(ta > tb) { double t = ta; ta = tb; tb = t; }
+
+            if(ta > t0) { t0 = ta; }
+            if(tb < t1) { t1 = tb; }
+        }
+
+        if(t0 > t1) { return false; }
+
+        // the major coordinate advances by one every step, so the parameter maps linearly to steps
+        // (one step of slack on both sides, the loop tests the pixels anyway)
+        if(t0 > 0.0) { First = (int)(t0 * N) - 1; if(First < 0) { First = 0; } }
+        if(t1 < 1.0) { Last  = (int)(t1 * N) + 2; if(Last  > N) { Last  = N; } }
+
+        return First <= Last;
+    }
+};
+
+/// Advance the Bresenham state of BitmapTarget::Line (position and error term, dx = |x1 - x0|, dy = |y1 - y0|)
+/// by K steps in constant time. The error term of the major axis walk stays in [0, dmajor) (negated for y-major
+/// lines) and drops by dminor every step, wrapping around with a minor step, so after K steps it is
+/// (err - K * dminor) mod dmajor and the number of minor steps is the number of wraps
+inline void bresenham_skip(int& x, int& y, int& err, int dx, int dy, int sx, int sy, int K)
+{
+    if(K <= 0) { return; }
+
+    if(dx > dy)
+    {
+        long long a = (long long)K * dy - err;
+        long long m = (a > 0) ? (a + dx - 1) / dx : 0;
+
+        x  += sx * K;
+        y  += sy * (int)m;
+        err = (int)(err - (long long)K * dy + m * dx);
+    } else
+    {
+        long long g = -err;
+        long long a = (long long)K * dx - g;
+        long long m = (a > 0) ? (a + dy - 1) / dy : 0;
+
+        y  += sy * K;
+        x  += sx * (int)m;
+        err = (int)-(g - (long long)K * dx + m * dy);
+    }
+}
+
+/// Color interpolation along the N steps of a styled line, 8.16 fixed point per channel (rounded)
+struct LineGradient
+{
+    void Setup(int color0, int color1, int N)
+    {
+        for(int k = 0 ; k < 3 ; k++)
+        {
+            const int Shift = 16 - 8 * k;
+            const int c0 = (color0 >> Shift) & 0xFF, c1 = (color1 >> Shift) & 0xFF;
+
+            C[k] = c0 * 65536 + 0x8000;
+            D[k] = (N > 0) ? (c1 - c0) * 65536 / N : 0;
+        }
+    }
+
+    inline void Skip(int K) { C[0] += D[0] * K; C[1] += D[1] * K; C[2] += D[2] * K; }
+    inline void Step()      { C[0] += D[0];     C[1] += D[1];     C[2] += D[2]; }
+
+    inline int Color() const { return ((C[0] >> 16) << 16) | ((C[1] >> 16) << 8) | (C[2] >> 16); }
+
+    int C[3], D[3];
+};
+
+/// Row-major pixels in Bitmap::FB (BITMAP_LINEAR)
+struct LayoutLinear
+{
+    static inline unsigned char* Base(const Bitmap* B) { return B->FB; }
+
+    /// Pixel index of (x, y)
+    static inline int Index(const Bitmap* B, int x, int y) { return y * B->Width + x; }
+
+    /// Scale for Locate(), one over the pixels per row
+    static inline double LocateScale(const Bitmap* B) { return 1.0 / (double)B->Width; }
+
+    /// (x, y) of pixel index i without a division: (i + 0.5) / W is at least 0.5 / W away from the next integer, far
+    /// more than the rounding error of the double product
+    static inline void Locate(const Bitmap* B, int i, double Scale, int& x, int& y)
+    {
+        y = (int)(((double)i + 0.5) * Scale);
+        x = i - y * B->Width;
+    }
+
+    /// Pointer stepping one pixel along x or y (Size bytes per pixel), every step is a constant offset
+    template <int Size>
+    struct Cursor
+    {
+        inline void Start(const Bitmap* B, int x, int y, int sx, int sy)
+        {
+            p = Base(B) + Index(B, x, y) * Size;
+            StepX = sx * Size;
+            StepY = sy * B->Width * Size;
+        }
+
+        inline void MoveX() { p += StepX; }
+        inline void MoveY() { p += StepY; }
+
+        unsigned char* p;
+        int StepX, StepY;
+    };
+};
+
+/// 8x8 tiles in Bitmap::FTiles (BITMAP_TILED)
+struct LayoutTiled
+{
+    enum { Mask = BITMAP_TILE_SIZE - 1, TilePixels = BITMAP_TILE_SIZE * BITMAP_TILE_SIZE };
+
+    static inline unsigned char* Base(const Bitmap* B) { return B->FTiles; }
+
+    static inline int Index(const Bitmap* B, int x, int y)
+    {
+        return ((((y >> BITMAP_TILE_SHIFT) * B->FTilesX + (x >> BITMAP_TILE_SHIFT)) << (2 * BITMAP_TILE_SHIFT))
+                + ((y & Mask) << BITMAP_TILE_SHIFT) + (x & Mask));
+    }
+
+    /// Scale for Locate(), one over the tiles per row
+    static inline double LocateScale(const Bitmap* B) { return 1.0 / (double)B->FTilesX; }
+
+    /// (x, y) of pixel index i, the tile row found as in LayoutLinear::Locate()
+    static inline void Locate(const Bitmap* B, int i, double Scale, int& x, int& y)
+    {
+        const int Tile = i >> (2 * BITMAP_TILE_SHIFT);
+        const int ty = (int)(((double)Tile + 0.5) * Scale);
+        const int tx = Tile - ty * B->FTilesX;
+
+        x = (tx << BITMAP_TILE_SHIFT) | (i & Mask);
+        y = (ty << BITMAP_TILE_SHIFT) | ((i >> BITMAP_TILE_SHIFT) & Mask);
+    }
+
+    /// Pointer stepping one pixel along x or y: inside a tile a step is one pixel (x) or one tile row (y), KX and KY count
+    /// the steps left before the next tile border, where the step jumps to the neighbour tile instead
+    template <int Size>
+    struct Cursor
+    {
+        inline void Start(const Bitmap* B, int x, int y, int sx, int sy)
+        {
+            p = Base(B) + Index(B, x, y) * Size;
+
+            KX = (sx > 0) ? Mask - (x & Mask) : (x & Mask);
+            KY = (sy > 0) ? Mask - (y & Mask) : (y & Mask);
+
+            // from the last column (row) of a tile to the first one of the next tile, or back
+            StepX = sx * Size;
+            StepY = sy * BITMAP_TILE_SIZE * Size;
+            TileStepX = sx * (TilePixels - Mask) * Size;
+            TileStepY = sy * (B->FTilesX * TilePixels - Mask * BITMAP_TILE_SIZE) * Size;
+        }
+
+        inline void MoveX() { p += KX ? StepX : TileStepX; KX = (KX - 1) & Mask; }
+        inline void MoveY() { p += KY ? StepY : TileStepY; KY = (KY - 1) & Mask; }
+
+        unsigned char* p;
+        int KX, KY;
+        int StepX, StepY, TileStepX, TileStepY;
+    };
+};
+
+/// Fill Count pixels of row y starting at x (no bounds checks), split at tile borders if needed
+template <class PixelT>
+inline void bitmap_fill_row(Bitmap* B, int x, int y, int Count, const typename PixelT::Value& v)
+{
+    if(B->FCells) { B->MarkRect(x, y, x + Count - 1, y); }
+
+    while(Count > 0)
+    {
+        int n = B->RunLength(x);
+        if(n > Count) { n = Count; }
+
+        PixelT::Fill(B->PixelPtr(x, y), n, v);
+
+        x += n; Count -= n;
+    }
+}
+
+/// Statically dispatched drawing target over a Bitmap
+template <class PixelT, class ClipT, class LayoutT = LayoutLinear>
+struct BitmapTarget
+{
+    BitmapTarget(Bitmap* bmp): FDest(bmp) {}
+
+    int GetWidth()  const { return FDest->Width; }
+    int GetHeight() const { return FDest->Height; }
+
+    inline void SetPixel(int x, int y, int color)
+    {
+        if(x < FDest->FClipX0 || y < FDest->FClipY0 || x >= FDest->FClipX1 || y >= FDest->FClipY1) { return; }
+
+        if(FDest->FCells) { FDest->TouchPixel(x, y); }
+
+        PixelT::Store(LayoutT::Base(FDest) + LayoutT::Index(FDest, x, y) * PixelT::Size, PixelT::Pack(color));
+    }
+
+    /// Bresenham (same stepping as the original Bitmap::Line) walking a pointer through the buffer (see the Cursor of
+    /// the layouts). The cells of tracked bitmaps are flagged by a separate walk over the cells, lines crossing the clip
+    /// rectangle walk in pieces (see WalkPieces)
+    inline void Line(int x0, int y0, int x1, int y1, int color)
+    {
+        const int CX0 = FDest->FClipX0, CY0 = FDest->FClipY0;
+        const int CW  = FDest->FClipX1 - CX0, CH = FDest->FClipY1 - CY0;
+
+        int dx = abs(x1-x0), sx = x0<x1 ? 1 : -1;
+        int dy = abs(y1-y0), sy = y0<y1 ? 1 : -1;
+        int err = (dx>dy ? dx : -dy)/2;
+        int n = (dx > dy) ? dx : dy;
+
+        bool Checked;
+        int First, Last;
+        if(!ClipT::Prepare(CX0, CY0, CX0 + CW, CY0 + CH, x0, y0, x1, y1, n, First, Last, Checked)) { return; }
+
+        // start at the first step that may be visible
+        bresenham_skip(x0, y0, err, dx, dy, sx, sy, First);
+        n = Last - First;
+
+        const typename PixelT::Value v = PixelT::Pack(color);
+
+        if(Checked)
+        {
+            WalkPieces(x0, y0, n, err, dx, dy, sx, sy, v);
+            return;
+        }
+
+        Walk(x0, y0, n, err, dx, dy, sx, sy, v);
+        if(FDest->FCells) { FDest->TouchLine(x0, y0, x1, y1); }
+    }
+
+    /// Line() with a stipple pattern and a gradient from color0 to color1 (see LineStyle). The colors are 0xRRGGBB
+    /// for every pixel format, indexed targets map each new color of a gradient to the palette. Pattern and gradient
+    /// advance with every step of the unclipped line, so clipping does not shift them
+    inline void LineStyled(int x0, int y0, int x1, int y1, int color0, int color1, const LineStyle& S)
+    {
+        const int CX0 = FDest->FClipX0, CY0 = FDest->FClipY0;
+        const int CW  = FDest->FClipX1 - CX0, CH = FDest->FClipY1 - CY0;
+
+        int dx = abs(x1-x0), sx = x0<x1 ? 1 : -1;
+        int dy = abs(y1-y0), sy = y0<y1 ? 1 : -1;
+        int err = (dx>dy ? dx : -dy)/2, e2;
+        int n = (dx > dy) ? dx : dy;
+
+        LineGradient G;
+        G.Setup(color0, color1, n);
+
+        bool Checked;
+        int First, Last;
+        if(!ClipT::Prepare(CX0, CY0, CX0 + CW, CY0 + CH, x0, y0, x1, y1, n, First, Last, Checked)) { return; }
+
+        bresenham_skip(x0, y0, err, dx, dy, sx, sy, First);
+        n = Last - First;
+
+        G.Skip(First);
+
+        const int L = S.GetLength();
+        int Bit = S.PatternBit(First);
+
+        const bool Gradient = (color0 != color1);
+        int Color = G.Color();
+        typename PixelT::Value v = PixelT::FromRGB(FDest, Color);
+
+        unsigned char* Base = LayoutT::Base(FDest);
+        const bool Track = (FDest->FCells != NULL);
+
+        for(;;)
+        {
+            if(((S.Pattern >> Bit) & 1) && (!Checked || ((unsigned)(x0 - CX0) < (unsigned)CW && (unsigned)(y0 - CY0) < (unsigned)CH)))
+            {
+                if(Gradient && G.Color() != Color)
+                {
+                    Color = G.Color();
+                    v = PixelT::FromRGB(FDest, Color);
+                }
+
+                PixelT::Store(Base + LayoutT::Index(FDest, x0, y0) * PixelT::Size, v);
+                if(Track) { FDest->TouchPixel(x0, y0); }
+            }
+
+            if (n-- == 0) break;
+            if (++Bit == L) Bit = 0;
+            if (Gradient) G.Step();
+            e2 = err;
+            if (e2 >-dx) { err -= dy; x0 += sx; }
+            if (e2 < dy) { err += dx; y0 += sy; }
+        }
+    }
+
+    Bitmap* FDest;
+
+private:
+    typedef typename LayoutT::template Cursor<PixelT::Size> CursorT;
+
+    /// The unclipped Bresenham loop of Line() over a pointer into the buffer
+    inline void Walk(int x, int y, int n, int err, int dx, int dy, int sx, int sy, const typename PixelT::Value& v)
+    {
+        CursorT c;
+        c.Start(FDest, x, y, sx, sy);
+
+        for(;;)
+        {
+            PixelT::Store(c.p, v);
+            if (n-- == 0) break;
+            int e2 = err;
+            if (e2 >-dx) { err -= dy; c.MoveX(); }
+            if (e2 < dy) { err += dx; c.MoveY(); }
+        }
+    }
+
+    /// Walk() for lines crossing the clip rectangle. The steps are taken in pieces of one cell size, so a piece moves
+    /// at most one cell on each axis. A piece whose bounding box is inside the rectangle runs
+    /// the pointer loop and flags the cells of its box (at most 2x2, possibly one the line just misses), a piece outside
+    /// is skipped in constant time, and only the pieces crossing the border test their pixels one by one
+    inline void WalkPieces(int x, int y, int n, int err, int dx, int dy, int sx, int sy, const typename PixelT::Value& v)
+    {
+        const int CX0 = FDest->FClipX0, CY0 = FDest->FClipY0;
+        const int CX1 = FDest->FClipX1, CY1 = FDest->FClipY1;
+
+        const bool Track = (FDest->FCells != NULL);
+        const double Scale = LayoutT::LocateScale(FDest);
+
+        unsigned char* const Base = LayoutT::Base(FDest);
+
+        // the cursor follows the pieces walked with it, the others start it again afterwards
+        CursorT c;
+        c.Start(FDest, x, y, sx, sy);
+
+        for(;;)
+        {
+            int m = (n < BITMAP_TRACK_SIZE) ? n : BITMAP_TRACK_SIZE;
+            n -= m;
+
+            const int xa = (sx > 0) ? x : x - m, xb = (sx > 0) ? x + m : x;
+            const int ya = (sy > 0) ? y : y - m, yb = (sy > 0) ? y + m : y;
+
+            if(xa >= CX0 && xb < CX1 && ya >= CY0 && yb < CY1)
+            {
+                const int x0 = x, y0 = y;
+
+                // the last pixel of a piece is stored again as the first one of the next
+                for(;;)
+                {
+                    PixelT::Store(c.p, v);
+                    if (m-- == 0) break;
+                    int e2 = err;
+                    if (e2 >-dx) { err -= dy; c.MoveX(); }
+                    if (e2 < dy) { err += dx; c.MoveY(); }
+                }
+
+                LayoutT::Locate(FDest, (int)(c.p - Base) / PixelT::Size, Scale, x, y);
+
+                if(Track) { FDest->TouchCellBox(x0, y0, x, y); }
+            } else
+            if(xb < CX0 || xa >= CX1 || yb < CY0 || ya >= CY1)
+            {
+                bresenham_skip(x, y, err, dx, dy, sx, sy, m);
+                c.Start(FDest, x, y, sx, sy);
+            } else
+            {
+                for(;;)
+                {
+                    if(x >= CX0 && x < CX1 && y >= CY0 && y < CY1)
+                    {
+                        PixelT::Store(Base + LayoutT::Index(FDest, x, y) * PixelT::Size, v);
+                        if(Track) { FDest->TouchPixel(x, y); }
+                    }
+
+                    if (m-- == 0) break;
+                    int e2 = err;
+                    if (e2 >-dx) { err -= dy; x += sx; }
+                    if (e2 < dy) { err += dx; y += sy; }
+                }
+
+                c.Start(FDest, x, y, sx, sy);
+            }
+
+            if(n == 0) break;
+        }
+    }
+};
+
+/// The default targets used by Bitmap::Line
+typedef BitmapTarget<PixelRGB24, ClipGuardBand, LayoutLinear> BitmapTargetRGB24;
+typedef BitmapTarget<PixelRGB24, ClipGuardBand, LayoutTiled>  BitmapTargetTiledRGB24;
+typedef BitmapTarget<PixelIndexed8, ClipGuardBand, LayoutLinear> BitmapTargetIndexed8;
@@ -0,0 +1,65 @@
+#include "Bitmap.h"
+#include "BitmapRaster.h"
+#include "Font.h"
+
+/// Draw one glyph: every row mask is split into runs of set bits, each run is one span fill
+template <class PixelT>
+static void BlitGlyph(Bitmap* B, int gx, int gy, const unsigned char* Rows, const typename PixelT::Value& v, int scale)
+{
+    const int X0 = B->FClipX0, Y0 = B->FClipY0, X1 = B->FClipX1, Y1 = B->FClipY1;
+
+    if(gx >= X1 || gy >= Y1 || gx + FONT_GLYPH_WIDTH * scale <= X0 || gy + FONT_GLYPH_HEIGHT * scale <= Y0) { return; }
+
+    for(int r = 0 ; r < FONT_GLYPH_HEIGHT ; r++)
+    {
+        unsigned int m = Rows[r];
+        if(!m) { continue; }
+
+        for(int sy = 0 ; sy < scale ; sy++)
+        {
+            int py = gy + r * scale + sy;
+            if(py < Y0 || py >= Y1) { continue; }
+
+            for(int b = 0 ; (m >> b) != 0 ; )
+            {
+                if(!((m >> b) & 1)) { b++; continue; }
+
+                int e = b + 1;
+                while((m >> e) & 1) { e++; }
+
+                int px0 = gx + b * scale, px1 = gx + e * scale;
+                if(px0 < X0) { px0 = X0; }
+                if(px1 > X1) { px1 = X1; }
+
+                if(px0 < px1)
+                    bitmap_fill_row<PixelT>(B, px0, py, px1 - px0, v);
+
+                b = e;
+            }
+        }
+    }
+}
+
+void Bitmap::Text(int x, int y, const char* text, int color, int scale)
+{
+    if(scale < 1) { scale = 1; }
+
+    const PixelRGB24::Value v = PixelRGB24::Pack(color);
+    const PixelIndexed8::Value Index = FPalette ? PixelIndexed8::Pack(FPalette->Map(color)) : 0;
+
+    for(int cx = x ; *text ; text++)
+    {
+        if(*text == '\n')
+        {
+            cx = x;
+            y += FONT_LINE_HEIGHT * scale;
+            continue;
+        }
+
+        if(FPalette)
+            BlitGlyph<PixelIndexed8>(this, cx, y, font_glyph((unsigned char)*text), Index, scale);
+        else
+            BlitGlyph<PixelRGB24>(this, cx, y, font_glyph((unsigned char)*text), v, scale);
+        cx += FONT_ADVANCE * scale;
+    }
+}
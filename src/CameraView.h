@@ -2,6 +2,11 @@
 
 #include "CommonFramework.h"
 #include "Canvas.h"
+#include "Trace.h"
+#include "Parallel.h"
+#include <math.h>
+#include <string.h>
+#include <vector>
 
 struct Window3D: public BaseWindow
 {
@@ -10,15 +15,158 @@ struct Window3D: public BaseWindow
 
     virtual void OnDraw()
     {
-        this->FCanvas3D->SetMatrices(FProj, Camera.FCurrentTransform);
+        const double Start = GetSeconds();
+
+        FFrameArena.Reset();
+
+        // dynamic resolution: Render3D() draws into the low resolution canvas, which is upscaled afterwards
+        const bool Scaled = FDynamicResolution && FRenderScale < 1.0f && !FRefine;
+        Canvas2D_Bitmap* FullCanvas = FCanvas2D;
+
+        if(Scaled)
+        {
+            FCanvas2D = GetLowResCanvas();
+            FCanvas3D->FCanvas = FCanvas2D;
+        }
+
+        if(FPicking)
+            FPickGrid.Begin(FCanvas2D->GetWidth(), FCanvas2D->GetHeight());
+
+        this->FCanvas3D->FPick = FPicking ? &FPickGrid : NULL;
+        this->FCanvas3D->SetPickID(-1);
+
+        // tracing records the 2D calls too, in order with the 3D ones
+        const bool Record = FDeferredDraw || FTrace;
+
+        if(Record)
+        {
+            FCommands.Begin(&FFrameArena);
+            this->FCanvas3D->SetCommandBuffer(&FCommands);
+
+            if(FTrace) { FCanvas2D->SetCommandBuffer(&FCommands); }
+        }
+
+        this->FCanvas3D->SetMatrices(FProj, Camera.FRenderTransform);
         this->Render3D();
+
+        if(Record)
+        {
+            FCanvas2D->SetCommandBuffer(NULL);
+
+            if(FTrace) { FTrace->WriteFrame(FCommands, FCanvas2D->GetWidth(), FCanvas2D->GetHeight()); }
+
+            this->FCanvas3D->Flush();
+            this->FCanvas3D->SetCommandBuffer(NULL);
+        }
+
+        if(Scaled)
+        {
+            Bitmap* Low = FCanvas2D->FDest;
+
+            FCanvas2D = FullCanvas;
+            FCanvas3D->FCanvas = FullCanvas;
+
+            FCanvasBitmap->BlitScaled(*Low, 0, 0, Width, Height, 0, 0, Low->Width, Low->Height, FUpscaleFilter, &FFrameArena);
+        }
+
+        // linearize the tiles (if any) into FB for presenting
+        FCanvasBitmap->Resolve();
+
+        Camera.FChanged = false;
+        FDrawnVersion   = FSceneVersion;
+
+        // the full size frame after the motion stopped does not count, it may take as long as it needs
+        if(FDynamicResolution && !FRefine)
+            UpdateRenderScale((float)(GetSeconds() - Start));
+
+        FFullFrame = !Scaled;
+        FRefine    = false;
+    }
+
+    /// Redraw only if the camera moved or the scene was invalidated since the last frame
+    virtual bool IsFrameDirty() { return Camera.FChanged || FSceneVersion != FDrawnVersion; }
+
+    /// Tell the window that Render3D() would draw something different now (animation, new data,
+    /// FDeferredDraw/FPicking toggled). Camera motion is tracked automatically
+    void Invalidate() { FSceneVersion++; }
+
+#ifdef __linux__
+    /// Convert only the dirty cells of the bitmap, untouched ones are constant fills of the clear color
+    virtual void ConvertFrame()
+    {
+        Bitmap* B = FCanvasBitmap;
+
+        if(!B->IsTracking())
+        {
+            BaseWindow::ConvertFrame();
+            return;
+        }
+
+        UpdatePalette();
+
+        // rows of cells on the thread pool
+        ConvertCellsTask Task;
+        Task.W = this;
+
+        parallel_for(B->FCellsY, Task);
+
+        B->ClearDirty();
     }
 
+    /// Convert the dirty cells of the row cy of cells
+    void ConvertCellRow(int cy)
+    {
+        Bitmap* B = FCanvasBitmap;
+        if(!(B->GetCellRowFlags(cy) & CELL_DIRTY)) { return; }
+
+        int y = cy << BITMAP_TRACK_SHIFT;
+        int h = (Height - y < BITMAP_TRACK_SIZE) ? Height - y : BITMAP_TRACK_SIZE;
+
+        for(int cx = 0 ; cx < B->FCellsX ; cx++)
+        {
+            int Flags = B->GetCellFlags(cx, cy);
+            if(!(Flags & CELL_DIRTY)) { continue; }
+
+            int x = cx << BITMAP_TRACK_SHIFT;
+            int w = (Width - x < BITMAP_TRACK_SIZE) ? Width - x : BITMAP_TRACK_SIZE;
+
+            if(Flags & CELL_TOUCHED)
+                ConvertRect(x, y, w, h);
+            else
+                FillRect(x, y, w, h, B->GetClearColor());
+        }
+    }
+
+    struct ConvertCellsTask
+    {
+        Window3D* W;
+
+        void operator()(int cy) const { W->ConvertCellRow(cy); }
+    };
+#endif
+
     virtual void OnTimer()
     {
         BaseWindow::OnTimer();
-        Camera.Update(GetDelta());
-        this->Repaint();
+
+        // the camera runs in fixed steps of the nominal timer period, driven by the real time elapsed
+        double Now = GetSeconds();
+        float Elapsed = (FLastTime > 0.0) ? (float)(Now - FLastTime) : 0.0f;
+        FLastTime = Now;
+
+        if(GetDelta() > 0.0f) { Camera.FFixedStep = GetDelta(); }
+        Camera.Advance(Elapsed);
+
+        // once the view settles, replace the last low resolution frame by a full size one
+        if(FDynamicResolution && !FFullFrame && !IsFrameDirty())
+        {
+            FRefine = true;
+            Invalidate();
+        }
+
+        // an idle window costs nothing beyond this check
+        if(IsFrameDirty())
+            this->Repaint();
     }
 
     virtual void OnWheelUp()   { Camera.FWheelTicks++; }
@@ -72,6 +220,8 @@ struct Window3D: public BaseWindow
     {
         float aa = ((float)w / (float)h);
         frustum(FProj,10.0,150.0,-1.0 * aa,1.0 * aa,-1.0,+1.0);
+
+        Invalidate();
     }
 
     Window3D(int x, int y, int w, int h, const char* title): BaseWindow(x, y, w, h, title)
@@ -92,19 +242,197 @@ struct Window3D: public BaseWindow
 
         // wrap this window's framebuffer
         FCanvasBitmap = new Bitmap(FB, w, h);
+        FCanvasBitmap->EnableTracking(true);
         FCanvas2D = new Canvas2D_Bitmap(FCanvasBitmap);
         FCanvas3D = new Canvas3D(FCanvas2D);
 
+        FDeferredDraw = false;
+        FTrace = NULL;
+        FPicking = false;
+        FLastTime = 0.0;
+
+        FSceneVersion = 1;
+        FDrawnVersion = 0;
+
+        FDynamicResolution = false;
+        FFrameBudget    = 0.016f;
+        FMinRenderScale = 0.25f;
+        FUpscaleFilter  = BLIT_BILINEAR;
+        FRenderScale    = 1.0f;
+
+        FFrameTime     = 0.0f;
+        FScaleCooldown = 0;
+        FFullFrame     = true;
+        FRefine        = false;
+        FLowResCanvas  = NULL;
+
         FixSize(w, h);
     }
 
+#ifdef __linux__
+    /// Draw into an 8-bit indexed frame buffer: 1 byte per pixel instead of 3, expanded through the palette of
+    /// FCanvasBitmap when presented. Colors are mapped to the nearest palette entry, exact ones can be set with
+    /// FCanvasBitmap->SetPalette(). Dynamic resolution upscales with nearest sampling in this mode
+    void EnableIndexedColor(bool On)
+    {
+        if(On == (FPalette != NULL)) { return; }
+
+        Bitmap* Old = FCanvasBitmap;
+        Bitmap* B   = new Bitmap(NULL, Width, Height, On ? BITMAP_INDEXED8 : BITMAP_RGB24);
+
+        SetIndexedColor(On ? B->GetPalette()->Colors : NULL);
+
+        B->FB = FB;
+        B->ZB = Old->ZB;
+        B->EnableTracking(Old->IsTracking());
+
+        FCanvasBitmap = B;
+        FCanvas2D->FDest = B;
+        delete Old;
+
+        // the low resolution target follows on the next frame
+        delete FLowResCanvas;
+        FLowResCanvas = NULL;
+
+        Invalidate();
+    }
+#endif
+
     Bitmap          *FCanvasBitmap;
     Canvas2D_Bitmap *FCanvas2D;
     Canvas3D        *FCanvas3D;
 
+    /// Transient per-frame storage, reset at the start of every OnDraw()
+    LinearArena FFrameArena;
+
+    /// If set, Canvas3D calls made in Render3D() are recorded into FCommands and drawn at the end of the frame
+    bool FDeferredDraw;
+    DrawCommandBuffer FCommands;
+
+    /// If set, every frame drawn by Render3D() (the FCanvas2D and FCanvas3D calls) is appended to the trace,
+    /// the frame is drawn in the deferred mode then. Blits into FCanvas2D are not recorded
+    TraceWriter* FTrace;
+
+    /// If set, primitives drawn with a pick ID (Canvas3D::SetPickID) are registered in FPickGrid
+    bool FPicking;
+    PickGrid FPickGrid;
+
+    /// ID of the object under (x, y) in the last drawn frame, -1 if nothing is within Radius pixels
+    int Pick(int x, int y, float Radius = 4.0f) const
+    {
+        if(!FPicking) { return -1; }
+
+        // the grid of a low resolution frame is in its pixels
+        float s = (float)FPickGrid.GetWidth() / (float)Width;
+        return FPickGrid.Query((int)((float)x * s), (int)((float)y * s), Radius * s);
+    }
+
+    /// If set, the scene is rendered at FRenderScale of the window size and upscaled with FUpscaleFilter.
+    /// The scale follows the measured OnDraw() time to keep it and the present time of the last frame
+    /// (FPresentTime, which does not shrink with the scale) within FFrameBudget (seconds), between
+    /// FMinRenderScale and 1. Render3D() must draw through FCanvas2D/FCanvas3D, which point to the
+    /// low resolution canvas during the call. A full size frame is drawn once the view stops changing
+    bool  FDynamicResolution;
+    float FFrameBudget;
+    float FMinRenderScale;
+    int   FUpscaleFilter;
+
+    /// Current scale, a multiple of 1/16
+    float FRenderScale;
+
     virtual void Render3D() {}
 
 protected:
+    /// GetSeconds() of the last OnTimer()
+    double FLastTime;
+
+    /// Bumped by Invalidate(), FDrawnVersion is the value of the last drawn frame
+    unsigned FSceneVersion, FDrawnVersion;
+
+    /// Smoothed frame time and the frames to wait before the next scale change
+    float FFrameTime;
+    int   FScaleCooldown;
+
+    /// The last frame was drawn at full size / the next one has to be
+    bool FFullFrame, FRefine;
+
+    /// Low resolution target, reallocated when the scale changes
+    Canvas2D_Bitmap* FLowResCanvas;
+    std::vector<unsigned char> FLowResBuffer;
+    std::vector<float> FLowResDepth;
+
+    Canvas2D_Bitmap* GetLowResCanvas()
+    {
+        int w = (int)((float)Width  * FRenderScale), h = (int)((float)Height * FRenderScale);
+        if(w < 1) { w = 1; }
+        if(h < 1) { h = 1; }
+
+        const BitmapPalette* Palette = FCanvasBitmap->GetPalette();
+
+        if(FLowResCanvas && FLowResCanvas->GetWidth() == w && FLowResCanvas->GetHeight() == h)
+        {
+            // indices are upscaled as they are, so both bitmaps need the same colors
+            BitmapPalette* Low = FLowResCanvas->FDest->GetPalette();
+            if(Palette && memcmp(Low->Colors, Palette->Colors, sizeof(Palette->Colors)))
+                FLowResCanvas->FDest->SetPalette(Palette->Colors, Palette->Count);
+
+            return FLowResCanvas;
+        }
+
+        delete FLowResCanvas;
+        FLowResBuffer.resize(w * h * FCanvasBitmap->GetPixelSize());
+
+        Bitmap* B = new Bitmap(&FLowResBuffer[0], w, h, FCanvasBitmap->GetFormat());
+        if(Palette) { B->SetPalette(Palette->Colors, Palette->Count); }
+
+        // depth-tested scenes get a depth buffer of the same size
+        if(FCanvasBitmap->ZB)
+        {
+            FLowResDepth.resize(w * h);
+            B->ZB = &FLowResDepth[0];
+        }
+
+        FLowResCanvas = new Canvas2D_Bitmap(B);
+        return FLowResCanvas;
+    }
+
+    /// Move the scale towards the frame budget left after presenting. Going down jumps by the estimated factor
+    /// (the cost is about proportional to the pixel count), going up takes single 1/16 steps and only well below
+    /// the budget, so that the next step cannot overshoot it; every change waits for a few frames at the new size
+    void UpdateRenderScale(float Seconds)
+    {
+        FFrameTime = (FFrameTime > 0.0f) ? FFrameTime + 0.25f * (Seconds - FFrameTime) : Seconds;
+
+        if(FScaleCooldown > 0) { FScaleCooldown--; return; }
+
+        const float Step = 1.0f / 16.0f;
+        float Scale = FRenderScale;
+
+        // only the drawing scales, it gets what presenting leaves of the budget (at least a quarter)
+        float Budget = FFrameBudget - FPresentTime;
+        if(Budget < 0.25f * FFrameBudget) { Budget = 0.25f * FFrameBudget; }
+
+        if(FFrameTime > Budget)
+        {
+            Scale = floorf(Scale * sqrtf(Budget / FFrameTime) / Step) * Step;
+            if(Scale >= FRenderScale) { Scale = FRenderScale - Step; }
+        } else
+        if(FFrameTime < 0.6f * Budget)
+        {
+            Scale += Step;
+        }
+
+        if(Scale < FMinRenderScale) { Scale = FMinRenderScale; }
+        if(Scale > 1.0f)            { Scale = 1.0f; }
+
+        if(Scale != FRenderScale)
+        {
+            FRenderScale   = Scale;
+            FScaleCooldown = 8;
+            FFrameTime     = 0.0f;
+        }
+    }
+
     bool pressed;
     int mousex, mousey, oldmousex, oldmousey;
 };
@@ -1,22 +1,123 @@
 #include "Canvas.h"
 #include "Bitmap.h"
+#include "CanvasT.h"
+#include "BitmapRaster.h"
+#include "Font.h"
+#include "quat.h"
+#include "Parallel.h"
 #include <algorithm>
+#include <vector>
+#include <string.h>
+#include <math.h>
 
-void Canvas3D::Frame3D(const vec3& base, const mtx4& mtx, float size, int Xcolor, int Ycolor, int Zcolor)
+void iCanvas2D::FillTriangle(float x0, float y0, float x1, float y1, float x2, float y2, int color)
 {
-    vec3 xa, ya, za;
+    // sort by y
+    if(y1 < y0) { std::swap(x0, x1); std::swap(y0, y1); }
+    if(y2 < y0) { std::swap(x0, x2); std::swap(y0, y2); }
+    if(y2 < y1) { std::swap(x1, x2); std::swap(y1, y2); }
+
+    if(y2 <= y0) { return; }
 
-    vec3 pos;
-    mtx4 m;
-    decompose_camera_transform( mtx, pos, m );
+    int ya = std::max((int)ceilf(y0 - 0.5f), 0);
+    int yb = std::min((int)ceilf(y2 - 0.5f), GetHeight());
+
+    for(int y = ya ; y < yb ; y++)
+    {
+        // intersect the row through pixel centers with the long edge and with one of the short edges
+        float fy = (float)y + 0.5f;
 
-    xa = vec3(MTX4_ELT(m, 0, 0), MTX4_ELT(m, 0, 1), MTX4_ELT(m, 0, 2));
-    ya = vec3(MTX4_ELT(m, 1, 0), MTX4_ELT(m, 1, 1), MTX4_ELT(m, 1, 2));
-    za = vec3(MTX4_ELT(m, 2, 0), MTX4_ELT(m, 2, 1), MTX4_ELT(m, 2, 2));
+        float xl = x0 + (x2 - x0) * (fy - y0) / (y2 - y0);
+        float xr = (fy < y1) ? x0 + (x1 - x0) * (fy - y0) / (y1 - y0) : x1 + (x2 - x1) * (fy - y1) / (y2 - y1);
 
-    Arrow3D(base + size * xa, base, 0.2f * size, Xcolor, Xcolor);
-    Arrow3D(base + size * ya, base, 0.2f * size, Ycolor, Ycolor);
-    Arrow3D(base + size * za, base, 0.2f * size, Zcolor, Zcolor);
+        if(xr < xl) { std::swap(xl, xr); }
+
+        int xa = (int)ceilf(xl - 0.5f);
+        int xb = (int)ceilf(xr - 0.5f) - 1;
+
+        if(xa <= xb)
+            this->Line(xa, y, xb, y, color);
+    }
+}
+
+void iCanvas2D::LineStyled(int x0, int y0, int x1, int y1, int color, const LineStyle& Style)
+{
+    const int EndColor = (Style.EndColor < 0) ? color : Style.EndColor;
+
+    if(EndColor == color && Style.IsSolid())
+    {
+        this->Line(x0, y0, x1, y1, color);
+        return;
+    }
+
+    // the stepping of Bitmap::Line
+    int dx = abs(x1-x0), sx = x0<x1 ? 1 : -1;
+    int dy = abs(y1-y0), sy = y0<y1 ? 1 : -1;
+    int err = (dx>dy ? dx : -dy)/2, e2;
+    int n = (dx > dy) ? dx : dy;
+
+    LineGradient G;
+    G.Setup(color, EndColor, n);
+
+    const int L = Style.GetLength();
+    int Bit = Style.PatternBit(0);
+
+    for(;;)
+    {
+        if((Style.Pattern >> Bit) & 1) { this->SetPixel(x0, y0, G.Color()); }
+
+        if (n-- == 0) break;
+        if (++Bit == L) Bit = 0;
+        G.Step();
+        e2 = err;
+        if (e2 >-dx) { err -= dy; x0 += sx; }
+        if (e2 < dy) { err += dx; y0 += sy; }
+    }
+}
+
+void iCanvas2D::Text(int x, int y, const char* text, int color, int scale)
+{
+    if(scale < 1) { scale = 1; }
+
+    for(int cx = x ; *text ; text++)
+    {
+        if(*text == '\n') { cx = x; y += FONT_LINE_HEIGHT * scale; continue; }
+
+        const unsigned char* Rows = font_glyph((unsigned char)*text);
+
+        for(int r = 0 ; r < FONT_GLYPH_HEIGHT * scale ; r++)
+            for(int c = 0 ; c < FONT_GLYPH_WIDTH * scale ; c++)
+                if((Rows[r / scale] >> (c / scale)) & 1)
+                    this->SetPixel(cx + c, y + r, color);
+
+        cx += FONT_ADVANCE * scale;
+    }
+}
+
+void iCanvas2D::Blit(const Bitmap& Src, int x, int y, int Alpha, int Key)
+{
+    if(Alpha <= 0) { return; }
+
+    for(int j = 0 ; j < Src.Height ; j++)
+        for(int i = 0 ; i < Src.Width ; i++)
+        {
+            int c = Src.GetPixel(i, j);
+            if(c != Key) { this->SetPixel(x + i, y + j, c); }
+        }
+}
+
+void iCanvas2D::BlitScaled(const Bitmap& Src, int x, int y, int w, int h, int Filter)
+{
+    for(int j = 0 ; j < h ; j++)
+        for(int i = 0 ; i < w ; i++)
+            this->SetPixel(x + i, y + j, Src.GetPixel((i * Src.Width) / w, (j * Src.Height) / h));
+}
+
+void Canvas3D::Frame3D(const vec3& base, const mtx4& mtx, float size, int Xcolor, int Ycolor, int Zcolor)
+{
+    if(FCommands) { FCommands->AddFrame(base, mtx, size, Xcolor, Ycolor, Zcolor); return; }
+
+    canvas_frame3d(*this, base, mtx, size, Xcolor, Ycolor, Zcolor);
 }
 
 void Canvas3D::Arrow3D(const vec3& Point1,
@@ -25,100 +126,1029 @@ void Canvas3D::Arrow3D(const vec3& Point1,
                         int ArrowColor,
                         int TipColor )
 {
-    Line3D( Point1, Point2, ArrowColor );
+    if(FCommands) { FCommands->AddArrow(Point1, Point2, TipSize, ArrowColor, TipColor); return; }
+
+    canvas_arrow3d(*this, Point1, Point2, TipSize, ArrowColor, TipColor);
+}
+
+//// Instanced glyphs
+
+/// Object-space line drawing: points and the segments between them, every segment with a color slot
+struct GlyphTemplate
+{
+    enum { MaxPoints = 16, MaxSegments = 27 };
 
-    // build coordsys for tip
-    vec3 Arrow = Point2 - Point1;
-    vec3 Up, Left;
+    int  NumPoints, NumSegments;
+    vec3 P[MaxPoints];
 
-    BuildComplementaryBasis(Arrow, Up, Left);
+    /// from, to, color slot
+    unsigned char Seg[MaxSegments][3];
 
-    Arrow.Normalize();
-    Up.Normalize();
-    Left.Normalize();
+    int AddPoint(const vec3& p) { P[NumPoints] = p; return NumPoints++; }
 
-    Arrow = TipSize * Arrow;
-    Up    = 0.5f * TipSize * Up;
-    Left  = 0.5f * TipSize * Left;
+    void AddSegment(int a, int b, int Slot)
+    {
+        Seg[NumSegments][0] = (unsigned char)a;
+        Seg[NumSegments][1] = (unsigned char)b;
+        Seg[NumSegments][2] = (unsigned char)Slot;
+        NumSegments++;
+    }
 
-    vec3 Pt1 = Point1 + Arrow + Left;
-    vec3 Pt2 = Point1 + Arrow + Up;
-    vec3 Pt3 = Point1 + Arrow - Left;
-    vec3 Pt4 = Point1 + Arrow - Up;
+    /// Head of canvas_arrow3d(): lines from the four ring points to the tip, then the ring
+    void AddHead(int Tip, const vec3& Center, const vec3& Up, const vec3& Left, int Slot)
+    {
+        int p1 = AddPoint(Center + Left), p2 = AddPoint(Center + Up);
+        int p3 = AddPoint(Center - Left), p4 = AddPoint(Center - Up);
 
-    Line3D( Pt1, Point1, TipColor );
-    Line3D( Pt2, Point1, TipColor );
-    Line3D( Pt3, Point1, TipColor );
-    Line3D( Pt4, Point1, TipColor );
+        AddSegment(p1, Tip, Slot); AddSegment(p2, Tip, Slot);
+        AddSegment(p3, Tip, Slot); AddSegment(p4, Tip, Slot);
 
-    Line3D( Pt1, Pt2, TipColor );
-    Line3D( Pt2, Pt3, TipColor );
-    Line3D( Pt3, Pt4, TipColor );
-    Line3D( Pt4, Pt1, TipColor );
+        AddSegment(p1, p2, Slot); AddSegment(p2, p3, Slot);
+        AddSegment(p3, p4, Slot); AddSegment(p4, p1, Slot);
+    }
+};
+
+/// canvas_frame3d() of size 1 at the origin with the identity axes, color slot = axis
+static GlyphTemplate make_frame_glyph()
+{
+    GlyphTemplate T;
+    T.NumPoints = T.NumSegments = 0;
+
+    const vec3 E[3] = { vec3(1, 0, 0), vec3(0, 1, 0), vec3(0, 0, 1) };
+
+    int Origin = T.AddPoint(vec3(0, 0, 0));
+
+    for(int k = 0 ; k < 3 ; k++)
+    {
+        int Tip = T.AddPoint(E[k]);
+        T.AddSegment(Tip, Origin, k);
+
+        // tip size 0.2: the ring is 0.2 back from the tip, 0.1 wide
+        T.AddHead(Tip, 0.8f * E[k], 0.1f * E[(k + 1) % 3], 0.1f * E[(k + 2) % 3], k);
+    }
+
+    return T;
 }
 
-void Canvas3D::Plane(const vec3& p, const vec3& v1, const vec3& v2, float step1, float step2, int numx, int numy, int color)
+/// Arrow head with the tip at the origin. The instance matrix rows are the arrow direction scaled by the tip size
+/// and the two side vectors scaled by half of it, so the ring is at x = 1
+static GlyphTemplate make_arrow_glyph()
+{
+    GlyphTemplate T;
+    T.NumPoints = T.NumSegments = 0;
+
+    int Tip = T.AddPoint(vec3(0, 0, 0));
+    T.AddHead(Tip, vec3(1, 0, 0), vec3(0, 1, 0), vec3(0, 0, 1), 1);
+
+    return T;
+}
+
+static const GlyphTemplate FrameGlyph = make_frame_glyph();
+static const GlyphTemplate ArrowGlyph = make_arrow_glyph();
+
+/// Instances projected per DrawSegments() pass
+static const int GlyphBatch = 32;
+
+/// Clip coordinates -> canvas pixels, the mapping of NdcToViewport() and the int conversion of Line3D()
+static inline void clip_to_pixel(const vec4& c, float w2, float h2, int OfsX, int OfsY, int& x, int& y)
 {
-    for(int i = 0 ; i <= numx ; i++)
-        Line3D(p + ((float)(i - numx/2) * step1) * v1 + (numy/2 ) * step2 * v2, p + ((float)(i - numx/2) * step1) * v1 - (numy/2) * step2 * v2, color);
+    vec3 p = c.Project();
 
-    for(int j = 0 ; j <= numy ; j++)
-        Line3D(p + ((float)(j - numy/2) * step2) * v2 + (numx/2 ) * step1 * v1, p + ((float)(j - numy/2) * step2) * v2 - (numx/2) * step1 * v1, color);
+    float fx = (p.x + 1.0f) * w2, fy = (p.y + 1.0f) * h2;
+
+    // keep the conversion defined for points near the camera plane, the line clipping handles the rest
+    if(fx < -1.0e6f) { fx = -1.0e6f; } else if(fx > 1.0e6f) { fx = 1.0e6f; }
+    if(fy < -1.0e6f) { fy = -1.0e6f; } else if(fy > 1.0e6f) { fy = 1.0e6f; }
+
+    x = (int)fx + OfsX;
+    y = (int)fy + OfsY;
 }
 
-void Canvas3D::Pt3D(const vec3& pt, float sz, int color)
+Canvas3D::ScreenSegment* Canvas3D::ProjectGlyph(ScreenSegment* Out, const GlyphTemplate& T, const mtx4& ObjectToClip, const int* Colors) const
+{
+    const int w = (FVpW > 0) ? FVpW : FCanvas->GetWidth();
+    const int h = (FVpH > 0) ? FVpH : FCanvas->GetHeight();
+
+    const float w2 = (float)((w - 1) / 2), h2 = (float)((h - 1) / 2);
+
+    vec4 C[GlyphTemplate::MaxPoints];
+    transform_points(C, ObjectToClip, &T.P[0].x, T.NumPoints);
+
+    int X[GlyphTemplate::MaxPoints], Y[GlyphTemplate::MaxPoints];
+    for(int i = 0 ; i < T.NumPoints ; i++)
+        clip_to_pixel(C[i], w2, h2, FVpX, FVpY, X[i], Y[i]);
+
+    for(int i = 0 ; i < T.NumSegments ; i++, Out++)
+    {
+        Out->X0 = X[T.Seg[i][0]]; Out->Y0 = Y[T.Seg[i][0]];
+        Out->X1 = X[T.Seg[i][1]]; Out->Y1 = Y[T.Seg[i][1]];
+        Out->Color = Colors[T.Seg[i][2]];
+    }
+
+    return Out;
+}
+
+void Canvas3D::DrawSegments(const ScreenSegment* S, int Count)
+{
+    if(FPick && FPickID >= 0)
+        for(int i = 0 ; i < Count ; i++)
+            FPick->AddSegment((float)S[i].X0, (float)S[i].Y0, (float)S[i].X1, (float)S[i].Y1, FPickID);
+
+    // the layout is resolved once for the whole batch, the line loops are inlined
+    Bitmap* B = FCanvas->GetBitmap();
+
+    if(B && B->GetFormat() == BITMAP_INDEXED8)
+    {
+        // segments of one object share the color, map it once per change
+        BitmapTargetIndexed8 T(B);
+        int Last = -1, Index = 0;
+
+        for(int i = 0 ; i < Count ; i++)
+        {
+            if(S[i].Color != Last) { Last = S[i].Color; Index = B->MapColor(Last); }
+            T.Line(S[i].X0, S[i].Y0, S[i].X1, S[i].Y1, Index);
+        }
+    } else
+    if(B && B->GetLayout() == BITMAP_LINEAR)
+    {
+        BitmapTargetRGB24 T(B);
+        for(int i = 0 ; i < Count ; i++) { T.Line(S[i].X0, S[i].Y0, S[i].X1, S[i].Y1, S[i].Color); }
+    } else
+    if(B)
+    {
+        BitmapTargetTiledRGB24 T(B);
+        for(int i = 0 ; i < Count ; i++) { T.Line(S[i].X0, S[i].Y0, S[i].X1, S[i].Y1, S[i].Color); }
+    } else
+    {
+        for(int i = 0 ; i < Count ; i++) { FCanvas->Line(S[i].X0, S[i].Y0, S[i].X1, S[i].Y1, S[i].Color); }
+    }
+}
+
+void Canvas3D::Frames3D(const mtx4* Poses, int Count, float Size, int Xcolor, int Ycolor, int Zcolor)
+{
+    if(FCommands) { FCommands->AddFrames(Poses, Count, Size, Xcolor, Ycolor, Zcolor); return; }
+
+    const mtx4 ViewProj = FView * FProj;
+    const int  Colors[3] = { Xcolor, Ycolor, Zcolor };
+
+    ScreenSegment Buf[GlyphBatch * GlyphTemplate::MaxSegments];
+
+    for(int i = 0 ; i < Count ; i += GlyphBatch)
+    {
+        int n = (Count - i < GlyphBatch) ? Count - i : GlyphBatch;
+        ScreenSegment* Out = Buf;
+
+        for(int k = 0 ; k < n ; k++)
+        {
+            // scale the axes, keep the origin
+            mtx4 M = Poses[i + k];
+            for(int j = 0 ; j < 12 ; j++) { M.x[j] *= Size; }
+
+            Out = ProjectGlyph(Out, FrameGlyph, M * ViewProj, Colors);
+        }
+
+        DrawSegments(Buf, (int)(Out - Buf));
+    }
+}
+
+void Canvas3D::Frames3D(const vec3* Positions, const quat* Orientations, const float* Scales, int Count, int Xcolor, int Ycolor, int Zcolor)
 {
-    vec3 p1x = pt - vec3(sz, 0, 0);
-    vec3 p2x = pt + vec3(sz, 0, 0);
+    mtx4 Poses[GlyphBatch];
+
+    for(int i = 0 ; i < Count ; i += GlyphBatch)
+    {
+        int n = (Count - i < GlyphBatch) ? Count - i : GlyphBatch;
 
-    vec3 p1y = pt - vec3(0, sz, 0);
-    vec3 p2y = pt + vec3(0, sz, 0);
+        for(int k = 0 ; k < n ; k++)
+        {
+            mtx4& M = Poses[k];
+            quat_to_matrix(M, Orientations[i + k]);
 
-    vec3 p1z = pt - vec3(0, 0, sz);
-    vec3 p2z = pt + vec3(0, 0, sz);
+            if(Scales)
+                for(int j = 0 ; j < 12 ; j++) { M.x[j] *= Scales[i + k]; }
 
-    Line3D(p1x, p2x, color);
-    Line3D(p1y, p2y, color);
-    Line3D(p1z, p2z, color);
+            MTX4_ELT(M, 3, 0) = Positions[i + k].x;
+            MTX4_ELT(M, 3, 1) = Positions[i + k].y;
+            MTX4_ELT(M, 3, 2) = Positions[i + k].z;
+        }
+
+        Frames3D(Poses, n, 1.0f, Xcolor, Ycolor, Zcolor);
+    }
 }
 
-void canvas_ndc_to_fb(vec3& V, int _w2, int _h2)
+void Canvas3D::Arrows3D(const vec3* From, const vec3* To, int Count, float TipSize, int LineColor, int TipColor)
 {
-    V.x = (float)((int)((V.x + 1)*_w2));
-    V.y = (float)((int)((V.y + 1)*_h2));
+    if(FCommands) { FCommands->AddArrows(From, To, Count, TipSize, LineColor, TipColor); return; }
+
+    const mtx4 ViewProj = FView * FProj;
+    const int  Colors[2] = { LineColor, TipColor };
 
-    V.z = (V.z + 1.0f) / 2;
+    const int w = (FVpW > 0) ? FVpW : FCanvas->GetWidth();
+    const int h = (FVpH > 0) ? FVpH : FCanvas->GetHeight();
+    const float w2 = (float)((w - 1) / 2), h2 = (float)((h - 1) / 2);
+
+    ScreenSegment Buf[GlyphBatch * (GlyphTemplate::MaxSegments + 1)];
+
+    for(int i = 0 ; i < Count ; i += GlyphBatch)
+    {
+        int n = (Count - i < GlyphBatch) ? Count - i : GlyphBatch;
+        ScreenSegment* Out = Buf;
+
+        for(int k = 0 ; k < n ; k++)
+        {
+            const vec3& P1 = From[i + k];
+            const vec3& P2 = To[i + k];
+
+            // the shaft first, as in canvas_arrow3d()
+            vec4 C1, C2;
+            mult_mtx_vec4(C1, ViewProj, P1);
+            mult_mtx_vec4(C2, ViewProj, P2);
+
+            clip_to_pixel(C1, w2, h2, FVpX, FVpY, Out->X0, Out->Y0);
+            clip_to_pixel(C2, w2, h2, FVpX, FVpY, Out->X1, Out->Y1);
+            Out->Color = LineColor;
+            Out++;
+
+            vec3 Arrow = P2 - P1, Up, Left;
+            BuildComplementaryBasis(Arrow, Up, Left);
+
+            Arrow.Normalize();
+            Up.Normalize();
+            Left.Normalize();
+
+            mtx4 M;
+            const vec3 Rows[4] = { TipSize * Arrow, 0.5f * TipSize * Up, 0.5f * TipSize * Left, P1 };
+            for(int r = 0 ; r < 4 ; r++)
+            {
+                MTX4_ELT(M, r, 0) = Rows[r].x;
+                MTX4_ELT(M, r, 1) = Rows[r].y;
+                MTX4_ELT(M, r, 2) = Rows[r].z;
+                MTX4_ELT(M, r, 3) = (r == 3) ? 1.0f : 0.0f;
+            }
+
+            Out = ProjectGlyph(Out, ArrowGlyph, M * ViewProj, Colors);
+        }
+
+        DrawSegments(Buf, (int)(Out - Buf));
+    }
+}
+
+void Canvas3D::Plane(const vec3& p, const vec3& v1, const vec3& v2, float step1, float step2, int numx, int numy, int color)
+{
+    if(FCommands) { FCommands->AddPlane(p, v1, v2, step1, step2, numx, numy, color); return; }
+
+    canvas_plane(*this, p, v1, v2, step1, step2, numx, numy, color);
+}
+
+void Canvas3D::Pt3D(const vec3& pt, float sz, int color)
+{
+    if(FCommands) { FCommands->AddPoint(pt, sz, color); return; }
+
+    canvas_pt3d(*this, pt, sz, color);
 }
 
 void Canvas3D::Line3D(const vec3& v1, const vec3& v2, int color)
 {
+    if(FCommands) { FCommands->AddLine(v1, v2, color); return; }
+
     mtx4 m = FView * FProj;
     vec3 p1, p2;
 
     mult_mtx_vec(p1, m, v1);
     mult_mtx_vec(p2, m, v2);
 
-    int w = FCanvas->GetWidth();
-    int h = FCanvas->GetHeight();
+    NdcToViewport(p1);
+    NdcToViewport(p2);
 
-    canvas_ndc_to_fb(p1, (w-1)/2, (h-1)/2);
-    canvas_ndc_to_fb(p2, (w-1)/2, (h-1)/2);
+    if(FPick && FPickID >= 0) { FPick->AddSegment((float)(int)p1.x, (float)(int)p1.y, (float)(int)p2.x, (float)(int)p2.y, FPickID); }
 
     FCanvas->Line((int)p1.x, (int)p1.y, (int)p2.x, (int)p2.y, color);
 }
 
+void Canvas3D::Line3DStyled(const vec3& v1, const vec3& v2, int color, const LineStyle& Style)
+{
+    if(FCommands) { FCommands->AddLineStyled(v1, v2, color, Style); return; }
+
+    mtx4 m = FView * FProj;
+    vec3 p1, p2;
+
+    mult_mtx_vec(p1, m, v1);
+    mult_mtx_vec(p2, m, v2);
+
+    NdcToViewport(p1);
+    NdcToViewport(p2);
+
+    if(FPick && FPickID >= 0) { FPick->AddSegment((float)(int)p1.x, (float)(int)p1.y, (float)(int)p2.x, (float)(int)p2.y, FPickID); }
+
+    // the fog is resolved at the end points, the 2D gradient carries it along the line
+    LineStyle S = Style;
+    S.EndColor = canvas_fog_color(Style.EndColor < 0 ? color : Style.EndColor, p2.z, Style);
+
+    FCanvas->LineStyled((int)p1.x, (int)p1.y, (int)p2.x, (int)p2.y, canvas_fog_color(color, p1.z, Style), S);
+}
+
+void Canvas3D::Triangle3D(const vec3& v1, const vec3& v2, const vec3& v3, int color)
+{
+    if(FCommands) { FCommands->AddTriangle(v1, v2, v3, color); return; }
+
+    mtx4 m = FView * FProj;
+    vec3 p[3];
+
+    mult_mtx_vec(p[0], m, v1);
+    mult_mtx_vec(p[1], m, v2);
+    mult_mtx_vec(p[2], m, v3);
+
+    for(int i = 0 ; i < 3 ; i++)
+    {
+        NdcToViewport(p[i]);
+
+        // no clipping against the near/far planes: such triangles would wrap around
+        if(p[i].z < 0.0f || p[i].z > 1.0f) { return; }
+
+        // align the fill with the lines, which pass through pixel centers
+        p[i].x += 0.5f;
+        p[i].y += 0.5f;
+    }
+
+    // the edges (p is shifted to pixel corners here)
+    if(FPick && FPickID >= 0)
+        for(int i = 0 ; i < 3 ; i++)
+            FPick->AddSegment(p[i].x - 0.5f, p[i].y - 0.5f, p[(i + 1) % 3].x - 0.5f, p[(i + 1) % 3].y - 0.5f, FPickID);
+
+    if(FDepthTest)
+        FCanvas->FillTriangleZ(p[0].x, p[0].y, p[0].z, p[1].x, p[1].y, p[1].z, p[2].x, p[2].y, p[2].z, color);
+    else
+        FCanvas->FillTriangle(p[0].x, p[0].y, p[1].x, p[1].y, p[2].x, p[2].y, color);
+}
+
+void Canvas3D::Polygon3D(const vec3* pts, int Count, int color)
+{
+    for(int i = 1 ; i + 1 < Count ; i++)
+        Triangle3D(pts[0], pts[i], pts[i + 1], color);
+}
+
+void Canvas3D::Text3D(const vec3& pt, const char* text, int color, int dx, int dy)
+{
+    if(FCommands) { FCommands->AddText(pt, text, color, dx, dy); return; }
+
+    mtx4 m = FView * FProj;
+    vec3 p;
+
+    mult_mtx_vec(p, m, pt);
+
+    NdcToViewport(p);
+
+    if(p.z < 0.0f || p.z > 1.0f) { return; }
+
+    // the label is picked along its middle line
+    if(FPick && FPickID >= 0)
+    {
+        float x = (float)((int)p.x + dx), y = (float)((int)p.y + dy) + 0.5f * (float)font_text_height(text);
+        FPick->AddSegment(x, y, x + (float)font_text_width(text), y, FPickID);
+    }
+
+    FCanvas->Text((int)p.x + dx, (int)p.y + dy, text, color);
+}
+
+void Canvas3D::PointCloud3D(const PointCloudFile& F, int Color)
+{
+    if(FCommands) { FCommands->AddPointCloud(&F, Color); return; }
+
+    if(!F.IsOpen()) { return; }
+
+    mtx4 m = FView * FProj;
+
+    const int w  = (FVpW > 0) ? FVpW : FCanvas->GetWidth();
+    const int h  = (FVpH > 0) ? FVpH : FCanvas->GetHeight();
+    const bool Polyline = (F.GetHeader().Flags & PCF_POLYLINE) != 0;
+
+    // cull first, so that the prefetch runs ahead over the visible chunks only
+    std::vector<int>& Visible = FVisibleChunks;
+    Visible.clear();
+
+    for(int i = 0 ; i < F.GetNumChunks() ; i++)
+        if(!box_outside_frustum(m, F.GetChunk(i).Min, F.GetChunk(i).Max))
+            Visible.push_back(i);
+
+    const int Ahead = 2;
+    for(int k = 0 ; k < Ahead && k < (int)Visible.size() ; k++)
+        F.Prefetch(Visible[k]);
+
+    // points go straight into the bitmap unless they have to be picked
+    Bitmap* B = (!Polyline && !(FPick && FPickID >= 0)) ? FCanvas->GetBitmap() : NULL;
+    if(B) { FSplatter.Begin(B, FPointMode, FPointSize); }
+
+    ProjectedPoints P;
+
+    for(int k = 0 ; k < (int)Visible.size() ; k++)
+    {
+        if(k + Ahead < (int)Visible.size()) { F.Prefetch(Visible[k + Ahead]); }
+
+        const int    Chunk  = Visible[k];
+        const int    Count  = (int)F.GetChunk(Chunk).Count;
+        const float* Pts    = F.GetPoints(Chunk);
+        const int*   Colors = (Color < 0) ? F.GetColors(Chunk) : NULL;
+        const int    Const  = (Color < 0) ? 0xFFFFFF : Color;
+
+        if(B)
+        {
+            FSplatter.Add(m, Pts, Count, Const, Colors, FVpX, FVpY, w, h);
+            continue;
+        }
+
+        // polyline batches overlap by one point to keep the segment between them
+        const int Step = Polyline ? ProjectedPoints::BatchSize - 1 : ProjectedPoints::BatchSize;
+
+        for(int b = 0 ; b < Count ; b += Step)
+        {
+            int n = std::min((int)ProjectedPoints::BatchSize, Count - b);
+            if(Polyline && n < 2) { break; }
+
+            project_points(P, m, Pts + 3 * b, n, w, h, FVpX, FVpY, !Polyline);
+
+            if(!Polyline)
+            {
+                for(int j = 0 ; j < P.Count ; j++)
+                {
+                    if(FPick && FPickID >= 0) { FPick->AddPoint((float)P.X[j], (float)P.Y[j], FPickID); }
+
+                    FCanvas->SetPixel(P.X[j], P.Y[j], Colors ? Colors[b + P.Index[j]] : Const);
+                }
+                continue;
+            }
+
+            // connect consecutive points, segments with a dropped end (behind the camera) are left out
+            for(int j = 1 ; j < P.Count ; j++)
+            {
+                if(P.Index[j] != P.Index[j - 1] + 1) { continue; }
+
+                if(FPick && FPickID >= 0) { FPick->AddSegment((float)P.X[j - 1], (float)P.Y[j - 1], (float)P.X[j], (float)P.Y[j], FPickID); }
+
+                FCanvas->Line(P.X[j - 1], P.Y[j - 1], P.X[j], P.Y[j], Colors ? Colors[b + P.Index[j]] : Const);
+            }
+        }
+    }
+
+    if(B) { FSplatter.End(); }
+}
+
+void Canvas3D::Points3D(const float* xyz, int Count, int Color, const int* Colors)
+{
+    if(FCommands) { FCommands->AddPoints(xyz, Count, Color, Colors); return; }
+
+    mtx4 m = FView * FProj;
+
+    const int w = (FVpW > 0) ? FVpW : FCanvas->GetWidth();
+    const int h = (FVpH > 0) ? FVpH : FCanvas->GetHeight();
+
+    Bitmap* B = (FPick && FPickID >= 0) ? NULL : FCanvas->GetBitmap();
+
+    if(B)
+    {
+        FSplatter.Begin(B, FPointMode, FPointSize);
+        FSplatter.Add(m, xyz, Count, Color, Colors, FVpX, FVpY, w, h);
+        FSplatter.End();
+        return;
+    }
+
+    ProjectedPoints P;
+
+    for(int b = 0 ; b < Count ; b += ProjectedPoints::BatchSize)
+    {
+        project_points(P, m, xyz + 3 * b, std::min((int)ProjectedPoints::BatchSize, Count - b), w, h, FVpX, FVpY, true);
+
+        for(int j = 0 ; j < P.Count ; j++)
+        {
+            if(FPick && FPickID >= 0) { FPick->AddPoint((float)P.X[j], (float)P.Y[j], FPickID); }
+
+            FCanvas->SetPixel(P.X[j], P.Y[j], Colors ? Colors[b + P.Index[j]] : Color);
+        }
+    }
+}
+
+void Canvas3D::NdcToViewport(vec3& p) const
+{
+    int w = (FVpW > 0) ? FVpW : FCanvas->GetWidth();
+    int h = (FVpH > 0) ? FVpH : FCanvas->GetHeight();
+
+    canvas_ndc_to_fb(p, (w-1)/2, (h-1)/2);
+
+    p.x += (float)FVpX;
+    p.y += (float)FVpY;
+}
+
+void Canvas3D::SetViewport(int x, int y, int w, int h)
+{
+    if(w <= 0 || h <= 0)
+    {
+        FVpX = FVpY = FVpW = FVpH = 0;
+        FCanvas->SetClipRect(0, 0, FCanvas->GetWidth(), FCanvas->GetHeight());
+        return;
+    }
+
+    FVpX = x; FVpY = y;
+    FVpW = w; FVpH = h;
+    FCanvas->SetClipRect(x, y, w, h);
+}
+
+void Canvas3D::ExecuteViews(const DrawCommandBuffer& B, const Viewport3D* Views, int Count)
+{
+    for(int i = 0 ; i < Count ; i++)
+    {
+        SetViewport(Views[i].X, Views[i].Y, Views[i].W, Views[i].H);
+        SetMatrices(Views[i].Proj, Views[i].View);
+        Execute(B, false);
+    }
+
+    SetViewport(0, 0, 0, 0);
+}
+
+/// One view of ViewportRenderer::Render(), drawn through a private Bitmap view and canvas pair
+struct ViewportTask
+{
+    Bitmap* Target;
+    const DrawCommandBuffer* Commands;
+    const Viewport3D* Views;
+    ViewportRenderer::ViewCanvas* const* Canvases;
+    bool DepthTest;
+
+    void operator()(int i) const
+    {
+        const Viewport3D& V = Views[i];
+
+        // the view is built here, so it sees the current state of Target (clear color, layout)
+        Bitmap View(Target, V.X, V.Y, V.W, V.H);
+
+        Canvas2D_Bitmap* C2 = &Canvases[i]->C2;
+        Canvas3D* C3 = &Canvases[i]->C3;
+        C2->FDest = &View;
+
+        C3->FDepthTest = DepthTest;
+        C3->SetViewport(V.X, V.Y, V.W, V.H);
+        C3->SetMatrices(V.Proj, V.View);
+        C3->Execute(*Commands, false);
+
+        // not owned by the canvas
+        C2->FDest = NULL;
+    }
+};
+
+ViewportRenderer::~ViewportRenderer()
+{
+    for(size_t i = 0 ; i < FViews.size() ; i++)
+        delete FViews[i];
+}
+
+void ViewportRenderer::Render(Bitmap* Target, const DrawCommandBuffer& B, const Viewport3D* Views, int Count, bool DepthTest)
+{
+    while((int)FViews.size() < Count)
+        FViews.push_back(new ViewCanvas);
+
+    if(Count <= 0) { return; }
+
+    ViewportTask Task;
+    Task.Target    = Target;
+    Task.Commands  = &B;
+    Task.Views     = Views;
+    Task.Canvases  = &FViews[0];
+    Task.DepthTest = DepthTest;
+
+    parallel_for(Count, Task);
+}
+
+/// One band of ViewportRenderer::RenderBands()
+struct BandTask
+{
+    Bitmap* Target;
+    const DrawCommandBuffer* Commands;
+    ViewportRenderer::ViewCanvas* const* Canvases;
+    int BandHeight;
+    bool DepthTest;
+
+    void operator()(int i) const
+    {
+        // the clip rectangles of the recording stay inside the view
+        Bitmap View(Target, 0, i * BandHeight, Target->Width, BandHeight);
+
+        Canvas2D_Bitmap* C2 = &Canvases[i]->C2;
+        Canvas3D* C3 = &Canvases[i]->C3;
+        C2->FDest = &View;
+
+        C3->FDepthTest = DepthTest;
+        C3->SetViewport(0, 0, 0, 0);
+        C3->Execute(*Commands);
+
+        C2->FDest = NULL;
+    }
+};
+
+void ViewportRenderer::RenderBands(Bitmap* Target, const DrawCommandBuffer& B, bool DepthTest)
+{
+    const int N = ThreadPool::Global().GetNumThreads();
+    const int H = Target->Height;
+
+    int BandHeight = ((H + N - 1) / N + BITMAP_TRACK_SIZE - 1) & ~(BITMAP_TRACK_SIZE - 1);
+    if(BandHeight < BITMAP_TRACK_SIZE) { BandHeight = BITMAP_TRACK_SIZE; }
+
+    const int Count = (H + BandHeight - 1) / BandHeight;
+
+    while((int)FViews.size() < Count)
+        FViews.push_back(new ViewCanvas);
+
+    if(Count <= 0) { return; }
+
+    BandTask Task;
+    Task.Target     = Target;
+    Task.Commands   = &B;
+    Task.Canvases   = &FViews[0];
+    Task.BandHeight = BandHeight;
+    Task.DepthTest  = DepthTest;
+
+    parallel_for(Count, Task);
+}
+
+void render_viewports(Bitmap* Target, const DrawCommandBuffer& B, const Viewport3D* Views, int Count, bool DepthTest)
+{
+    ViewportRenderer R;
+    R.Render(Target, B, Views, Count, DepthTest);
+}
+
+/// Filters a band of rows of one render_supersampled() strip
+struct DownsampleTask
+{
+    Bitmap* Target;
+    const Bitmap* Strip;
+    int SrcY, Factor, Filter;
+    int Y0, Y1;
+
+    void operator()(int i) const
+    {
+        int y0 = Y0 + i * BITMAP_TRACK_SIZE;
+        int y1 = std::min(y0 + BITMAP_TRACK_SIZE, Y1);
+
+        Target->Downsample(*Strip, SrcY, Factor, Filter, y0, y1);
+    }
+};
+
+void render_supersampled(Bitmap* Target, const DrawCommandBuffer& B, int Factor, int Filter, bool DepthTest, size_t StripBytes)
+{
+    const int F = (Factor >= 4) ? 4 : 2;
+    const int W = Target->Width, H = Target->Height;
+    const int SW = W * F;
+
+    // the tent reaches half a pixel into the rows above and below a strip, so these are drawn too
+    const int Guard = (Filter == DOWNSAMPLE_TENT) ? 1 : 0;
+
+    // output rows per strip, whole tracking cells so that parallel bands never share one
+    const size_t RowBytes = (size_t)SW * F * (3 + (DepthTest ? sizeof(float) : 0));
+    int Rows = (int)(StripBytes / RowBytes) - 2 * Guard;
+    Rows = std::max(Rows & ~(BITMAP_TRACK_SIZE - 1), (int)BITMAP_TRACK_SIZE);
+
+    const int MaxSH = (std::min(Rows, H) + 2 * Guard) * F;
+    std::vector<unsigned char> Pixels((size_t)SW * MaxSH * 3);
+    std::vector<float> Depth(DepthTest ? (size_t)SW * MaxSH : 0);
+    std::vector<unsigned char> Row(W * 3), Above(W * 3);
+
+    for(int y0 = 0 ; y0 < H ; y0 += Rows)
+    {
+        const int y1 = std::min(y0 + Rows, H);
+
+        // output rows covered by the strip and its place in the large image
+        const int r0 = std::max(y0 - Guard, 0), r1 = std::min(y1 + Guard, H);
+        const int SrcY = r0 * F, SH = (r1 - r0) * F;
+
+        // background: the target pixels repeated F x F times
+        for(int r = r0 ; r < r1 ; r++)
+        {
+            // the guard row above was already filtered by the previous strip, its background was kept
+            if(r < y0)
+                memcpy(&Row[0], &Above[0], W * 3);
+            else
+                Target->ReadRow(0, r, W, &Row[0]);
+
+            unsigned char* d = &Pixels[(size_t)(r - r0) * F * SW * 3];
+            for(int x = 0 ; x < W ; x++)
+                for(int k = 0 ; k < F ; k++, d += 3)
+                    { d[0] = Row[x * 3]; d[1] = Row[x * 3 + 1]; d[2] = Row[x * 3 + 2]; }
+
+            for(int k = 1 ; k < F ; k++)
+                memcpy(&Pixels[(size_t)((r - r0) * F + k) * SW * 3], &Pixels[(size_t)(r - r0) * F * SW * 3], SW * 3);
+        }
+
+        // the 2D canvas owns (and deletes) the strip bitmap, the buffers stay ours
+        Bitmap* Strip = new Bitmap(&Pixels[0], SW, SH);
+        if(DepthTest)
+        {
+            Strip->ZB = &Depth[0];
+            Strip->ClearDepth();
+        }
+
+        Canvas2D_Bitmap C2(Strip);
+        Canvas3D C3(&C2);
+
+        // the viewport is the whole large image, shifted so that the strip is visible
+        C3.FDepthTest = DepthTest;
+        C3.SetViewport(0, -SrcY, SW, H * F);
+
+        // the 2D commands are placed the same way
+        C3.F2DScale = F;
+        C3.F2DY     = -SrcY;
+        C3.Execute(B);
+
+        if(Guard) { Target->ReadRow(0, y1 - 1, W, &Above[0]); }
+
+        DownsampleTask Task;
+        Task.Target = Target;
+        Task.Strip  = Strip;
+        Task.SrcY   = SrcY;
+        Task.Factor = F;
+        Task.Filter = Filter;
+        Task.Y0     = y0;
+        Task.Y1     = y1;
+
+        parallel_for((y1 - y0 + BITMAP_TRACK_SIZE - 1) / BITMAP_TRACK_SIZE, Task);
+    }
+}
+
+void Canvas3D::Flush()
+{
+    DrawCommandBuffer* B = FCommands;
+    if(!B) { return; }
+
+    FCommands = NULL;
+    Execute(*B);
+    B->Clear();
+    FCommands = B;
+}
+
+void Canvas3D::Execute(const DrawCommandBuffer& B, bool ApplyMatrices)
+{
+    // placement of the 2D commands
+    const int S = F2DScale, OX = F2DX, OY = F2DY;
+
+    for(DrawCommandBuffer::Iterator i = B.Iterate() ; i.Cmd ; i.Advance())
+    {
+        switch(i.Cmd->Type)
+        {
+            case DRAW_MATRICES:
+            {
+                const DrawMatricesCmd* C = DrawCommandBuffer::Payload<DrawMatricesCmd>(i.Cmd);
+                if(ApplyMatrices) { SetMatrices(C->Proj, C->View); }
+                break;
+            }
+            case DRAW_LINE:
+            {
+                const DrawLineCmd* C = DrawCommandBuffer::Payload<DrawLineCmd>(i.Cmd);
+                Line3D(C->P1, C->P2, C->Color);
+                break;
+            }
+            case DRAW_ARROW:
+            {
+                const DrawArrowCmd* C = DrawCommandBuffer::Payload<DrawArrowCmd>(i.Cmd);
+                Arrow3D(C->P1, C->P2, C->TipSize, C->LineColor, C->TipColor);
+                break;
+            }
+            case DRAW_FRAME:
+            {
+                const DrawFrameCmd* C = DrawCommandBuffer::Payload<DrawFrameCmd>(i.Cmd);
+                Frame3D(C->Base, C->Mtx, C->Size, C->Colors[0], C->Colors[1], C->Colors[2]);
+                break;
+            }
+            case DRAW_FRAMES:
+            {
+                const DrawFramesCmd* C = DrawCommandBuffer::Payload<DrawFramesCmd>(i.Cmd);
+                Frames3D(DrawCommandBuffer::FramesPoses(C), C->Count, C->Size, C->Colors[0], C->Colors[1], C->Colors[2]);
+                break;
+            }
+            case DRAW_ARROWS:
+            {
+                const DrawArrowsCmd* C = DrawCommandBuffer::Payload<DrawArrowsCmd>(i.Cmd);
+                const vec3* P = DrawCommandBuffer::ArrowsPoints(C);
+                Arrows3D(P, P + C->Count, C->Count, C->TipSize, C->LineColor, C->TipColor);
+                break;
+            }
+            case DRAW_BEZIER:
+            {
+                const DrawBezierCmd* C = DrawCommandBuffer::Payload<DrawBezierCmd>(i.Cmd);
+                Bezier3D(C->P[0], C->P[1], C->P[2], C->P[3], C->Color);
+                break;
+            }
+            case DRAW_CLEAR:
+            {
+                FCanvas->Clear(DrawCommandBuffer::Payload<DrawClearCmd>(i.Cmd)->Color);
+                break;
+            }
+            case DRAW_LINE2D:
+            {
+                const DrawLine2DCmd* C = DrawCommandBuffer::Payload<DrawLine2DCmd>(i.Cmd);
+                FCanvas->Line(C->X1 * S + OX, C->Y1 * S + OY, C->X2 * S + OX, C->Y2 * S + OY, C->Color);
+                break;
+            }
+            case DRAW_LINE_STYLED:
+            {
+                const DrawLineStyledCmd* C = DrawCommandBuffer::Payload<DrawLineStyledCmd>(i.Cmd);
+                Line3DStyled(C->P1, C->P2, C->Color, C->Style);
+                break;
+            }
+            case DRAW_LINE2D_STYLED:
+            {
+                const DrawLine2DStyledCmd* C = DrawCommandBuffer::Payload<DrawLine2DStyledCmd>(i.Cmd);
+                FCanvas->LineStyled(C->X1 * S + OX, C->Y1 * S + OY, C->X2 * S + OX, C->Y2 * S + OY, C->Color, C->Style);
+                break;
+            }
+            case DRAW_PIXEL:
+            {
+                const DrawPixelCmd* C = DrawCommandBuffer::Payload<DrawPixelCmd>(i.Cmd);
+                for(int y = 0 ; y < S ; y++)
+                    for(int x = 0 ; x < S ; x++)
+                        FCanvas->SetPixel(C->X * S + OX + x, C->Y * S + OY + y, C->Color);
+                break;
+            }
+            case DRAW_TRIANGLE2D:
+            {
+                const DrawTriangle2DCmd* C = DrawCommandBuffer::Payload<DrawTriangle2DCmd>(i.Cmd);
+
+                float X[3], Y[3];
+                for(int k = 0 ; k < 3 ; k++)
+                {
+                    X[k] = C->X[k] * (float)S + (float)OX;
+                    Y[k] = C->Y[k] * (float)S + (float)OY;
+                }
+
+                if(C->UseZ)
+                    FCanvas->FillTriangleZ(X[0], Y[0], C->Z[0], X[1], Y[1], C->Z[1], X[2], Y[2], C->Z[2], C->Color);
+                else
+                    FCanvas->FillTriangle(X[0], Y[0], X[1], Y[1], X[2], Y[2], C->Color);
+                break;
+            }
+            case DRAW_TEXT2D:
+            {
+                const DrawText2DCmd* C = DrawCommandBuffer::Payload<DrawText2DCmd>(i.Cmd);
+                FCanvas->Text(C->X * S + OX, C->Y * S + OY, (const char*)(C + 1), C->Color, C->Scale * S);
+                break;
+            }
+            case DRAW_CLIP_RECT:
+            {
+                const DrawClipRectCmd* C = DrawCommandBuffer::Payload<DrawClipRectCmd>(i.Cmd);
+                FCanvas->SetClipRect(C->X * S + OX, C->Y * S + OY, C->W * S, C->H * S);
+                break;
+            }
+            case DRAW_POINT:
+            {
+                const DrawPointCmd* C = DrawCommandBuffer::Payload<DrawPointCmd>(i.Cmd);
+                Pt3D(C->Pt, C->Size, C->Color);
+                break;
+            }
+            case DRAW_TRIANGLE:
+            {
+                const DrawTriangleCmd* C = DrawCommandBuffer::Payload<DrawTriangleCmd>(i.Cmd);
+                Triangle3D(C->P[0], C->P[1], C->P[2], C->Color);
+                break;
+            }
+            case DRAW_TEXT:
+            {
+                const DrawTextCmd* C = DrawCommandBuffer::Payload<DrawTextCmd>(i.Cmd);
+                Text3D(C->P, (const char*)(C + 1), C->Color, C->Dx, C->Dy);
+                break;
+            }
+            case DRAW_PICK_ID:
+            {
+                const DrawPickIDCmd* C = DrawCommandBuffer::Payload<DrawPickIDCmd>(i.Cmd);
+                SetPickID(C->ID);
+                break;
+            }
+            case DRAW_POINT_CLOUD:
+            {
+                const DrawPointCloudCmd* C = DrawCommandBuffer::Payload<DrawPointCloudCmd>(i.Cmd);
+                PointCloud3D(*C->File, C->Color);
+                break;
+            }
+            case DRAW_POINTS:
+            {
+                const DrawPointsCmd* C = DrawCommandBuffer::Payload<DrawPointsCmd>(i.Cmd);
+                Points3D(C->XYZ, C->Count, C->Color, C->Colors);
+                break;
+            }
+            case DRAW_PLANE:
+            {
+                const DrawPlaneCmd* C = DrawCommandBuffer::Payload<DrawPlaneCmd>(i.Cmd);
+                Plane(C->P, C->V1, C->V2, C->Step1, C->Step2, C->NumX, C->NumY, C->Color);
+                break;
+            }
+            default:
+                break;
+        }
+    }
+}
+
 void Canvas2D_Bitmap::SetPixel(int x, int y, int color)
 {
+    if(FCommands) { FCommands->AddPixel(x, y, color); return; }
+
     FDest->SetPixel(x, y, color);
 }
 
 void Canvas2D_Bitmap::Line(int x1, int y1, int x2, int y2, int color)
 {
+    if(FCommands) { FCommands->AddLine2D(x1, y1, x2, y2, color); return; }
+
     FDest->Line(x1, y1, x2, y2, color);
 }
 
+void Canvas2D_Bitmap::LineStyled(int x1, int y1, int x2, int y2, int color, const LineStyle& Style)
+{
+    if(FCommands) { FCommands->AddLine2DStyled(x1, y1, x2, y2, color, Style); return; }
+
+    FDest->Line(x1, y1, x2, y2, color, Style);
+}
+
+void Canvas2D_Bitmap::FillTriangle(float x0, float y0, float x1, float y1, float x2, float y2, int color)
+{
+    if(FCommands)
+    {
+        const float X[3] = { x0, x1, x2 }, Y[3] = { y0, y1, y2 };
+        FCommands->AddTriangle2D(X, Y, NULL, color);
+        return;
+    }
+
+    FDest->FillTriangle(x0, y0, x1, y1, x2, y2, color);
+}
+
+void Canvas2D_Bitmap::FillTriangleZ(float x0, float y0, float z0, float x1, float y1, float z1, float x2, float y2, float z2, int color)
+{
+    if(FCommands)
+    {
+        const float X[3] = { x0, x1, x2 }, Y[3] = { y0, y1, y2 }, Z[3] = { z0, z1, z2 };
+        FCommands->AddTriangle2D(X, Y, Z, color);
+        return;
+    }
+
+    FDest->FillTriangleZ(x0, y0, z0, x1, y1, z1, x2, y2, z2, color);
+}
+
+void Canvas2D_Bitmap::FillPolygon(const float* xy, int Count, int color)
+{
+    // recorded as the triangle fan Bitmap::FillPolygon draws
+    if(FCommands) { iCanvas2D::FillPolygon(xy, Count, color); return; }
+
+    FDest->FillPolygon(xy, Count, color);
+}
+
+void Canvas2D_Bitmap::Text(int x, int y, const char* text, int color, int scale)
+{
+    if(FCommands) { FCommands->AddText2D(x, y, text, color, scale); return; }
+
+    FDest->Text(x, y, text, color, scale);
+}
+
+void Canvas2D_Bitmap::SetClipRect(int x, int y, int w, int h)
+{
+    if(FCommands) { FCommands->AddClipRect(x, y, w, h); return; }
+
+    FDest->SetClipRect(x, y, w, h);
+}
+
+void Canvas2D_Bitmap::Blit(const Bitmap& Src, int x, int y, int Alpha, int Key)
+{
+    if(Key < 0)
+    {
+        FDest->BlitAlpha(Src, Alpha, x, y);
+        return;
+    }
+
+    if(Alpha >= 255)
+    {
+        FDest->BlitKeyed(Src, Key, x, y);
+        return;
+    }
+
+    if(Alpha <= 0) { return; }
+
+    // keyed and blended at once: rare, done per pixel
+    for(int j = 0 ; j < Src.Height ; j++)
+        for(int i = 0 ; i < Src.Width ; i++)
+        {
+            int s = Src.GetPixel(i, j);
+            if(s == Key) { continue; }
+
+            int d = FDest->GetPixel(x + i, y + j), c = 0;
+
+            for(int Shift = 0 ; Shift < 24 ; Shift += 8)
+                c |= (((((s >> Shift) & 0xFF) * Alpha) + (((d >> Shift) & 0xFF) * (255 - Alpha))) / 255) << Shift;
+
+            FDest->SetPixel(x + i, y + j, c);
+        }
+}
+
+void Canvas2D_Bitmap::BlitScaled(const Bitmap& Src, int x, int y, int w, int h, int Filter)
+{
+    FDest->BlitScaled(Src, x, y, w, h, 0, 0, Src.Width, Src.Height, Filter);
+}
+
 void Canvas2D_Bitmap::Clear(int color)
 {
+    if(FCommands) { FCommands->AddClear(color); return; }
+
     FDest->Clear(color);
 }
 
@@ -127,6 +1157,14 @@ int Canvas2D_Bitmap::GetHeight() const { return FDest->Height; }
 
 //// Camera positioning
 
+static bool same_transform(const mtx4& A, const mtx4& B)
+{
+    for(int i = 0 ; i < 16 ; i++)
+        if(A.x[i] != B.x[i]) { return false; }
+
+    return true;
+}
+
 void PanOrbitPositioner::SetMouse(float x, float y)
 {
     FLastMouse = FMouse;
@@ -139,6 +1177,51 @@ void PanOrbitPositioner::SetMouse(float x, float y)
 }
 
 void PanOrbitPositioner::Update( float dt )
+{
+    ReadInput();
+    MakeStep( dt );
+
+    FRenderTransform = FCurrentTransform;
+}
+
+void PanOrbitPositioner::Advance( float RealDt )
+{
+    if ( RealDt > FMaxFrameTime ) { RealDt = FMaxFrameTime; }
+    if ( RealDt < 0.0f )          { RealDt = 0.0f; }
+
+    FAccumulator += RealDt;
+
+    bool First = true;
+
+    while ( FAccumulator >= FFixedStep )
+    {
+        FPrevTarget          = FTarget;
+        FPrevSphericalCoords = FSphericalCoords;
+        FPrevViewDistance    = FViewDistance;
+
+        // the wheel ticks and the mouse delta are impulses: only the first step gets them
+        if ( First ) { ReadInput(); } else { FZoomIn = FZoomOut = 0.0f; }
+        First = false;
+
+        MakeStep( FFixedStep );
+
+        FAccumulator -= FFixedStep;
+    }
+
+    // blend the last two states by the fraction of a step already elapsed
+    float Alpha = FAccumulator / FFixedStep;
+
+    vec3  Target    = FPrevTarget + Alpha * ( FTarget - FPrevTarget );
+    vec3  Spherical = FPrevSphericalCoords + Alpha * ( FSphericalCoords - FPrevSphericalCoords );
+    float Distance  = FPrevViewDistance + Alpha * ( FViewDistance - FPrevViewDistance );
+
+    mtx4 Old = FRenderTransform;
+    BuildTransform( FRenderTransform, Target, Spherical, Distance );
+
+    if ( !same_transform( Old, FRenderTransform ) ) { FChanged = true; }
+}
+
+void PanOrbitPositioner::ReadInput()
 {
     FZoomOut = FZoomIn = 0.0f;
 
@@ -151,8 +1234,6 @@ void PanOrbitPositioner::Update( float dt )
         FZoomOut = std::min( ( ( float )FWheelTicks ) * 0.1f, 0.0f );
         FWheelTicks = 0;
     }
-
-    MakeStep( dt );
 }
 
 void PanOrbitPositioner::Reset()
@@ -170,6 +1251,15 @@ void PanOrbitPositioner::Reset()
     diag(FCurrentTransform, 1);
 
     MakeStep( 0.0f );
+
+    FPrevTarget          = FTarget;
+    FPrevSphericalCoords = FSphericalCoords;
+    FPrevViewDistance    = FViewDistance;
+
+    FAccumulator     = 0.0f;
+    FRenderTransform = FCurrentTransform;
+
+    FChanged = true;
 }
 
 void PanOrbitPositioner::MakeStep( float dt )
@@ -227,23 +1317,30 @@ void PanOrbitPositioner::MakeStep( float dt )
         FTarget = FTarget - delta;
     }
 
-    /// get polar vector in cartesian space
-    mtx4 ViewTrans = translate(0.0f, 0.0f, -FViewDistance);
-
-    float Angle2 = deg2rad( FSphericalCoords.z );
-    float Angle1 = deg2rad( FSphericalCoords.y - 90.0f );
+    mtx4 Old = FCurrentTransform;
+    BuildTransform( FCurrentTransform, FTarget, FSphericalCoords, FViewDistance );
 
-    mtx4 RotY, RotZ;
-    vec3 MinusX ( 1, 0, 0 );
+    if ( !same_transform( Old, FCurrentTransform ) ) { FChanged = true; }
 
-    rotate_matrix_axis( RotY, Angle2, MinusX );
-    rotate_matrix_axis( RotZ, Angle1, FUpVector );
+    /// what decompose_camera_transform() returns, in closed form: -Target + Distance * (third column of the rotation)
+    FViewerPosition = vec3( MTX4_ELT(FCurrentTransform, 0, 2), MTX4_ELT(FCurrentTransform, 1, 2), MTX4_ELT(FCurrentTransform, 2, 2) );
+    FViewerPosition *= FViewDistance;
+    FViewerPosition = FViewerPosition - FTarget;
 
-    mtx4 m = RotZ * RotY * ViewTrans;
+    FMouseDelta.x = FMouseDelta.y = 0;
+}
 
-    FCurrentTransform = translate(FTarget.x, FTarget.y, FTarget.z) * m;
+void PanOrbitPositioner::BuildTransform( mtx4& Out, const vec3& Target, const vec3& Spherical, float Distance ) const
+{
+    /// orbit rotation: turn around the up vector, then tilt around X
+    quat q = quat_from_axis_angle( vec3( 1, 0, 0 ), deg2rad( Spherical.z ) ) *
+             quat_from_axis_angle( FUpVector, deg2rad( Spherical.y - 90.0f ) );
 
-    decompose_camera_transform( FCurrentTransform, FViewerPosition, m );
+    quat_to_matrix( Out, q );
 
-    FMouseDelta.x = FMouseDelta.y = 0;
+    /// translation row of translate(Target) * R * translate(0, 0, -Distance)
+    vec3 t = Target;
+    MTX4_ELT(Out, 3, 0) = t.x * MTX4_ELT(Out, 0, 0) + t.y * MTX4_ELT(Out, 1, 0) + t.z * MTX4_ELT(Out, 2, 0);
+    MTX4_ELT(Out, 3, 1) = t.x * MTX4_ELT(Out, 0, 1) + t.y * MTX4_ELT(Out, 1, 1) + t.z * MTX4_ELT(Out, 2, 1);
+    MTX4_ELT(Out, 3, 2) = t.x * MTX4_ELT(Out, 0, 2) + t.y * MTX4_ELT(Out, 1, 2) + t.z * MTX4_ELT(Out, 2, 2) - Distance;
 }
@@ -2,6 +2,11 @@
 
 #include "vecmath.h"
 #include "Bitmap.h"
+#include "CommandBuffer.h"
+#include "Picking.h"
+#include "PointCloud.h"
+#include "PointSplat.h"
+#include "quat.h"
 
 struct iCanvas2D
 {
@@ -12,11 +17,47 @@ struct iCanvas2D
     
     virtual void Line(int x1, int y1, int x2, int y2, int color) = 0;
 
+    /// Line with a stipple pattern and a color gradient (see LineStyle, the fog is applied by Canvas3D).
+    /// The default implementation walks the line with SetPixel()
+    virtual void LineStyled(int x1, int y1, int x2, int y2, int color, const LineStyle& Style);
+
     virtual void Clear(int color) = 0;
 
     virtual int GetWidth()  const = 0;
     virtual int GetHeight() const = 0;
 
+    /// Filled triangle in pixel coordinates. The default implementation draws horizontal spans with Line()
+    virtual void FillTriangle(float x0, float y0, float x1, float y1, float x2, float y2, int color);
+
+    /// Depth-tested triangle (z in [0..1], smaller is nearer). Targets without a depth buffer ignore z
+    virtual void FillTriangleZ(float x0, float y0, float z0, float x1, float y1, float z1, float x2, float y2, float z2, int color)
+    {
+        this->FillTriangle(x0, y0, x1, y1, x2, y2, color);
+    }
+
+    /// Filled convex polygon, xy holds Count (x, y) pairs
+    virtual void FillPolygon(const float* xy, int Count, int color)
+    {
+        for(int i = 1 ; i + 1 < Count ; i++)
+            this->FillTriangle(xy[0], xy[1], xy[2 * i], xy[2 * i + 1], xy[2 * i + 2], xy[2 * i + 3], color);
+    }
+
+    /// Text with the built-in font (Font.h), top-left corner at (x, y). The default implementation goes through SetPixel()
+    virtual void Text(int x, int y, const char* text, int color, int scale = 1);
+
+    /// Copy a bitmap to (x, y). Key >= 0 makes pixels of that color transparent, Alpha < 255 blends with constant opacity.
+    /// The default implementation goes through SetPixel() and, as it cannot read the target back, draws opaque
+    virtual void Blit(const Bitmap& Src, int x, int y, int Alpha = 255, int Key = -1);
+
+    /// Scale a bitmap into the (x, y, w, h) rectangle. The default implementation samples the nearest pixel
+    virtual void BlitScaled(const Bitmap& Src, int x, int y, int w, int h, int Filter = BLIT_NEAREST);
+
+    /// Restrict drawing (including Clear) to the (x, y, w, h) rectangle. Targets without clipping ignore it
+    virtual void SetClipRect(int x, int y, int w, int h) {}
+
+    /// The bitmap behind the canvas, if any (lets bulk primitives such as point clouds write it directly)
+    virtual Bitmap* GetBitmap() { return NULL; }
+
     virtual void LineW(float x1, float y1, float x2, float y2, int color)
     {
         this->Line(XToScreen(x1), YToScreen(y1), XToScreen(x2), YToScreen(y2), color);
@@ -33,9 +74,18 @@ struct iCanvas2D
     float XOfs, YOfs;
 };
 
+struct GlyphTemplate;
+
+/// One view of a scene: a rectangle of the canvas with its own camera
+struct Viewport3D
+{
+    int X, Y, W, H;
+    mtx4 Proj, View;
+};
+
 struct Canvas3D
 {
-    Canvas3D(iCanvas2D* C): FCanvas(C) {}
+    Canvas3D(iCanvas2D* C): FCanvas(C), FCommands(NULL), FDepthTest(false), FPick(NULL), FPickID(-1), FVpX(0), FVpY(0), FVpW(0), FVpH(0), F2DScale(1), F2DX(0), F2DY(0), FPointMode(SPLAT_OVERWRITE), FPointSize(1), FCurveTolerance(0.5f) {}
 
     virtual void Arrow3D(const vec3& p1, const vec3& p2, float size, int lineColor, int tipColor);
     virtual void Frame3D(const vec3& base, const mtx4& mtx, float size, int Xcolor, int Ycolor, int Zcolor);
@@ -43,38 +93,232 @@ struct Canvas3D
 
     void Pt3D(const vec3& pt, float sz, int color);
 
+    /// Many Frame3D()s at once. Frame i has its axes in the first three rows of Poses[i] (scaled by Size) and its
+    /// origin in the last row, i.e. Frame3D(base, mtx) is the pose with mtx's rotation rows and base.
+    /// Every frame is one precomputed glyph transformed by a single matrix; unlike Frame3D() the tips keep a fixed
+    /// orientation relative to their frame. In deferred mode the poses are copied
+    void Frames3D(const mtx4* Poses, int Count, float Size, int Xcolor, int Ycolor, int Zcolor);
+
+    /// Same from positions, unit orientations and per-frame sizes (Scales may be NULL for size 1)
+    void Frames3D(const vec3* Positions, const quat* Orientations, const float* Scales, int Count, int Xcolor, int Ycolor, int Zcolor);
+
+    /// Many Arrow3D(From[i], To[i])s at once (the tips are at From, as in Arrow3D). In deferred mode the points are copied
+    void Arrows3D(const vec3* From, const vec3* To, int Count, float TipSize, int LineColor, int TipColor);
+
+    /// Cubic Bezier curve. It is tessellated at draw time (so also in deferred mode) into as many segments as its
+    /// projection needs to stay within FCurveTolerance pixels of the true curve: far or small curves get a few
+    /// segments, parts outside the view frustum get none. Parts behind the camera are skipped
+    void Bezier3D(const vec3& p0, const vec3& p1, const vec3& p2, const vec3& p3, int color);
+
+    /// Uniform Catmull-Rom spline through the Count points (the end points are repeated as outer neighbours)
+    void CatmullRom3D(const vec3* Points, int Count, int color);
+
+    /// Elliptic arc Center + U * cos(a) + V * sin(a) for a from Angle0 to Angle1 (radians). With perpendicular U and V
+    /// of equal length it is a circular arc. Drawn as cubic Beziers of at most 45 degrees each
+    void Arc3D(const vec3& Center, const vec3& U, const vec3& V, float Angle0, float Angle1, int color);
+
+    /// Circle around the Normal axis
+    void Circle3D(const vec3& Center, const vec3& Normal, float Radius, int color);
+
+    /// Wire sphere: NumMeridians half circles from pole to pole and NumParallels circles of latitude, the poles on the Z axis
+    void Sphere3D(const vec3& Center, float Radius, int color, int NumMeridians = 12, int NumParallels = 5);
+
+    /// Filled triangle. Triangles crossing the near or far plane are skipped
+    virtual void Triangle3D(const vec3& p1, const vec3& p2, const vec3& p3, int color);
+
+    /// Filled convex planar polygon
+    void Polygon3D(const vec3* pts, int Count, int color);
+
+    /// Points (or the polyline) of a mapped point cloud file. Chunks outside the frustum are skipped, the visible
+    /// ones are prefetched ahead and transformed in batches. Color < 0 uses the colors stored in the file (if any).
+    /// In deferred mode the file is referenced and must stay open until the commands are executed
+    void PointCloud3D(const PointCloudFile& F, int Color = -1);
+
+    /// Count points (xyz triples) drawn as FPointSize splats in FPointMode. Colors (one per point) may be NULL.
+    /// In deferred mode the arrays are referenced and must stay valid until the commands are executed
+    void Points3D(const float* xyz, int Count, int Color, const int* Colors = NULL);
+
+    /// Label at the projection of pt, shifted by (dx, dy) pixels. Labels behind the camera are skipped
+    virtual void Text3D(const vec3& pt, const char* text, int color, int dx = 0, int dy = 0);
+
     virtual void SetMatrices(const mtx4& Proj, const mtx4& View)
     {
+        if(FCommands) { FCommands->AddMatrices(Proj, View); return; }
+
         FView = View;
         FProj = Proj;
     }
 
     virtual void Line3D(const vec3& p1, const vec3& p2, int color);
 
+    /// Line with a LineStyle in a single call: stipple, gradient towards Style.EndColor and depth fog of the end points
+    void Line3DStyled(const vec3& p1, const vec3& p2, int color, const LineStyle& Style);
+
+    /// Record subsequent calls into the buffer instead of drawing them (NULL switches back to immediate drawing)
+    void SetCommandBuffer(DrawCommandBuffer* B) { FCommands = B; }
+
+    /// Draw everything recorded in the attached command buffer and empty it
+    void Flush();
+
+    /// Draw the commands immediately. Without ApplyMatrices recorded SetMatrices() calls are skipped,
+    /// so one recording can be drawn with different cameras
+    void Execute(const DrawCommandBuffer& B, bool ApplyMatrices = true);
+
+    /// Map the projection into the (x, y, w, h) rectangle of the canvas and clip drawing to it.
+    /// A width or height <= 0 selects the whole canvas
+    void SetViewport(int x, int y, int w, int h);
+
+    /// Draw the recorded geometry once per view, each with its own matrices (recorded matrices are skipped)
+    void ExecuteViews(const DrawCommandBuffer& B, const Viewport3D* Views, int Count);
+
+    /// Primitives drawn from now on belong to the object ID (for FPick). -1 excludes them from picking
+    void SetPickID(int ID)
+    {
+        if(FCommands) { FCommands->AddPickID(ID); return; }
+
+        FPickID = ID;
+    }
+
     iCanvas2D* FCanvas;
 
+    /// Deferred mode target, NULL for immediate drawing
+    DrawCommandBuffer* FCommands;
+
+    /// Fill triangles with FillTriangleZ (needs a depth buffer in the target, e.g. Bitmap::ZB)
+    bool FDepthTest;
+
     mtx4 FProj, FView;
+
+    /// Optional picking grid: lines, triangle edges and labels drawn with a pick ID are added to it
+    PickGrid* FPick;
+    int FPickID;
+
+    /// Current viewport, FVpW == 0 for the whole canvas
+    int FVpX, FVpY, FVpW, FVpH;
+
+    /// Placement of the recorded 2D commands (pixels, lines, triangles, text, clip rectangles) in Execute(): (x, y) is
+    /// drawn at (x * F2DScale + F2DX, y * F2DScale + F2DY), pixels as F2DScale x F2DScale blocks and text F2DScale times
+    /// larger. render_supersampled() sets it to match the enlarged, shifted viewport
+    int F2DScale, F2DX, F2DY;
+
+    /// How Points3D() and point clouds are drawn (PointSplatMode) and the splat size in pixels.
+    /// Bitmap targets go through FSplatter; other targets and picking fall back to 1x1 SetPixel() points
+    int FPointMode, FPointSize;
+    PointSplatter FSplatter;
+
+    /// Largest distance in pixels between a tessellated curve (Bezier3D() and the ones built on it) and its projection
+    float FCurveTolerance;
+
+protected:
+    /// Chunks of the point cloud being drawn that pass the frustum test (kept to reuse the memory)
+    std::vector<int> FVisibleChunks;
+
+    /// Normalized device coordinates -> canvas pixels of the current viewport
+    void NdcToViewport(vec3& p) const;
+
+    /// Projected segment of an instanced glyph
+    struct ScreenSegment { int X0, Y0, X1, Y1, Color; };
+
+    /// Project the glyph template with ObjectToClip and append its segments to Out
+    ScreenSegment* ProjectGlyph(ScreenSegment* Out, const GlyphTemplate& T, const mtx4& ObjectToClip, const int* Colors) const;
+
+    /// Rasterize projected segments in one pass (straight into the bitmap if the canvas has one)
+    void DrawSegments(const ScreenSegment* S, int Count);
+
+    /// Draw the part of a cubic with clip space control points C that lies inside the view frustum
+    void DrawClipBezier(const vec4* C, int color, int Depth);
 };
 
 /// Adapter of the Bitmap class for the Canvas2D interface (used in offscreen rendering). Redirects calls to Bitmap methods. By default the XScale/YScale are 1.0
 struct Canvas2D_Bitmap: public iCanvas2D
 {
-    Canvas2D_Bitmap(Bitmap* bmp): FDest(bmp) {}
+    Canvas2D_Bitmap(Bitmap* bmp): FDest(bmp), FCommands(NULL) {}
     virtual ~Canvas2D_Bitmap() { delete FDest; }
 
     virtual void SetPixel(int x, int y, int color);
 
     virtual void Line(int x1, int y1, int x2, int y2, int color);
+    virtual void LineStyled(int x1, int y1, int x2, int y2, int color, const LineStyle& Style);
+
+    virtual void FillTriangle(float x0, float y0, float x1, float y1, float x2, float y2, int color);
+    virtual void FillTriangleZ(float x0, float y0, float z0, float x1, float y1, float z1, float x2, float y2, float z2, int color);
+    virtual void FillPolygon(const float* xy, int Count, int color);
+
+    virtual void Text(int x, int y, const char* text, int color, int scale = 1);
+
+    virtual void Blit(const Bitmap& Src, int x, int y, int Alpha = 255, int Key = -1);
+    virtual void BlitScaled(const Bitmap& Src, int x, int y, int w, int h, int Filter = BLIT_NEAREST);
+
+    virtual void SetClipRect(int x, int y, int w, int h);
+
+    /// NULL while recording, so that bulk primitives do not bypass the command buffer
+    virtual Bitmap* GetBitmap() { return FCommands ? NULL : FDest; }
 
     virtual void Clear(int color);
 
     virtual int GetWidth()  const;
     virtual int GetHeight() const;
 
+    /// Record the drawing calls (Clear, SetPixel, the lines, the triangles, Text and SetClipRect) into the buffer instead of
+    /// drawing them, e.g. the same buffer a Canvas3D records into, so that 2D and 3D calls keep their order.
+    /// Canvas3D::Execute() draws them on its FCanvas, which must not be recording then. Blits are never recorded.
+    /// NULL switches back to immediate drawing
+    void SetCommandBuffer(DrawCommandBuffer* B) { FCommands = B; }
+
     // target for this canvas
     Bitmap* FDest;
+
+    /// Recording target, NULL for immediate drawing
+    DrawCommandBuffer* FCommands;
+};
+
+/// Draws the recorded geometry into several views of one bitmap, the views are drawn in parallel.
+/// Every thread draws through its own view of Target (see Bitmap(Bitmap*, x, y, w, h)), so views must not overlap.
+/// The canvases of the views (and their point splatting buffers) are kept between calls, so drawing every frame
+/// with the same renderer does not allocate once it has seen the largest number of views
+struct ViewportRenderer
+{
+    ViewportRenderer() {}
+    ~ViewportRenderer();
+
+    void Render(Bitmap* Target, const DrawCommandBuffer& B, const Viewport3D* Views, int Count, bool DepthTest = false);
+
+    /// Draws the recording (with its recorded matrices) over the whole Target, split into horizontal bands that are drawn
+    /// in parallel, one per thread of the pool. Bands are whole tracking cells, so whole tiles of BITMAP_TILED, and no two
+    /// threads write the same cache line of the tiled layout. Every band runs the whole recording (the transforms too)
+    /// clipped to its rows, so this pays off when the rasterization dominates
+    void RenderBands(Bitmap* Target, const DrawCommandBuffer& B, bool DepthTest = false);
+
+private:
+    /// Canvas pair of one view, FDest of C2 is set only during Render()
+    struct ViewCanvas
+    {
+        ViewCanvas(): C2(NULL), C3(&C2) {}
+
+        Canvas2D_Bitmap C2;
+        Canvas3D C3;
+    };
+
+    std::vector<ViewCanvas*> FViews;
+
+    friend struct ViewportTask;
+    friend struct BandTask;
+
+    ViewportRenderer(const ViewportRenderer&);
+    ViewportRenderer& operator=(const ViewportRenderer&);
 };
 
+/// One-shot ViewportRenderer::Render() (creates the canvases on every call)
+void render_viewports(Bitmap* Target, const DrawCommandBuffer& B, const Viewport3D* Views, int Count, bool DepthTest = false);
+
+/// Anti-aliased offline rendering: draw the recording (with its recorded matrices) Factor x Factor times larger
+/// (Factor 2 or 4) and filter it down into Target with a DownsampleFilter. The large image is drawn in horizontal
+/// strips of at most StripBytes each, so the memory use does not grow with the height of Target; the filtering
+/// of every strip runs in parallel bands. The current content of Target is the background. The recorded 2D commands
+/// are placed like in a normal render (see Canvas3D::F2DScale). Lines stay one (supersampled) pixel wide, so they come
+/// out thinner and fainter than in a normal render
+void render_supersampled(Bitmap* Target, const DrawCommandBuffer& B, int Factor = 2, int Filter = DOWNSAMPLE_BOX, bool DepthTest = false, size_t StripBytes = 16 << 20);
+
 /// Simple camera positioner for 3D rendering
 struct PanOrbitPositioner
 {
@@ -108,11 +352,23 @@ struct PanOrbitPositioner
         FUpVector.x = 0;
         FUpVector.y = 0;
         FUpVector.z = 1;
+
+        FFixedStep   = 0.02f;
+        FAccumulator = 0.0f;
+        FMaxFrameTime = 0.25f;
+
+        FChanged = true;
     }
 
     /// Read mouse, keyboard, joysticks and call MakeStep to update the state
     virtual void Update( float dt );
 
+    /// Fixed-step integration driven by real elapsed time: makes as many FFixedStep steps as fit into
+    /// RealDt plus the remainder of the previous call, then interpolates FRenderTransform between the last
+    /// two states. Input gathered in between is consumed by the first step, so the camera dynamics do not
+    /// depend on how often this is called
+    void Advance( float RealDt );
+
     /// Calculate initial transform for a given Up/Target/ViewPos triple
     virtual void Reset();
 
@@ -120,6 +376,21 @@ struct PanOrbitPositioner
 
     mtx4 FCurrentTransform;
 
+    /// Transform to render with (interpolated by Advance(), FCurrentTransform after Update()/Reset())
+    mtx4 FRenderTransform;
+
+    /// Step of Advance() in seconds
+    float FFixedStep;
+
+    /// Time not yet simulated by Advance()
+    float FAccumulator;
+
+    /// Longer frames are cut to this (avoids a burst of steps after a stall)
+    float FMaxFrameTime;
+
+    /// Set whenever FCurrentTransform or FRenderTransform changes, cleared by the user (e.g. after drawing a frame)
+    bool FChanged;
+
     bool MiddleButton;
     bool AltKey;
 
@@ -186,6 +457,16 @@ public:
     /// Internal update
     void MakeStep( float dt );
 
+    /// Turn the pending wheel/button state into zoom/orbit/pan amounts for MakeStep
+    void ReadInput();
+
+    /// Camera transform for the given target, spherical viewer coordinates and distance
+    void BuildTransform( mtx4& Out, const vec3& Target, const vec3& Spherical, float Distance ) const;
+
+    /// State before the last step of Advance(), for the interpolation
+    vec3  FPrevTarget, FPrevSphericalCoords;
+    float FPrevViewDistance;
+
     /// Current/Previous mouse positions
     vec3 FLastMouse, FMouse;
 };
@@ -0,0 +1,244 @@
+#include "Canvas.h"
+#include <math.h>
+
+/// Curves of Canvas3D. Everything is drawn as cubic Beziers. In clip space (before the division by w) the curve
+/// is still a polynomial cubic with the transformed control points, so their hull bounds it: pieces outside a
+/// frustum plane are culled exactly, pieces that are too big, too deep or crossing the camera plane are split
+/// in halves (de Casteljau). The remaining ones get their segment count from Wang's formula on the projected
+/// control points and are evaluated with forward differences.
+
+/// Deepest split of one curve and the largest segment count of an unsplit piece
+static const int BezierMaxDepth    = 16;
+static const int BezierMaxSegments = 128;
+
+/// Split the cubic at t = 1/2
+static void split_bezier(const vec4* C, vec4* L, vec4* R)
+{
+    vec4 m01 = 0.5f * (C[0] + C[1]);
+    vec4 m12 = 0.5f * (C[1] + C[2]);
+    vec4 m23 = 0.5f * (C[2] + C[3]);
+
+    vec4 m012 = 0.5f * (m01 + m12);
+    vec4 m123 = 0.5f * (m12 + m23);
+
+    vec4 Mid = 0.5f * (m012 + m123);
+
+    L[0] = C[0]; L[1] = m01;  L[2] = m012; L[3] = Mid;
+    R[0] = Mid;  R[1] = m123; R[2] = m23;  R[3] = C[3];
+}
+
+/// Pixel coordinate -> int, clamped to +-1e6 like clip_to_pixel() so that the conversion stays defined for points
+/// near the camera plane (NaN goes to the low end); the line clipping handles the rest
+static inline int to_pixel(float v)
+{
+    if(!(v >= -1.0e6f)) { return -1000000; }
+    if(v > 1.0e6f)      { return 1000000; }
+
+    return (int)v;
+}
+
+/// Outside flags of a clip space point for the six frustum planes
+static inline int clip_outcode(const vec4& p)
+{
+    return (p.x < -p.w ?  1 : 0) | (p.x > p.w ?  2 : 0) |
+           (p.y < -p.w ?  4 : 0) | (p.y > p.w ?  8 : 0) |
+           (p.z < -p.w ? 16 : 0) | (p.z > p.w ? 32 : 0);
+}
+
+void Canvas3D::DrawClipBezier(const vec4* C, int color, int Depth)
+{
+    int Outside = ~0;
+    float MinW = C[0].w, MaxW = C[0].w;
+
+    for(int i = 0 ; i < 4 ; i++)
+    {
+        Outside &= clip_outcode(C[i]);
+
+        if(C[i].w < MinW) { MinW = C[i].w; }
+        if(C[i].w > MaxW) { MaxW = C[i].w; }
+    }
+
+    // all control points beyond one plane
+    if(Outside) { return; }
+
+    const bool CanSplit = (Depth < BezierMaxDepth);
+    vec4 L[4], R[4];
+
+    // the projection is undefined at w <= 0, and only close to a cubic while w varies little
+    if(MinW <= 0.0f || MaxW > 2.0f * MinW)
+    {
+        if(CanSplit)
+        {
+            split_bezier(C, L, R);
+            DrawClipBezier(L, color, Depth + 1);
+            DrawClipBezier(R, color, Depth + 1);
+            return;
+        }
+
+        if(MinW <= 0.0f) { return; }
+    }
+
+    // control points in pixels of the viewport
+    const int vw = (FVpW > 0) ? FVpW : FCanvas->GetWidth();
+    const int vh = (FVpH > 0) ? FVpH : FCanvas->GetHeight();
+    const float w2 = (float)((vw - 1) / 2), h2 = (float)((vh - 1) / 2);
+
+    float Sx[4], Sy[4];
+    for(int i = 0 ; i < 4 ; i++)
+    {
+        Sx[i] = (C[i].x / C[i].w + 1.0f) * w2;
+        Sy[i] = (C[i].y / C[i].w + 1.0f) * h2;
+    }
+
+    // Wang's formula: n = sqrt(3 * 2 / 8 * max |second difference| / tolerance) segments keep the chords within the tolerance
+    float ax = Sx[0] - 2.0f * Sx[1] + Sx[2], ay = Sy[0] - 2.0f * Sy[1] + Sy[2];
+    float bx = Sx[1] - 2.0f * Sx[2] + Sx[3], by = Sy[1] - 2.0f * Sy[2] + Sy[3];
+    float M  = sqrtf(fmaxf(ax * ax + ay * ay, bx * bx + by * by));
+
+    // compared as a float first, a huge (or NaN) M just asks for more than the largest count
+    const float Segments = ceilf(sqrtf(0.75f * M / (FCurveTolerance > 0.01f ? FCurveTolerance : 0.01f)));
+    int n = (Segments <= (float)BezierMaxSegments) ? (int)Segments : BezierMaxSegments + 1;
+    if(n < 1) { n = 1; }
+
+    // a partly visible piece much bigger than the viewport is split, so that its invisible parts are culled
+    float MinX = fminf(fminf(Sx[0], Sx[1]), fminf(Sx[2], Sx[3])), MaxX = fmaxf(fmaxf(Sx[0], Sx[1]), fmaxf(Sx[2], Sx[3]));
+    float MinY = fminf(fminf(Sy[0], Sy[1]), fminf(Sy[2], Sy[3])), MaxY = fmaxf(fmaxf(Sy[0], Sy[1]), fmaxf(Sy[2], Sy[3]));
+    bool Huge = (MaxX - MinX > 4.0f * (float)vw) || (MaxY - MinY > 4.0f * (float)vh);
+
+    if(CanSplit && (Huge || n > BezierMaxSegments))
+    {
+        split_bezier(C, L, R);
+        DrawClipBezier(L, color, Depth + 1);
+        DrawClipBezier(R, color, Depth + 1);
+        return;
+    }
+
+    if(n > BezierMaxSegments) { n = BezierMaxSegments; }
+
+    // forward differences of f(t) = A t^3 + B t^2 + D t + C[0] with step h
+    const float h = 1.0f / (float)n, hh = h * h, hhh = hh * h;
+
+    vec4 A = (C[3] - C[0]) + 3.0f * (C[1] - C[2]);
+    vec4 B = 3.0f * ((C[0] + C[2]) - 2.0f * C[1]);
+    vec4 D = 3.0f * (C[1] - C[0]);
+
+    vec4 P  = C[0];
+    vec4 D1 = (hhh * A + hh * B) + h * D;
+    vec4 D2 = (6.0f * hhh) * A + (2.0f * hh) * B;
+    vec4 D3 = (6.0f * hhh) * A;
+
+    ScreenSegment Seg[BezierMaxSegments];
+
+    // the mapping of NdcToViewport(), which converts to int unclamped
+    vec3 p0 = P.Project();
+    int X0 = to_pixel((p0.x + 1.0f) * w2) + FVpX, Y0 = to_pixel((p0.y + 1.0f) * h2) + FVpY;
+
+    for(int k = 0 ; k < n ; k++)
+    {
+        P  = P + D1;
+        D1 = D1 + D2;
+        D2 = D2 + D3;
+
+        // the last point exactly, so that consecutive pieces join
+        vec3 p1 = (k == n - 1) ? C[3].Project() : P.Project();
+        const int X1 = to_pixel((p1.x + 1.0f) * w2) + FVpX, Y1 = to_pixel((p1.y + 1.0f) * h2) + FVpY;
+
+        ScreenSegment& S = Seg[k];
+        S.X0 = X0; S.Y0 = Y0;
+        S.X1 = X1; S.Y1 = Y1;
+        S.Color = color;
+
+        X0 = X1; Y0 = Y1;
+    }
+
+    DrawSegments(Seg, n);
+}
+
+void Canvas3D::Bezier3D(const vec3& p0, const vec3& p1, const vec3& p2, const vec3& p3, int color)
+{
+    if(FCommands) { FCommands->AddBezier(p0, p1, p2, p3, color); return; }
+
+    const mtx4 m = FView * FProj;
+
+    vec4 C[4];
+    mult_mtx_vec4(C[0], m, p0);
+    mult_mtx_vec4(C[1], m, p1);
+    mult_mtx_vec4(C[2], m, p2);
+    mult_mtx_vec4(C[3], m, p3);
+
+    DrawClipBezier(C, color, 0);
+}
+
+void Canvas3D::CatmullRom3D(const vec3* Points, int Count, int color)
+{
+    // the segment from P1 to P2 is the Bezier with the tangents (P2 - P0) / 2 and (P3 - P1) / 2
+    for(int i = 0 ; i + 1 < Count ; i++)
+    {
+        const vec3& P0 = Points[i > 0 ? i - 1 : 0];
+        const vec3& P1 = Points[i];
+        const vec3& P2 = Points[i + 1];
+        const vec3& P3 = Points[i + 2 < Count ? i + 2 : Count - 1];
+
+        Bezier3D(P1, P1 + (1.0f / 6.0f) * (P2 - P0), P2 - (1.0f / 6.0f) * (P3 - P1), P2, color);
+    }
+}
+
+void Canvas3D::Arc3D(const vec3& Center, const vec3& U, const vec3& V, float Angle0, float Angle1, int color)
+{
+    const float Span = Angle1 - Angle0;
+    if(Span == 0.0f) { return; }
+
+    int Pieces = (int)ceilf(fabsf(Span) / (0.25f * VECMATH_PI));
+    if(Pieces < 1) { Pieces = 1; }
+
+    // a piece of angle t: the tangents at the ends scaled by 4/3 tan(t/4) (radial error below 5e-6 of the radius at 45 degrees)
+    const float Step = Span / (float)Pieces;
+    const float k = (4.0f / 3.0f) * tanf(0.25f * Step);
+
+    for(int i = 0 ; i < Pieces ; i++)
+    {
+        float a0 = Angle0 + (float)i * Step;
+        float a1 = (i == Pieces - 1) ? Angle1 : Angle0 + (float)(i + 1) * Step;
+
+        float c0 = cosf(a0), s0 = sinf(a0);
+        float c1 = cosf(a1), s1 = sinf(a1);
+
+        vec3 P0 = Center + c0 * U + s0 * V;
+        vec3 P3 = Center + c1 * U + s1 * V;
+
+        vec3 T0 = c0 * V - s0 * U;
+        vec3 T3 = c1 * V - s1 * U;
+
+        Bezier3D(P0, P0 + k * T0, P3 - k * T3, P3, color);
+    }
+}
+
+void Canvas3D::Circle3D(const vec3& Center, const vec3& Normal, float Radius, int color)
+{
+    vec3 U, V;
+    BuildComplementaryBasis(Normal, U, V);
+
+    U.Normalize();
+    V.Normalize();
+
+    Arc3D(Center, Radius * U, Radius * V, 0.0f, 2.0f * VECMATH_PI, color);
+}
+
+void Canvas3D::Sphere3D(const vec3& Center, float Radius, int color, int NumMeridians, int NumParallels)
+{
+    const vec3 X(1, 0, 0), Y(0, 1, 0), Z(0, 0, 1);
+
+    for(int i = 0 ; i < NumMeridians ; i++)
+    {
+        float Phi = 2.0f * VECMATH_PI * (float)i / (float)NumMeridians;
+        Arc3D(Center, Radius * Z, Radius * (cosf(Phi) * X + sinf(Phi) * Y), 0.0f, VECMATH_PI, color);
+    }
+
+    for(int j = 1 ; j <= NumParallels ; j++)
+    {
+        float Lat = VECMATH_PI * ((float)j / (float)(NumParallels + 1) - 0.5f);
+        float r   = Radius * cosf(Lat);
+
+        Arc3D(Center + (Radius * sinf(Lat)) * Z, r * X, r * Y, 0.0f, 2.0f * VECMATH_PI, color);
+    }
+}
@@ -0,0 +1,184 @@
+#pragma once
+
+/// Devirtualized 3D canvas. Canvas3DT<TargetT> calls TargetT::Line() directly, so with a BitmapTarget<>
+/// the whole Line3D -> Line -> pixel store chain is inlined. The virtual Canvas3D/iCanvas2D pair stays
+/// the flexible default; both share the glyph construction code below.
+
+#include "vecmath.h"
+#include "BitmapRaster.h"
+
+/// Map normalized device coordinates to framebuffer coordinates
+inline void canvas_ndc_to_fb(vec3& V, int _w2, int _h2)
+{
+    V.x = (float)((int)((V.x + 1)*_w2));
+    V.y = (float)((int)((V.y + 1)*_h2));
+
+    V.z = (V.z + 1.0f) / 2;
+}
+
+/// Color of a styled 3D line end point at depth z (LineStyle::FogColor)
+inline int canvas_fog_color(int color, float z, const LineStyle& S)
+{
+    if(S.FogFar <= S.FogNear) { return color; }
+
+    float f = (z - S.FogNear) / (S.FogFar - S.FogNear);
+    if(f < 0.0f) { f = 0.0f; }
+    if(f > 1.0f) { f = 1.0f; }
+
+    const int a = (int)(f * 256.0f + 0.5f);
+
+    int c = 0;
+    for(int Shift = 0 ; Shift < 24 ; Shift += 8)
+        c |= ((((color >> Shift) & 0xFF) * (256 - a) + ((S.FogColor >> Shift) & 0xFF) * a) >> 8) << Shift;
+
+    return c;
+}
+
+/// Shared implementations of the composite primitives. CanvasT is anything with Line3D(p1, p2, color)
+
+template <class CanvasT>
+void canvas_arrow3d(CanvasT& C, const vec3& Point1, const vec3& Point2, float TipSize, int ArrowColor, int TipColor)
+{
+    C.Line3D( Point1, Point2, ArrowColor );
+
+    // build coordsys for tip
+    vec3 Arrow = Point2 - Point1;
+    vec3 Up, Left;
+
+    BuildComplementaryBasis(Arrow, Up, Left);
+
+    Arrow.Normalize();
+    Up.Normalize();
+    Left.Normalize();
+
+    Arrow = TipSize * Arrow;
+    Up    = 0.5f * TipSize * Up;
+    Left  = 0.5f * TipSize * Left;
+
+    vec3 Pt1 = Point1 + Arrow + Left;
+    vec3 Pt2 = Point1 + Arrow + Up;
+    vec3 Pt3 = Point1 + Arrow - Left;
+    vec3 Pt4 = Point1 + Arrow - Up;
+
+    C.Line3D( Pt1, Point1, TipColor );
+    C.Line3D( Pt2, Point1, TipColor );
+    C.Line3D( Pt3, Point1, TipColor );
+    C.Line3D( Pt4, Point1, TipColor );
+
+    C.Line3D( Pt1, Pt2, TipColor );
+    C.Line3D( Pt2, Pt3, TipColor );
+    C.Line3D( Pt3, Pt4, TipColor );
+    C.Line3D( Pt4, Pt1, TipColor );
+}
+
+template <class CanvasT>
+void canvas_frame3d(CanvasT& C, const vec3& base, const mtx4& mtx, float size, int Xcolor, int Ycolor, int Zcolor)
+{
+    vec3 xa, ya, za;
+
+    vec3 pos;
+    mtx4 m;
+    decompose_camera_transform( mtx, pos, m );
+
+    xa = vec3(MTX4_ELT(m, 0, 0), MTX4_ELT(m, 0, 1), MTX4_ELT(m, 0, 2));
+    ya = vec3(MTX4_ELT(m, 1, 0), MTX4_ELT(m, 1, 1), MTX4_ELT(m, 1, 2));
+    za = vec3(MTX4_ELT(m, 2, 0), MTX4_ELT(m, 2, 1), MTX4_ELT(m, 2, 2));
+
+    C.Arrow3D(base + size * xa, base, 0.2f * size, Xcolor, Xcolor);
+    C.Arrow3D(base + size * ya, base, 0.2f * size, Ycolor, Ycolor);
+    C.Arrow3D(base + size * za, base, 0.2f * size, Zcolor, Zcolor);
+}
+
+template <class CanvasT>
+void canvas_plane(CanvasT& C, const vec3& p, const vec3& v1, const vec3& v2, float step1, float step2, int numx, int numy, int color)
+{
+    for(int i = 0 ; i <= numx ; i++)
+        C.Line3D(p + ((float)(i - numx/2) * step1) * v1 + (numy/2 ) * step2 * v2, p + ((float)(i - numx/2) * step1) * v1 - (numy/2) * step2 * v2, color);
+
+    for(int j = 0 ; j <= numy ; j++)
+        C.Line3D(p + ((float)(j - numy/2) * step2) * v2 + (numx/2 ) * step1 * v1, p + ((float)(j - numy/2) * step2) * v2 - (numx/2) * step1 * v1, color);
+}
+
+template <class CanvasT>
+void canvas_pt3d(CanvasT& C, const vec3& pt, float sz, int color)
+{
+    vec3 p1x = pt - vec3(sz, 0, 0);
+    vec3 p2x = pt + vec3(sz, 0, 0);
+
+    vec3 p1y = pt - vec3(0, sz, 0);
+    vec3 p2y = pt + vec3(0, sz, 0);
+
+    vec3 p1z = pt - vec3(0, 0, sz);
+    vec3 p2z = pt + vec3(0, 0, sz);
+
+    C.Line3D(p1x, p2x, color);
+    C.Line3D(p1y, p2y, color);
+    C.Line3D(p1z, p2z, color);
+}
+
+/// 3D canvas statically bound to a 2D target (e.g. BitmapTargetRGB24)
+template <class TargetT>
+struct Canvas3DT
+{
+    Canvas3DT(const TargetT& T): FTarget(T) {}
+
+    void SetMatrices(const mtx4& Proj, const mtx4& View)
+    {
+        FView = View;
+        FProj = Proj;
+        FViewProj = FView * FProj;
+    }
+
+    inline void Line3D(const vec3& v1, const vec3& v2, int color)
+    {
+        vec3 p1, p2;
+
+        mult_mtx_vec(p1, FViewProj, v1);
+        mult_mtx_vec(p2, FViewProj, v2);
+
+        const int w2 = (FTarget.GetWidth()  - 1) / 2;
+        const int h2 = (FTarget.GetHeight() - 1) / 2;
+
+        canvas_ndc_to_fb(p1, w2, h2);
+        canvas_ndc_to_fb(p2, w2, h2);
+
+        FTarget.Line((int)p1.x, (int)p1.y, (int)p2.x, (int)p2.y, color);
+    }
+
+    /// Canvas3D::Line3DStyled(). The target needs LineStyled(x0, y0, x1, y1, color0, color1, Style)
+    inline void Line3DStyled(const vec3& v1, const vec3& v2, int color, const LineStyle& S)
+    {
+        vec3 p1, p2;
+
+        mult_mtx_vec(p1, FViewProj, v1);
+        mult_mtx_vec(p2, FViewProj, v2);
+
+        const int w2 = (FTarget.GetWidth()  - 1) / 2;
+        const int h2 = (FTarget.GetHeight() - 1) / 2;
+
+        canvas_ndc_to_fb(p1, w2, h2);
+        canvas_ndc_to_fb(p2, w2, h2);
+
+        const int EndColor = (S.EndColor < 0) ? color : S.EndColor;
+
+        FTarget.LineStyled((int)p1.x, (int)p1.y, (int)p2.x, (int)p2.y, canvas_fog_color(color, p1.z, S), canvas_fog_color(EndColor, p2.z, S), S);
+    }
+
+    void Arrow3D(const vec3& p1, const vec3& p2, float size, int lineColor, int tipColor) { canvas_arrow3d(*this, p1, p2, size, lineColor, tipColor); }
+    void Frame3D(const vec3& base, const mtx4& mtx, float size, int Xcolor, int Ycolor, int Zcolor) { canvas_frame3d(*this, base, mtx, size, Xcolor, Ycolor, Zcolor); }
+    void Plane(const vec3& p, const vec3& v1, const vec3& v2, float step1, float step2, int numx, int numy, int color) { canvas_plane(*this, p, v1, v2, step1, step2, numx, numy, color); }
+    void Pt3D(const vec3& pt, float sz, int color) { canvas_pt3d(*this, pt, sz, color); }
+
+    TargetT FTarget;
+
+    mtx4 FProj, FView;
+
+    /// FView * FProj, cached by SetMatrices
+    mtx4 FViewProj;
+};
+
+/// The fully inlined Bitmap pipeline
+typedef Canvas3DT<BitmapTargetRGB24> Canvas3D_Bitmap;
+
+/// Same for a Bitmap in the BITMAP_TILED layout (call Bitmap::Resolve() before presenting)
+typedef Canvas3DT<BitmapTargetTiledRGB24> Canvas3D_TiledBitmap;
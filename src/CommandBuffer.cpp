@@ -0,0 +1,270 @@
+#include "CommandBuffer.h"
+#include <string.h>
+
+/// Default size of a command chunk (commands are never split between chunks)
+static const int CommandChunkSize = 16 * 1024;
+
+/// Instances per DRAW_FRAMES/DRAW_ARROWS command, keeps the commands well inside a chunk
+static const int FramesPerCommand = 128;
+static const int ArrowsPerCommand = 256;
+
+void DrawCommandBuffer::Begin(LinearArena* Arena)
+{
+    FArena = Arena;
+    Clear();
+}
+
+void* DrawCommandBuffer::Append(int Type, int PayloadSize)
+{
+    int Size = (DRAW_COMMAND_ALIGN + PayloadSize + DRAW_COMMAND_ALIGN - 1) & ~(DRAW_COMMAND_ALIGN - 1);
+
+    if(!FLast || FLast->Used + Size > FLast->Capacity)
+    {
+        int Capacity = (Size > CommandChunkSize) ? Size : CommandChunkSize;
+
+        Chunk* C = (Chunk*)FArena->Alloc(ChunkHeaderSize + Capacity, DRAW_COMMAND_ALIGN);
+        C->Next = NULL;
+        C->Used = 0;
+        C->Capacity = Capacity;
+
+        if(FLast) { FLast->Next = C; } else { FFirst = C; }
+        FLast = C;
+    }
+
+    DrawCommand* Cmd = (DrawCommand*)(ChunkData(FLast) + FLast->Used);
+    Cmd->Type = (unsigned short)Type;
+    Cmd->Size = (unsigned short)Size;
+
+    FLast->Used += Size;
+    FCount++;
+
+    return (unsigned char*)Cmd + DRAW_COMMAND_ALIGN;
+}
+
+void DrawCommandBuffer::AddMatrices(const mtx4& Proj, const mtx4& View)
+{
+    DrawMatricesCmd* C = (DrawMatricesCmd*)Append(DRAW_MATRICES, sizeof(DrawMatricesCmd));
+    C->Proj = Proj;
+    C->View = View;
+}
+
+void DrawCommandBuffer::AddLine(const vec3& P1, const vec3& P2, int Color)
+{
+    DrawLineCmd* C = (DrawLineCmd*)Append(DRAW_LINE, sizeof(DrawLineCmd));
+    C->P1 = P1;
+    C->P2 = P2;
+    C->Color = Color;
+}
+
+void DrawCommandBuffer::AddArrow(const vec3& P1, const vec3& P2, float TipSize, int LineColor, int TipColor)
+{
+    DrawArrowCmd* C = (DrawArrowCmd*)Append(DRAW_ARROW, sizeof(DrawArrowCmd));
+    C->P1 = P1;
+    C->P2 = P2;
+    C->TipSize = TipSize;
+    C->LineColor = LineColor;
+    C->TipColor = TipColor;
+}
+
+void DrawCommandBuffer::AddFrame(const vec3& Base, const mtx4& Mtx, float Size, int Xcolor, int Ycolor, int Zcolor)
+{
+    DrawFrameCmd* C = (DrawFrameCmd*)Append(DRAW_FRAME, sizeof(DrawFrameCmd));
+    C->Mtx = Mtx;
+    C->Base = Base;
+    C->Size = Size;
+    C->Colors[0] = Xcolor;
+    C->Colors[1] = Ycolor;
+    C->Colors[2] = Zcolor;
+}
+
+void DrawCommandBuffer::AddPoint(const vec3& Pt, float Size, int Color)
+{
+    DrawPointCmd* C = (DrawPointCmd*)Append(DRAW_POINT, sizeof(DrawPointCmd));
+    C->Pt = Pt;
+    C->Size = Size;
+    C->Color = Color;
+}
+
+void DrawCommandBuffer::AddPlane(const vec3& P, const vec3& V1, const vec3& V2, float Step1, float Step2, int NumX, int NumY, int Color)
+{
+    DrawPlaneCmd* C = (DrawPlaneCmd*)Append(DRAW_PLANE, sizeof(DrawPlaneCmd));
+    C->P = P;
+    C->V1 = V1;
+    C->V2 = V2;
+    C->Step1 = Step1;
+    C->Step2 = Step2;
+    C->NumX = NumX;
+    C->NumY = NumY;
+    C->Color = Color;
+}
+
+void DrawCommandBuffer::AddTriangle(const vec3& P1, const vec3& P2, const vec3& P3, int Color)
+{
+    DrawTriangleCmd* C = (DrawTriangleCmd*)Append(DRAW_TRIANGLE, sizeof(DrawTriangleCmd));
+    C->P[0] = P1;
+    C->P[1] = P2;
+    C->P[2] = P3;
+    C->Color = Color;
+}
+
+void DrawCommandBuffer::AddText(const vec3& P, const char* Text, int Color, int Dx, int Dy)
+{
+    // the command size is 16-bit, longer labels are cut
+    int Len = (int)strlen(Text);
+    if(Len > 4096) { Len = 4096; }
+
+    DrawTextCmd* C = (DrawTextCmd*)Append(DRAW_TEXT, (int)sizeof(DrawTextCmd) + ((Len + 4) & ~3));
+    C->P = P;
+    C->Color = Color;
+    C->Dx = Dx;
+    C->Dy = Dy;
+
+    char* Dest = (char*)(C + 1);
+    memcpy(Dest, Text, Len);
+    Dest[Len] = 0;
+}
+
+void DrawCommandBuffer::AddPickID(int ID)
+{
+    DrawPickIDCmd* C = (DrawPickIDCmd*)Append(DRAW_PICK_ID, sizeof(DrawPickIDCmd));
+    C->ID = ID;
+}
+
+void DrawCommandBuffer::AddPointCloud(const PointCloudFile* File, int Color)
+{
+    DrawPointCloudCmd* C = (DrawPointCloudCmd*)Append(DRAW_POINT_CLOUD, sizeof(DrawPointCloudCmd));
+    C->File = File;
+    C->Color = Color;
+}
+
+void DrawCommandBuffer::AddPoints(const float* XYZ, int Count, int Color, const int* Colors)
+{
+    DrawPointsCmd* C = (DrawPointsCmd*)Append(DRAW_POINTS, sizeof(DrawPointsCmd));
+    C->XYZ = XYZ;
+    C->Colors = Colors;
+    C->Count = Count;
+    C->Color = Color;
+}
+
+void DrawCommandBuffer::AddBezier(const vec3& P0, const vec3& P1, const vec3& P2, const vec3& P3, int Color)
+{
+    DrawBezierCmd* C = (DrawBezierCmd*)Append(DRAW_BEZIER, sizeof(DrawBezierCmd));
+    C->P[0] = P0;
+    C->P[1] = P1;
+    C->P[2] = P2;
+    C->P[3] = P3;
+    C->Color = Color;
+}
+
+void DrawCommandBuffer::AddClear(int Color)
+{
+    DrawClearCmd* C = (DrawClearCmd*)Append(DRAW_CLEAR, sizeof(DrawClearCmd));
+    C->Color = Color;
+}
+
+void DrawCommandBuffer::AddLine2D(int X1, int Y1, int X2, int Y2, int Color)
+{
+    DrawLine2DCmd* C = (DrawLine2DCmd*)Append(DRAW_LINE2D, sizeof(DrawLine2DCmd));
+    C->X1 = X1; C->Y1 = Y1;
+    C->X2 = X2; C->Y2 = Y2;
+    C->Color = Color;
+}
+
+void DrawCommandBuffer::AddPixel(int X, int Y, int Color)
+{
+    DrawPixelCmd* C = (DrawPixelCmd*)Append(DRAW_PIXEL, sizeof(DrawPixelCmd));
+    C->X = X;
+    C->Y = Y;
+    C->Color = Color;
+}
+
+void DrawCommandBuffer::AddTriangle2D(const float* X, const float* Y, const float* Z, int Color)
+{
+    DrawTriangle2DCmd* C = (DrawTriangle2DCmd*)Append(DRAW_TRIANGLE2D, sizeof(DrawTriangle2DCmd));
+
+    for(int k = 0 ; k < 3 ; k++)
+    {
+        C->X[k] = X[k];
+        C->Y[k] = Y[k];
+        C->Z[k] = Z ? Z[k] : 0.0f;
+    }
+
+    C->Color = Color;
+    C->UseZ  = Z ? 1 : 0;
+}
+
+void DrawCommandBuffer::AddText2D(int X, int Y, const char* Text, int Color, int Scale)
+{
+    int Len = (int)strlen(Text);
+    if(Len > 4096) { Len = 4096; }
+
+    DrawText2DCmd* C = (DrawText2DCmd*)Append(DRAW_TEXT2D, (int)sizeof(DrawText2DCmd) + ((Len + 4) & ~3));
+    C->X = X;
+    C->Y = Y;
+    C->Color = Color;
+    C->Scale = Scale;
+
+    char* Dest = (char*)(C + 1);
+    memcpy(Dest, Text, Len);
+    Dest[Len] = 0;
+}
+
+void DrawCommandBuffer::AddClipRect(int X, int Y, int W, int H)
+{
+    DrawClipRectCmd* C = (DrawClipRectCmd*)Append(DRAW_CLIP_RECT, sizeof(DrawClipRectCmd));
+    C->X = X; C->Y = Y;
+    C->W = W; C->H = H;
+}
+
+void DrawCommandBuffer::AddLineStyled(const vec3& P1, const vec3& P2, int Color, const LineStyle& Style)
+{
+    DrawLineStyledCmd* C = (DrawLineStyledCmd*)Append(DRAW_LINE_STYLED, sizeof(DrawLineStyledCmd));
+    C->P1 = P1;
+    C->P2 = P2;
+    C->Color = Color;
+    C->Style = Style;
+}
+
+void DrawCommandBuffer::AddLine2DStyled(int X1, int Y1, int X2, int Y2, int Color, const LineStyle& Style)
+{
+    DrawLine2DStyledCmd* C = (DrawLine2DStyledCmd*)Append(DRAW_LINE2D_STYLED, sizeof(DrawLine2DStyledCmd));
+    C->X1 = X1; C->Y1 = Y1;
+    C->X2 = X2; C->Y2 = Y2;
+    C->Color = Color;
+    C->Style = Style;
+}
+
+void DrawCommandBuffer::AddFrames(const mtx4* Poses, int Count, float Size, int Xcolor, int Ycolor, int Zcolor)
+{
+    for(int i = 0 ; i < Count ; i += FramesPerCommand)
+    {
+        int n = (Count - i < FramesPerCommand) ? Count - i : FramesPerCommand;
+
+        DrawFramesCmd* C = (DrawFramesCmd*)Append(DRAW_FRAMES, FramesHeaderSize + n * (int)sizeof(mtx4));
+        C->Count = n;
+        C->Size = Size;
+        C->Colors[0] = Xcolor;
+        C->Colors[1] = Ycolor;
+        C->Colors[2] = Zcolor;
+
+        memcpy((mtx4*)FramesPoses(C), Poses + i, n * sizeof(mtx4));
+    }
+}
+
+void DrawCommandBuffer::AddArrows(const vec3* From, const vec3* To, int Count, float TipSize, int LineColor, int TipColor)
+{
+    for(int i = 0 ; i < Count ; i += ArrowsPerCommand)
+    {
+        int n = (Count - i < ArrowsPerCommand) ? Count - i : ArrowsPerCommand;
+
+        DrawArrowsCmd* C = (DrawArrowsCmd*)Append(DRAW_ARROWS, (int)sizeof(DrawArrowsCmd) + 2 * n * (int)sizeof(vec3));
+        C->Count = n;
+        C->TipSize = TipSize;
+        C->LineColor = LineColor;
+        C->TipColor = TipColor;
+
+        vec3* P = (vec3*)ArrowsPoints(C);
+        memcpy(P,     From + i, n * sizeof(vec3));
+        memcpy(P + n, To + i,   n * sizeof(vec3));
+    }
+}
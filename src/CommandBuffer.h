@@ -0,0 +1,171 @@
+#pragma once
+
+#include "vecmath.h"
+#include "Arena.h"
+#include "Bitmap.h"
+
+/// Types of the recorded Canvas3D operations (and of the 2D calls recorded by Canvas2D_Bitmap)
+enum DrawCommandType
+{
+    DRAW_MATRICES = 0,
+    DRAW_LINE,
+    DRAW_ARROW,
+    DRAW_FRAME,
+    DRAW_POINT,
+    DRAW_PLANE,
+    DRAW_TRIANGLE,
+    DRAW_TEXT,
+    DRAW_PICK_ID,
+    DRAW_POINT_CLOUD,
+    DRAW_POINTS,
+    DRAW_FRAMES,
+    DRAW_ARROWS,
+    DRAW_BEZIER,
+
+    // 2D canvas calls, executed on Canvas3D::FCanvas
+    DRAW_CLEAR,
+    DRAW_LINE2D,
+    DRAW_PIXEL,
+    DRAW_TRIANGLE2D,
+    DRAW_TEXT2D,
+    DRAW_CLIP_RECT,
+
+    // styled lines, 3D and 2D (after the others, so that older traces keep their numbers)
+    DRAW_LINE_STYLED,
+    DRAW_LINE2D_STYLED,
+
+    DRAW_NUM_TYPES
+};
+
+struct PointCloudFile;
+
+/// Commands and their payloads start at multiples of this, so that aligned types (mtx4) can be stored in place
+enum { DRAW_COMMAND_ALIGN = 16 };
+
+/// Common header of every recorded command. Payload of the given type follows at the next DRAW_COMMAND_ALIGN boundary
+struct DrawCommand
+{
+    unsigned short Type;
+    unsigned short Size; // header + payload + padding, in bytes
+};
+
+struct DrawMatricesCmd { mtx4 Proj, View; };
+struct DrawLineCmd     { vec3 P1, P2; int Color; };
+struct DrawArrowCmd    { vec3 P1, P2; float TipSize; int LineColor, TipColor; };
+struct DrawFrameCmd    { mtx4 Mtx; vec3 Base; float Size; int Colors[3]; };
+struct DrawPointCmd    { vec3 Pt; float Size; int Color; };
+struct DrawPlaneCmd    { vec3 P, V1, V2; float Step1, Step2; int NumX, NumY; int Color; };
+struct DrawTriangleCmd { vec3 P[3]; int Color; };
+struct DrawTextCmd     { vec3 P; int Color; int Dx, Dy; /* zero-terminated text follows */ };
+struct DrawPickIDCmd   { int ID; };
+struct DrawPointCloudCmd { const PointCloudFile* File; int Color; /* the file is referenced, not copied */ };
+struct DrawPointsCmd   { const float* XYZ; const int* Colors; int Count; int Color; /* the arrays are referenced, not copied */ };
+struct DrawFramesCmd   { int Count; float Size; int Colors[3]; /* Count poses follow at the next 16-byte boundary */ };
+struct DrawArrowsCmd   { int Count; float TipSize; int LineColor, TipColor; /* Count From points follow, then Count To points */ };
+struct DrawBezierCmd   { vec3 P[4]; int Color; };
+
+struct DrawClearCmd      { int Color; };
+struct DrawLine2DCmd     { int X1, Y1, X2, Y2; int Color; };
+struct DrawPixelCmd      { int X, Y; int Color; };
+struct DrawTriangle2DCmd { float X[3], Y[3], Z[3]; int Color; int UseZ; };
+struct DrawText2DCmd     { int X, Y; int Color; int Scale; /* zero-terminated text follows */ };
+struct DrawClipRectCmd   { int X, Y, W, H; };
+
+struct DrawLineStyledCmd   { vec3 P1, P2; int Color; LineStyle Style; };
+struct DrawLine2DStyledCmd { int X1, Y1, X2, Y2; int Color; LineStyle Style; };
+
+/// Compact list of Canvas3D draw operations stored in a LinearArena.
+/// Commands are packed back to back into arena chunks; the buffer owns no memory itself,
+/// so it must be re-attached with Begin() after every LinearArena::Reset().
+struct DrawCommandBuffer
+{
+    DrawCommandBuffer(): FArena(NULL), FFirst(NULL), FLast(NULL), FCount(0) {}
+
+    /// Start a new (empty) list allocating from the Arena
+    void Begin(LinearArena* Arena);
+
+    /// Forget all recorded commands (the memory is returned by the next LinearArena::Reset())
+    void Clear() { FFirst = FLast = NULL; FCount = 0; }
+
+    void AddMatrices(const mtx4& Proj, const mtx4& View);
+    void AddLine(const vec3& P1, const vec3& P2, int Color);
+    void AddArrow(const vec3& P1, const vec3& P2, float TipSize, int LineColor, int TipColor);
+    void AddFrame(const vec3& Base, const mtx4& Mtx, float Size, int Xcolor, int Ycolor, int Zcolor);
+    void AddPoint(const vec3& Pt, float Size, int Color);
+    void AddPlane(const vec3& P, const vec3& V1, const vec3& V2, float Step1, float Step2, int NumX, int NumY, int Color);
+    void AddTriangle(const vec3& P1, const vec3& P2, const vec3& P3, int Color);
+    void AddText(const vec3& P, const char* Text, int Color, int Dx, int Dy);
+    void AddPickID(int ID);
+    void AddPointCloud(const PointCloudFile* File, int Color);
+    void AddPoints(const float* XYZ, int Count, int Color, const int* Colors);
+    void AddBezier(const vec3& P0, const vec3& P1, const vec3& P2, const vec3& P3, int Color);
+
+    void AddClear(int Color);
+    void AddLine2D(int X1, int Y1, int X2, int Y2, int Color);
+    void AddPixel(int X, int Y, int Color);
+    void AddTriangle2D(const float* X, const float* Y, const float* Z, int Color);
+    void AddText2D(int X, int Y, const char* Text, int Color, int Scale);
+    void AddClipRect(int X, int Y, int W, int H);
+
+    void AddLineStyled(const vec3& P1, const vec3& P2, int Color, const LineStyle& Style);
+    void AddLine2DStyled(int X1, int Y1, int X2, int Y2, int Color, const LineStyle& Style);
+
+    /// Instanced frames and arrows. The arrays are copied, split into several commands if needed
+    void AddFrames(const mtx4* Poses, int Count, float Size, int Xcolor, int Ycolor, int Zcolor);
+    void AddArrows(const vec3* From, const vec3* To, int Count, float TipSize, int LineColor, int TipColor);
+
+    /// The arrays stored after the DrawFramesCmd/DrawArrowsCmd header
+    static const mtx4* FramesPoses(const DrawFramesCmd* C) { return (const mtx4*)((const unsigned char*)C + FramesHeaderSize); }
+    static const vec3* ArrowsPoints(const DrawArrowsCmd* C) { return (const vec3*)(C + 1); }
+
+    int GetCount() const { return FCount; }
+
+    /// Arena given to Begin(), e.g. for data referenced by the commands
+    LinearArena* GetArena() const { return FArena; }
+
+    template <class T> static const T* Payload(const DrawCommand* C) { return (const T*)((const unsigned char*)C + DRAW_COMMAND_ALIGN); }
+
+    /// Piece of arena memory holding several commands
+    struct Chunk
+    {
+        Chunk* Next;
+        int    Used;
+        int    Capacity;
+    };
+
+    static unsigned char* ChunkData(const Chunk* C) { return (unsigned char*)C + ChunkHeaderSize; }
+
+    enum { FramesHeaderSize = (sizeof(DrawFramesCmd) + DRAW_COMMAND_ALIGN - 1) & ~(DRAW_COMMAND_ALIGN - 1) };
+
+    /// sizeof(Chunk) rounded up to DRAW_COMMAND_ALIGN
+    enum { ChunkHeaderSize = (sizeof(Chunk) + DRAW_COMMAND_ALIGN - 1) & ~(DRAW_COMMAND_ALIGN - 1) };
+
+    /// Sequential access to the commands: for(DrawCommandBuffer::Iterator i = B.Iterate() ; i.Cmd ; i.Advance())
+    struct Iterator
+    {
+        Iterator(const Chunk* C): Ch(C), Ofs(0), Cmd(NULL) { Fetch(); }
+
+        void Advance() { Ofs += Cmd->Size; Fetch(); }
+
+        const Chunk* Ch;
+        int Ofs;
+        const DrawCommand* Cmd;
+
+    private:
+        void Fetch()
+        {
+            while(Ch && Ofs >= Ch->Used) { Ch = Ch->Next; Ofs = 0; }
+            Cmd = Ch ? (const DrawCommand*)(ChunkData(Ch) + Ofs) : NULL;
+        }
+    };
+
+    Iterator Iterate() const { return Iterator(FFirst); }
+
+private:
+    void* Append(int Type, int PayloadSize);
+
+    LinearArena* FArena;
+    Chunk* FFirst;
+    Chunk* FLast;
+    int FCount;
+};
@@ -1,4 +1,5 @@
 #include "CommonFramework.h"
+#include "Parallel.h"
 
 #ifdef _WIN32
 #  include <windowsx.h>
@@ -9,19 +10,41 @@
 #include <X11/Xos.h>
 #include <X11/Xatom.h>
 #include <X11/keysym.h>
+#include <time.h>
+#include "FrameServer.h"
+
+#ifdef __AVX2__
+#  include <immintrin.h>
+#endif
+
+double GetSeconds()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1.0e-9;
+}
 
 Display* App::FDisplay = NULL;
 int App::FScreen;
 
-std::map<Window, BaseWindow*> App::FWnd2Window;
+std::vector<BaseWindow*> App::FWindows;
+std::unordered_map<Window, BaseWindow*> App::FWindowMap;
+BaseWindow* App::FLastWindow = NULL;
 
-App::App()
+App::App(): FPool(0, true)
 {
 	FShouldExit = false;
 	FDisplay = XOpenDisplay (NULL);
-	FScreen  = DefaultScreen (FDisplay);
+	FScreen  = FDisplay ? DefaultScreen (FDisplay) : 0;
 
 	MainWnd = NULL;
+
+	ThreadPool::SetGlobal(&FPool);
+}
+
+App::~App()
+{
+	ThreadPool::SetGlobal(NULL);
 }
 
 void App::Exit()
@@ -32,12 +55,110 @@ void App::Exit()
 
 void App::RegisterWindow(BaseWindow* W)
 {
-	FWnd2Window[W->FWnd] = W;
+	FWindows.push_back(W);
+
+	// headless windows have no X11 window and get no events
+	if(W->FWnd) { FWindowMap[W->FWnd] = W; }
 }
 
 void App::UnregisterWindow(BaseWindow* W)
 {
-	FWnd2Window[W->FWnd] = NULL;
+	for(size_t i = 0 ; i < FWindows.size() ; i++)
+	{
+		if(FWindows[i] == W)
+		{
+			FWindows.erase(FWindows.begin() + i);
+			break;
+		}
+	}
+
+	std::unordered_map<Window, BaseWindow*>::iterator It = FWindowMap.find(W->FWnd);
+	if(It != FWindowMap.end() && It->second == W)
+		FWindowMap.erase(It);
+
+	if(FLastWindow == W)
+		FLastWindow = NULL;
+}
+
+BaseWindow* App::FindWindow(Window W)
+{
+	if(FLastWindow && FLastWindow->FWnd == W)
+		return FLastWindow;
+
+	std::unordered_map<Window, BaseWindow*>::const_iterator It = FWindowMap.find(W);
+	if(It == FWindowMap.end())
+		return NULL;
+
+	FLastWindow = It->second;
+	return FLastWindow;
+}
+
+static void draw_window(void* W)    { ((BaseWindow*)W)->OnDraw(); }
+/// The conversion time starts the present time, OnPaint() adds the copy to the screen
+static void convert_window(void* W)
+{
+	BaseWindow* B = (BaseWindow*)W;
+
+	double Start = GetSeconds();
+	B->ConvertFrame();
+	B->FPresentTime = (float)(GetSeconds() - Start);
+}
+
+/// Draw the windows with FConcurrentDraw that wait for a new frame all at once, OnPaint() only presents them then
+static void draw_concurrent(const std::vector<BaseWindow*>& Windows)
+{
+	std::vector<BaseWindow*> Due;
+
+	for(size_t i = 0 ; i < Windows.size() ; i++)
+	{
+		BaseWindow* W = Windows[i];
+		if(W->FConcurrentDraw && W->FRepaint && !W->FDrawn && W->IsFrameDirty())
+			Due.push_back(W);
+	}
+
+	// a single window gains nothing
+	if(Due.size() < 2) { return; }
+
+	// each window converts its frame as soon as it is drawn
+	TaskGraph G;
+	for(size_t i = 0 ; i < Due.size() ; i++)
+	{
+		int Draw = G.Add(draw_window, Due[i]);
+
+		if(!App::IsHeadless())
+			G.Add(convert_window, Due[i], Draw);
+	}
+
+	G.Run();
+
+	for(size_t i = 0 ; i < Due.size() ; i++)
+		Due[i]->FDrawn = true;
+}
+
+/// Feed the input events of the window's stream client to the window, publish again if the client misses the image
+static void poll_stream(BaseWindow* W)
+{
+	FrameServer* S = W->FServer;
+	S->Poll();
+
+	StreamEvent E;
+	while(S->NextEvent(E))
+	{
+		switch(E.Type)
+		{
+			case STREAM_MOUSE_DOWN: W->OnMouseDown(E.A, E.B, E.C); break;
+			case STREAM_MOUSE_UP:   W->OnMouseUp(E.A, E.B, E.C);   break;
+			case STREAM_MOUSE_MOVE: W->OnMouseMove(E.B, E.C);      break;
+			case STREAM_WHEEL_UP:   W->OnWheelUp();                break;
+			case STREAM_WHEEL_DOWN: W->OnWheelDown();              break;
+			case STREAM_KEY_DOWN:   W->OnKeyDown(E.A);             break;
+			case STREAM_KEY_UP:     W->OnKeyUp(E.A);               break;
+			default: break;
+		}
+	}
+
+	if(S->NeedsFrame())
+		W->Repaint();
 }
 
 int App::Run()
@@ -45,27 +166,61 @@ int App::Run()
 	while (!FShouldExit)
 	{
 		XEvent event;
-		if ( XPending ( this->FDisplay ) )
+		if ( FDisplay && XPending ( this->FDisplay ) )
 		{
 			XNextEvent( this->FDisplay, &event );
 		} else
 		{
-			// wait for 10 milliseconds
-			usleep(10000);
+			for(size_t i = 0 ; i < App::FWindows.size() ; i++)
+			{
+				if(App::FWindows[i]->FServer)
+					poll_stream(App::FWindows[i]);
+			}
+
+			// fire the due timers (windows without SetDelta() get one per poll),
+			// then sleep until the next one is due, but at most 10 milliseconds
+			double Now  = GetSeconds();
+			double Next = Now + 0.01;
 
-			for(std::map<Window, BaseWindow*>::iterator i = App::FWnd2Window.begin(); i != App::FWnd2Window.end() ; i++)
+			// by index: a timer handler may close its window
+			for(size_t i = 0 ; i < App::FWindows.size() ; i++)
 			{
-				if(i->second != NULL)
-					i->second->OnTimer();
+				BaseWindow* W = App::FWindows[i];
+				if(Now < W->FNextTimer)
+				{
+					if(W->FNextTimer < Next) { Next = W->FNextTimer; }
+					continue;
+				}
+
+				// keep the period unless we are more than one period late
+				float dt = W->GetDelta();
+				W->FNextTimer = (Now - W->FNextTimer < dt) ? W->FNextTimer + dt : Now + dt;
+				if(dt > 0 && W->FNextTimer < Next) { Next = W->FNextTimer; }
+
+				W->OnTimer();
 			}
+
+			draw_concurrent(App::FWindows);
+
+			// headless windows have no Expose events, Repaint() only flags them
+			for(size_t i = 0 ; i < App::FWindows.size() ; i++)
+			{
+				BaseWindow* W = App::FWindows[i];
+				if(W->FRepaint && !FDisplay)
+					W->OnPaint();
+			}
+
+			double Wait = Next - GetSeconds();
+			if(Wait > 0.0)
+				usleep((useconds_t)(Wait * 1.0e6));
+
 			continue;
 		}
 
-		if(FWnd2Window.count(event.xany.window) < 1)
+		BaseWindow* wnd = FindWindow(event.xany.window);
+		if(!wnd)
 			continue;
 
-		BaseWindow* wnd = FWnd2Window[event.xany.window];
-
 		switch  (event.type)
 		{
 			/* We could have handled the ConfigureNotify for window resize */
@@ -144,7 +299,20 @@ int App::Run()
   
 			case MotionNotify:
 			{
-				wnd->OnMouseMove(event.xbutton.x, event.xbutton.y);
+				// motion compression: skip to the last one of consecutive motion events of this window.
+				// Positions are absolute, so the camera still gets the whole delta (it accumulates them until Update()).
+				// Unlike XCheckTypedWindowEvent() this never reorders motion around button events
+				XEvent next;
+				while(XPending(this->FDisplay))
+				{
+					XPeekEvent(this->FDisplay, &next);
+					if(next.type != MotionNotify || next.xany.window != event.xany.window)
+						break;
+
+					XNextEvent(this->FDisplay, &event);
+				}
+
+				wnd->OnMouseMove(event.xmotion.x, event.xmotion.y);
 				break;
 			}
 
@@ -158,13 +326,40 @@ int App::Run()
 
 BaseWindow::BaseWindow(int x, int y, int w, int h, const char* title): Width(w), Height(h)
 {
-	FBOut = new unsigned char[w * h * 4];
+	DeltaTime  = 0.0f;
+	FNextTimer = 0.0;
+	FServer    = NULL;
+	FConcurrentDraw = false;
+	FDrawn     = false;
+	FPalette   = NULL;
+	FPresentTime = 0.0f;
+
+	CtrlPressed  = false;
+	ShiftPressed = false;
+	AltPressed   = false;
 
 	FB = new unsigned char[w * h * 3];
 	memset(FB, 0xFF, w * h * 3);
 
 	Display* dis = App::FDisplay;
 
+	// headless: no X window and no output image, the first frame is drawn by App::Run()
+	if(!dis)
+	{
+		FWnd    = 0;
+		FBOut   = NULL;
+		img     = NULL;
+		copyGC  = NULL;
+		outBits = 32;
+
+		FRepaint = true;
+		App::RegisterWindow(this);
+		return;
+	}
+
+	FRepaint = true;
+	FBOut = new unsigned char[w * h * 4];
+
 	FWnd = XCreateSimpleWindow(dis, RootWindow(dis, 0), x, y, w, h, 0, BlackPixel (dis, 0), BlackPixel(dis, 0));
 
 	XSelectInput(dis, FWnd, StructureNotifyMask | ExposureMask | PointerMotionMask | KeyPressMask | KeyReleaseMask | ButtonPressMask | ButtonReleaseMask );
@@ -192,27 +387,31 @@ BaseWindow::BaseWindow(int x, int y, int w, int h, const char* title): Width(w),
 	SetPos(x, y);
 	SetSize(w, h);
 	SetTitle(title);
-
-	CtrlPressed  = false;
-	ShiftPressed = false;
-	AltPressed   = false;
 }
 
 BaseWindow::~BaseWindow()
 {
 	App::UnregisterWindow(this);
-	XDestroyImage(img);
+
+	// the image owns FBOut
+	if(img)
+		XDestroyImage(img);
+	else
+		delete[] FBOut;
+
 	delete[] FB;
 	FB = NULL;
 }
 
-void BaseWindow::SetTitle(const char* title) { XStoreName(App::FDisplay, FWnd, title); }
+void BaseWindow::SetTitle(const char* title) { if(App::FDisplay) { XStoreName(App::FDisplay, FWnd, title); } }
 
-void BaseWindow::SetPos(int x, int y) { XMoveWindow(App::FDisplay, FWnd, x, y); }
-void BaseWindow::SetSize(int w, int h) { XResizeWindow(App::FDisplay, FWnd, w, h); Width = w; Height = h; }
+void BaseWindow::SetPos(int x, int y) { if(App::FDisplay) { XMoveWindow(App::FDisplay, FWnd, x, y); } }
+void BaseWindow::SetSize(int w, int h) { if(App::FDisplay) { XResizeWindow(App::FDisplay, FWnd, w, h); } Width = w; Height = h; }
 
 void BaseWindow::Show(bool Visible)
 {
+	if(!App::FDisplay) { return; }
+
 	Visible ? XMapWindow(App::FDisplay, FWnd) : XUnmapWindow(App::FDisplay, FWnd);
 
 	XFlush(App::FDisplay);
@@ -225,24 +424,106 @@ void BaseWindow::SetDelta(float dt)
 
 void BaseWindow::Repaint()
 {
+	FRepaint = true;
+
+	if(!App::FDisplay) { return; }
+
 	XClearArea(App::FDisplay, FWnd, 0, 0, 1, 1, true);
 }
 
-void BaseWindow::OnPaint()
+void BaseWindow::SetIndexedColor(const int* Palette)
+{
+	if((Palette != NULL) != (FPalette != NULL))
+	{
+		const int Size = Width * Height * (Palette ? 1 : 3);
+
+		delete[] FB;
+		FB = new unsigned char[Size];
+		memset(FB, 0xFF, Size);
+	}
+
+	FPalette = Palette;
+	UpdatePalette();
+}
+
+void BaseWindow::UpdatePalette()
+{
+	if(!FPalette) { return; }
+
+	for(int i = 0 ; i < 256 ; i++)
+	{
+		unsigned r = (FPalette[i] >> 16) & 0xFF, g = (FPalette[i] >> 8) & 0xFF, b = FPalette[i] & 0xFF;
+
+		FLut[i] = (outBits == 32) ? (0xFFu << 24) | (r << 16) | (g << 8) | b : ((b >> 3) << 11) | ((g >> 2) << 5) | (r >> 3);
+	}
+}
+
+/// Expand Count palette indices through Lut into 32-bit pixels, 8 at a time with a gather if built with -mavx2
+static void expand_indexed32(unsigned int* Dst, const unsigned char* Src, int Count, const unsigned int* Lut)
 {
-	OnDraw();
+	int i = 0;
 
-	// copy FB to FBOut (invert image rows and RGB(24bit) to BGRA(32bit) conversion)
+#ifdef __AVX2__
+	for( ; i + 8 <= Count ; i += 8)
+	{
+		__m256i Idx = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(Src + i)));
+		_mm256_storeu_si256((__m256i*)(Dst + i), _mm256_i32gather_epi32((const int*)Lut, Idx, 4));
+	}
+#endif
+
+	for( ; i < Count ; i++)
+		Dst[i] = Lut[Src[i]];
+}
+
+/// Same for 16-bit pixels: two gathers of 8 packed into 16
+static void expand_indexed16(unsigned short* Dst, const unsigned char* Src, int Count, const unsigned int* Lut)
+{
+	int i = 0;
+
+#ifdef __AVX2__
+	for( ; i + 16 <= Count ; i += 16)
+	{
+		__m128i Bytes = _mm_loadu_si128((const __m128i*)(Src + i));
+
+		__m256i Lo = _mm256_i32gather_epi32((const int*)Lut, _mm256_cvtepu8_epi32(Bytes), 4);
+		__m256i Hi = _mm256_i32gather_epi32((const int*)Lut, _mm256_cvtepu8_epi32(_mm_srli_si128(Bytes, 8)), 4);
+
+		// the pack works per 128-bit lane, put the quarters back in order
+		__m256i v = _mm256_permute4x64_epi64(_mm256_packus_epi32(Lo, Hi), 0xD8);
+		_mm256_storeu_si256((__m256i*)(Dst + i), v);
+	}
+#endif
+
+	for( ; i < Count ; i++)
+		Dst[i] = (unsigned short)Lut[Src[i]];
+}
+
+void BaseWindow::ConvertRect(int x, int y, int w, int h)
+{
+	// indexed FB: one table lookup per pixel
+	if(FPalette)
+	{
+		for(int j = y ; j < y + h ; j++)
+		{
+			if(outBits == 32)
+				expand_indexed32((unsigned int *)FBOut + j * Width + x, FB + j * Width + x, w, FLut);
+			else
+				expand_indexed16((unsigned short *)FBOut + j * Width + x, FB + j * Width + x, w, FLut);
+		}
+		return;
+	}
+
+	// copy FB to FBOut (RGB(24bit) to BGRA(32bit) conversion)
 	// for 16-bit output buffers we also should perform the conversion
 
 	if(outBits == 32)
 	{
-		for(int j = 0 ; j < Height ; j++)
+		for(int j = y ; j < y + h ; j++)
 		{
-			unsigned char *fb    = FB    + j * Width * 3;
-			unsigned char *fbOut = FBOut + j * Width * 4;
+			unsigned char *fb    = FB    + (j * Width + x) * 3;
+			unsigned char *fbOut = FBOut + (j * Width + x) * 4;
 
-			for(int i = 0 ; i < Width ; i++)
+			for(int i = 0 ; i < w ; i++)
 			{
 				unsigned char r = *fb++;
 				unsigned char g = *fb++;
@@ -257,12 +538,12 @@ void BaseWindow::OnPaint()
 
 	} else
 	{
-		for(int j = 0 ; j < Height ; j++)
+		for(int j = y ; j < y + h ; j++)
 		{
-			unsigned char  *fb    = FB    + j * Width * 3;
-			unsigned short *fbOut = (unsigned short *)FBOut + j * Width;
+			unsigned char  *fb    = FB    + (j * Width + x) * 3;
+			unsigned short *fbOut = (unsigned short *)FBOut + j * Width + x;
 
-			for(int i = 0 ; i < Width ; i++)
+			for(int i = 0 ; i < w ; i++)
 			{
 				unsigned char r = *fb++;
 				unsigned char g = *fb++;
@@ -275,8 +556,100 @@ void BaseWindow::OnPaint()
 		}
 
 	}
-	XPutImage (App::FDisplay, FWnd, copyGC, img, 0, 0, 0, 0, Width, Height);
-	XFlush (App::FDisplay);
+}
+
+void BaseWindow::FillRect(int x, int y, int w, int h, int color)
+{
+	unsigned char r = (color >> 16) & 0xFF;
+	unsigned char g = (color >>  8) & 0xFF;
+	unsigned char b = (color      ) & 0xFF;
+
+	if(outBits == 32)
+	{
+		unsigned int v = (0xFFu << 24) | (r << 16) | (g << 8) | b;
+
+		for(int j = y ; j < y + h ; j++)
+		{
+			unsigned int *fbOut = (unsigned int *)FBOut + j * Width + x;
+
+			for(int i = 0 ; i < w ; i++)
+				fbOut[i] = v;
+		}
+
+	} else
+	{
+		unsigned short v = ((b >> 3) << 11) | ((g >> 2) << 5) | (r >> 3);
+
+		for(int j = y ; j < y + h ; j++)
+		{
+			unsigned short *fbOut = (unsigned short *)FBOut + j * Width + x;
+
+			for(int i = 0 ; i < w ; i++)
+				fbOut[i] = v;
+		}
+	}
+}
+
+/// Rows of ConvertFrame() per task
+static const int ConvertBandRows = 32;
+
+/// ConvertFrame() of one band of rows
+struct ConvertTask
+{
+	BaseWindow* W;
+
+	void operator()(int i) const
+	{
+		int y = i * ConvertBandRows;
+		W->ConvertRect(0, y, W->Width, (W->Height - y < ConvertBandRows) ? W->Height - y : ConvertBandRows);
+	}
+};
+
+void BaseWindow::ConvertFrame()
+{
+	UpdatePalette();
+
+	ConvertTask Task;
+	Task.W = this;
+
+	parallel_for((Height + ConvertBandRows - 1) / ConvertBandRows, Task);
+}
+
+void BaseWindow::OnPaint()
+{
+	FRepaint = false;
+
+	// start of presenting a new frame, < 0 if there is none
+	double Start = -1.0;
+
+	// img still holds the last frame, so an unchanged window (or a plain Expose) only copies it again.
+	// Windows drawn concurrently by App::Run() only present, their conversion time is already in FPresentTime
+	if(FDrawn)
+	{
+		FDrawn = false;
+		Start  = GetSeconds() - FPresentTime;
+	} else
+	if(IsFrameDirty())
+	{
+		OnDraw();
+		Start = GetSeconds();
+
+		if(img)
+			ConvertFrame();
+	}
+
+	// unchanged tiles cost only their hashes
+	if(FServer)
+		FServer->Publish(FB, Width, Height, FPalette);
+
+	if(img)
+	{
+		XPutImage (App::FDisplay, FWnd, copyGC, img, 0, 0, 0, 0, Width, Height);
+		XFlush (App::FDisplay);
+	}
+
+	if(Start >= 0.0)
+		FPresentTime = (float)(GetSeconds() - Start);
 }
 
 #endif
@@ -287,10 +660,20 @@ const char* AppWindowClassName = "OurApplicationWindow";
 
 static LRESULT CALLBACK MyWindowFunction(HWND, UINT, WPARAM, LPARAM);
 
-App::App()
+double GetSeconds()
+{
+	LARGE_INTEGER Freq, Count;
+	QueryPerformanceFrequency(&Freq);
+	QueryPerformanceCounter(&Count);
+	return (double)Count.QuadPart / (double)Freq.QuadPart;
+}
+
+App::App(): FPool(0, true)
 {
 	MainWnd = NULL;
 
+	ThreadPool::SetGlobal(&FPool);
+
 	WNDCLASSA wcl;
 	memset(&wcl, 0, sizeof(WNDCLASSA));
 	wcl.lpszClassName = AppWindowClassName;
@@ -303,6 +686,11 @@ App::App()
 	RegisterClassA(&wcl);
 }
 
+App::~App()
+{
+	ThreadPool::SetGlobal(NULL);
+}
+
 void App::Exit()
 {
 	if(!MainWnd) { return; }
@@ -398,6 +786,7 @@ LRESULT CALLBACK MyWindowFunction(HWND this_hwnd,UINT message, WPARAM wParam, LP
 BaseWindow::BaseWindow(int x, int y, int w, int h, const char* title)
 {
 	hMemDC = NULL;
+	FPresentTime = 0.0f;
 
 	FB = new unsigned char[w * h * 4];
 
@@ -418,7 +807,8 @@ BaseWindow::BaseWindow(int x, int y, int w, int h, const char* title)
 	
 	BitmapInfo.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
 	BitmapInfo.bmiHeader.biWidth = Width;
-	BitmapInfo.bmiHeader.biHeight = Height;
+	// negative: top-down rows, as in FB
+	BitmapInfo.bmiHeader.biHeight = -Height;
 	BitmapInfo.bmiHeader.biPlanes = 1;
 	BitmapInfo.bmiHeader.biBitCount = 24;
 	BitmapInfo.bmiHeader.biSizeImage = Width * Height * 24;
@@ -475,31 +865,29 @@ void BaseWindow::Repaint()
 
 void BaseWindow::OnPaint()
 {
-	OnDraw();
-
-	int Stride = Width * 3;
-
-	unsigned char Tmp[16384 * 3];
+	// start of presenting a new frame, < 0 if there is none
+	double Start = -1.0;
 
-	for(int y = 0 ; y < Height / 2; y++)
+	// hTmpBmp still holds the last frame, so an unchanged window only blits it again
+	if(IsFrameDirty())
 	{
-		unsigned char* Src = this->FB + y * Stride;
-		unsigned char* Dst = this->FB + (Height - y - 1) * Stride;
+		OnDraw();
+		Start = GetSeconds();
 
-		memcpy(Tmp, Src, Stride);
-		memcpy(Src, Dst, Stride);
-		memcpy(Dst, Tmp, Stride);
+		// Copy image bits to GDI bitmap. The DIB is top-down, FB is not modified: a tracked
+		// bitmap in FB (Window3D) relies on the pixels of untouched cells staying as drawn
+		SetDIBits(hMemDC, hTmpBmp, 0, Height, (BYTE*)FB, &BitmapInfo, DIB_RGB_COLORS);
 	}
 
-	// Copy image bits to GDI bitmap
-	SetDIBits(hMemDC, hTmpBmp, 0, Height, (BYTE*)FB, &BitmapInfo, DIB_RGB_COLORS);
-
 	HDC h = ::GetDC(hWnd);
 
 	SelectObject(hMemDC, hTmpBmp);
 	BitBlt(h, 0, 0, Width, Height, hMemDC, 0, 0, SRCCOPY);
 
 	ReleaseDC(hWnd, h);
+
+	if(Start >= 0.0)
+		FPresentTime = (float)(GetSeconds() - Start);
 }
 
 #endif
@@ -1,9 +1,12 @@
 #pragma once
 
+#include "ThreadPool.h"
+
 #ifdef __linux__
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
-#include <map>
+#include <vector>
+#include <unordered_map>
 #endif /** __linux */
 
 #ifdef _WIN32
@@ -20,23 +23,43 @@
 #endif
 
 class BaseWindow;
+struct FrameServer;
+
+/// Monotonic clock in seconds (arbitrary origin), for measuring real elapsed time
+double GetSeconds();
 
 struct App
 {
 	App();
+	~App();
+
 	int Run();
 	void Exit();
 
 	void SetMainWindow(BaseWindow* W) { MainWnd = W; }
 
+	/// Worker threads of the program (ThreadPool::Global() while the App exists), one per hardware thread, pinned
+	ThreadPool FPool;
+
 #ifdef __linux__
-	static std::map<Window, BaseWindow*> FWnd2Window;
+	/// Registered windows, in the order of registration
+	static std::vector<BaseWindow*> FWindows;
+
+	/// Window objects by X11 window, and the last one found (events mostly come in runs for one window)
+	static std::unordered_map<Window, BaseWindow*> FWindowMap;
+	static BaseWindow* FLastWindow;
+
+	/// Window object for the X11 window (NULL if not registered). Constant time for any number of windows
+	static BaseWindow* FindWindow(Window W);
 
 	static Display *FDisplay;
 	static int FScreen;
 
 	bool FShouldExit;
 
+	/// No X display could be opened (e.g. on a server). Windows still draw, and present only through BaseWindow::FServer
+	static bool IsHeadless() { return FDisplay == NULL; }
+
 	static void RegisterWindow(BaseWindow* W);
 	static void UnregisterWindow(BaseWindow* W);
 #endif
@@ -66,6 +89,10 @@ struct BaseWindow
 	/// Callback for user-defined rendering
 	virtual void OnDraw() {}
 
+	/// Does the next OnPaint() need a new frame? If not, OnDraw() is skipped and the last presented image
+	/// is shown again. The default always redraws
+	virtual bool IsFrameDirty() { return true; }
+
 	virtual void OnMouseDown(int btn, int x, int y) {}
 	virtual void OnMouseUp(int btn, int x, int y) {}
 	virtual void OnMouseMove(int x, int y) {}
@@ -78,6 +105,9 @@ struct BaseWindow
 	int Width, Height;
 	unsigned char* FB;
 
+	/// Seconds OnPaint() spent presenting the last new frame after OnDraw() (conversion and copy to the screen)
+	float FPresentTime;
+
 #ifdef _WIN32
 	HWND hWnd;
 
@@ -102,13 +132,53 @@ struct BaseWindow
 	bool IsCtrlOn()  const { return CtrlPressed; }
 	bool IsShiftOn() const { return ShiftPressed; }
 
+	/// Convert FB into the output image. The default converts the whole frame,
+	/// overrides may convert only the changed regions with ConvertRect()/FillRect()
+	virtual void ConvertFrame();
+
+	/// Convert a rectangle of FB, or fill one with a constant color
+	void ConvertRect(int x, int y, int w, int h);
+	void FillRect(int x, int y, int w, int h, int color);
+
+	/// Switch FB to 8-bit palette indices (Width * Height bytes), expanded through the 256 0xRRGGBB colors of Palette
+	/// when presented. The palette is not copied and may change between frames. NULL switches back to RGB24.
+	/// FB is reallocated, its content is undefined afterwards
+	void SetIndexedColor(const int* Palette);
+
+	/// Build the expansion table from FPalette, ConvertFrame() calls it (overrides have to, before ConvertRect())
+	void UpdatePalette();
+
 	bool ShiftPressed;
 	bool AltPressed;
 	bool CtrlPressed;
 
 	Window FWnd;
+
+	/// Time (GetSeconds) when OnTimer() is due next, paced by SetDelta()
+	double FNextTimer;
+
+	/// If set, every presented frame is published to the client of the server, and its input events are
+	/// dispatched to this window by App::Run(). The window does not own the server
+	FrameServer* FServer;
+
+	/// Repaint() was called and OnPaint() did not run since (headless: App::Run() calls it)
+	bool FRepaint;
+
+	/// OnDraw() and ConvertFrame() of this window may run on a worker thread, at the same time as those of other windows
+	/// with the flag. App::Run() then draws all due windows of the kind at once and only presents them afterwards
+	bool FConcurrentDraw;
+
+	/// Drawn and converted by App::Run(), the next OnPaint() presents
+	bool FDrawn;
+
+	/// Palette of an indexed FB (see SetIndexedColor), NULL for RGB24
+	const int* FPalette;
 private:
+	/// Pixels of img in the X server format, always 4 bytes per pixel (RGB565 uses half), also for an indexed FB
 	unsigned char* FBOut;
+
+	/// FPalette in the output format (BGRA32 or RGB565 in the low half)
+	unsigned int FLut[256];
 	int outBits;
 	GC copyGC;
 	XImage* img;
@@ -0,0 +1,126 @@
+#include "Font.h"
+
+/// 5x7 glyphs for ASCII 32..126. One byte per row, bit 0 is the leftmost pixel
+const unsigned char Font5x7[FONT_NUM_GLYPHS][FONT_GLYPH_HEIGHT] =
+{
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }, // ' '
+    { 0x04, 0x04, 0x04, 0x04, 0x04, 0x00, 0x04 }, // '!'
+    { 0x0A, 0x0A, 0x0A, 0x00, 0x00, 0x00, 0x00 }, // '"'
+    { 0x0A, 0x0A, 0x1F, 0x0A, 0x1F, 0x0A, 0x0A }, // '#'
+    { 0x04, 0x1E, 0x05, 0x0E, 0x14, 0x0F, 0x04 }, // '$'
+    { 0x03, 0x13, 0x08, 0x04, 0x02, 0x19, 0x18 }, // '%'
+    { 0x06, 0x09, 0x05, 0x02, 0x15, 0x09, 0x16 }, // '&'
+    { 0x06, 0x04, 0x02, 0x00, 0x00, 0x00, 0x00 }, // '\''
+    { 0x08, 0x04, 0x02, 0x02, 0x02, 0x04, 0x08 }, // '('
+    { 0x02, 0x04, 0x08, 0x08, 0x08, 0x04, 0x02 }, // ')'
+    { 0x00, 0x04, 0x15, 0x0E, 0x15, 0x04, 0x00 }, // '*'
+    { 0x00, 0x04, 0x04, 0x1F, 0x04, 0x04, 0x00 }, // '+'
+    { 0x00, 0x00, 0x00, 0x00, 0x06, 0x04, 0x02 }, // ','
+    { 0x00, 0x00, 0x00, 0x1F, 0x00, 0x00, 0x00 }, // '-'
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x06, 0x06 }, // '.'
+    { 0x00, 0x10, 0x08, 0x04, 0x02, 0x01, 0x00 }, // '/'
+    { 0x0E, 0x11, 0x19, 0x15, 0x13, 0x11, 0x0E }, // '0'
+    { 0x04, 0x06, 0x04, 0x04, 0x04, 0x04, 0x0E }, // '1'
+    { 0x0E, 0x11, 0x10, 0x08, 0x04, 0x02, 0x1F }, // '2'
+    { 0x1F, 0x08, 0x04, 0x08, 0x10, 0x11, 0x0E }, // '3'
+    { 0x08, 0x0C, 0x0A, 0x09, 0x1F, 0x08, 0x08 }, // '4'
+    { 0x1F, 0x01, 0x0F, 0x10, 0x10, 0x11, 0x0E }, // '5'
+    { 0x0C, 0x02, 0x01, 0x0F, 0x11, 0x11, 0x0E }, // '6'
+    { 0x1F, 0x10, 0x08, 0x04, 0x02, 0x02, 0x02 }, // '7'
+    { 0x0E, 0x11, 0x11, 0x0E, 0x11, 0x11, 0x0E }, // '8'
+    { 0x0E, 0x11, 0x11, 0x1E, 0x10, 0x08, 0x06 }, // '9'
+    { 0x00, 0x06, 0x06, 0x00, 0x06, 0x06, 0x00 }, // ':'
+    { 0x00, 0x06, 0x06, 0x00, 0x06, 0x04, 0x02 }, // ';'
+    { 0x08, 0x04, 0x02, 0x01, 0x02, 0x04, 0x08 }, // '<'
+    { 0x00, 0x00, 0x1F, 0x00, 0x1F, 0x00, 0x00 }, // '='
+    { 0x02, 0x04, 0x08, 0x10, 0x08, 0x04, 0x02 }, // '>'
+    { 0x0E, 0x11, 0x10, 0x08, 0x04, 0x00, 0x04 }, // '?'
+    { 0x0E, 0x11, 0x10, 0x16, 0x15, 0x15, 0x0E }, // '@'
+    { 0x0E, 0x11, 0x11, 0x11, 0x1F, 0x11, 0x11 }, // 'A'
+    { 0x0F, 0x11, 0x11, 0x0F, 0x11, 0x11, 0x0F }, // 'B'
+    { 0x0E, 0x11, 0x01, 0x01, 0x01, 0x11, 0x0E }, // 'C'
+    { 0x07, 0x09, 0x11, 0x11, 0x11, 0x09, 0x07 }, // 'D'
+    { 0x1F, 0x01, 0x01, 0x0F, 0x01, 0x01, 0x1F }, // 'E'
+    { 0x1F, 0x01, 0x01, 0x0F, 0x01, 0x01, 0x01 }, // 'F'
+    { 0x0E, 0x11, 0x01, 0x1D, 0x11, 0x11, 0x1E }, // 'G'
+    { 0x11, 0x11, 0x11, 0x1F, 0x11, 0x11, 0x11 }, // 'H'
+    { 0x0E, 0x04, 0x04, 0x04, 0x04, 0x04, 0x0E }, // 'I'
+    { 0x1C, 0x08, 0x08, 0x08, 0x08, 0x09, 0x06 }, // 'J'
+    { 0x11, 0x09, 0x05, 0x03, 0x05, 0x09, 0x11 }, // 'K'
+    { 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x1F }, // 'L'
+    { 0x11, 0x1B, 0x15, 0x15, 0x11, 0x11, 0x11 }, // 'M'
+    { 0x11, 0x11, 0x13, 0x15, 0x19, 0x11, 0x11 }, // 'N'
+    { 0x0E, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0E }, // 'O'
+    { 0x0F, 0x11, 0x11, 0x0F, 0x01, 0x01, 0x01 }, // 'P'
+    { 0x0E, 0x11, 0x11, 0x11, 0x15, 0x09, 0x16 }, // 'Q'
+    { 0x0F, 0x11, 0x11, 0x0F, 0x05, 0x09, 0x11 }, // 'R'
+    { 0x1E, 0x01, 0x01, 0x0E, 0x10, 0x10, 0x0F }, // 'S'
+    { 0x1F, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04 }, // 'T'
+    { 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0E }, // 'U'
+    { 0x11, 0x11, 0x11, 0x11, 0x11, 0x0A, 0x04 }, // 'V'
+    { 0x11, 0x11, 0x11, 0x15, 0x15, 0x15, 0x0A }, // 'W'
+    { 0x11, 0x11, 0x0A, 0x04, 0x0A, 0x11, 0x11 }, // 'X'
+    { 0x11, 0x11, 0x11, 0x0A, 0x04, 0x04, 0x04 }, // 'Y'
+    { 0x1F, 0x10, 0x08, 0x04, 0x02, 0x01, 0x1F }, // 'Z'
+    { 0x0E, 0x02, 0x02, 0x02, 0x02, 0x02, 0x0E }, // '['
+    { 0x00, 0x01, 0x02, 0x04, 0x08, 0x10, 0x00 }, // '\\'
+    { 0x0E, 0x08, 0x08, 0x08, 0x08, 0x08, 0x0E }, // ']'
+    { 0x04, 0x0A, 0x11, 0x00, 0x00, 0x00, 0x00 }, // '^'
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x1F }, // '_'
+    { 0x02, 0x04, 0x08, 0x00, 0x00, 0x00, 0x00 }, // '`'
+    { 0x00, 0x00, 0x0E, 0x10, 0x1E, 0x11, 0x1E }, // 'a'
+    { 0x01, 0x01, 0x0D, 0x13, 0x11, 0x11, 0x0F }, // 'b'
+    { 0x00, 0x00, 0x0E, 0x01, 0x01, 0x11, 0x0E }, // 'c'
+    { 0x10, 0x10, 0x16, 0x19, 0x11, 0x11, 0x1E }, // 'd'
+    { 0x00, 0x00, 0x0E, 0x11, 0x1F, 0x01, 0x0E }, // 'e'
+    { 0x0C, 0x12, 0x02, 0x07, 0x02, 0x02, 0x02 }, // 'f'
+    { 0x00, 0x1E, 0x11, 0x11, 0x1E, 0x10, 0x0E }, // 'g'
+    { 0x01, 0x01, 0x0D, 0x13, 0x11, 0x11, 0x11 }, // 'h'
+    { 0x04, 0x00, 0x06, 0x04, 0x04, 0x04, 0x0E }, // 'i'
+    { 0x08, 0x00, 0x0C, 0x08, 0x08, 0x09, 0x06 }, // 'j'
+    { 0x01, 0x01, 0x09, 0x05, 0x03, 0x05, 0x09 }, // 'k'
+    { 0x06, 0x04, 0x04, 0x04, 0x04, 0x04, 0x0E }, // 'l'
+    { 0x00, 0x00, 0x0B, 0x15, 0x15, 0x11, 0x11 }, // 'm'
+    { 0x00, 0x00, 0x0D, 0x13, 0x11, 0x11, 0x11 }, // 'n'
+    { 0x00, 0x00, 0x0E, 0x11, 0x11, 0x11, 0x0E }, // 'o'
+    { 0x00, 0x00, 0x0F, 0x11, 0x0F, 0x01, 0x01 }, // 'p'
+    { 0x00, 0x00, 0x16, 0x19, 0x1E, 0x10, 0x10 }, // 'q'
+    { 0x00, 0x00, 0x0D, 0x13, 0x01, 0x01, 0x01 }, // 'r'
+    { 0x00, 0x00, 0x0E, 0x01, 0x0E, 0x10, 0x0F }, // 's'
+    { 0x02, 0x02, 0x07, 0x02, 0x02, 0x12, 0x0C }, // 't'
+    { 0x00, 0x00, 0x11, 0x11, 0x11, 0x19, 0x16 }, // 'u'
+    { 0x00, 0x00, 0x11, 0x11, 0x11, 0x0A, 0x04 }, // 'v'
+    { 0x00, 0x00, 0x11, 0x11, 0x15, 0x15, 0x0A }, // 'w'
+    { 0x00, 0x00, 0x11, 0x0A, 0x04, 0x0A, 0x11 }, // 'x'
+    { 0x00, 0x00, 0x11, 0x11, 0x1E, 0x10, 0x0E }, // 'y'
+    { 0x00, 0x00, 0x1F, 0x08, 0x04, 0x02, 0x1F }, // 'z'
+    { 0x08, 0x04, 0x04, 0x02, 0x04, 0x04, 0x08 }, // '{'
+    { 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04 }, // '|'
+    { 0x02, 0x04, 0x04, 0x08, 0x04, 0x04, 0x02 }, // '}'
+    { 0x00, 0x00, 0x02, 0x15, 0x08, 0x00, 0x00 }, // '~'
+};
+
+int font_text_width(const char* text)
+{
+    int Width = 0, Line = 0;
+
+    for( ; *text ; text++)
+    {
+        if(*text == '\n') { Line = 0; continue; }
+
+        Line += FONT_ADVANCE;
+        if(Line > Width) { Width = Line; }
+    }
+
+    return Width;
+}
+
+int font_text_height(const char* text)
+{
+    int Lines = 1;
+
+    for( ; *text ; text++)
+        if(*text == '\n') { Lines++; }
+
+    return Lines * FONT_LINE_HEIGHT;
+}
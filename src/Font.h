@@ -0,0 +1,30 @@
+#pragma once
+
+/// Built-in 5x7 bitmap font covering printable ASCII, drawn in a 6x8 cell
+enum
+{
+    FONT_FIRST_CHAR    = 32,
+    FONT_LAST_CHAR     = 126,
+    FONT_NUM_GLYPHS    = FONT_LAST_CHAR - FONT_FIRST_CHAR + 1,
+
+    FONT_GLYPH_WIDTH   = 5,
+    FONT_GLYPH_HEIGHT  = 7,
+
+    /// Horizontal distance between characters and vertical distance between lines
+    FONT_ADVANCE       = 6,
+    FONT_LINE_HEIGHT   = 8
+};
+
+/// Glyph atlas: one row mask per glyph line, bit 0 is the leftmost pixel
+extern const unsigned char Font5x7[FONT_NUM_GLYPHS][FONT_GLYPH_HEIGHT];
+
+/// Row masks of the character (unknown characters are drawn as '?')
+inline const unsigned char* font_glyph(unsigned char c)
+{
+    if(c < FONT_FIRST_CHAR || c > FONT_LAST_CHAR) { c = '?'; }
+    return Font5x7[c - FONT_FIRST_CHAR];
+}
+
+/// Size of the text in pixels (at scale 1), lines are separated by '\n'
+int font_text_width(const char* text);
+int font_text_height(const char* text);
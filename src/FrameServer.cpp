@@ -0,0 +1,565 @@
+#include "FrameServer.h"
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+static void put_u16(unsigned char* p, unsigned v) { p[0] = (unsigned char)v; p[1] = (unsigned char)(v >> 8); }
+static void put_u32(unsigned char* p, unsigned v) { put_u16(p, v & 0xFFFF); put_u16(p + 2, v >> 16); }
+
+static unsigned get_u16(const unsigned char* p) { return (unsigned)p[0] | ((unsigned)p[1] << 8); }
+static unsigned get_u32(const unsigned char* p) { return get_u16(p) | (get_u16(p + 2) << 16); }
+
+static void set_nonblocking(int s)
+{
+    fcntl(s, F_SETFL, fcntl(s, F_GETFL, 0) | O_NONBLOCK);
+}
+
+/// Socket bound (Server) or connected to the address (see FrameServer.h), -1 on failure. Path receives the Unix socket path
+static int open_socket(const char* Address, bool Server, std::vector<char>* Path)
+{
+    if(strchr(Address, '/'))
+    {
+        sockaddr_un A;
+        memset(&A, 0, sizeof(A));
+        A.sun_family = AF_UNIX;
+
+        if(strlen(Address) >= sizeof(A.sun_path)) { return -1; }
+        strcpy(A.sun_path, Address);
+
+        int s = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if(s < 0) { return -1; }
+
+        if(Server)
+        {
+            // a stale socket file of a previous run
+            unlink(Address);
+
+            if(bind(s, (sockaddr*)&A, sizeof(A)) < 0 || listen(s, 1) < 0) { close(s); return -1; }
+
+            if(Path) { Path->assign(Address, Address + strlen(Address) + 1); }
+        } else
+        if(connect(s, (sockaddr*)&A, sizeof(A)) < 0) { close(s); return -1; }
+
+        return s;
+    }
+
+    // "port" or "host:port", numeric hosts only
+    char Host[64] = "127.0.0.1";
+    const char* Port = Address;
+
+    if(const char* Colon = strchr(Address, ':'))
+    {
+        size_t Len = (size_t)(Colon - Address);
+        if(Len >= sizeof(Host)) { return -1; }
+
+        memcpy(Host, Address, Len);
+        Host[Len] = 0;
+        Port = Colon + 1;
+    }
+
+    sockaddr_in A;
+    memset(&A, 0, sizeof(A));
+    A.sin_family = AF_INET;
+    A.sin_port   = htons((unsigned short)atoi(Port));
+
+    if(inet_pton(AF_INET, Host, &A.sin_addr) != 1) { return -1; }
+
+    int s = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(s < 0) { return -1; }
+
+    int On = 1;
+
+    if(Server)
+    {
+        setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &On, sizeof(On));
+
+        if(bind(s, (sockaddr*)&A, sizeof(A)) < 0 || listen(s, 1) < 0) { close(s); return -1; }
+    } else
+    {
+        if(connect(s, (sockaddr*)&A, sizeof(A)) < 0) { close(s); return -1; }
+
+        setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &On, sizeof(On));
+    }
+
+    return s;
+}
+
+void StreamSocket::Attach(int Socket)
+{
+    Close();
+
+    set_nonblocking(Socket);
+    FSocket = Socket;
+}
+
+void StreamSocket::Close()
+{
+    if(FSocket >= 0) { close(FSocket); }
+
+    FSocket = -1;
+    FIn.clear();
+    FOut.clear();
+    FSent = 0;
+}
+
+void StreamSocket::Flush()
+{
+    while(FSocket >= 0 && FSent < FOut.size())
+    {
+        ssize_t n = send(FSocket, &FOut[FSent], FOut.size() - FSent, MSG_NOSIGNAL);
+
+        if(n > 0) { FSent += (size_t)n; continue; }
+        if(n < 0 && errno == EINTR) { continue; }
+        if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) { return; }
+
+        Close();
+        return;
+    }
+
+    FOut.clear();
+    FSent = 0;
+}
+
+void StreamSocket::Receive()
+{
+    unsigned char Buf[16384];
+
+    while(FSocket >= 0)
+    {
+        ssize_t n = recv(FSocket, Buf, sizeof(Buf), 0);
+
+        if(n > 0) { FIn.insert(FIn.end(), Buf, Buf + n); continue; }
+        if(n < 0 && errno == EINTR) { continue; }
+        if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) { return; }
+
+        Close();
+    }
+}
+
+static inline unsigned long long hash_mix(unsigned long long h, unsigned long long w)
+{
+    h = (h ^ w) * 0xFF51AFD7ED558CCDull;
+    return h ^ (h >> 32);
+}
+
+/// Continue the hash of a tile with the next Size bytes of pixels, in two independent lanes (half the dependency chain).
+/// Every step is a bijection of the lane for a fixed word, so a change of a single word always changes the hash
+static inline void hash_bytes(unsigned long long& a, unsigned long long& b, const unsigned char* P, size_t Size)
+{
+    size_t i = 0;
+    for( ; i + 16 <= Size ; i += 16)
+    {
+        unsigned long long w0, w1;
+        memcpy(&w0, P + i, 8);
+        memcpy(&w1, P + i + 8, 8);
+
+        a = hash_mix(a, w0);
+        b = hash_mix(b, w1);
+    }
+
+    if(i + 8 <= Size)
+    {
+        unsigned long long w;
+        memcpy(&w, P + i, 8);
+
+        a = hash_mix(a, w);
+        i += 8;
+    }
+
+    if(i < Size)
+    {
+        unsigned long long w = 0;
+        memcpy(&w, P + i, Size - i);
+
+        b = hash_mix(b, w);
+    }
+}
+
+static inline bool same_pixel(const unsigned char* a, const unsigned char* b)
+{
+    return a[0] == b[0] && a[1] == b[1] && a[2] == b[2];
+}
+
+/// Run-length code Count RGB pixels (see FrameServer.h)
+static void rle_encode(const unsigned char* P, int Count, std::vector<unsigned char>& Out)
+{
+    int i = 0;
+
+    while(i < Count)
+    {
+        int Run = 1;
+        while(i + Run < Count && Run < 128 && same_pixel(P + i * 3, P + (i + Run) * 3)) { Run++; }
+
+        if(Run >= 2)
+        {
+            Out.push_back((unsigned char)(127 + Run));
+            Out.insert(Out.end(), P + i * 3, P + i * 3 + 3);
+            i += Run;
+            continue;
+        }
+
+        // literals up to the start of the next run
+        int Lit = 1;
+        while(i + Lit < Count && Lit < 128 && !(i + Lit + 1 < Count && same_pixel(P + (i + Lit) * 3, P + (i + Lit + 1) * 3))) { Lit++; }
+
+        Out.push_back((unsigned char)(Lit - 1));
+        Out.insert(Out.end(), P + i * 3, P + (i + Lit) * 3);
+        i += Lit;
+    }
+}
+
+/// Decode exactly Count pixels from exactly Size bytes, false if the data does not match
+static bool rle_decode(const unsigned char* In, size_t Size, unsigned char* P, int Count)
+{
+    size_t Pos = 0;
+    int i = 0;
+
+    while(Pos < Size)
+    {
+        int c = In[Pos++];
+
+        if(c >= 128)
+        {
+            int Run = c - 127;
+            if(i + Run > Count || Pos + 3 > Size) { return false; }
+
+            for(int k = 0 ; k < Run ; k++, i++) { memcpy(P + i * 3, In + Pos, 3); }
+            Pos += 3;
+        } else
+        {
+            int Lit = c + 1;
+            if(i + Lit > Count || Pos + (size_t)Lit * 3 > Size) { return false; }
+
+            memcpy(P + i * 3, In + Pos, (size_t)Lit * 3);
+            Pos += (size_t)Lit * 3;
+            i += Lit;
+        }
+    }
+
+    return i == Count;
+}
+
+FrameServer::FrameServer(): FFramesSent(0), FFramesDropped(0), FTilesSent(0), FBytesSent(0.0), FListen(-1),
+    FWidth(0), FHeight(0), FKeyFrame(true), FStale(true), FEventPos(0)
+{
+}
+
+FrameServer::~FrameServer()
+{
+    Close();
+}
+
+bool FrameServer::Listen(const char* Address)
+{
+    Close();
+
+    FListen = open_socket(Address, true, &FPath);
+    if(FListen < 0) { return false; }
+
+    set_nonblocking(FListen);
+
+    FFramesSent = FFramesDropped = 0;
+    FTilesSent = 0;
+    FBytesSent = 0.0;
+
+    return true;
+}
+
+void FrameServer::Close()
+{
+    FClient.Close();
+
+    if(FListen >= 0) { close(FListen); }
+    FListen = -1;
+
+    if(!FPath.empty()) { unlink(&FPath[0]); }
+    FPath.clear();
+}
+
+void FrameServer::Accept()
+{
+    int s = accept(FListen, NULL, NULL);
+    if(s < 0) { return; }
+
+    int On = 1;
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &On, sizeof(On));
+
+    FClient.Attach(s);
+
+    // the new client has nothing yet
+    FKeyFrame = true;
+    FStale    = true;
+
+    FEvents.clear();
+    FEventPos = 0;
+}
+
+void FrameServer::Poll()
+{
+    if(FListen < 0) { return; }
+
+    if(!FClient.IsOpen()) { Accept(); }
+    if(!FClient.IsOpen()) { return; }
+
+    FClient.Flush();
+    FClient.Receive();
+
+    const size_t Count = FClient.FIn.size() / STREAM_EVENT_SIZE;
+    if(!Count) { return; }
+
+    if(FEventPos >= FEvents.size())
+    {
+        FEvents.clear();
+        FEventPos = 0;
+    }
+
+    for(size_t i = 0 ; i < Count ; i++)
+    {
+        const unsigned char* p = &FClient.FIn[i * STREAM_EVENT_SIZE];
+
+        StreamEvent E;
+        E.Type = (int)get_u32(p);
+        E.A    = (int)get_u32(p + 4);
+        E.B    = (int)get_u32(p + 8);
+        E.C    = (int)get_u32(p + 12);
+        FEvents.push_back(E);
+    }
+
+    FClient.FIn.erase(FClient.FIn.begin(), FClient.FIn.begin() + Count * STREAM_EVENT_SIZE);
+}
+
+bool FrameServer::NextEvent(StreamEvent& E)
+{
+    if(FEventPos >= FEvents.size()) { return false; }
+
+    E = FEvents[FEventPos++];
+    return true;
+}
+
+bool FrameServer::Publish(const unsigned char* Pixels, int Width, int Height, const int* Palette)
+{
+    FClient.Flush();
+
+    if(!FClient.IsOpen() || Width <= 0 || Height <= 0) { return false; }
+
+    // at most one frame in flight
+    if(!FClient.IsIdle())
+    {
+        FStale = true;
+        FFramesDropped++;
+        return false;
+    }
+
+    const int TilesX = (Width  + STREAM_TILE_SIZE - 1) >> STREAM_TILE_SHIFT;
+    const int TilesY = (Height + STREAM_TILE_SIZE - 1) >> STREAM_TILE_SHIFT;
+
+    if(Width != FWidth || Height != FHeight)
+    {
+        FWidth  = Width;
+        FHeight = Height;
+        FHashes.assign((size_t)TilesX * TilesY, 0);
+        FKeyFrame = true;
+    }
+
+    // the hashes of indexed tiles only hold for the palette they were taken with
+    if(Palette && (FPalette.empty() || memcmp(&FPalette[0], Palette, 256 * sizeof(int))))
+    {
+        FPalette.assign(Palette, Palette + 256);
+        FKeyFrame = true;
+    }
+
+    const int Size = Palette ? 1 : 3;
+
+    std::vector<unsigned char>& Out = FClient.FOut;
+    Out.resize(STREAM_FRAME_HEADER);
+
+    unsigned char Tile[STREAM_TILE_SIZE * STREAM_TILE_SIZE * 3];
+    int NumTiles = 0;
+
+    for(int ty = 0 ; ty < TilesY ; ty++)
+    {
+        const int y = ty << STREAM_TILE_SHIFT;
+        const int h = (Height - y < STREAM_TILE_SIZE) ? Height - y : STREAM_TILE_SIZE;
+
+        for(int tx = 0 ; tx < TilesX ; tx++)
+        {
+            const int x = tx << STREAM_TILE_SHIFT;
+            const int w = (Width - x < STREAM_TILE_SIZE) ? Width - x : STREAM_TILE_SIZE;
+
+            const unsigned char* Src = Pixels + ((size_t)y * Width + x) * Size;
+
+            // hashed in place, only changed tiles are copied out
+            unsigned long long a = 0x9E3779B97F4A7C15ull, b = 0xC2B2AE3D27D4EB4Full;
+            for(int r = 0 ; r < h ; r++)
+                hash_bytes(a, b, Src + (size_t)r * Width * Size, w * Size);
+
+            const unsigned long long Hash = a ^ ((b << 23) | (b >> 41));
+
+            unsigned long long& Prev = FHashes[ty * TilesX + tx];
+
+            if(!FKeyFrame && Hash == Prev) { continue; }
+            Prev = Hash;
+
+            for(int r = 0 ; r < h ; r++)
+            {
+                if(!Palette)
+                {
+                    memcpy(Tile + r * w * 3, Src + (size_t)r * Width * 3, w * 3);
+                    continue;
+                }
+
+                const unsigned char* p = Src + (size_t)r * Width;
+                unsigned char* d = Tile + r * w * 3;
+
+                for(int i = 0 ; i < w ; i++, d += 3)
+                {
+                    int c = Palette[p[i]];
+                    d[0] = (unsigned char)(c >> 16); d[1] = (unsigned char)(c >> 8); d[2] = (unsigned char)c;
+                }
+            }
+
+            size_t At = Out.size();
+            Out.resize(At + STREAM_TILE_HEADER);
+            rle_encode(Tile, w * h, Out);
+
+            put_u16(&Out[At], tx);
+            put_u16(&Out[At + 2], ty);
+            put_u16(&Out[At + 4], (unsigned)(Out.size() - At - STREAM_TILE_HEADER));
+
+            NumTiles++;
+        }
+    }
+
+    FKeyFrame = false;
+    FStale    = false;
+
+    // nothing changed
+    if(!NumTiles)
+    {
+        Out.clear();
+        return true;
+    }
+
+    memcpy(&Out[0], "MFFS", 4);
+    put_u16(&Out[4], Width);
+    put_u16(&Out[6], Height);
+    put_u32(&Out[8], NumTiles);
+    put_u32(&Out[12], (unsigned)(Out.size() - STREAM_FRAME_HEADER));
+
+    FFramesSent++;
+    FTilesSent += NumTiles;
+    FBytesSent += (double)Out.size();
+
+    FClient.Flush();
+    return true;
+}
+
+bool FrameClient::Connect(const char* Address)
+{
+    int s = open_socket(Address, false, NULL);
+    if(s < 0) { return false; }
+
+    FServer.Attach(s);
+    return true;
+}
+
+void FrameClient::SendEvent(int Type, int A, int B, int C)
+{
+    if(!FServer.IsOpen()) { return; }
+
+    unsigned char p[STREAM_EVENT_SIZE];
+    put_u32(p, (unsigned)Type);
+    put_u32(p + 4, (unsigned)A);
+    put_u32(p + 8, (unsigned)B);
+    put_u32(p + 12, (unsigned)C);
+
+    FServer.FOut.insert(FServer.FOut.end(), p, p + STREAM_EVENT_SIZE);
+    FServer.Flush();
+}
+
+bool FrameClient::Poll()
+{
+    FServer.Flush();
+    FServer.Receive();
+
+    std::vector<unsigned char>& In = FServer.FIn;
+
+    bool Changed = false;
+    size_t Pos = 0;
+
+    while(FServer.IsOpen() && In.size() - Pos >= STREAM_FRAME_HEADER)
+    {
+        const unsigned char* p = &In[Pos];
+
+        int Width    = (int)get_u16(p + 4);
+        int Height   = (int)get_u16(p + 6);
+        int NumTiles = (int)get_u32(p + 8);
+        size_t Size  = get_u32(p + 12);
+
+        if(memcmp(p, "MFFS", 4) != 0) { FServer.Close(); break; }
+
+        if(In.size() - Pos - STREAM_FRAME_HEADER < Size) { break; }
+
+        if(!DecodeFrame(p + STREAM_FRAME_HEADER, Size, Width, Height, NumTiles)) { FServer.Close(); break; }
+
+        Pos += STREAM_FRAME_HEADER + Size;
+        FFrames++;
+        Changed = true;
+    }
+
+    // Close() empties the buffer
+    if(Pos > 0 && FServer.IsOpen()) { In.erase(In.begin(), In.begin() + Pos); }
+
+    return Changed;
+}
+
+bool FrameClient::DecodeFrame(const unsigned char* Data, size_t Size, int Width, int Height, int NumTiles)
+{
+    if(Width <= 0 || Height <= 0) { return false; }
+
+    const int TilesX = (Width  + STREAM_TILE_SIZE - 1) >> STREAM_TILE_SHIFT;
+    const int TilesY = (Height + STREAM_TILE_SIZE - 1) >> STREAM_TILE_SHIFT;
+
+    if(NumTiles > TilesX * TilesY) { return false; }
+
+    if(Width != FWidth || Height != FHeight)
+    {
+        FWidth  = Width;
+        FHeight = Height;
+        FPixels.assign((size_t)Width * Height * 3, 0);
+    }
+
+    unsigned char Tile[STREAM_TILE_SIZE * STREAM_TILE_SIZE * 3];
+    size_t Pos = 0;
+
+    for(int i = 0 ; i < NumTiles ; i++)
+    {
+        if(Size - Pos < STREAM_TILE_HEADER) { return false; }
+
+        int tx = (int)get_u16(Data + Pos);
+        int ty = (int)get_u16(Data + Pos + 2);
+        size_t Bytes = get_u16(Data + Pos + 4);
+        Pos += STREAM_TILE_HEADER;
+
+        if(tx >= TilesX || ty >= TilesY || Size - Pos < Bytes) { return false; }
+
+        const int x = tx << STREAM_TILE_SHIFT, y = ty << STREAM_TILE_SHIFT;
+        const int w = (Width  - x < STREAM_TILE_SIZE) ? Width  - x : STREAM_TILE_SIZE;
+        const int h = (Height - y < STREAM_TILE_SIZE) ? Height - y : STREAM_TILE_SIZE;
+
+        if(!rle_decode(Data + Pos, Bytes, Tile, w * h)) { return false; }
+        Pos += Bytes;
+
+        for(int r = 0 ; r < h ; r++)
+            memcpy(&FPixels[((size_t)(y + r) * Width + x) * 3], Tile + r * w * 3, w * 3);
+    }
+
+    return Pos == Size;
+}
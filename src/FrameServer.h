@@ -0,0 +1,161 @@
+#pragma once
+
+/// Streaming of presented frames over a socket, for viewing windows of a machine without a display
+/// (see BaseWindow::FServer and example/streamview.cpp). POSIX sockets, one client at a time.
+///
+/// The image is split into 16x16 tiles. Every published frame is compared tile by tile (64-bit hash of the pixels)
+/// with the last frame sent, only the changed tiles go out, run-length coded. A frame is sent only when the previous
+/// one has left the process completely, otherwise it is dropped: a slow client gets fewer frames, never stale ones,
+/// and the next frame sent is the difference to what the client has.
+///
+/// Addresses are "port" (TCP on the loopback interface), "host:port" (TCP, e.g. "0.0.0.0:5900" for all interfaces)
+/// or a path containing a '/' (Unix socket).
+///
+/// Wire format, all values little endian:
+///   frame  (server -> client): "MFFS", u16 width, u16 height, u32 number of tiles, u32 bytes of tile data, tiles
+///   tile:  u16 tile x, u16 tile y, u16 bytes, runs of RGB pixels in row order (of the clipped tile)
+///   run:   control byte c, c < 128: c + 1 literal pixels follow, c >= 128: one pixel follows, repeated c - 127 times
+///   event  (client -> server): u32 type, i32 a, i32 b, i32 c (see StreamEventType)
+
+#include <stddef.h>
+#include <vector>
+
+#define STREAM_TILE_SHIFT 4
+#define STREAM_TILE_SIZE  (1 << STREAM_TILE_SHIFT)
+
+enum { STREAM_FRAME_HEADER = 16, STREAM_TILE_HEADER = 6, STREAM_EVENT_SIZE = 16 };
+
+/// Input events sent back by the client. Buttons and key codes are the ones of the client's platform
+enum StreamEventType
+{
+    STREAM_MOUSE_DOWN = 1,  // a = button, b = x, c = y
+    STREAM_MOUSE_UP,        // a = button, b = x, c = y
+    STREAM_MOUSE_MOVE,      // b = x, c = y
+    STREAM_WHEEL_UP,
+    STREAM_WHEEL_DOWN,
+    STREAM_KEY_DOWN,        // a = key
+    STREAM_KEY_UP           // a = key
+};
+
+struct StreamEvent
+{
+    int Type, A, B, C;
+};
+
+/// Non-blocking connection with input and output buffers
+struct StreamSocket
+{
+    StreamSocket(): FSocket(-1), FSent(0) {}
+    ~StreamSocket() { Close(); }
+
+    void Attach(int Socket);
+    void Close();
+
+    bool IsOpen() const { return FSocket >= 0; }
+
+    /// Send as much of FOut as the socket takes. Closes the connection on errors
+    void Flush();
+
+    /// Append everything available to FIn. Closes the connection on errors or when the peer closed it
+    void Receive();
+
+    /// Nothing of FOut is waiting
+    bool IsIdle() const { return FSent >= FOut.size(); }
+
+    int FSocket;
+
+    std::vector<unsigned char> FIn, FOut;
+    size_t FSent;
+
+private:
+    StreamSocket(const StreamSocket&);
+    StreamSocket& operator=(const StreamSocket&);
+};
+
+struct FrameServer
+{
+    FrameServer();
+    ~FrameServer();
+
+    /// Start listening. Returns false if the address cannot be bound
+    bool Listen(const char* Address);
+    void Close();
+
+    bool IsConnected() const { return FClient.IsOpen(); }
+
+    /// Accept a waiting client, send pending data and read input events. Call regularly (App::Run does for BaseWindow::FServer)
+    void Poll();
+
+    /// Next input event received from the client, false if there is none
+    bool NextEvent(StreamEvent& E);
+
+    /// Offer an RGB24 frame to the client. Returns false if there is no client or the frame was dropped
+    /// because the previous one is still being sent. With a Palette (256 0xRRGGBB colors) the frame holds 8-bit
+    /// indices instead: tiles are hashed on the indices and expanded to RGB when sent
+    bool Publish(const unsigned char* Pixels, int Width, int Height, const int* Palette = NULL);
+
+    /// The client misses the current image (it just connected or the last frame was dropped) and the connection is
+    /// ready for a frame. The owner publishes again even if nothing changed
+    bool NeedsFrame() const { return FClient.IsOpen() && FStale && FClient.IsIdle(); }
+
+    /// Frames sent and dropped, tiles sent and bytes sent since Listen()
+    int    FFramesSent, FFramesDropped;
+    long   FTilesSent;
+    double FBytesSent;
+
+private:
+    int FListen;
+    StreamSocket FClient;
+
+    /// Size of the last frame sent and the hashes of its tiles
+    int FWidth, FHeight;
+    std::vector<unsigned long long> FHashes;
+
+    /// Palette of the last indexed frame (a new one resends all tiles)
+    std::vector<int> FPalette;
+
+    /// The client needs all tiles with the next frame / missed the latest image
+    bool FKeyFrame, FStale;
+
+    /// Unix socket path to remove on Close()
+    std::vector<char> FPath;
+
+    /// Events received, FEventPos is the next one
+    std::vector<StreamEvent> FEvents;
+    size_t FEventPos;
+
+    void Accept();
+
+    FrameServer(const FrameServer&);
+    FrameServer& operator=(const FrameServer&);
+};
+
+/// Receiving end of a FrameServer, keeps the decoded image
+struct FrameClient
+{
+    FrameClient(): FWidth(0), FHeight(0), FFrames(0) {}
+
+    /// Connect (blocking). Returns false if the server cannot be reached
+    bool Connect(const char* Address);
+    void Close() { FServer.Close(); }
+
+    bool IsConnected() const { return FServer.IsOpen(); }
+
+    /// Send pending events, receive and decode. Returns true if the image changed. Damaged data closes the connection
+    bool Poll();
+
+    void SendEvent(int Type, int A = 0, int B = 0, int C = 0);
+
+    /// Current image, RGB24 rows of FWidth pixels (empty before the first frame)
+    std::vector<unsigned char> FPixels;
+    int FWidth, FHeight;
+
+    /// Frames decoded so far
+    int FFrames;
+
+private:
+    StreamSocket FServer;
+
+    /// Decode one complete frame, false if it is damaged
+    bool DecodeFrame(const unsigned char* Data, size_t Size, int Width, int Height, int NumTiles);
+};
@@ -0,0 +1,12 @@
+#pragma once
+
+/// Minimal fork-join helper: Fn(i) is called for every i in [0, Count) on the threads of the global pool
+/// (see ThreadPool.h). Fn must be safe to call concurrently
+
+#include "ThreadPool.h"
+
+template <class FnT>
+void parallel_for(int Count, const FnT& Fn)
+{
+    ThreadPool::Global().ParallelFor(Count, Fn);
+}
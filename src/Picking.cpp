@@ -0,0 +1,160 @@
+#include "Picking.h"
+#include <math.h>
+
+PickGrid::PickGrid(int CellSize): FCellSize(CellSize), FWidth(0), FHeight(0), FCellsX(0), FCellsY(0) {}
+
+void PickGrid::Begin(int W, int H)
+{
+    FWidth  = W;
+    FHeight = H;
+
+    FCellsX = (W + FCellSize - 1) / FCellSize;
+    FCellsY = (H + FCellSize - 1) / FCellSize;
+
+    FSegments.clear();
+    FNodes.clear();
+    FHeads.assign(FCellsX * FCellsY, -1);
+}
+
+void PickGrid::AddToCell(int cx, int cy, int Seg)
+{
+    int& Head = FHeads[cy * FCellsX + cx];
+
+    Node N;
+    N.Seg  = Seg;
+    N.Next = Head;
+
+    Head = (int)FNodes.size();
+    FNodes.push_back(N);
+}
+
+void PickGrid::AddSegment(float x0, float y0, float x1, float y1, int ID)
+{
+    if(FCellsX <= 0 || FCellsY <= 0) { return; }
+
+    // Liang-Barsky against the target, the rest of the segment can never be under the mouse
+    const float Lo[2] = { 0.0f, 0.0f };
+    const float Hi[2] = { (float)FWidth, (float)FHeight };
+
+    float P0[2] = { x0, y0 };
+    float D[2]  = { x1 - x0, y1 - y0 };
+
+    float t0 = 0.0f, t1 = 1.0f;
+
+    for(int k = 0 ; k < 2 ; k++)
+    {
+        if(D[k] == 0.0f)
+        {
+            if(P0[k] < Lo[k] || P0[k] > Hi[k]) { return; }
+            continue;
+        }
+
+        float ta = (Lo[k] - P0[k]) / D[k];
+        float tb = (Hi[k] - P0[k]) / D[k];
+        if(ta > tb) { float t = ta; ta = tb; tb = t; }
+
+        if(ta > t0) { t0 = ta; }
+        if(tb < t1) { t1 = tb; }
+    }
+
+    if(t0 > t1) { return; }
+
+    Segment S;
+    S.X0 = P0[0] + t0 * D[0]; S.Y0 = P0[1] + t0 * D[1];
+    S.X1 = P0[0] + t1 * D[0]; S.Y1 = P0[1] + t1 * D[1];
+    S.ID = ID;
+
+    const int Index = (int)FSegments.size();
+    FSegments.push_back(S);
+
+    // walk the cell rows covered by the segment, in each row add the cells between the x at the row borders
+    const float Cell = (float)FCellSize;
+
+    float ya = S.Y0 < S.Y1 ? S.Y0 : S.Y1;
+    float yb = S.Y0 < S.Y1 ? S.Y1 : S.Y0;
+
+    int cy0 = (int)(ya / Cell), cy1 = (int)(yb / Cell);
+    if(cy1 >= FCellsY) { cy1 = FCellsY - 1; }
+
+    const float Dy = S.Y1 - S.Y0;
+
+    for(int cy = cy0 ; cy <= cy1 ; cy++)
+    {
+        float xa, xb;
+
+        if(Dy == 0.0f)
+        {
+            xa = S.X0; xb = S.X1;
+        } else
+        {
+            float ra = (float)cy * Cell, rb = ra + Cell;
+            if(ra < ya) { ra = ya; }
+            if(rb > yb) { rb = yb; }
+
+            xa = S.X0 + (S.X1 - S.X0) * (ra - S.Y0) / Dy;
+            xb = S.X0 + (S.X1 - S.X0) * (rb - S.Y0) / Dy;
+        }
+
+        if(xa > xb) { float t = xa; xa = xb; xb = t; }
+
+        int cx0 = (int)(xa / Cell), cx1 = (int)(xb / Cell);
+        if(cx1 >= FCellsX) { cx1 = FCellsX - 1; }
+
+        for(int cx = cx0 ; cx <= cx1 ; cx++)
+            AddToCell(cx, cy, Index);
+    }
+}
+
+/// Squared distance from (px, py) to the segment
+static float SegmentDist2(float px, float py, float x0, float y0, float x1, float y1)
+{
+    float dx = x1 - x0, dy = y1 - y0;
+    float L2 = dx * dx + dy * dy;
+
+    float t = (L2 > 0.0f) ? ((px - x0) * dx + (py - y0) * dy) / L2 : 0.0f;
+    if(t < 0.0f) { t = 0.0f; }
+    if(t > 1.0f) { t = 1.0f; }
+
+    float ex = x0 + t * dx - px, ey = y0 + t * dy - py;
+    return ex * ex + ey * ey;
+}
+
+int PickGrid::Query(int x, int y, float Radius, float* Dist) const
+{
+    if(FCellsX <= 0 || FCellsY <= 0) { return -1; }
+
+    const float px = (float)x, py = (float)y;
+
+    int cx0 = (int)floorf((px - Radius) / FCellSize), cx1 = (int)floorf((px + Radius) / FCellSize);
+    int cy0 = (int)floorf((py - Radius) / FCellSize), cy1 = (int)floorf((py + Radius) / FCellSize);
+
+    if(cx0 < 0) { cx0 = 0; }
+    if(cy0 < 0) { cy0 = 0; }
+    if(cx1 >= FCellsX) { cx1 = FCellsX - 1; }
+    if(cy1 >= FCellsY) { cy1 = FCellsY - 1; }
+
+    float Best = Radius * Radius;
+    int   BestSeg = -1;
+
+    for(int cy = cy0 ; cy <= cy1 ; cy++)
+        for(int cx = cx0 ; cx <= cx1 ; cx++)
+            for(int n = FHeads[cy * FCellsX + cx] ; n >= 0 ; n = FNodes[n].Next)
+            {
+                const int i = FNodes[n].Seg;
+                const Segment& S = FSegments[i];
+
+                float d = SegmentDist2(px, py, S.X0, S.Y0, S.X1, S.Y1);
+
+                if(d < Best || (d == Best && i > BestSeg))
+                {
+                    Best = d;
+                    BestSeg = i;
+                }
+            }
+
+    if(BestSeg < 0) { return -1; }
+
+    if(Dist) { *Dist = sqrtf(Best); }
+
+    return FSegments[BestSeg].ID;
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <vector>
+
+/// Screen-space picking structure. Canvas3D fills it while drawing (see Canvas3D::FPick), afterwards
+/// Query() finds the primitive under the mouse without re-projecting or re-rendering anything.
+/// Primitives are binned into a uniform grid of square cells, so a query only looks at the few cells around
+/// the cursor, independent of the scene size. All storage is reused from frame to frame
+struct PickGrid
+{
+    PickGrid(int CellSize = 16);
+
+    /// Start a new frame for a W x H target (keeps the allocated memory)
+    void Begin(int W, int H);
+
+    /// Segment (in pixels) belonging to the primitive ID. Parts outside the target are dropped
+    void AddSegment(float x0, float y0, float x1, float y1, int ID);
+
+    /// Single point, e.g. the anchor of a label
+    void AddPoint(float x, float y, int ID) { AddSegment(x, y, x, y, ID); }
+
+    /// ID of the nearest primitive within Radius pixels of (x, y), -1 if there is none.
+    /// On equal distance the primitive drawn last (on top) wins. Dist receives the distance if given
+    int Query(int x, int y, float Radius, float* Dist = 0) const;
+
+    int GetNumSegments() const { return (int)FSegments.size(); }
+
+    /// Size of the target given to Begin()
+    int GetWidth()  const { return FWidth;  }
+    int GetHeight() const { return FHeight; }
+
+private:
+    struct Segment
+    {
+        float X0, Y0, X1, Y1;
+        int ID;
+    };
+
+    /// Entry of a cell list: a segment index and the next entry of the same cell (-1 ends the list)
+    struct Node
+    {
+        int Seg;
+        int Next;
+    };
+
+    void AddToCell(int cx, int cy, int Seg);
+
+    int FCellSize;
+    int FWidth, FHeight;
+    int FCellsX, FCellsY;
+
+    std::vector<Segment> FSegments;
+    std::vector<Node>    FNodes;
+
+    /// First node of every cell
+    std::vector<int>     FHeads;
+};
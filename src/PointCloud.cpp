@@ -0,0 +1,341 @@
+#include "PointCloud.h"
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+#  include <fcntl.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <unistd.h>
+#endif
+
+#ifdef _WIN32
+#  define WIN32_LEAN_AND_MEAN
+#  include <windows.h>
+#endif
+
+PointCloudFile::PointCloudFile(): FData(NULL), FChunks(NULL), FSize(0)
+{
+#ifdef _WIN32
+    FFile = FMapping = NULL;
+#endif
+}
+
+PointCloudFile::~PointCloudFile()
+{
+    Close();
+}
+
+bool PointCloudFile::Open(const char* FileName)
+{
+    Close();
+
+#ifdef __linux__
+    int fd = open(FileName, O_RDONLY);
+    if(fd < 0) { return false; }
+
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(PointCloudHeader)) { close(fd); return false; }
+
+    void* p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if(p == MAP_FAILED) { return false; }
+
+    FData = (const unsigned char*)p;
+    FSize = (unsigned long long)st.st_size;
+
+    // chunks are visited in file order, but the visible ones only: keep the default read-ahead
+#endif
+
+#ifdef _WIN32
+    FFile = CreateFileA(FileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if(FFile == INVALID_HANDLE_VALUE) { FFile = NULL; return false; }
+
+    LARGE_INTEGER Size;
+    GetFileSizeEx((HANDLE)FFile, &Size);
+
+    FMapping = CreateFileMappingA((HANDLE)FFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    if(!FMapping) { Close(); return false; }
+
+    FData = (const unsigned char*)MapViewOfFile((HANDLE)FMapping, FILE_MAP_READ, 0, 0, 0);
+    FSize = (unsigned long long)Size.QuadPart;
+
+    if(!FData || FSize < sizeof(PointCloudHeader)) { Close(); return false; }
+#endif
+
+    // validate the header and the chunk table
+    const PointCloudHeader& H = GetHeader();
+
+    bool Valid = !memcmp(H.Magic, "PCLD", 4) && H.Version == 1 &&
+                 H.TableOffset <= FSize && (FSize - H.TableOffset) / sizeof(PointCloudChunk) >= H.NumChunks;
+
+    if(Valid)
+    {
+        FChunks = (const PointCloudChunk*)(FData + H.TableOffset);
+
+        const unsigned long long PointSize = (H.Flags & PCF_COLORS) ? 16 : 12;
+
+        for(unsigned i = 0 ; i < H.NumChunks && Valid ; i++)
+            Valid = FChunks[i].Offset <= FSize && (FSize - FChunks[i].Offset) / PointSize >= FChunks[i].Count;
+    }
+
+    if(!Valid) { Close(); return false; }
+
+    return true;
+}
+
+void PointCloudFile::Close()
+{
+#ifdef __linux__
+    if(FData) { munmap((void*)FData, (size_t)FSize); }
+#endif
+
+#ifdef _WIN32
+    if(FData)    { UnmapViewOfFile(FData); }
+    if(FMapping) { CloseHandle((HANDLE)FMapping); }
+    if(FFile)    { CloseHandle((HANDLE)FFile); }
+    FFile = FMapping = NULL;
+#endif
+
+    FData   = NULL;
+    FChunks = NULL;
+    FSize   = 0;
+}
+
+const int* PointCloudFile::GetColors(int i) const
+{
+    if(!(GetHeader().Flags & PCF_COLORS)) { return NULL; }
+
+    return (const int*)(FData + FChunks[i].Offset + (unsigned long long)FChunks[i].Count * 12);
+}
+
+void PointCloudFile::Prefetch(int i) const
+{
+#ifdef __linux__
+    const unsigned long long PageSize = (unsigned long long)sysconf(_SC_PAGESIZE);
+
+    unsigned long long Begin = FChunks[i].Offset;
+    unsigned long long End   = Begin + (unsigned long long)FChunks[i].Count * ((GetHeader().Flags & PCF_COLORS) ? 16 : 12);
+
+    Begin &= ~(PageSize - 1);
+
+    madvise((void*)(FData + Begin), (size_t)(End - Begin), MADV_WILLNEED);
+#endif
+}
+
+//// Writer
+
+PointCloudWriter::PointCloudWriter(): FFile(NULL), FFlags(0), FPointsPerChunk(0), FNumPoints(0), FOffset(0),
+    FPoints(NULL), FColors(NULL), FCount(0), FTable(NULL), FNumChunks(0), FTableCapacity(0) {}
+
+bool PointCloudWriter::Open(const char* FileName, unsigned Flags, int PointsPerChunk)
+{
+    Close();
+
+    FFile = fopen(FileName, "wb");
+    if(!FFile) { return false; }
+
+    FFlags = Flags;
+    FPointsPerChunk = PointsPerChunk < 2 ? 2 : PointsPerChunk;
+    FNumPoints = 0;
+    FCount = 0;
+    FNumChunks = 0;
+
+    FPoints = (float*)malloc(FPointsPerChunk * 3 * sizeof(float));
+    FColors = (int*)malloc(FPointsPerChunk * sizeof(int));
+
+    // the header is written by Close()
+    PointCloudHeader H;
+    memset(&H, 0, sizeof(H));
+    fwrite(&H, sizeof(H), 1, FFile);
+    FOffset = sizeof(H);
+
+    return true;
+}
+
+void PointCloudWriter::Add(const vec3& P, int Color)
+{
+    if(!FFile) { return; }
+
+    if(FCount == FPointsPerChunk)
+    {
+        // a polyline continues from the last point of the previous chunk
+        float Last[3] = { FPoints[3 * FCount - 3], FPoints[3 * FCount - 2], FPoints[3 * FCount - 1] };
+        int LastColor = FColors[FCount - 1];
+
+        FlushChunk();
+
+        if(FFlags & PCF_POLYLINE)
+        {
+            memcpy(FPoints, Last, sizeof(Last));
+            FColors[0] = LastColor;
+            FCount = 1;
+        }
+    }
+
+    FPoints[3 * FCount + 0] = P.x;
+    FPoints[3 * FCount + 1] = P.y;
+    FPoints[3 * FCount + 2] = P.z;
+    FColors[FCount] = Color;
+    FCount++;
+
+    FNumPoints++;
+}
+
+void PointCloudWriter::FlushChunk()
+{
+    if(FCount == 0) { return; }
+
+    if(FNumChunks == FTableCapacity)
+    {
+        FTableCapacity = FTableCapacity ? FTableCapacity * 2 : 64;
+        FTable = (PointCloudChunk*)realloc(FTable, FTableCapacity * sizeof(PointCloudChunk));
+    }
+
+    PointCloudChunk& C = FTable[FNumChunks++];
+    memset(&C, 0, sizeof(C));
+
+    C.Offset = FOffset;
+    C.Count  = (unsigned)FCount;
+
+    for(int k = 0 ; k < 3 ; k++) { C.Min[k] = C.Max[k] = FPoints[k]; }
+
+    for(int i = 1 ; i < FCount ; i++)
+        for(int k = 0 ; k < 3 ; k++)
+        {
+            float v = FPoints[3 * i + k];
+            if(v < C.Min[k]) { C.Min[k] = v; }
+            if(v > C.Max[k]) { C.Max[k] = v; }
+        }
+
+    fwrite(FPoints, sizeof(float) * 3, FCount, FFile);
+    FOffset += (unsigned long long)FCount * sizeof(float) * 3;
+
+    if(FFlags & PCF_COLORS)
+    {
+        fwrite(FColors, sizeof(int), FCount, FFile);
+        FOffset += (unsigned long long)FCount * sizeof(int);
+    }
+
+    FCount = 0;
+}
+
+bool PointCloudWriter::Close()
+{
+    if(!FFile) { return false; }
+
+    // a polyline chunk holding only the repeated point adds nothing
+    if(!((FFlags & PCF_POLYLINE) && FCount == 1 && FNumChunks > 0))
+        FlushChunk();
+
+    PointCloudHeader H;
+    memset(&H, 0, sizeof(H));
+    memcpy(H.Magic, "PCLD", 4);
+    H.Version     = 1;
+    H.Flags       = FFlags;
+    H.NumChunks   = FNumChunks;
+    H.NumPoints   = FNumPoints;
+    H.TableOffset = FOffset;
+
+    fwrite(FTable, sizeof(PointCloudChunk), FNumChunks, FFile);
+
+    fseek(FFile, 0, SEEK_SET);
+    fwrite(&H, sizeof(H), 1, FFile);
+
+    bool Ok = !ferror(FFile);
+    fclose(FFile);
+
+    free(FPoints);
+    free(FColors);
+    free(FTable);
+
+    FFile   = NULL;
+    FPoints = NULL;
+    FColors = NULL;
+    FTable  = NULL;
+    FNumChunks = FTableCapacity = 0;
+
+    return Ok;
+}
+
+//// Culling and projection
+
+bool box_outside_frustum(const mtx4& ViewProj, const float* Min, const float* Max)
+{
+    const float* m = ViewProj.x;
+
+    // clip coordinates of the 8 corners
+    float C[8][4];
+
+    for(int i = 0 ; i < 8 ; i++)
+    {
+        float x = (i & 1) ? Max[0] : Min[0];
+        float y = (i & 2) ? Max[1] : Min[1];
+        float z = (i & 4) ? Max[2] : Min[2];
+
+        for(int k = 0 ; k < 4 ; k++)
+            C[i][k] = x * m[k] + y * m[4 + k] + z * m[8 + k] + m[12 + k];
+    }
+
+    // -w <= x, y, z <= w for every plane
+    for(int k = 0 ; k < 3 ; k++)
+    {
+        bool AllBelow = true, AllAbove = true;
+
+        for(int i = 0 ; i < 8 ; i++)
+        {
+            if(C[i][k] >= -C[i][3]) { AllBelow = false; }
+            if(C[i][k] <=  C[i][3]) { AllAbove = false; }
+        }
+
+        if(AllBelow || AllAbove) { return true; }
+    }
+
+    return false;
+}
+
+void project_points(ProjectedPoints& Out, const mtx4& ViewProj, const float* xyz, int Count, int W, int H, int OfsX, int OfsY, bool ClipXY)
+{
+    // clip coordinates of the whole batch first (vectorized in vecmath.h)
+    vec4 C[ProjectedPoints::BatchSize];
+    transform_points(C, ViewProj, xyz, Count);
+
+    // the mapping of canvas_ndc_to_fb()
+    const float w2 = (float)((W - 1) / 2);
+    const float h2 = (float)((H - 1) / 2);
+
+    int n = 0;
+
+    for(int i = 0 ; i < Count ; i++)
+    {
+        const vec4& c = C[i];
+        if(c.w <= 0.0f) { continue; }
+
+        float iw = 1.0f / c.w;
+
+        float nz = c.z * iw;
+        if(nz < -1.0f || nz > 1.0f) { continue; }
+
+        float fx = (c.x * iw + 1.0f) * w2;
+        float fy = (c.y * iw + 1.0f) * h2;
+
+        if(ClipXY)
+        {
+            if(!(fx >= 0.0f && fx < (float)W && fy >= 0.0f && fy < (float)H)) { continue; }
+        } else
+        {
+            // keep the integer conversion defined, the line clipping handles the rest
+            if(fx < -1.0e6f) { fx = -1.0e6f; } else if(fx > 1.0e6f) { fx = 1.0e6f; }
+            if(fy < -1.0e6f) { fy = -1.0e6f; } else if(fy > 1.0e6f) { fy = 1.0e6f; }
+        }
+
+        Out.X[n] = (int)fx + OfsX;
+        Out.Y[n] = (int)fy + OfsY;
+        Out.Z[n] = (nz + 1.0f) * 0.5f;
+        Out.Index[n] = i;
+        n++;
+    }
+
+    Out.Count = n;
+}
@@ -0,0 +1,142 @@
+#pragma once
+
+/// Large point clouds and polylines (trajectories) in a memory-mapped file.
+///
+/// File layout (little endian):
+///     PointCloudHeader
+///     chunk data: Count * xyz floats, followed by Count packed 0xRRGGBB colors if PCF_COLORS is set
+///     PointCloudChunk table (NumChunks entries) at Header.TableOffset
+///
+/// Every chunk has a bounding box, so whole chunks outside the view frustum are skipped without touching their pages.
+/// For polylines each chunk starts with the last point of the previous one, so chunks can be drawn independently.
+
+#include "vecmath.h"
+#include <stdio.h>
+
+enum PointCloudFlags
+{
+    /// A packed color per point follows the coordinates of every chunk
+    PCF_COLORS   = 1,
+
+    /// Consecutive points are connected
+    PCF_POLYLINE = 2
+};
+
+struct PointCloudHeader
+{
+    char     Magic[4];          // "PCLD"
+    unsigned Version;           // 1
+    unsigned Flags;             // PointCloudFlags
+    unsigned NumChunks;
+    unsigned long long NumPoints;
+    unsigned long long TableOffset;
+};
+
+struct PointCloudChunk
+{
+    unsigned long long Offset;  // of the coordinates, from the start of the file
+    unsigned Count;
+    unsigned Reserved;
+    float    Min[3], Max[3];
+};
+
+/// Read-only mapping of a point cloud file. Nothing is copied: chunk data is read straight from the mapping
+struct PointCloudFile
+{
+    PointCloudFile();
+    ~PointCloudFile();
+
+    /// Map the file. Returns false if it cannot be opened or is not a valid point cloud
+    bool Open(const char* FileName);
+    void Close();
+
+    bool IsOpen() const { return FData != NULL; }
+
+    const PointCloudHeader& GetHeader() const { return *(const PointCloudHeader*)FData; }
+    int GetNumChunks() const { return FData ? (int)GetHeader().NumChunks : 0; }
+
+    const PointCloudChunk& GetChunk(int i) const { return FChunks[i]; }
+
+    /// xyz triples of the chunk
+    const float* GetPoints(int i) const { return (const float*)(FData + FChunks[i].Offset); }
+
+    /// Colors of the chunk, NULL without PCF_COLORS
+    const int* GetColors(int i) const;
+
+    /// Ask the OS to start reading the chunk in the background (madvise(MADV_WILLNEED), no-op where unsupported)
+    void Prefetch(int i) const;
+
+private:
+    const unsigned char*   FData;
+    const PointCloudChunk* FChunks;
+    unsigned long long     FSize;
+
+#ifdef _WIN32
+    void* FFile;
+    void* FMapping;
+#endif
+
+    PointCloudFile(const PointCloudFile&);
+    PointCloudFile& operator=(const PointCloudFile&);
+};
+
+/// Sequential writer of the format above
+struct PointCloudWriter
+{
+    PointCloudWriter();
+    ~PointCloudWriter() { Close(); }
+
+    /// Start a file. Flags are PointCloudFlags, chunks hold up to PointsPerChunk points
+    bool Open(const char* FileName, unsigned Flags, int PointsPerChunk = 64 * 1024);
+
+    /// Append a point (Color is ignored without PCF_COLORS)
+    void Add(const vec3& P, int Color = 0);
+
+    /// Write the last chunk, the chunk table and the header
+    bool Close();
+
+private:
+    void FlushChunk();
+
+    FILE* FFile;
+    unsigned FFlags;
+    int FPointsPerChunk;
+
+    unsigned long long FNumPoints;
+
+    /// Bytes written so far, the offset of the next write (ftell() is 32 bits on Win64)
+    unsigned long long FOffset;
+
+    /// Points of the current chunk
+    float* FPoints;
+    int*   FColors;
+    int    FCount;
+
+    /// Table of the written chunks
+    PointCloudChunk* FTable;
+    unsigned FNumChunks, FTableCapacity;
+
+    PointCloudWriter(const PointCloudWriter&);
+    PointCloudWriter& operator=(const PointCloudWriter&);
+};
+
+/// True if the box [Min, Max] lies completely outside one of the frustum planes of ViewProj
+bool box_outside_frustum(const mtx4& ViewProj, const float* Min, const float* Max);
+
+/// Projected points of one batch, in pixels of a viewport
+struct ProjectedPoints
+{
+    enum { BatchSize = 1024 };
+
+    int   X[BatchSize], Y[BatchSize];
+    float Z[BatchSize];
+
+    /// Index of the point in the input batch
+    int   Index[BatchSize];
+
+    int   Count;
+};
+
+/// Transform up to BatchSize xyz points with ViewProj and map them to a W x H viewport at (OfsX, OfsY) like Canvas3D does.
+/// Points behind the camera or outside the depth range are dropped, with ClipXY also the ones outside the viewport
+void project_points(ProjectedPoints& Out, const mtx4& ViewProj, const float* xyz, int Count, int W, int H, int OfsX, int OfsY, bool ClipXY);
@@ -0,0 +1,387 @@
+#include "PointSplat.h"
+#include "PointCloud.h"
+#include "BitmapRaster.h"
+#include "Parallel.h"
+#include <math.h>
+#include <string.h>
+
+/// Below this many points the threads cost more than they save
+static const int ParallelThreshold = 64 * 1024;
+
+/// Points handled per pass, bounds the size of the bins
+static const int PassPoints = 1 << 20;
+
+void PointSplatter::Begin(Bitmap* Target, int Mode, int Size)
+{
+    FTarget = Target;
+    FMode   = Mode;
+    FSize   = Size < 1 ? 1 : Size;
+
+    const int N = Target->Width * Target->Height;
+
+    if(Mode == SPLAT_NEAREST && !Target->ZB) { FDepth.assign(N, 1.0f); }
+    if(Mode == SPLAT_DENSITY)                { FCounts.assign(N, 0); }
+}
+
+template <class PixelT, class LayoutT, int Mode>
+void PointSplatter::SplatRunT(const SplatPoint* P, int Count, int RowMin, int RowMax)
+{
+    if(Count <= 0) { return; }
+
+    Bitmap* B = FTarget;
+
+    unsigned char* Base = LayoutT::Base(B);
+    float* Depth = B->ZB ? B->ZB : (FDepth.empty() ? NULL : &FDepth[0]);
+    unsigned* Counts = FCounts.empty() ? NULL : &FCounts[0];
+    const bool Track = (B->FCells != NULL);
+
+    const int h = FSize / 2;
+
+    // points come in long runs of one color (or one per point from a file): convert only on a change
+    int Color = P[0].Color;
+    typename PixelT::Value v = PixelT::FromRGB(B, Color);
+
+    for(int k = 0 ; k < Count ; k++)
+    {
+        const SplatPoint& S = P[k];
+
+        int x0 = S.X - h, x1 = x0 + FSize;
+        int y0 = S.Y - h, y1 = y0 + FSize;
+
+        if(x0 < B->FClipX0) { x0 = B->FClipX0; }
+        if(x1 > B->FClipX1) { x1 = B->FClipX1; }
+        if(y0 < RowMin)     { y0 = RowMin; }
+        if(y1 > RowMax)     { y1 = RowMax; }
+
+        if(Mode != SPLAT_DENSITY && S.Color != Color)
+        {
+            Color = S.Color;
+            v = PixelT::FromRGB(B, Color);
+        }
+
+        for(int y = y0 ; y < y1 ; y++)
+        {
+            for(int x = x0 ; x < x1 ; x++)
+            {
+                const int i = y * B->Width + x;
+
+                if(Mode == SPLAT_DENSITY)
+                {
+                    Counts[i]++;
+                    continue;
+                }
+
+                if(Mode == SPLAT_NEAREST)
+                {
+                    if(S.Z >= Depth[i]) { continue; }
+                    Depth[i] = S.Z;
+                }
+
+                PixelT::Store(Base + LayoutT::Index(B, x, y) * PixelT::Size, v);
+
+                if(Track) { B->TouchPixel(x, y); }
+            }
+        }
+    }
+}
+
+void PointSplatter::SplatRun(const SplatPoint* P, int Count, int RowMin, int RowMax)
+{
+    // the counts do not depend on the pixel format
+    if(FMode == SPLAT_DENSITY)
+    {
+        SplatRunT<PixelRGB24, LayoutLinear, SPLAT_DENSITY>(P, Count, RowMin, RowMax);
+        return;
+    }
+
+    const bool Nearest = (FMode == SPLAT_NEAREST);
+
+    if(FTarget->GetFormat() == BITMAP_INDEXED8)
+    {
+        if(Nearest)
+            SplatRunT<PixelIndexed8, LayoutLinear, SPLAT_NEAREST>(P, Count, RowMin, RowMax);
+        else
+            SplatRunT<PixelIndexed8, LayoutLinear, SPLAT_OVERWRITE>(P, Count, RowMin, RowMax);
+    } else
+    if(FTarget->GetLayout() == BITMAP_TILED)
+    {
+        if(Nearest)
+            SplatRunT<PixelRGB24, LayoutTiled, SPLAT_NEAREST>(P, Count, RowMin, RowMax);
+        else
+            SplatRunT<PixelRGB24, LayoutTiled, SPLAT_OVERWRITE>(P, Count, RowMin, RowMax);
+    } else
+    {
+        if(Nearest)
+            SplatRunT<PixelRGB24, LayoutLinear, SPLAT_NEAREST>(P, Count, RowMin, RowMax);
+        else
+            SplatRunT<PixelRGB24, LayoutLinear, SPLAT_OVERWRITE>(P, Count, RowMin, RowMax);
+    }
+}
+
+void PointSplatter::PlanBands(int NumThreads)
+{
+    // a few bands per thread for balance, whole tracking cells each
+    int ClipH = FTarget->FClipY1 - FTarget->FClipY0;
+    FBandHeight = (ClipH / (NumThreads * 4) + BITMAP_TRACK_SIZE - 1) & ~(BITMAP_TRACK_SIZE - 1);
+    if(FBandHeight < BITMAP_TRACK_SIZE) { FBandHeight = BITMAP_TRACK_SIZE; }
+
+    FNumBands = (FTarget->Height + FBandHeight - 1) / FBandHeight;
+}
+
+void PointSplatter::GetBandRows(int Band, int& RowMin, int& RowMax) const
+{
+    RowMin = Band * FBandHeight;
+    RowMax = RowMin + FBandHeight;
+
+    if(RowMin < FTarget->FClipY0) { RowMin = FTarget->FClipY0; }
+    if(RowMax > FTarget->FClipY1) { RowMax = FTarget->FClipY1; }
+}
+
+void PointSplatter::DrawBand(int Band)
+{
+    int RowMin, RowMax;
+    GetBandRows(Band, RowMin, RowMax);
+
+    // slices in order: the same result as drawing the points one by one
+    for(int s = 0 ; s < FNumSlices ; s++)
+    {
+        const std::vector<SplatPoint>& Bin = FBins[s * FNumBands + Band];
+
+        if(!Bin.empty()) { SplatRun(&Bin[0], (int)Bin.size(), RowMin, RowMax); }
+    }
+}
+
+/// Pass 1: project a slice of the points and bin them by band
+struct SplatProjectTask
+{
+    PointSplatter* S;
+    const mtx4* ViewProj;
+    const float* xyz;
+    const int* Colors;
+    int Count, Color;
+    int VpX, VpY, VpW, VpH;
+
+    void operator()(int Slice) const
+    {
+        const int Begin = (int)((long long)Count * Slice / S->FNumSlices);
+        const int End   = (int)((long long)Count * (Slice + 1) / S->FNumSlices);
+
+        std::vector<PointSplatter::SplatPoint>* Bins = &S->FBins[Slice * S->FNumBands];
+
+        for(int b = 0 ; b < S->FNumBands ; b++)
+            Bins[b].clear();
+
+        const int h = S->FSize / 2;
+
+        ProjectedPoints P;
+
+        for(int i = Begin ; i < End ; i += ProjectedPoints::BatchSize)
+        {
+            int n = End - i < (int)ProjectedPoints::BatchSize ? End - i : (int)ProjectedPoints::BatchSize;
+
+            project_points(P, *ViewProj, xyz + 3 * i, n, VpW, VpH, VpX, VpY, true);
+
+            for(int j = 0 ; j < P.Count ; j++)
+            {
+                PointSplatter::SplatPoint Sp;
+                Sp.X = P.X[j];
+                Sp.Y = P.Y[j];
+                Sp.Z = P.Z[j];
+                Sp.Color = Colors ? Colors[i + P.Index[j]] : Color;
+
+                // every band the splat overlaps
+                int b0 = (Sp.Y - h) / S->FBandHeight, b1 = (Sp.Y - h + S->FSize - 1) / S->FBandHeight;
+                if(Sp.Y - h < 0)           { b0 = 0; }
+                if(b1 >= S->FNumBands)     { b1 = S->FNumBands - 1; }
+
+                for(int b = b0 ; b <= b1 ; b++)
+                    Bins[b].push_back(Sp);
+            }
+        }
+    }
+};
+
+/// Pass 2: one band per call
+struct SplatBandTask
+{
+    PointSplatter* S;
+
+    void operator()(int Band) const { S->DrawBand(Band); }
+};
+
+void PointSplatter::Add(const mtx4& ViewProj, const float* xyz, int Count, int Color, const int* Colors, int VpX, int VpY, int VpW, int VpH)
+{
+    if(!FTarget || Count <= 0) { return; }
+
+    if(FMode == SPLAT_DENSITY) { FDensityColor = Color; }
+
+    int NumThreads = ThreadPool::Global().GetNumThreads();
+
+    if(Count < ParallelThreshold || NumThreads <= 1)
+    {
+        ProjectedPoints P;
+        SplatPoint Run[ProjectedPoints::BatchSize];
+
+        for(int i = 0 ; i < Count ; i += ProjectedPoints::BatchSize)
+        {
+            int n = Count - i < (int)ProjectedPoints::BatchSize ? Count - i : (int)ProjectedPoints::BatchSize;
+
+            project_points(P, ViewProj, xyz + 3 * i, n, VpW, VpH, VpX, VpY, true);
+
+            for(int j = 0 ; j < P.Count ; j++)
+            {
+                Run[j].X = P.X[j];
+                Run[j].Y = P.Y[j];
+                Run[j].Z = P.Z[j];
+                Run[j].Color = Colors ? Colors[i + P.Index[j]] : Color;
+            }
+
+            SplatRun(Run, P.Count, FTarget->FClipY0, FTarget->FClipY1);
+        }
+        return;
+    }
+
+    PlanBands(NumThreads);
+    FNumSlices = NumThreads;
+    FBins.resize(FNumSlices * FNumBands);
+
+    for(int i = 0 ; i < Count ; i += PassPoints)
+    {
+        SplatProjectTask Project;
+        Project.S        = this;
+        Project.ViewProj = &ViewProj;
+        Project.xyz      = xyz + 3 * i;
+        Project.Colors   = Colors ? Colors + i : NULL;
+        Project.Count    = Count - i < PassPoints ? Count - i : PassPoints;
+        Project.Color    = Color;
+        Project.VpX = VpX; Project.VpY = VpY; Project.VpW = VpW; Project.VpH = VpH;
+
+        parallel_for(FNumSlices, Project);
+
+        SplatBandTask Draw;
+        Draw.S = this;
+
+        parallel_for(FNumBands, Draw);
+    }
+}
+
+void PointSplatter::MaxBand(int Band)
+{
+    int RowMin, RowMax;
+    GetBandRows(Band, RowMin, RowMax);
+
+    const Bitmap* B = FTarget;
+
+    unsigned Max = 0;
+    for(int y = RowMin ; y < RowMax ; y++)
+        for(int x = B->FClipX0 ; x < B->FClipX1 ; x++)
+            if(FCounts[y * B->Width + x] > Max) { Max = FCounts[y * B->Width + x]; }
+
+    FBandMax[Band] = Max;
+}
+
+template <class PixelT, class LayoutT>
+void PointSplatter::ResolveBandT(int Band, float Scale)
+{
+    int RowMin, RowMax;
+    GetBandRows(Band, RowMin, RowMax);
+
+    Bitmap* B = FTarget;
+
+    unsigned char* Base = LayoutT::Base(B);
+    const bool Track = (B->FCells != NULL);
+
+    const int R = (FDensityColor >> 16) & 0xFF, G = (FDensityColor >> 8) & 0xFF, Bl = FDensityColor & 0xFF;
+
+    // the color depends on the count only: small counts (the common ones) are converted once per band,
+    // larger ones when they differ from the previous pixel
+    enum { LutSize = 256 };
+    typename PixelT::Value Lut[LutSize];
+    unsigned char Have[LutSize];
+    memset(Have, 0, sizeof(Have));
+
+    unsigned Last = 0;
+    typename PixelT::Value v = PixelT::FromRGB(B, 0);
+
+    for(int y = RowMin ; y < RowMax ; y++)
+        for(int x = B->FClipX0 ; x < B->FClipX1 ; x++)
+        {
+            unsigned c = FCounts[y * B->Width + x];
+            if(!c) { continue; }
+
+            if(c != Last)
+            {
+                if(c < LutSize && Have[c])
+                {
+                    v = Lut[c];
+                } else
+                {
+                    float f = logf(1.0f + (float)c) * Scale;
+                    v = PixelT::FromRGB(B, ((int)(R * f) << 16) | ((int)(G * f) << 8) | (int)(Bl * f));
+
+                    if(c < LutSize) { Lut[c] = v; Have[c] = 1; }
+                }
+
+                Last = c;
+            }
+
+            PixelT::Store(Base + LayoutT::Index(B, x, y) * PixelT::Size, v);
+
+            if(Track) { B->TouchPixel(x, y); }
+        }
+}
+
+void PointSplatter::ResolveBand(int Band, float Scale)
+{
+    if(FTarget->GetFormat() == BITMAP_INDEXED8)
+        ResolveBandT<PixelIndexed8, LayoutLinear>(Band, Scale);
+    else
+    if(FTarget->GetLayout() == BITMAP_TILED)
+        ResolveBandT<PixelRGB24, LayoutTiled>(Band, Scale);
+    else
+        ResolveBandT<PixelRGB24, LayoutLinear>(Band, Scale);
+}
+
+/// Density resolve, one band per call: the largest counts first (Scale == 0), then the pixels
+struct SplatResolveTask
+{
+    PointSplatter* S;
+    float Scale;
+
+    void operator()(int Band) const
+    {
+        if(Scale > 0.0f)
+            S->ResolveBand(Band, Scale);
+        else
+            S->MaxBand(Band);
+    }
+};
+
+void PointSplatter::End()
+{
+    if(!FTarget || FMode != SPLAT_DENSITY) { FTarget = NULL; return; }
+
+    // bands of whole tracking cells, as in Add()
+    PlanBands(ThreadPool::Global().GetNumThreads());
+    FBandMax.assign(FNumBands, 0);
+
+    SplatResolveTask Task;
+    Task.S     = this;
+    Task.Scale = 0.0f;
+
+    parallel_for(FNumBands, Task);
+
+    unsigned Max = 0;
+    for(int b = 0 ; b < FNumBands ; b++)
+        if(FBandMax[b] > Max) { Max = FBandMax[b]; }
+
+    if(Max > 0)
+    {
+        // log scale, so that sparse regions stay visible next to dense ones
+        Task.Scale = 1.0f / logf(1.0f + (float)Max);
+
+        parallel_for(FNumBands, Task);
+    }
+
+    FTarget = NULL;
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+/// Fast point rendering straight into a Bitmap: batched transform, then 1x1 or NxN splats with an optional
+/// per-pixel reduction. Large batches run on all cores in two conflict-free passes:
+///   1. every thread projects a slice of the points and bins them by horizontal screen band,
+///   2. every band is drawn by one thread, in input order, so the result equals the sequential one.
+/// Bands are multiples of the tracking cell height, so occupancy flags never get written from two threads.
+
+#include "vecmath.h"
+#include "Bitmap.h"
+#include <vector>
+
+enum PointSplatMode
+{
+    /// Later points overwrite earlier ones
+    SPLAT_OVERWRITE = 0,
+
+    /// Keep the nearest point per pixel (tested against Bitmap::ZB if set, so points and depth-tested triangles mix)
+    SPLAT_NEAREST,
+
+    /// Count the points per pixel, End() maps the counts to a log-scaled intensity of the point color
+    SPLAT_DENSITY
+};
+
+struct PointSplatter
+{
+    PointSplatter(): FTarget(NULL), FMode(SPLAT_OVERWRITE), FSize(1), FDensityColor(0xFFFFFF), FNumSlices(0), FNumBands(0), FBandHeight(0) {}
+
+    /// Start drawing into Target (within its clip rectangle). Size is the splat width in pixels
+    void Begin(Bitmap* Target, int Mode, int Size = 1);
+
+    /// Transform and splat Count xyz points. Colors (one per point) may be NULL to use Color for all.
+    /// (VpX, VpY, VpW, VpH) is the viewport the projection maps to (see Canvas3D::SetViewport)
+    void Add(const mtx4& ViewProj, const float* xyz, int Count, int Color, const int* Colors, int VpX, int VpY, int VpW, int VpH);
+
+    /// Finish the frame (resolves SPLAT_DENSITY into the bitmap, in parallel bands)
+    void End();
+
+    /// Splat of a projected point, X/Y in bitmap pixels
+    struct SplatPoint
+    {
+        int X, Y;
+        float Z;
+        int Color;
+    };
+
+private:
+    /// Set FBandHeight and FNumBands for NumThreads threads, and the rows [RowMin, RowMax) of a band inside the clip rectangle
+    void PlanBands(int NumThreads);
+    void GetBandRows(int Band, int& RowMin, int& RowMax) const;
+
+    void DrawBand(int Band);
+
+    /// Splat Count points, clipped to the rows [RowMin, RowMax). SplatRun() picks the SplatRunT<> of the format, layout and mode
+    void SplatRun(const SplatPoint* P, int Count, int RowMin, int RowMax);
+    template <class PixelT, class LayoutT, int Mode> void SplatRunT(const SplatPoint* P, int Count, int RowMin, int RowMax);
+
+    /// Density resolve of a band: its largest count (into FBandMax), then the pixels
+    void MaxBand(int Band);
+    void ResolveBand(int Band, float Scale);
+    template <class PixelT, class LayoutT> void ResolveBandT(int Band, float Scale);
+
+    Bitmap* FTarget;
+    int FMode, FSize;
+
+    /// Color used by the density resolve (the Color of the last Add())
+    int FDensityColor;
+
+    /// Depth buffer for SPLAT_NEAREST when the bitmap has none, counts for SPLAT_DENSITY
+    std::vector<float>    FDepth;
+    std::vector<unsigned> FCounts;
+
+    /// Pass 1 output: FBins[Slice * FNumBands + Band]
+    std::vector< std::vector<SplatPoint> > FBins;
+    int FNumSlices, FNumBands, FBandHeight;
+
+    /// Largest count per band of the density resolve
+    std::vector<unsigned> FBandMax;
+
+    friend struct SplatProjectTask;
+    friend struct SplatBandTask;
+    friend struct SplatResolveTask;
+};
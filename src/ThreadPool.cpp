@@ -0,0 +1,291 @@
+#include "ThreadPool.h"
+#include <stdio.h>
+#include <new>
+
+#ifdef __linux__
+#  include <pthread.h>
+#  include <sched.h>
+#endif
+
+#ifdef _WIN32
+#  define WIN32_LEAN_AND_MEAN
+#  include <windows.h>
+#endif
+
+static ThreadPool* GlobalPool = NULL;
+
+ThreadPool& ThreadPool::Global()
+{
+    if(GlobalPool) { return *GlobalPool; }
+
+    static ThreadPool Default;
+    return Default;
+}
+
+void ThreadPool::SetGlobal(ThreadPool* P)
+{
+    GlobalPool = P;
+}
+
+/// CPUs in NUMA node order (node 0 first). Without the node information (or off Linux) simply 0, 1, 2, ...
+static void numa_cpu_order(std::vector<int>& CPUs)
+{
+    CPUs.clear();
+
+#ifdef __linux__
+    for(int Node = 0 ; ; Node++)
+    {
+        char Name[96];
+        snprintf(Name, sizeof(Name), "/sys/devices/system/node/node%d/cpulist", Node);
+
+        FILE* F = fopen(Name, "r");
+        if(!F) { break; }
+
+        // "0-7,16-23"
+        int a, b;
+        while(fscanf(F, "%d", &a) == 1)
+        {
+            b = a;
+
+            int c = fgetc(F);
+            if(c == '-')
+            {
+                if(fscanf(F, "%d", &b) != 1) { b = a; }
+                c = fgetc(F);
+            }
+
+            for(int i = a ; i <= b ; i++) { CPUs.push_back(i); }
+
+            if(c != ',') { break; }
+        }
+
+        fclose(F);
+    }
+#endif
+
+    int N = (int)std::thread::hardware_concurrency();
+    if(CPUs.empty())
+    {
+        for(int i = 0 ; i < N ; i++) { CPUs.push_back(i); }
+    }
+}
+
+static void pin_thread(int CPU)
+{
+#ifdef __linux__
+    cpu_set_t Set;
+    CPU_ZERO(&Set);
+    CPU_SET(CPU, &Set);
+    pthread_setaffinity_np(pthread_self(), sizeof(Set), &Set);
+#endif
+
+#ifdef _WIN32
+    if(CPU < 64) { SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << CPU); }
+#endif
+}
+
+ThreadPool::ThreadPool(int NumThreads, bool Pin): FInline(false), FJob(NULL), FJobCtx(NULL), FGeneration(0), FPending(0),
+    FStop(false), FBusy(false), FRanges(NULL), FRangeMemory(NULL)
+{
+    Start(NumThreads, Pin);
+}
+
+ThreadPool::~ThreadPool()
+{
+    Stop();
+}
+
+void ThreadPool::Resize(int NumThreads, bool Pin)
+{
+    Stop();
+    Start(NumThreads, Pin);
+}
+
+void ThreadPool::Start(int NumThreads, bool Pin)
+{
+    if(NumThreads <= 0) { NumThreads = (int)std::thread::hardware_concurrency(); }
+    if(NumThreads <= 0) { NumThreads = 1; }
+
+    std::vector<int> CPUs;
+    if(Pin) { numa_cpu_order(CPUs); }
+
+    // plain new[] only aligns to the alignment of the largest fundamental type
+    FRangeMemory = new char[NumThreads * sizeof(Range) + 63];
+    FRanges = (Range*)(((size_t)FRangeMemory + 63) & ~(size_t)63);
+
+    for(int t = 0 ; t < NumThreads ; t++)
+        new(&FRanges[t]) Range();
+
+    FStop   = false;
+
+    // the calling thread is thread 0 and stays where it is
+    for(int t = 1 ; t < NumThreads ; t++)
+    {
+        int CPU = CPUs.empty() ? -1 : CPUs[t % CPUs.size()];
+        FWorkers.push_back(std::thread(&ThreadPool::Worker, this, t, CPU, FGeneration));
+    }
+}
+
+void ThreadPool::Stop()
+{
+    {
+        std::lock_guard<std::mutex> Lock(FMutex);
+        FStop = true;
+    }
+
+    FWake.notify_all();
+
+    for(size_t t = 0 ; t < FWorkers.size() ; t++)
+        FWorkers[t].join();
+
+    FWorkers.clear();
+
+    // the ranges hold nothing to destroy
+    delete[] FRangeMemory;
+    FRangeMemory = NULL;
+    FRanges = NULL;
+}
+
+void ThreadPool::Worker(int Thread, int CPU, unsigned Seen)
+{
+    if(CPU >= 0) { pin_thread(CPU); }
+
+    for(;;)
+    {
+        void (*Fn)(void*, int, int);
+        void* Ctx;
+        int N;
+
+        {
+            std::unique_lock<std::mutex> Lock(FMutex);
+            FWake.wait(Lock, [&] { return FStop || FGeneration != Seen; });
+
+            if(FStop) { return; }
+
+            Seen = FGeneration;
+            Fn   = FJob;
+            Ctx  = FJobCtx;
+            N    = (int)FWorkers.size() + 1;
+        }
+
+        Fn(Ctx, Thread, N);
+
+        std::lock_guard<std::mutex> Lock(FMutex);
+        if(--FPending == 0) { FDone.notify_one(); }
+    }
+}
+
+void ThreadPool::RunJob(void (*Fn)(void*, int, int), void* Ctx)
+{
+    {
+        std::lock_guard<std::mutex> Lock(FMutex);
+        FJob    = Fn;
+        FJobCtx = Ctx;
+        FPending = (int)FWorkers.size();
+        FGeneration++;
+    }
+
+    FWake.notify_all();
+
+    Fn(Ctx, 0, (int)FWorkers.size() + 1);
+
+    std::unique_lock<std::mutex> Lock(FMutex);
+    FDone.wait(Lock, [&] { return FPending == 0; });
+}
+
+void ThreadPool::Run(void (*Fn)(void*, int, int), void* Ctx)
+{
+    if(!Acquire())
+    {
+        Fn(Ctx, 0, 1);
+        return;
+    }
+
+    RunJob(Fn, Ctx);
+    FBusy = false;
+}
+
+int TaskGraph::Add(void (*Fn)(void*), void* Ctx, const int* Deps, int NumDeps)
+{
+    const int ID = (int)FTasks.size();
+
+    FTasks.push_back(Task());
+
+    Task& T   = FTasks.back();
+    T.Fn      = Fn;
+    T.Ctx     = Ctx;
+    T.NumDeps = 0;
+    T.Pending = 0;
+
+    for(int i = 0 ; i < NumDeps ; i++)
+    {
+        if(Deps[i] < 0 || Deps[i] >= ID) { continue; }
+
+        FTasks[Deps[i]].Next.push_back(ID);
+        T.NumDeps++;
+    }
+
+    return ID;
+}
+
+void TaskGraph::Run(ThreadPool& Pool)
+{
+    FReady.clear();
+    FReadyPos = 0;
+    FDone = 0;
+
+    for(size_t i = 0 ; i < FTasks.size() ; i++)
+    {
+        FTasks[i].Pending = FTasks[i].NumDeps;
+        if(!FTasks[i].NumDeps) { FReady.push_back((int)i); }
+    }
+
+    if(FTasks.empty()) { return; }
+
+    Pool.Run(Body, this);
+}
+
+void TaskGraph::Body(void* Ctx, int, int)
+{
+    TaskGraph* G = (TaskGraph*)Ctx;
+    const int Count = (int)G->FTasks.size();
+
+    std::unique_lock<std::mutex> Lock(G->FMutex);
+
+    for(;;)
+    {
+        G->FChanged.wait(Lock, [&] { return G->FDone == Count || G->FReadyPos < G->FReady.size(); });
+
+        if(G->FDone == Count) { break; }
+
+        Task& T = G->FTasks[G->FReady[G->FReadyPos++]];
+
+        Lock.unlock();
+        T.Fn(T.Ctx);
+        Lock.lock();
+
+        G->FDone++;
+
+        int NewReady = 0;
+        for(size_t i = 0 ; i < T.Next.size() ; i++)
+        {
+            if(--G->FTasks[T.Next[i]].Pending == 0)
+            {
+                G->FReady.push_back(T.Next[i]);
+                NewReady++;
+            }
+        }
+
+        // wake the others for the new tasks, or to finish
+        if(NewReady > 1 || G->FDone == Count)
+            G->FChanged.notify_all();
+        else
+        if(NewReady == 1)
+            G->FChanged.notify_one();
+    }
+
+    Lock.unlock();
+
+    // the last ones may still wait
+    G->FChanged.notify_all();
+}
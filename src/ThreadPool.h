@@ -0,0 +1,183 @@
+#pragma once
+
+/// Worker threads shared by all parallel stages of the framework (bitmap clears and resolves, viewports, supersampling,
+/// point splatting, frame conversion). App owns the pool of a program and registers it as ThreadPool::Global(),
+/// programs without an App (tools, tests) get a default one on first use.
+///
+/// A parallel-for splits the index range into one contiguous part per thread. Every thread works through its own part
+/// and then takes the remaining indices of the others (work stealing), neighbours first. Pinned workers are placed
+/// on the CPUs in NUMA node order, so neighbouring parts, and the first steals, stay on one node.
+///
+/// One job runs at a time. A parallel call made from inside a job, or while another thread has the pool, runs on the
+/// calling thread alone, so stages can nest freely. In the inline mode all work runs on the calling thread in a fixed
+/// order (ascending indices, tasks in the order they become ready), for reproducible runs and debugging.
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <vector>
+
+struct ThreadPool
+{
+    /// NumThreads counts the calling thread, 0 means one per hardware thread. Pin fixes each worker to one CPU
+    explicit ThreadPool(int NumThreads = 0, bool Pin = false);
+    ~ThreadPool();
+
+    /// Stop the workers and start NumThreads - 1 new ones (same meaning as in the constructor). Not during a job
+    void Resize(int NumThreads, bool Pin);
+
+    /// Threads taking part in a job, the caller included (1 in the inline mode)
+    int GetNumThreads() const { return FInline ? 1 : (int)FWorkers.size() + 1; }
+
+    void SetInline(bool On) { FInline = On; }
+    bool IsInline() const { return FInline; }
+
+    /// Call Fn(Ctx, Thread, NumThreads) once on each thread of the job (the caller is thread 0) and wait for all
+    void Run(void (*Fn)(void*, int, int), void* Ctx);
+
+    /// Call Fn(i) for every i in [0, Count). Fn must be safe to call concurrently
+    template <class FnT> void ParallelFor(int Count, const FnT& Fn);
+
+    /// Pool of the program: the registered one (App's) or a default pool with a thread per hardware thread
+    static ThreadPool& Global();
+
+    /// Register P as the global pool, NULL goes back to the default one
+    static void SetGlobal(ThreadPool* P);
+
+private:
+    std::vector<std::thread> FWorkers;
+    bool FInline;
+
+    /// The current job, FGeneration counts the jobs, FPending the workers still in the current one
+    std::mutex FMutex;
+    std::condition_variable FWake, FDone;
+    void (*FJob)(void*, int, int);
+    void* FJobCtx;
+    unsigned FGeneration;
+    int  FPending;
+    bool FStop;
+
+    /// Set while a job runs (taken with Acquire())
+    std::atomic<bool> FBusy;
+
+    bool Acquire() { return !FInline && !FWorkers.empty() && !FBusy.exchange(true); }
+
+    /// Run the job, FBusy taken
+    void RunJob(void (*Fn)(void*, int, int), void* Ctx);
+
+    /// Index range of one thread in a parallel-for, padded to a cache line
+    struct Range
+    {
+        std::atomic<int> Next;
+        int End;
+        char Pad[64 - sizeof(std::atomic<int>) - sizeof(int)];
+    };
+
+    /// One per thread of a job, aligned to a cache line inside FRangeMemory (over-allocated by one line)
+    Range* FRanges;
+    char* FRangeMemory;
+
+    template <class FnT> struct ForJob
+    {
+        const FnT* Fn;
+        Range* Ranges;
+    };
+
+    template <class FnT> static void ForBody(void* Ctx, int Thread, int NumThreads);
+
+    void Start(int NumThreads, bool Pin);
+    void Stop();
+    /// Seen: the last job generation before the worker started
+    void Worker(int Thread, int CPU, unsigned Seen);
+
+    ThreadPool(const ThreadPool&);
+    ThreadPool& operator=(const ThreadPool&);
+};
+
+/// Runs tasks in the order given by their dependencies on a pool. Tasks can only depend on tasks added before them
+struct TaskGraph
+{
+    TaskGraph(): FReadyPos(0), FDone(0) {}
+
+    /// Add Fn(Ctx), to run after the NumDeps tasks with the IDs in Deps. Returns the ID of the task
+    int Add(void (*Fn)(void*), void* Ctx, const int* Deps = NULL, int NumDeps = 0);
+
+    /// Add Fn(Ctx) with a single dependency (none if Dep < 0)
+    int Add(void (*Fn)(void*), void* Ctx, int Dep) { return Add(Fn, Ctx, &Dep, Dep >= 0 ? 1 : 0); }
+
+    /// Run all tasks and wait for them. Independent tasks run concurrently. The graph can be run again
+    void Run(ThreadPool& Pool = ThreadPool::Global());
+
+    void Clear() { FTasks.clear(); }
+
+    int GetCount() const { return (int)FTasks.size(); }
+
+private:
+    struct Task
+    {
+        void (*Fn)(void*);
+        void* Ctx;
+
+        /// Dependencies, and those not finished yet in the current run
+        int NumDeps, Pending;
+
+        /// Tasks depending on this one
+        std::vector<int> Next;
+    };
+
+    std::vector<Task> FTasks;
+
+    /// Tasks ready to run, in the order they became ready, and the number finished
+    std::vector<int> FReady;
+    size_t FReadyPos;
+    int FDone;
+
+    std::mutex FMutex;
+    std::condition_variable FChanged;
+
+    static void Body(void* Ctx, int Thread, int NumThreads);
+};
+
+template <class FnT>
+void ThreadPool::ForBody(void* Ctx, int Thread, int NumThreads)
+{
+    ForJob<FnT>* J = (ForJob<FnT>*)Ctx;
+
+    // the own range first, then the neighbours' leftovers
+    for(int k = 0 ; k < NumThreads ; k++)
+    {
+        Range& R = J->Ranges[(Thread + k) % NumThreads];
+
+        for(int i = R.Next++ ; i < R.End ; i = R.Next++)
+            (*J->Fn)(i);
+    }
+}
+
+template <class FnT>
+void ThreadPool::ParallelFor(int Count, const FnT& Fn)
+{
+    // nothing to share, or the pool is taken: run here
+    if(Count <= 1 || !Acquire())
+    {
+        for(int i = 0 ; i < Count ; i++)
+            Fn(i);
+
+        return;
+    }
+
+    const int N = GetNumThreads();
+
+    for(int t = 0 ; t < N ; t++)
+    {
+        FRanges[t].Next = (int)(((long long)Count * t) / N);
+        FRanges[t].End  = (int)(((long long)Count * (t + 1)) / N);
+    }
+
+    ForJob<FnT> J;
+    J.Fn     = &Fn;
+    J.Ranges = FRanges;
+
+    RunJob(ForBody<FnT>, &J);
+    FBusy = false;
+}
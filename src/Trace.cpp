@@ -0,0 +1,461 @@
+#include "Trace.h"
+#include <string.h>
+
+void TracePredictor::Reset()
+{
+    memset(Prev, 0, sizeof(Prev));
+}
+
+/// Writes the fields of a command (see trace_fields)
+struct TraceEncoder
+{
+    TraceEncoder(std::vector<unsigned char>* Out, TracePredictor* P): FOut(Out), FP(P), Type(0) {}
+
+    void Varint(unsigned v)
+    {
+        while(v >= 0x80) { FOut->push_back((unsigned char)((v & 0x7F) | 0x80)); v >>= 7; }
+        FOut->push_back((unsigned char)v);
+    }
+
+    void Int(int& v)   { Varint(((unsigned)v << 1) ^ (unsigned)(v >> 31)); }
+    void Color(int& v) { Varint((unsigned)v); }
+
+    void Float(int Slot, float& f)
+    {
+        unsigned b;
+        memcpy(&b, &f, 4);
+
+        int d = (int)(b - FP->Prev[Type][Slot]);
+        FP->Prev[Type][Slot] = b;
+        Int(d);
+    }
+
+    void Vec(int Slot, vec3& v) { Float(Slot, v.x); Float(Slot + 1, v.y); Float(Slot + 2, v.z); }
+    void Mtx(int Slot, mtx4& m) { for(int i = 0 ; i < 16 ; i++) { Float(Slot + i, m.x[i]); } }
+
+    void Text(const char* s)
+    {
+        unsigned Len = (unsigned)strlen(s);
+        Varint(Len);
+        FOut->insert(FOut->end(), (const unsigned char*)s, (const unsigned char*)s + Len);
+    }
+
+    std::vector<unsigned char>* FOut;
+    TracePredictor* FP;
+    int Type;
+};
+
+/// Reads the fields of a command. Running past the end sets FError, the values are zeros then
+struct TraceDecoder
+{
+    TraceDecoder(const unsigned char* Data, size_t Size, size_t Pos, TracePredictor* P): FData(Data), FSize(Size), FPos(Pos), FP(P), Type(0), FError(false) {}
+
+    unsigned ReadVarint()
+    {
+        unsigned v = 0;
+
+        for(int Shift = 0 ; Shift <= 28 ; Shift += 7)
+        {
+            if(FPos >= FSize) { break; }
+
+            unsigned char c = FData[FPos++];
+            v |= (unsigned)(c & 0x7F) << Shift;
+
+            if(!(c & 0x80)) { return v; }
+        }
+
+        FError = true;
+        return 0;
+    }
+
+    void Int(int& v)   { unsigned z = ReadVarint(); v = (int)((z >> 1) ^ (0u - (z & 1))); }
+    void Color(int& v) { v = (int)ReadVarint(); }
+
+    void Float(int Slot, float& f)
+    {
+        int d;
+        Int(d);
+
+        unsigned b = FP->Prev[Type][Slot] + (unsigned)d;
+        FP->Prev[Type][Slot] = b;
+        memcpy(&f, &b, 4);
+    }
+
+    void Vec(int Slot, vec3& v) { Float(Slot, v.x); Float(Slot + 1, v.y); Float(Slot + 2, v.z); }
+    void Mtx(int Slot, mtx4& m) { for(int i = 0 ; i < 16 ; i++) { Float(Slot + i, m.x[i]); } }
+
+    void Text(std::vector<char>& s)
+    {
+        unsigned Len = ReadVarint();
+        if(Len > FSize - FPos) { FError = true; Len = 0; }
+
+        s.assign((const char*)FData + FPos, (const char*)FData + FPos + Len);
+        s.push_back(0);
+        FPos += Len;
+    }
+
+    /// Element count of an array: every element takes at least one byte
+    int Count()
+    {
+        int n;
+        Int(n);
+        if(n < 0 || (size_t)n > FSize - FPos) { FError = true; n = 0; }
+        return n;
+    }
+
+    const unsigned char* FData;
+    size_t FSize, FPos;
+    TracePredictor* FP;
+    int Type;
+    bool FError;
+};
+
+//// Fields of the fixed-size commands, shared by the encoder and the decoder. The first argument of Float/Vec/Mtx
+//// is the prediction slot of the field
+
+template <class A> static void trace_fields(A& a, DrawMatricesCmd& C)   { a.Mtx(0, C.Proj); a.Mtx(16, C.View); }
+template <class A> static void trace_fields(A& a, DrawLineCmd& C)       { a.Vec(0, C.P1); a.Vec(3, C.P2); a.Color(C.Color); }
+template <class A> static void trace_fields(A& a, DrawArrowCmd& C)      { a.Vec(0, C.P1); a.Vec(3, C.P2); a.Float(6, C.TipSize); a.Color(C.LineColor); a.Color(C.TipColor); }
+template <class A> static void trace_fields(A& a, DrawPointCmd& C)      { a.Vec(0, C.Pt); a.Float(3, C.Size); a.Color(C.Color); }
+template <class A> static void trace_fields(A& a, DrawTriangleCmd& C)   { a.Vec(0, C.P[0]); a.Vec(3, C.P[1]); a.Vec(6, C.P[2]); a.Color(C.Color); }
+template <class A> static void trace_fields(A& a, DrawPickIDCmd& C)     { a.Int(C.ID); }
+template <class A> static void trace_fields(A& a, DrawBezierCmd& C)     { a.Vec(0, C.P[0]); a.Vec(3, C.P[1]); a.Vec(6, C.P[2]); a.Vec(9, C.P[3]); a.Color(C.Color); }
+template <class A> static void trace_fields(A& a, DrawClearCmd& C)      { a.Color(C.Color); }
+template <class A> static void trace_fields(A& a, DrawLine2DCmd& C)     { a.Int(C.X1); a.Int(C.Y1); a.Int(C.X2); a.Int(C.Y2); a.Color(C.Color); }
+template <class A> static void trace_fields(A& a, DrawPixelCmd& C)      { a.Int(C.X); a.Int(C.Y); a.Color(C.Color); }
+template <class A> static void trace_fields(A& a, DrawClipRectCmd& C)   { a.Int(C.X); a.Int(C.Y); a.Int(C.W); a.Int(C.H); }
+
+/// Fields of a LineStyle, Slot is the prediction slot of FogNear (FogFar takes the next one)
+template <class A> static void trace_style(A& a, int Slot, LineStyle& S)
+{
+    int Pattern = (int)S.Pattern;
+    a.Color(Pattern);
+    S.Pattern = (unsigned)Pattern;
+
+    a.Int(S.Length); a.Int(S.Phase); a.Color(S.EndColor); a.Color(S.FogColor);
+    a.Float(Slot, S.FogNear); a.Float(Slot + 1, S.FogFar);
+}
+
+template <class A> static void trace_fields(A& a, DrawLineStyledCmd& C)   { a.Vec(0, C.P1); a.Vec(3, C.P2); a.Color(C.Color); trace_style(a, 6, C.Style); }
+template <class A> static void trace_fields(A& a, DrawLine2DStyledCmd& C) { a.Int(C.X1); a.Int(C.Y1); a.Int(C.X2); a.Int(C.Y2); a.Color(C.Color); trace_style(a, 0, C.Style); }
+
+template <class A> static void trace_fields(A& a, DrawFrameCmd& C)
+{
+    a.Mtx(0, C.Mtx); a.Vec(16, C.Base); a.Float(19, C.Size);
+    a.Color(C.Colors[0]); a.Color(C.Colors[1]); a.Color(C.Colors[2]);
+}
+
+template <class A> static void trace_fields(A& a, DrawPlaneCmd& C)
+{
+    a.Vec(0, C.P); a.Vec(3, C.V1); a.Vec(6, C.V2); a.Float(9, C.Step1); a.Float(10, C.Step2);
+    a.Int(C.NumX); a.Int(C.NumY); a.Color(C.Color);
+}
+
+template <class A> static void trace_fields(A& a, DrawTriangle2DCmd& C)
+{
+    for(int k = 0 ; k < 3 ; k++) { a.Float(k, C.X[k]); a.Float(3 + k, C.Y[k]); a.Float(6 + k, C.Z[k]); }
+    a.Color(C.Color); a.Int(C.UseZ);
+}
+
+/// Variable-size commands: the header fields here, the arrays and texts follow
+template <class A> static void trace_fields(A& a, DrawTextCmd& C)       { a.Vec(0, C.P); a.Color(C.Color); a.Int(C.Dx); a.Int(C.Dy); }
+template <class A> static void trace_fields(A& a, DrawText2DCmd& C)     { a.Int(C.X); a.Int(C.Y); a.Color(C.Color); a.Int(C.Scale); }
+template <class A> static void trace_fields(A& a, DrawFramesCmd& C)     { a.Float(16, C.Size); a.Color(C.Colors[0]); a.Color(C.Colors[1]); a.Color(C.Colors[2]); }
+template <class A> static void trace_fields(A& a, DrawArrowsCmd& C)     { a.Float(6, C.TipSize); a.Color(C.LineColor); a.Color(C.TipColor); }
+
+/// Copy of the payload passed through the encoder
+template <class T> static void encode_fixed(TraceEncoder& E, const DrawCommand* Cmd)
+{
+    T C = *DrawCommandBuffer::Payload<T>(Cmd);
+    trace_fields(E, C);
+}
+
+static void encode_command(TraceEncoder& E, const DrawCommand* Cmd)
+{
+    switch(Cmd->Type)
+    {
+        case DRAW_MATRICES:   encode_fixed<DrawMatricesCmd>(E, Cmd);   break;
+        case DRAW_LINE:       encode_fixed<DrawLineCmd>(E, Cmd);       break;
+        case DRAW_ARROW:      encode_fixed<DrawArrowCmd>(E, Cmd);      break;
+        case DRAW_FRAME:      encode_fixed<DrawFrameCmd>(E, Cmd);      break;
+        case DRAW_POINT:      encode_fixed<DrawPointCmd>(E, Cmd);      break;
+        case DRAW_PLANE:      encode_fixed<DrawPlaneCmd>(E, Cmd);      break;
+        case DRAW_TRIANGLE:   encode_fixed<DrawTriangleCmd>(E, Cmd);   break;
+        case DRAW_PICK_ID:    encode_fixed<DrawPickIDCmd>(E, Cmd);     break;
+        case DRAW_BEZIER:     encode_fixed<DrawBezierCmd>(E, Cmd);     break;
+        case DRAW_CLEAR:      encode_fixed<DrawClearCmd>(E, Cmd);      break;
+        case DRAW_LINE2D:     encode_fixed<DrawLine2DCmd>(E, Cmd);     break;
+        case DRAW_PIXEL:      encode_fixed<DrawPixelCmd>(E, Cmd);      break;
+        case DRAW_TRIANGLE2D: encode_fixed<DrawTriangle2DCmd>(E, Cmd); break;
+        case DRAW_CLIP_RECT:  encode_fixed<DrawClipRectCmd>(E, Cmd);   break;
+        case DRAW_LINE_STYLED:   encode_fixed<DrawLineStyledCmd>(E, Cmd);   break;
+        case DRAW_LINE2D_STYLED: encode_fixed<DrawLine2DStyledCmd>(E, Cmd); break;
+
+        case DRAW_TEXT:
+        {
+            const DrawTextCmd* P = DrawCommandBuffer::Payload<DrawTextCmd>(Cmd);
+            DrawTextCmd C = *P;
+            trace_fields(E, C);
+            E.Text((const char*)(P + 1));
+            break;
+        }
+        case DRAW_TEXT2D:
+        {
+            const DrawText2DCmd* P = DrawCommandBuffer::Payload<DrawText2DCmd>(Cmd);
+            DrawText2DCmd C = *P;
+            trace_fields(E, C);
+            E.Text((const char*)(P + 1));
+            break;
+        }
+        case DRAW_POINTS:
+        {
+            const DrawPointsCmd* C = DrawCommandBuffer::Payload<DrawPointsCmd>(Cmd);
+
+            int Count = C->Count, Color = C->Color, HasColors = C->Colors ? 1 : 0;
+            E.Int(Count); E.Color(Color); E.Int(HasColors);
+
+            // coordinates predicted from the previous point, colors from the previous color
+            for(int i = 0 ; i < Count ; i++)
+            {
+                float p[3] = { C->XYZ[3 * i], C->XYZ[3 * i + 1], C->XYZ[3 * i + 2] };
+                E.Float(0, p[0]); E.Float(1, p[1]); E.Float(2, p[2]);
+            }
+
+            for(int i = 0, Prev = 0 ; HasColors && i < Count ; Prev = C->Colors[i], i++)
+            {
+                int d = C->Colors[i] - Prev;
+                E.Int(d);
+            }
+            break;
+        }
+        case DRAW_FRAMES:
+        {
+            const DrawFramesCmd* P = DrawCommandBuffer::Payload<DrawFramesCmd>(Cmd);
+            DrawFramesCmd C = *P;
+
+            int Count = C.Count;
+            E.Int(Count);
+            trace_fields(E, C);
+
+            const mtx4* Poses = DrawCommandBuffer::FramesPoses(P);
+            for(int i = 0 ; i < Count ; i++)
+            {
+                mtx4 m = Poses[i];
+                E.Mtx(0, m);
+            }
+            break;
+        }
+        case DRAW_ARROWS:
+        {
+            const DrawArrowsCmd* P = DrawCommandBuffer::Payload<DrawArrowsCmd>(Cmd);
+            DrawArrowsCmd C = *P;
+
+            int Count = C.Count;
+            E.Int(Count);
+            trace_fields(E, C);
+
+            const vec3* Pts = DrawCommandBuffer::ArrowsPoints(P);
+            for(int i = 0 ; i < 2 * Count ; i++)
+            {
+                vec3 v = Pts[i];
+                E.Vec(i < Count ? 0 : 3, v);
+            }
+            break;
+        }
+    }
+}
+
+bool TraceWriter::Open(const char* FileName)
+{
+    Close();
+
+    FFile = fopen(FileName, "wb");
+    if(!FFile) { return false; }
+
+    const unsigned char Header[5] = { 'M', 'F', 'T', 'R', TRACE_VERSION };
+    fwrite(Header, 1, sizeof(Header), FFile);
+
+    FPredictor.Reset();
+    FNumFrames = 0;
+    return true;
+}
+
+void TraceWriter::Close()
+{
+    if(FFile) { fclose(FFile); }
+    FFile = NULL;
+}
+
+void TraceWriter::WriteFrame(const DrawCommandBuffer& B, int Width, int Height)
+{
+    if(!FFile) { return; }
+
+    FBuffer.clear();
+    TraceEncoder E(&FBuffer, &FPredictor);
+
+    int Count = 0;
+
+    for(DrawCommandBuffer::Iterator i = B.Iterate() ; i.Cmd ; i.Advance())
+    {
+        if(i.Cmd->Type == DRAW_POINT_CLOUD) { continue; }
+
+        E.Type = i.Cmd->Type;
+        E.Varint(i.Cmd->Type);
+        encode_command(E, i.Cmd);
+        Count++;
+    }
+
+    std::vector<unsigned char> Header;
+    TraceEncoder H(&Header, &FPredictor);
+    H.Varint((unsigned)Width);
+    H.Varint((unsigned)Height);
+    H.Varint((unsigned)Count);
+
+    fwrite(&Header[0], 1, Header.size(), FFile);
+    if(!FBuffer.empty()) { fwrite(&FBuffer[0], 1, FBuffer.size(), FFile); }
+
+    FNumFrames++;
+}
+
+bool TraceReader::Open(const char* FileName)
+{
+    FData.clear();
+    FPos = 0;
+    FPredictor.Reset();
+
+    FILE* F = fopen(FileName, "rb");
+    if(!F) { return false; }
+
+    unsigned char Buf[65536];
+    for(size_t n ; (n = fread(Buf, 1, sizeof(Buf), F)) > 0 ; )
+        FData.insert(FData.end(), Buf, Buf + n);
+
+    fclose(F);
+
+    if(FData.size() < 5 || memcmp(&FData[0], "MFTR", 4) != 0 || FData[4] != TRACE_VERSION)
+    {
+        FData.clear();
+        return false;
+    }
+
+    FPos = 5;
+    return true;
+}
+
+/// Every field is read (zeros after an error), so C needs no initialization
+template <class T> static void decode_fixed(TraceDecoder& D, T& C)
+{
+    trace_fields(D, C);
+}
+
+bool TraceReader::ReadFrame(DrawCommandBuffer& B, int& Width, int& Height)
+{
+    if(FPos >= FData.size()) { return false; }
+
+    TraceDecoder D(&FData[0], FData.size(), FPos, &FPredictor);
+
+    Width  = (int)D.ReadVarint();
+    Height = (int)D.ReadVarint();
+    const unsigned Count = D.ReadVarint();
+
+    std::vector<char> Text;
+
+    for(unsigned n = 0 ; n < Count && !D.FError ; n++)
+    {
+        D.Type = (int)D.ReadVarint();
+        if(D.Type >= DRAW_NUM_TYPES) { return false; }
+
+        switch(D.Type)
+        {
+            case DRAW_MATRICES:   { DrawMatricesCmd C;   decode_fixed(D, C); B.AddMatrices(C.Proj, C.View); break; }
+            case DRAW_LINE:       { DrawLineCmd C;       decode_fixed(D, C); B.AddLine(C.P1, C.P2, C.Color); break; }
+            case DRAW_ARROW:      { DrawArrowCmd C;      decode_fixed(D, C); B.AddArrow(C.P1, C.P2, C.TipSize, C.LineColor, C.TipColor); break; }
+            case DRAW_FRAME:      { DrawFrameCmd C;      decode_fixed(D, C); B.AddFrame(C.Base, C.Mtx, C.Size, C.Colors[0], C.Colors[1], C.Colors[2]); break; }
+            case DRAW_POINT:      { DrawPointCmd C;      decode_fixed(D, C); B.AddPoint(C.Pt, C.Size, C.Color); break; }
+            case DRAW_PLANE:      { DrawPlaneCmd C;      decode_fixed(D, C); B.AddPlane(C.P, C.V1, C.V2, C.Step1, C.Step2, C.NumX, C.NumY, C.Color); break; }
+            case DRAW_TRIANGLE:   { DrawTriangleCmd C;   decode_fixed(D, C); B.AddTriangle(C.P[0], C.P[1], C.P[2], C.Color); break; }
+            case DRAW_PICK_ID:    { DrawPickIDCmd C;     decode_fixed(D, C); B.AddPickID(C.ID); break; }
+            case DRAW_BEZIER:     { DrawBezierCmd C;     decode_fixed(D, C); B.AddBezier(C.P[0], C.P[1], C.P[2], C.P[3], C.Color); break; }
+            case DRAW_CLEAR:      { DrawClearCmd C;      decode_fixed(D, C); B.AddClear(C.Color); break; }
+            case DRAW_LINE2D:     { DrawLine2DCmd C;     decode_fixed(D, C); B.AddLine2D(C.X1, C.Y1, C.X2, C.Y2, C.Color); break; }
+            case DRAW_PIXEL:      { DrawPixelCmd C;      decode_fixed(D, C); B.AddPixel(C.X, C.Y, C.Color); break; }
+            case DRAW_TRIANGLE2D: { DrawTriangle2DCmd C; decode_fixed(D, C); B.AddTriangle2D(C.X, C.Y, C.UseZ ? C.Z : NULL, C.Color); break; }
+            case DRAW_CLIP_RECT:  { DrawClipRectCmd C;   decode_fixed(D, C); B.AddClipRect(C.X, C.Y, C.W, C.H); break; }
+            case DRAW_LINE_STYLED:   { DrawLineStyledCmd C;   decode_fixed(D, C); B.AddLineStyled(C.P1, C.P2, C.Color, C.Style); break; }
+            case DRAW_LINE2D_STYLED: { DrawLine2DStyledCmd C; decode_fixed(D, C); B.AddLine2DStyled(C.X1, C.Y1, C.X2, C.Y2, C.Color, C.Style); break; }
+
+            case DRAW_TEXT:
+            {
+                DrawTextCmd C;
+                decode_fixed(D, C);
+                D.Text(Text);
+                B.AddText(C.P, &Text[0], C.Color, C.Dx, C.Dy);
+                break;
+            }
+            case DRAW_TEXT2D:
+            {
+                DrawText2DCmd C;
+                decode_fixed(D, C);
+                D.Text(Text);
+                B.AddText2D(C.X, C.Y, &Text[0], C.Color, C.Scale);
+                break;
+            }
+            case DRAW_POINTS:
+            {
+                int PointCount = D.Count(), Color, HasColors;
+                D.Color(Color);
+                D.Int(HasColors);
+
+                // the command references its arrays, they live in the arena of the buffer
+                float* XYZ  = B.GetArena()->AllocArray<float>(3 * (size_t)PointCount + 1);
+                int* Colors = HasColors ? B.GetArena()->AllocArray<int>((size_t)PointCount + 1) : NULL;
+
+                for(int i = 0 ; i < 3 * PointCount ; i++)
+                    D.Float(i % 3, XYZ[i]);
+
+                for(int i = 0, Prev = 0 ; Colors && i < PointCount ; i++)
+                {
+                    int d;
+                    D.Int(d);
+                    Prev = Colors[i] = Prev + d;
+                }
+
+                B.AddPoints(XYZ, PointCount, Color, Colors);
+                break;
+            }
+            case DRAW_FRAMES:
+            {
+                DrawFramesCmd C;
+                int FrameCount = D.Count();
+                decode_fixed(D, C);
+
+                mtx4* Poses = B.GetArena()->AllocArray<mtx4>((size_t)FrameCount + 1);
+                for(int i = 0 ; i < FrameCount ; i++)
+                    D.Mtx(0, Poses[i]);
+
+                B.AddFrames(Poses, FrameCount, C.Size, C.Colors[0], C.Colors[1], C.Colors[2]);
+                break;
+            }
+            case DRAW_ARROWS:
+            {
+                DrawArrowsCmd C;
+                int ArrowCount = D.Count();
+                decode_fixed(D, C);
+
+                std::vector<vec3> Pts(2 * (size_t)ArrowCount + 1);
+                for(int i = 0 ; i < 2 * ArrowCount ; i++)
+                    D.Vec(i < ArrowCount ? 0 : 3, Pts[i]);
+
+                B.AddArrows(&Pts[0], &Pts[ArrowCount], ArrowCount, C.TipSize, C.LineColor, C.TipColor);
+                break;
+            }
+            default:
+                return false;
+        }
+    }
+
+    if(D.FError) { return false; }
+
+    FPos = D.FPos;
+    return true;
+}
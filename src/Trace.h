@@ -0,0 +1,81 @@
+#pragma once
+
+/// Binary traces of drawn frames, for profiling the framework against recorded workloads (see example/replay.cpp).
+/// A frame is the content of a DrawCommandBuffer: the Canvas3D calls and the 2D calls recorded by Canvas2D_Bitmap,
+/// e.g. Window3D::FTrace records every OnDraw(). Replaying executes the same commands on any canvas.
+///
+/// File layout: "MFTR", a version byte, then the frames. A frame is the varints Width, Height and the number of
+/// commands, then the commands: a varint type and the fields. Integers are zigzag varints, colors plain varints.
+/// Floats are stored losslessly as the difference of their bit pattern to the previous value of the same field of
+/// the same command type (zigzag varint), arrays (points, poses) along the array, so repeated and slowly changing
+/// coordinates take a byte or two instead of four. The prediction state runs through the whole file, frames can
+/// only be read in order.
+
+#include "CommandBuffer.h"
+#include <stdio.h>
+#include <vector>
+
+enum { TRACE_VERSION = 1 };
+
+/// Fields per command type with their own float prediction (DRAW_MATRICES has the most: two matrices)
+enum { TRACE_SLOTS = 32 };
+
+/// Previous float bit patterns of every field
+struct TracePredictor
+{
+    TracePredictor() { Reset(); }
+
+    void Reset();
+
+    unsigned Prev[DRAW_NUM_TYPES][TRACE_SLOTS];
+};
+
+struct TraceWriter
+{
+    TraceWriter(): FFile(NULL), FNumFrames(0) {}
+    ~TraceWriter() { Close(); }
+
+    /// Create the file and write the header. Returns false if it cannot be created
+    bool Open(const char* FileName);
+    void Close();
+
+    bool IsOpen() const { return FFile != NULL; }
+
+    /// Append one frame drawn into a Width x Height target. Point cloud commands are left out (they reference files)
+    void WriteFrame(const DrawCommandBuffer& B, int Width, int Height);
+
+    int GetNumFrames() const { return FNumFrames; }
+
+private:
+    FILE* FFile;
+    int FNumFrames;
+
+    TracePredictor FPredictor;
+
+    /// Encoded frame, written at once
+    std::vector<unsigned char> FBuffer;
+
+    TraceWriter(const TraceWriter&);
+    TraceWriter& operator=(const TraceWriter&);
+};
+
+struct TraceReader
+{
+    TraceReader(): FPos(0) {}
+
+    /// Load the whole file. Returns false if it cannot be read or is not a trace
+    bool Open(const char* FileName);
+
+    /// Append the commands of the next frame to B (arrays referenced by commands go to B's arena).
+    /// Returns false at the end of the trace or if the frame is damaged
+    bool ReadFrame(DrawCommandBuffer& B, int& Width, int& Height);
+
+    /// Size of the trace in bytes
+    size_t GetSize() const { return FData.size(); }
+
+private:
+    std::vector<unsigned char> FData;
+    size_t FPos;
+
+    TracePredictor FPredictor;
+};
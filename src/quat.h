@@ -0,0 +1,61 @@
+#pragma once
+
+/// Rotation quaternions for the camera code. Matrices follow the vecmath.h convention (row vectors, v' = v * M),
+/// so quat_to_matrix(a * b) equals the matrix of b followed by the matrix of a: rotation(b) * rotation(a)
+
+#include "vecmath.h"
+#include <math.h>
+
+struct quat
+{
+    float x, y, z, w;
+
+    quat() {}
+    quat(float X, float Y, float Z, float W): x(X), y(Y), z(Z), w(W) {}
+
+    /// Hamilton product: rotate by q first, then by *this
+    inline quat operator*(const quat& q) const
+    {
+        return quat(w * q.x + x * q.w + y * q.z - z * q.y,
+                    w * q.y - x * q.z + y * q.w + z * q.x,
+                    w * q.z + x * q.y - y * q.x + z * q.w,
+                    w * q.w - x * q.x - y * q.y - z * q.z);
+    }
+};
+
+/// Rotation by Angle (radians) around Axis, same direction as rotate_matrix_axis(). The axis need not be normalized
+inline quat quat_from_axis_angle(const vec3& Axis, float Angle)
+{
+    float Len = Axis.Length();
+    float s = sinf(0.5f * Angle) / (Len > 0.0f ? Len : 1.0f);
+
+    return quat(Axis.x * s, Axis.y * s, Axis.z * s, cosf(0.5f * Angle));
+}
+
+/// Write the rotation of a unit quaternion into the upper 3x3 part of M, the rest becomes identity
+inline void quat_to_matrix(mtx4& M, const quat& q)
+{
+    const float xx = q.x * q.x, yy = q.y * q.y, zz = q.z * q.z;
+    const float xy = q.x * q.y, xz = q.x * q.z, yz = q.y * q.z;
+    const float wx = q.w * q.x, wy = q.w * q.y, wz = q.w * q.z;
+
+    MTX4_ELT(M, 0, 0) = 1.0f - 2.0f * (yy + zz);
+    MTX4_ELT(M, 0, 1) = 2.0f * (xy + wz);
+    MTX4_ELT(M, 0, 2) = 2.0f * (xz - wy);
+    MTX4_ELT(M, 0, 3) = 0.0f;
+
+    MTX4_ELT(M, 1, 0) = 2.0f * (xy - wz);
+    MTX4_ELT(M, 1, 1) = 1.0f - 2.0f * (xx + zz);
+    MTX4_ELT(M, 1, 2) = 2.0f * (yz + wx);
+    MTX4_ELT(M, 1, 3) = 0.0f;
+
+    MTX4_ELT(M, 2, 0) = 2.0f * (xz + wy);
+    MTX4_ELT(M, 2, 1) = 2.0f * (yz - wx);
+    MTX4_ELT(M, 2, 2) = 1.0f - 2.0f * (xx + yy);
+    MTX4_ELT(M, 2, 3) = 0.0f;
+
+    MTX4_ELT(M, 3, 0) = 0.0f;
+    MTX4_ELT(M, 3, 1) = 0.0f;
+    MTX4_ELT(M, 3, 2) = 0.0f;
+    MTX4_ELT(M, 3, 3) = 1.0f;
+}
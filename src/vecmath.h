@@ -0,0 +1,326 @@
+#pragma once
+
+/// Vector and matrix math for the canvas and camera code.
+/// Conventions: row vectors multiplied from the left (v' = v * M), row-major matrices with the translation
+/// in the last row, so A * B applies A first. Projections are GL-style (z_ndc in [-1..1], w = -z_view).
+/// vec4 and mtx4 are 16-byte aligned; products, transforms and the batch functions use SSE (and AVX for
+/// mtx4 * mtx4) when the compiler targets it, plain scalar code otherwise.
+
+#include <math.h>
+#include <string.h>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#  include <xmmintrin.h>
+#  define VECMATH_SSE
+#endif
+
+#if defined(__AVX__)
+#  include <immintrin.h>
+#  define VECMATH_AVX
+#endif
+
+#ifdef _MSC_VER
+#  define VECMATH_ALIGN16 __declspec(align(16))
+#else
+#  define VECMATH_ALIGN16 __attribute__((aligned(16)))
+#endif
+
+#define VECMATH_PI 3.14159265358979323846f
+
+inline float deg2rad(float d) { return d * (VECMATH_PI / 180.0f); }
+inline float rad2deg(float r) { return r * (180.0f / VECMATH_PI); }
+
+/// 1 / sqrt(x): the hardware estimate refined by one Newton-Raphson step (about 22 bits)
+inline float fast_rsqrt(float x)
+{
+#ifdef VECMATH_SSE
+    float y = _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss(x)));
+    return y * (1.5f - (0.5f * x) * (y * y));
+#else
+    return 1.0f / sqrtf(x);
+#endif
+}
+
+struct vec3
+{
+    float x, y, z;
+
+    vec3() {}
+    vec3(float X, float Y, float Z): x(X), y(Y), z(Z) {}
+
+    inline vec3 operator+(const vec3& v) const { return vec3(x + v.x, y + v.y, z + v.z); }
+    inline vec3 operator-(const vec3& v) const { return vec3(x - v.x, y - v.y, z - v.z); }
+    inline vec3 operator-() const { return vec3(-x, -y, -z); }
+
+    inline vec3& operator+=(const vec3& v) { x += v.x; y += v.y; z += v.z; return *this; }
+    inline vec3& operator-=(const vec3& v) { x -= v.x; y -= v.y; z -= v.z; return *this; }
+    inline vec3& operator*=(float s) { x *= s; y *= s; z *= s; return *this; }
+
+    inline float SqrLength() const { return x * x + y * y + z * z; }
+    inline float Length() const { return sqrtf(SqrLength()); }
+
+    /// Scale to unit length (zero vectors are left alone)
+    inline void Normalize()
+    {
+        float l2 = SqrLength();
+        if(l2 > 1.0e-24f) { *this *= fast_rsqrt(l2); }
+    }
+
+    inline vec3 Normalized() const { vec3 v = *this; v.Normalize(); return v; }
+};
+
+inline vec3 operator*(float s, const vec3& v) { return vec3(s * v.x, s * v.y, s * v.z); }
+inline vec3 operator*(const vec3& v, float s) { return vec3(s * v.x, s * v.y, s * v.z); }
+
+inline float dot(const vec3& a, const vec3& b) { return a.x * b.x + a.y * b.y + a.z * b.z; }
+
+inline vec3 cross(const vec3& a, const vec3& b)
+{
+    return vec3(a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x);
+}
+
+/// Homogeneous point, one SSE register
+struct VECMATH_ALIGN16 vec4
+{
+    float x, y, z, w;
+
+    vec4() {}
+    vec4(float X, float Y, float Z, float W): x(X), y(Y), z(Z), w(W) {}
+    vec4(const vec3& v, float W): x(v.x), y(v.y), z(v.z), w(W) {}
+
+    inline vec4 operator+(const vec4& v) const { return vec4(x + v.x, y + v.y, z + v.z, w + v.w); }
+    inline vec4 operator-(const vec4& v) const { return vec4(x - v.x, y - v.y, z - v.z, w - v.w); }
+
+    /// (x, y, z) / w
+    inline vec3 Project() const { float iw = (w != 0.0f) ? 1.0f / w : 1.0f; return vec3(x * iw, y * iw, z * iw); }
+};
+
+inline vec4 operator*(float s, const vec4& v) { return vec4(s * v.x, s * v.y, s * v.z, s * v.w); }
+
+inline float dot(const vec4& a, const vec4& b) { return a.x * b.x + a.y * b.y + a.z * b.z + a.w * b.w; }
+
+/// Element (row i, column j)
+#define MTX4_ELT(m, i, j) ((m).x[(i) * 4 + (j)])
+
+struct VECMATH_ALIGN16 mtx4
+{
+    float x[16];
+
+    /// *this first, then b
+    inline mtx4 operator*(const mtx4& b) const;
+};
+
+inline mtx4 mtx4::operator*(const mtx4& b) const
+{
+    mtx4 r;
+
+#if defined(VECMATH_AVX)
+    // two result rows per register: every row of b is broadcast to both halves
+    const __m256 b0 = _mm256_broadcast_ps((const __m128*)(b.x + 0));
+    const __m256 b1 = _mm256_broadcast_ps((const __m128*)(b.x + 4));
+    const __m256 b2 = _mm256_broadcast_ps((const __m128*)(b.x + 8));
+    const __m256 b3 = _mm256_broadcast_ps((const __m128*)(b.x + 12));
+
+    for(int i = 0 ; i < 16 ; i += 8)
+    {
+        __m256 a = _mm256_loadu_ps(x + i);
+
+        __m256 s = _mm256_mul_ps(_mm256_shuffle_ps(a, a, 0x00), b0);
+        s = _mm256_add_ps(s, _mm256_mul_ps(_mm256_shuffle_ps(a, a, 0x55), b1));
+        s = _mm256_add_ps(s, _mm256_mul_ps(_mm256_shuffle_ps(a, a, 0xAA), b2));
+        s = _mm256_add_ps(s, _mm256_mul_ps(_mm256_shuffle_ps(a, a, 0xFF), b3));
+
+        _mm256_storeu_ps(r.x + i, s);
+    }
+#elif defined(VECMATH_SSE)
+    const __m128 b0 = _mm_loadu_ps(b.x + 0);
+    const __m128 b1 = _mm_loadu_ps(b.x + 4);
+    const __m128 b2 = _mm_loadu_ps(b.x + 8);
+    const __m128 b3 = _mm_loadu_ps(b.x + 12);
+
+    for(int i = 0 ; i < 16 ; i += 4)
+    {
+        __m128 s = _mm_mul_ps(_mm_set1_ps(x[i]), b0);
+        s = _mm_add_ps(s, _mm_mul_ps(_mm_set1_ps(x[i + 1]), b1));
+        s = _mm_add_ps(s, _mm_mul_ps(_mm_set1_ps(x[i + 2]), b2));
+        s = _mm_add_ps(s, _mm_mul_ps(_mm_set1_ps(x[i + 3]), b3));
+
+        _mm_storeu_ps(r.x + i, s);
+    }
+#else
+    for(int i = 0 ; i < 4 ; i++)
+        for(int j = 0 ; j < 4 ; j++)
+            r.x[i * 4 + j] = x[i * 4] * b.x[j] + x[i * 4 + 1] * b.x[4 + j] + x[i * 4 + 2] * b.x[8 + j] + x[i * 4 + 3] * b.x[12 + j];
+#endif
+
+    return r;
+}
+
+/// m = d * identity
+inline void diag(mtx4& m, float d)
+{
+    memset(m.x, 0, sizeof(m.x));
+    m.x[0] = m.x[5] = m.x[10] = m.x[15] = d;
+}
+
+inline mtx4 identity() { mtx4 m; diag(m, 1.0f); return m; }
+
+inline mtx4 translate(float x, float y, float z)
+{
+    mtx4 m;
+    diag(m, 1.0f);
+    m.x[12] = x; m.x[13] = y; m.x[14] = z;
+    return m;
+}
+
+inline mtx4 translate(const vec3& v) { return translate(v.x, v.y, v.z); }
+
+/// Rotation by angle (radians) around the axis (normalized here)
+inline void rotate_matrix_axis(mtx4& m, float angle, const vec3& axis)
+{
+    vec3 n = axis;
+    n.Normalize();
+
+    const float c = cosf(angle), s = sinf(angle), t = 1.0f - c;
+
+    diag(m, 1.0f);
+
+    m.x[0] = t * n.x * n.x + c;       m.x[1] = t * n.x * n.y + s * n.z; m.x[2]  = t * n.x * n.z - s * n.y;
+    m.x[4] = t * n.x * n.y - s * n.z; m.x[5] = t * n.y * n.y + c;       m.x[6]  = t * n.y * n.z + s * n.x;
+    m.x[8] = t * n.x * n.z + s * n.y; m.x[9] = t * n.y * n.z - s * n.x; m.x[10] = t * n.z * n.z + c;
+}
+
+/// (v, 1) * m without the division
+inline void mult_mtx_vec4(vec4& out, const mtx4& m, const vec3& v)
+{
+#ifdef VECMATH_SSE
+    __m128 s = _mm_mul_ps(_mm_set1_ps(v.x), _mm_loadu_ps(m.x));
+    s = _mm_add_ps(s, _mm_mul_ps(_mm_set1_ps(v.y), _mm_loadu_ps(m.x + 4)));
+    s = _mm_add_ps(s, _mm_mul_ps(_mm_set1_ps(v.z), _mm_loadu_ps(m.x + 8)));
+    s = _mm_add_ps(s, _mm_loadu_ps(m.x + 12));
+    _mm_storeu_ps(&out.x, s);
+#else
+    out.x = v.x * m.x[0] + v.y * m.x[4] + v.z * m.x[8]  + m.x[12];
+    out.y = v.x * m.x[1] + v.y * m.x[5] + v.z * m.x[9]  + m.x[13];
+    out.z = v.x * m.x[2] + v.y * m.x[6] + v.z * m.x[10] + m.x[14];
+    out.w = v.x * m.x[3] + v.y * m.x[7] + v.z * m.x[11] + m.x[15];
+#endif
+}
+
+/// Transform the point and divide by w
+inline void mult_mtx_vec(vec3& out, const mtx4& m, const vec3& v)
+{
+    vec4 h;
+    mult_mtx_vec4(h, m, v);
+    out = h.Project();
+}
+
+/// Camera (view) transform -> viewer position and the pure rotation part
+inline void decompose_camera_transform(const mtx4& t, vec3& pos, mtx4& rot)
+{
+    rot = t;
+    rot.x[12] = rot.x[13] = rot.x[14] = 0.0f;
+
+    // the translation row is -pos * R, and R is orthonormal
+    vec3 tr(t.x[12], t.x[13], t.x[14]);
+    pos = vec3(-(tr.x * t.x[0] + tr.y * t.x[1] + tr.z * t.x[2]),
+               -(tr.x * t.x[4] + tr.y * t.x[5] + tr.z * t.x[6]),
+               -(tr.x * t.x[8] + tr.y * t.x[9] + tr.z * t.x[10]));
+}
+
+/// (radius, azimuth, polar angle), angles in degrees
+inline vec3 cartesian_to_spherical(const vec3& v)
+{
+    float r = v.Length();
+    return vec3(r, rad2deg(atan2f(v.y, v.x)), rad2deg(acosf(v.z / r)));
+}
+
+/// Two vectors perpendicular to N and to each other (not normalized)
+inline void BuildComplementaryBasis(const vec3& N, vec3& V1, vec3& V2)
+{
+    V1 = (fabsf(N.x) > fabsf(N.y)) ? vec3(-N.z, 0.0f, N.x) : vec3(0.0f, N.z, -N.y);
+    V2 = cross(N, V1);
+}
+
+/// Perspective projection of the (l, r, b, t) window on the near plane n, far plane f
+inline void frustum(mtx4& m, float n, float f, float l, float r, float b, float t)
+{
+    memset(m.x, 0, sizeof(m.x));
+
+    m.x[0]  = 2.0f * n / (r - l);
+    m.x[5]  = 2.0f * n / (t - b);
+    m.x[8]  = (r + l) / (r - l);
+    m.x[9]  = (t + b) / (t - b);
+    m.x[10] = -(f + n) / (f - n);
+    m.x[11] = -1.0f;
+    m.x[14] = -2.0f * f * n / (f - n);
+}
+
+//// Batch versions over arrays. They do exactly the operations of the single-element functions, in the same order
+
+/// Out[i] = (xyz[i], 1) * m for Count packed xyz triples (no division)
+inline void transform_points(vec4* Out, const mtx4& m, const float* xyz, int Count)
+{
+#ifdef VECMATH_SSE
+    const __m128 r0 = _mm_loadu_ps(m.x + 0);
+    const __m128 r1 = _mm_loadu_ps(m.x + 4);
+    const __m128 r2 = _mm_loadu_ps(m.x + 8);
+    const __m128 r3 = _mm_loadu_ps(m.x + 12);
+
+    for(int i = 0 ; i < Count ; i++, xyz += 3)
+    {
+        __m128 s = _mm_mul_ps(_mm_set1_ps(xyz[0]), r0);
+        s = _mm_add_ps(s, _mm_mul_ps(_mm_set1_ps(xyz[1]), r1));
+        s = _mm_add_ps(s, _mm_mul_ps(_mm_set1_ps(xyz[2]), r2));
+        _mm_store_ps(&Out[i].x, _mm_add_ps(s, r3));
+    }
+#else
+    for(int i = 0 ; i < Count ; i++, xyz += 3)
+        mult_mtx_vec4(Out[i], m, vec3(xyz[0], xyz[1], xyz[2]));
+#endif
+}
+
+/// Out[i] = In[i] * m with the division by w (Out may equal In)
+inline void mult_mtx_vec_array(vec3* Out, const mtx4& m, const vec3* In, int Count)
+{
+    for(int i = 0 ; i < Count ; i++)
+        mult_mtx_vec(Out[i], m, In[i]);
+}
+
+/// Normalize Count vectors, four at a time with SSE
+inline void normalize_array(vec3* V, int Count)
+{
+    int i = 0;
+
+#ifdef VECMATH_SSE
+    const __m128 Half  = _mm_set1_ps(0.5f);
+    const __m128 Three = _mm_set1_ps(1.5f);
+    const __m128 Eps   = _mm_set1_ps(1.0e-24f);
+
+    for( ; i + 4 <= Count ; i += 4)
+    {
+        __m128 x = _mm_set_ps(V[i + 3].x, V[i + 2].x, V[i + 1].x, V[i].x);
+        __m128 y = _mm_set_ps(V[i + 3].y, V[i + 2].y, V[i + 1].y, V[i].y);
+        __m128 z = _mm_set_ps(V[i + 3].z, V[i + 2].z, V[i + 1].z, V[i].z);
+
+        __m128 l2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)), _mm_mul_ps(z, z));
+
+        __m128 r = _mm_rsqrt_ps(l2);
+        r = _mm_mul_ps(r, _mm_sub_ps(Three, _mm_mul_ps(_mm_mul_ps(Half, l2), _mm_mul_ps(r, r))));
+
+        // zero vectors stay zero
+        r = _mm_or_ps(_mm_and_ps(_mm_cmpgt_ps(l2, Eps), r), _mm_andnot_ps(_mm_cmpgt_ps(l2, Eps), _mm_set1_ps(1.0f)));
+
+        float X[4], Y[4], Z[4];
+        _mm_storeu_ps(X, _mm_mul_ps(x, r));
+        _mm_storeu_ps(Y, _mm_mul_ps(y, r));
+        _mm_storeu_ps(Z, _mm_mul_ps(z, r));
+
+        for(int k = 0 ; k < 4 ; k++)
+            V[i + k] = vec3(X[k], Y[k], Z[k]);
+    }
+#endif
+
+    for( ; i < Count ; i++)
+        V[i].Normalize();
+}